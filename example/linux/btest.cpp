@@ -4,13 +4,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 #include <sqlite3.h>
+#include <openssl/crypto.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+#include <openssl/thread.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 
 // 测试数据库文件名
 #define TEST_DB "test.db"
 #define TEST_DB_COPY "test_encrypted_copy.db"
 #define PLAINTEXT_DB "test_plaintext.db"
+#define SWEEP_DB "test_sweep.db"
+#define CONCURRENCY_DB "test_concurrency.db"
+#define WRITER_QUEUE_DB "test_writer_queue.db"
 
 // 测试密钥
 #define TEST_KEY "123456789"
@@ -20,6 +65,156 @@
 // 测试数据量
 #define TEST_DATA_COUNT 1000
 
+// SQLCipher 4 默认密钥派生参数（PBKDF2-HMAC-SHA512）
+#define CIPHER_KDF_ITER   256000
+#define CIPHER_KEY_SIZE   32
+#define CIPHER_SALT_SIZE  16
+
+// 可选 Argon2id 密钥派生（运行库需 OpenSSL 3.2+），默认参数可用 --argon2-memory-kib= --argon2-iterations=
+// --argon2-lanes= 覆盖；选用 Argon2id 的库把参数保存在 "<库路径>-kdf" 附属文件中
+#define ARGON2_MEMORY_KIB   65536
+#define ARGON2_ITERATIONS   3
+#define ARGON2_LANES        4
+#define KDF_SIDECAR_SUFFIX  "-kdf"
+#define KDF_ARGON2_VERSION  0x13                  // Argon2 1.3，OpenSSL 实现的版本
+#define KDF_BENCH_OPENS     3
+
+// 3.0 的头文件没有 Argon2 参数名，运行库是 3.2+ 时照样可用
+#ifndef OSSL_KDF_PARAM_ARGON2_LANES
+#define OSSL_KDF_PARAM_ARGON2_LANES   "lanes"
+#define OSSL_KDF_PARAM_ARGON2_MEMCOST "memcost"
+#define OSSL_KDF_PARAM_THREADS        "threads"
+#define OSSL_KDF_PARAM_ARGON2_AD      "ad"
+#endif
+
+// 派生密钥缓存容量（条目数）
+#define KEY_CACHE_CAPACITY 64
+
+// 密钥缓存基准测试的打开次数
+#define KEY_CACHE_BENCH_OPENS 5
+
+// 每个连接缓存的预编译语句数
+#define STMT_CACHE_CAPACITY 64
+
+// 批量插入基准的行数
+#define BULK_BENCH_ROWS 200000
+
+// 多行 VALUES 默认每条语句的行数（实测超过几百行后收益消失，过大反而变慢）
+#define BULK_ROWS_PER_STATEMENT 256
+
+// 基准测试默认参数（可用 --warmup= --reps= --rows= --json= 覆盖）
+#define BENCH_WARMUP_REPS   2
+#define BENCH_MEASURED_REPS 10
+#define BENCH_INSERT_BATCH  100
+#define BENCH_SELECT_OPS    20
+#define BENCH_JSON_PATH     "bench_results.json"
+
+// 加密参数扫描：默认网格与安全基线（可用 --kdf-iter= --page-size= --hmac= --use-hmac= 逗号列表覆盖）
+#define SWEEP_KDF_ITERS     "64000,256000"
+#define SWEEP_PAGE_SIZES    "1024,4096,16384,65536"
+#define SWEEP_ALGORITHMS    "SHA1,SHA256,SHA512"
+#define SWEEP_USE_HMAC      "1,0"
+#define SWEEP_WARMUP_REPS   1
+#define SWEEP_MEASURED_REPS 3
+#define SWEEP_JSON_PATH     "sweep_results.json"
+#define SECURITY_MIN_KDF_ITER 256000
+
+// 并发测试默认参数（可用 --readers= --writers= --read-ratio= --duration= --rows= 覆盖）
+#define CONCURRENCY_READERS     4
+#define CONCURRENCY_WRITERS     2
+#define CONCURRENCY_READ_RATIO  "0.5"   // 写线程中读操作所占比例
+#define CONCURRENCY_DURATION    5       // 秒
+#define CONCURRENCY_ROWS        10000
+#define CONCURRENCY_BUSY_RETRIES 200    // 忙等处理函数最多重试次数
+
+// 写队列组提交窗口：每个事务最多合并的写入数和自首个写入起的最长等待
+#define WRITER_MAX_BATCH     256
+#define WRITER_MAX_DELAY_US  2000
+
+// 写队列基准默认参数（可用 --producers= --writes= 覆盖）
+#define WRITER_BENCH_PRODUCERS 8
+#define WRITER_BENCH_WRITES    500
+
+// 异步接口：执行器线程数与行流每次在执行器上读取的行数
+#define ASYNC_EXECUTOR_THREADS 4
+#define ASYNC_STREAM_BATCH     64
+#define ASYNC_LOOP_TICK_MS     1        // 事件循环空闲时每隔多久记一次心跳
+#define ASYNC_MAX_LOOP_GAP_MS  50       // 心跳最大间隔上限，超过说明循环线程被阻塞
+
+// 后台密钥派生基准：数据库文件名、模拟的其他启动初始化耗时（可用 --dbs= --init-ms= --threads= 覆盖）
+#define KEYPOOL_DB_PATTERN "test_keypool_%d.db"
+#define KEYPOOL_INIT_MS    200
+
+// 分步在线备份默认参数（可用 --backup-pages= --backup-sleep-us= --backup-bps= --backup-cpu= 覆盖）
+#define BACKUP_PAGES_PER_STEP 64
+#define BACKUP_SLEEP_US       1000
+#define BACKUP_MAX_RESTARTS   16
+#define BACKUP_BENCH_ROWS     200000
+
+// 在线换密钥：检查源库在复制期间是否被修改的最大轮数，切换时等待写锁的时间
+#define REKEY_MAX_ROUNDS      4
+#define REKEY_LOCK_TIMEOUT_MS 5000
+#define REKEY_BENCH_ROWS      200000
+#define REKEY_BENCH_READERS   2
+#define REKEY_BENCH_WRITERS   1
+
+// 明文转加密迁移：读线程数、每批行数（一批一个事务）、读写之间排队的批数
+#define MIGRATE_READERS     4
+#define MIGRATE_BATCH_ROWS  5000
+#define MIGRATE_QUEUE_DEPTH 8
+#define MIGRATE_BENCH_ROWS  500000
+
+// 全局页缓存：分片数、--pcache-mb= 指定的总内存预算，以及基准的行数/读线程/时长
+#define PCACHE_SHARDS         16
+#define PCACHE_BUDGET_MB      64
+#define PCACHE_BENCH_MB       8
+#define PCACHE_BENCH_ROWS     300000
+#define PCACHE_BENCH_READERS  4
+#define PCACHE_BENCH_DURATION 3
+
+// 内存池剖析：推荐值按多少个并发连接计算、在观测峰值上留的余量、默认 lookaside 槽大小
+#define ARENA_TARGET_CONNECTIONS 8
+#define ARENA_HEADROOM           1.25
+#define ARENA_LOOKASIDE_SLOT     1200
+
+// io_uring VFS：每个文件的提交队列深度、延迟写暂存区大小（注册为固定缓冲区）、基准行数
+#define URING_QUEUE_DEPTH    64
+#define URING_STAGING_BYTES  (256 * 1024)
+#define URING_POOL_SIZE      16
+#define URING_BENCH_ROWS     100000
+
+// 引擎指标：默认输出文件（--metrics-interval 开启定期采样）
+#define METRICS_PROM_PATH  "btest_metrics.prom"
+#define METRICS_JSON_PATH  "btest_metrics.json"
+
+// SQL 剖析：报告条数、直方图每个 2 的幂区间细分的位数、每线程 SQL 文本缓存上限
+#define SQL_PROFILE_TOP_N        20
+#define SQL_HIST_SUB_BITS        4
+#define SQL_PROFILE_CACHE_MAX    4096
+
+// 执行计划剖析：全表扫描访问行数达到多少算“大表全表扫描”、基准表行数
+#define PLAN_LARGE_SCAN_ROWS  10000
+#define PLAN_BENCH_ROWS       100000
+
+// 预读 VFS：连续多少次顺序读后开始预读、允许跳过的间隙（内部页）、预读窗口范围、冷扫描基准行数
+#define READAHEAD_TRIGGER_READS  4
+#define READAHEAD_MAX_GAP        (64 * 1024)
+#define READAHEAD_MIN_WINDOW     (128 * 1024)
+#define READAHEAD_MAX_WINDOW     (4 * 1024 * 1024)
+#define READAHEAD_BENCH_ROWS     500000
+
+// 数据库内容比较：并行线程上限、范围缩小到多少行以内停止、每次扫描的分桶数、每表最多报告的不一致范围数
+#define COMPARE_MAX_THREADS 8
+#define COMPARE_LEAF_ROWS   64
+#define COMPARE_FANOUT      16
+#define COMPARE_MAX_RANGES  16
+#define COMPARE_BENCH_ROWS  200000
+
+// 连接池默认大小与借出等待时间
+#define POOL_MIN_SIZE 1
+#define POOL_MAX_SIZE 4
+#define POOL_ACQUIRE_TIMEOUT_MS 5000
+
 // 颜色定义
 #define ANSI_COLOR_GREEN   "\x1b[32m"
 #define ANSI_COLOR_RED     "\x1b[31m"
@@ -32,17 +227,836 @@ int test_key_management();
 int test_error_handling();
 int test_performance();
 int test_database_conversion();
+int test_database_migration();
 int test_concurrency();
 int test_backup_restore();
+int bench_key_cache();
+int bench_bulk_insert();
+int bench_cipher_sweep();
+int bench_writer_queue();
+int test_async_api();
+int bench_paced_backup();
+int bench_compare_databases();
+int bench_online_rekey();
+int bench_migration();
+int bench_page_cache();
+int profile_memory_arenas();
+int bench_uring_vfs();
+int bench_readahead_vfs();
+int profile_query_plans();
+int bench_key_pool();
+int bench_kdf();
 
 // 辅助函数
 int execute_sql(sqlite3 *db, const char *sql);
 int compare_databases(const char *db1_path, const char *db2_path, const char *key1, const char *key2);
 void print_test_result(const char *test_name, int result);
 sqlite3* open_database(const char *db_path, const char *key);
+sqlite3* open_database_uncached(const char *db_path, const char *key);
+
+// SQLCipher 加密参数，字符串为 NULL / 数值为 0 表示沿用默认值
+struct CipherSettings {
+    int kdf_iter;
+    int page_size;
+    const char *hmac_algorithm;     // SHA1 / SHA256 / SHA512
+    const char *kdf_algorithm;      // SHA1 / SHA256 / SHA512
+    int use_hmac;                   // 1 开启，0 关闭，-1 默认
+};
+
+sqlite3* open_database_with_settings(const char *db_path, const char *key, const CipherSettings *settings);
 void close_database(sqlite3 *db);
 
-int main() {
+// 派生密钥缓存
+int key_cache_apply(sqlite3 *db, const char *db_path, const char *key);
+int key_cache_rekey(sqlite3 *db, const char *db_path, const char *new_key);
+void key_cache_confirm(sqlite3 *db, int closing);
+void key_cache_set_kdf(const char *db_path, int kdf_iter, const char *kdf_algorithm);
+int key_cache_get_kdf(const char *db_path, int *kdf_iter, std::string *kdf_algorithm);
+void key_cache_invalidate(const char *db_path);
+void key_cache_clear();
+
+// 可选 Argon2id 密钥派生：只能在建库时选定，之后每次经 open_database 打开都按附属文件中的参数派生。
+// SQLCipher 自身只认 PBKDF2，这类库必须用原始密钥打开，open_database_uncached 不适用。
+struct Argon2Params {
+    uint32_t memory_kib;
+    uint32_t iterations;
+    uint32_t lanes;
+};
+
+int argon2_available();
+uint32_t argon2_threads(uint32_t lanes);
+void kdf_set_default_argon2(const Argon2Params *params);
+int kdf_sidecar_write(const char *db_path, const Argon2Params *params);
+int kdf_sidecar_read(const char *db_path, Argon2Params *params);    // 1 有效，0 不存在，-1 损坏
+void kdf_sidecar_remove(const char *db_path);
+sqlite3* open_database_argon2(const char *db_path, const char *key, const Argon2Params *params);
+double now_seconds();
+
+/*
+ * 加密连接池：池中连接都已设置密钥，借出时优先返还本线程上次用过的连接，
+ * 归还时若报告过 SQLITE_NOTADB 则先做健康检查，不通过的连接直接关闭。
+ */
+class ConnectionPool {
+public:
+    ConnectionPool(const char *db_path, const char *key, int min_size, int max_size);
+    ~ConnectionPool();
+    
+    sqlite3 *checkout(int timeout_ms);
+    void checkin(sqlite3 *db, int last_rc);
+    void shutdown();
+    
+    const std::string &path() const { return path_; }
+    int matches_key(const char *key) const { return key_ == key; }
+    
+private:
+    struct IdleConnection {
+        sqlite3 *db;
+        std::thread::id owner;      // 最后一次使用该连接的线程
+    };
+    
+    int health_check(sqlite3 *db);
+    
+    std::string path_;
+    std::string key_;
+    int min_size_;
+    int max_size_;
+    int total_;                     // 已打开的连接数（空闲 + 借出）
+    int closed_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<IdleConnection> idle_;
+    std::unordered_map<sqlite3 *, unsigned long long> generation_;    // 每条连接打开时的文件代次
+};
+
+/**
+ * 借出/归还连接的 RAII 守卫，析构时自动归还
+ */
+class PooledConnection {
+public:
+    explicit PooledConnection(std::shared_ptr<ConnectionPool> pool, int timeout_ms = POOL_ACQUIRE_TIMEOUT_MS);
+    ~PooledConnection();
+    PooledConnection(const PooledConnection &) = delete;
+    PooledConnection &operator=(const PooledConnection &) = delete;
+    
+    sqlite3 *get() const { return db_; }
+    // 记录最近一次操作的返回码，归还时据此决定是否做健康检查
+    int report(int rc) { last_rc_ = rc; return rc; }
+    
+private:
+    std::shared_ptr<ConnectionPool> pool_;
+    sqlite3 *db_;
+    int last_rc_;
+};
+
+std::shared_ptr<ConnectionPool> connection_pool_for(const char *db_path, const char *key);
+void connection_pool_shutdown_all();
+
+// 数据库文件在本进程内被替换的次数（按规范路径），连接池据此丢弃替换前打开的连接
+unsigned long long database_generation(const char *db_path);
+void database_generation_bump(const char *db_path);
+
+// 预编译语句缓存（按连接启用）
+struct StmtCacheStats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t size;
+};
+
+int stmt_cache_attach(sqlite3 *db, size_t capacity);
+void stmt_cache_detach(sqlite3 *db);
+sqlite3_stmt *stmt_cache_acquire(sqlite3 *db, const char *sql);
+void stmt_cache_release(sqlite3_stmt *stmt);
+int stmt_cache_stats(sqlite3 *db, StmtCacheStats *stats);
+
+// 批量插入
+enum BulkValueType {
+    BULK_NULL,
+    BULK_INT64,
+    BULK_DOUBLE,
+    BULK_TEXT,
+    BULK_BLOB
+};
+
+struct BulkBlob {
+    const void *data;
+    int size;
+};
+
+// 按列连续存放的数组：int64 列为 sqlite3_int64[]，double 列为 double[]，
+// 文本列为 const char *[]（元素为 NULL 时插入 NULL），BLOB 列为 BulkBlob[]
+struct BulkColumn {
+    const char *name;
+    BulkValueType type;
+    const void *data;
+};
+
+// 行生成器填写的单个值，文本/BLOB 指针只需在本次回调返回前有效
+struct BulkValue {
+    BulkValueType type;
+    sqlite3_int64 i;
+    double d;
+    const void *p;
+    int n;                      // 文本/BLOB 字节数，文本可为 -1 表示以 NUL 结尾
+};
+
+struct BulkInsertOptions {
+    int rows_per_statement;     // 每条 INSERT 的 VALUES 行数，0 取 BULK_ROWS_PER_STATEMENT，均受变量上限约束
+    long long commit_every;     // 每插入多少行提交一次，0 表示整批一个事务
+};
+
+// 行生成回调：填写第 row 行的 ncols 个值，返回 1 表示产生了一行，0 表示结束，负数表示出错
+typedef int (*BulkRowGenerator)(void *ctx, long long row, BulkValue *values);
+
+int bulk_insert_arrays(sqlite3 *db, const char *table, const BulkColumn *columns, int ncols,
+                       long long nrows, const BulkInsertOptions *opts);
+int bulk_insert_generated(sqlite3 *db, const char *table, const char *const *column_names, int ncols,
+                          BulkRowGenerator generator, void *ctx, const BulkInsertOptions *opts,
+                          long long *rows_inserted);
+
+// 独立运行模式：./btest <模式名>
+struct RunMode {
+    const char *name;
+    int (*fn)();
+    const char *desc;
+};
+
+static const RunMode g_run_modes[] = {
+    {"bench-keycache", bench_key_cache, "派生密钥缓存：冷打开与缓存打开对比"},
+    {"bench-bulk", bench_bulk_insert, "批量插入：逐行 SQL 与多行 VALUES 对比"},
+    {"performance", test_performance, "性能测试：插入/查询/更新/删除各阶段基准"},
+    {"concurrency", test_concurrency, "并发测试：WAL 模式多线程读写吞吐、延迟与 BUSY 统计"},
+    {"bench-writer", bench_writer_queue, "写队列组提交与逐条自动提交对比"},
+    {"async", test_async_api, "协程异步接口：打开/执行/查询/行流不阻塞事件循环线程"},
+    {"bench-backup", bench_paced_backup, "在线备份：一次性复制与分步限速复制对写入延迟的影响"},
+    {"bench-compare", bench_compare_databases, "并行内容哈希比较与不一致范围定位"},
+    {"bench-rekey", bench_online_rekey, "换密钥期间读写延迟：原地换密钥与在线换密钥"},
+    {"migrate", bench_migration, "明文转加密：sqlcipher_export 与流水线迁移对比"},
+    {"bench-pagecache", bench_page_cache, "全局预算页缓存：单连接与多连接在同一预算下的页加载（解密）次数"},
+    {"profile-memory", profile_memory_arenas, "内存剖析：按高水位推荐页缓存/lookaside/堆内存池大小"},
+    {"bench-vfs", bench_uring_vfs, "io_uring VFS 与默认 unix VFS 的性能测试各阶段对比"},
+    {"bench-readahead", bench_readahead_vfs, "冷缓存全表扫描：默认 VFS 与顺序预读 VFS 对比"},
+    {"profile-plans", profile_query_plans, "执行计划剖析：各循环访问行数/估计行数，标出大表全表扫描"},
+    {"bench-keypool", bench_key_pool, "启动时批量打开加密库：串行派生密钥与后台派生池对比"},
+    {"bench-kdf", bench_kdf, "打开延迟：PBKDF2 与 Argon2id（多 lane 并行）对比"},
+    {"sweep", bench_cipher_sweep, "加密参数扫描：kdf_iter/页大小/HMAC/KDF 组合的吞吐与打开延迟"},
+};
+
+int run_mode(const char *name);
+
+/*
+ * 单写线程队列：生产者经无锁 MPSC 队列提交写入，写线程把一个组提交窗口内的
+ * 写入合并进同一个事务，提交后通过 future 返回每条写入的结果
+ */
+struct MpscNode {
+    std::atomic<MpscNode *> next;
+};
+
+// Vyukov 侵入式多生产者单消费者队列：push 无锁，pop 只能由唯一的消费者调用
+class MpscQueue {
+public:
+    MpscQueue();
+    void push(MpscNode *node);
+    MpscNode *pop();
+    
+private:
+    std::atomic<MpscNode *> head_;  // 生产者端
+    MpscNode *tail_;                // 消费者端
+    MpscNode stub_;
+};
+
+struct WriterQueueOptions {
+    int max_batch;                  // 每个事务最多合并的写入数
+    int max_delay_us;               // 自批内第一条写入起最多等待多久再提交
+};
+
+struct WriterQueueStats {
+    long long writes;
+    long long batches;
+    long long failed_writes;
+};
+
+class WriterQueue {
+public:
+    WriterQueue(const char *db_path, const char *key, const WriterQueueOptions &opts);
+    ~WriterQueue();
+    
+    int start();
+    void stop();
+    // 提交一条写语句，params 中的文本/BLOB 会被复制；future 在所在事务提交后就绪
+    std::future<int> submit(const char *sql, const BulkValue *params, int nparams);
+    WriterQueueStats stats() const;
+    
+private:
+    struct Request;
+    
+    void run();
+    Request *next_request();
+    int execute(Request *request);
+    void wait_for_work(int timeout_us);
+    
+    std::string path_;
+    std::string key_;
+    WriterQueueOptions opts_;
+    sqlite3 *db_;
+    std::thread thread_;
+    // submit 先增加 inflight_ 再检查 running_，stop 先清除 running_ 再等 inflight_ 归零：
+    // 两边都是顺序一致的原子操作，停止后不会有请求漏在队列里，入队路径仍然无锁
+    std::atomic<int> running_;
+    std::atomic<int> inflight_;
+    MpscQueue queue_;
+    std::atomic<long long> queued_;
+    std::atomic<int> stopping_;
+    std::atomic<int> sleeping_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_cond_;
+    std::atomic<long long> writes_;
+    std::atomic<long long> batches_;
+    std::atomic<long long> failed_writes_;
+};
+
+/*
+ * C++20 协程异步接口
+ *
+ * 打开（含 PBKDF2）、sqlite3_step、提交等阻塞工作都在固定大小的执行器线程池上运行，
+ * 调用方线程（例如事件循环）co_await 时只挂起协程，不会被阻塞。
+ * 在 EventLoop 线程上 co_await 的 Task / RowStream 完成后投递回该循环继续，
+ * 协程的其余部分始终在循环线程上运行；不在循环线程上的等待者照常对称转移。
+ * 同一连接同一时刻只能有一个未完成的异步操作。
+ */
+class Executor {
+public:
+    explicit Executor(int threads);
+    ~Executor();
+    
+    void post(std::function<void()> work);
+    
+    // co_await executor.schedule() 之后协程在执行器线程上继续运行
+    struct ScheduleAwaiter {
+        Executor *executor;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { executor->post([handle] { handle.resume(); }); }
+        void await_resume() const noexcept {}
+    };
+    ScheduleAwaiter schedule() { return ScheduleAwaiter{this}; }
+    
+private:
+    void run();
+    
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()> > queue_;
+    std::vector<std::thread> threads_;
+    int stopping_;
+};
+
+struct EventLoopStats {
+    long long ticks;                // 循环轮数
+    long long tasks;                // 在循环线程上执行的工作（含协程续体）数
+    double max_gap_seconds;         // 相邻两轮之间的最大间隔
+};
+
+// 单线程事件循环：投递来的工作只在调用 run_until 的线程上执行
+class EventLoop {
+public:
+    void post(std::function<void()> work);
+    // 每轮执行已就绪的工作，没有工作时最多等待 tick_ms 毫秒，直到 done() 为真
+    void run_until(const std::function<bool()> &done, int tick_ms, EventLoopStats *stats);
+    // 当前线程正在运行的事件循环，不在循环线程上时为 NULL
+    static EventLoop *current();
+    
+    // co_await loop.schedule() 之后协程在循环线程上继续运行
+    struct ScheduleAwaiter {
+        EventLoop *loop;
+        bool await_ready() const noexcept { return current() == loop; }
+        void await_suspend(std::coroutine_handle<> handle) { loop->post([handle] { handle.resume(); }); }
+        void await_resume() const noexcept {}
+    };
+    ScheduleAwaiter schedule() { return ScheduleAwaiter{this}; }
+    
+    // 等待者在循环线程上、当前却不在该线程时，把续体投递回循环并返回 noop
+    static std::coroutine_handle<> resume_on(EventLoop *loop, std::coroutine_handle<> next) {
+        if (!loop || current() == loop) {
+            return next;
+        }
+        loop->post([next] { next.resume(); });
+        return std::noop_coroutine();
+    }
+    
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()> > queue_;
+};
+
+// 惰性协程任务：被 co_await 时才开始执行，结束后回到等待者（等待者在事件循环上时回到该循环）
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+        EventLoop *continuation_loop = NULL;
+        
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        
+        struct FinalAwaiter {
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                std::coroutine_handle<> next = handle.promise().continuation;
+                return next ? EventLoop::resume_on(handle.promise().continuation_loop, next) : std::noop_coroutine();
+            }
+            void await_resume() const noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+    
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(Task &&other) noexcept : handle_(other.handle_) { other.handle_ = NULL; }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+    
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        handle_.promise().continuation_loop = EventLoop::current();
+        return handle_;
+    }
+    T await_resume() {
+        if (handle_.promise().error) {
+            std::rethrow_exception(handle_.promise().error);
+        }
+        return std::move(*handle_.promise().value);
+    }
+    
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// 立即开始、结束后自行销毁的协程，用于从普通函数发起异步流程
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return DetachedTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// 查询结果的一个值与一行
+typedef std::variant<std::monostate, sqlite3_int64, double, std::string> SqlValue;
+typedef std::vector<SqlValue> SqlRow;
+
+/*
+ * 异步行流：生产端协程 co_yield 行，消费端 co_await stream.next() 逐行取，
+ * 返回空 optional 表示结束。sqlite3_step 以 ASYNC_STREAM_BATCH 行为一批在执行器上运行。
+ */
+class RowStream {
+public:
+    struct promise_type {
+        const SqlRow *current;
+        std::coroutine_handle<> consumer;
+        EventLoop *consumer_loop = NULL;
+        std::exception_ptr error;
+        
+        RowStream get_return_object() { return RowStream(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        
+        // 产出一行或结束后都把控制权交还给消费者
+        struct YieldAwaiter {
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                return EventLoop::resume_on(handle.promise().consumer_loop, handle.promise().consumer);
+            }
+            void await_resume() const noexcept {}
+        };
+        YieldAwaiter yield_value(const SqlRow &row) {
+            current = &row;
+            return YieldAwaiter();
+        }
+        YieldAwaiter final_suspend() noexcept { return YieldAwaiter(); }
+        void return_void() { current = NULL; }
+        void unhandled_exception() {
+            error = std::current_exception();
+            current = NULL;
+        }
+    };
+    
+    explicit RowStream(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    RowStream(RowStream &&other) noexcept : handle_(other.handle_) { other.handle_ = NULL; }
+    RowStream(const RowStream &) = delete;
+    RowStream &operator=(const RowStream &) = delete;
+    ~RowStream() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+    
+    struct NextAwaiter {
+        std::coroutine_handle<promise_type> handle;
+        bool await_ready() const noexcept { return handle.done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept {
+            handle.promise().consumer = consumer;
+            handle.promise().consumer_loop = EventLoop::current();
+            return handle;
+        }
+        std::optional<SqlRow> await_resume() {
+            if (handle.promise().error) {
+                std::rethrow_exception(handle.promise().error);
+            }
+            if (handle.done() || !handle.promise().current) {
+                return std::nullopt;
+            }
+            return *handle.promise().current;
+        }
+    };
+    NextAwaiter next() { return NextAwaiter{handle_}; }
+    
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+Task<sqlite3 *> async_open(Executor &executor, std::string db_path, std::string key);
+Task<int> async_exec(Executor &executor, sqlite3 *db, std::string sql);
+Task<std::vector<SqlRow> > async_query(Executor &executor, sqlite3 *db, std::string sql);
+RowStream async_query_stream(Executor &executor, sqlite3 *db, std::string sql);
+Task<int> async_close(Executor &executor, sqlite3 *db);
+
+/*
+ * 后台密钥派生池：启动时把一批 (路径, 口令) 一次交给执行器，打开、PBKDF2 和首页校验
+ * 在执行器线程上并行完成，调用方先做其他初始化，再从 future 取已设置好密钥的连接。
+ * 打开或校验失败时 future 的值为 NULL；取到的连接由调用方 close_database。
+ */
+struct KeyedOpen {
+    std::string db_path;
+    std::string key;
+};
+
+sqlite3 *open_database_keyed(const char *db_path, const char *key);
+std::vector<std::future<sqlite3 *> > open_databases_keyed(Executor &executor, std::vector<KeyedOpen> requests);
+
+/*
+ * 分步在线备份
+ */
+// 进度回调：remaining/pagecount 来自 sqlite3_backup_remaining/pagecount
+typedef void (*BackupProgress)(void *ctx, int remaining, int pagecount, int restarts);
+
+struct PacedBackupOptions {
+    int pages_per_step;             // 每次 sqlite3_backup_step 复制的页数
+    int sleep_us;                   // 步间最少休眠，0 表示只让出 CPU
+    long long max_bytes_per_sec;    // 带宽上限，0 表示不限
+    double max_cpu_fraction;        // 备份线程 CPU 占用上限 (0, 1]，1 表示不限
+    int max_restarts;               // 源库被其他连接修改导致重新开始的次数上限，超过后一次性复制剩余页
+    BackupProgress progress;        // 可为 NULL
+    void *progress_ctx;
+};
+
+struct PacedBackupStats {
+    int steps;
+    int restarts;
+    int pagecount;
+    long long bytes;
+    double seconds;
+};
+
+void paced_backup_default_options(PacedBackupOptions *opts);
+int paced_backup(sqlite3 *dest, sqlite3 *src, const PacedBackupOptions *opts, PacedBackupStats *stats);
+
+/*
+ * 在线换密钥：用分步备份把数据复制到新密钥的副本，再持写锁原子替换原文件。
+ * 替换后仍打开旧文件的连接写入时得到 SQLITE_READONLY_DBMOVED，读取则静默读到旧数据，
+ * 需用新密钥重新打开；其他进程的连接不会被通知，见 online_rekey 实现处的说明。
+ */
+struct OnlineRekeyOptions {
+    PacedBackupOptions backup;
+    int max_rounds;                 // 复制期间源库被改动时重做的轮数，用尽后持写锁做最后一轮
+    int lock_timeout_ms;
+};
+
+struct OnlineRekeyStats {
+    int rounds;
+    int resumed;                    // 从上次中断的状态文件继续
+    int locked_copy;                // 最后一轮是否在持写锁的情况下完成
+    double lock_seconds;            // 持有写锁（阻塞其他写入）的总时长
+    double seconds;
+    PacedBackupStats backup;        // 最后一轮的备份统计
+};
+
+void online_rekey_default_options(OnlineRekeyOptions *opts);
+int online_rekey(const char *db_path, const char *old_key, const char *new_key,
+                 const OnlineRekeyOptions *opts, OnlineRekeyStats *stats);
+
+/*
+ * 明文转加密迁移：多个读线程按 rowid 顺序流式读取明文库的表，单个写线程把批次批量
+ * 插入加密库，每批一个事务并在同一事务里记录进度；数据全部写完后再建索引、触发器和视图。
+ * 中断后用相同参数再次调用即从进度表记录的位置继续。
+ */
+struct MigrationOptions {
+    int readers;
+    int batch_rows;
+    int queue_depth;
+    int progress;                   // 是否打印进度
+};
+
+struct MigrationStats {
+    int tables;
+    int resumed;
+    long long rows;
+    long long bytes;                // 迁移的列值字节数
+    double seconds;
+    double write_seconds;           // 写线程实际插入耗时，其余时间在等待读线程
+    double index_seconds;
+};
+
+void migration_default_options(MigrationOptions *opts);
+int migrate_plaintext_database(const char *plain_path, const char *target_path, const char *key,
+                               const MigrationOptions *opts, MigrationStats *stats);
+void migration_print_report(const MigrationStats *stats);
+
+/*
+ * 全局预算页缓存（SQLITE_CONFIG_PCACHE2）：所有连接的页缓存共用一个内存预算，
+ * 未钉住的页按分片 LRU 在连接之间相互淘汰。必须在 sqlite3_initialize 之前安装。
+ * 它只限制总内存，不在连接之间共享页：每个连接仍各自读取并解密校验自己用到的页。
+ */
+struct SharedPcacheStats {
+    size_t budget;
+    size_t bytes;
+    long long loads;                // 新建的页，即 pager 需从磁盘读取并解密校验的页
+    long long hits;
+    long long evictions;
+};
+
+int shared_pcache_install(size_t budget_bytes);
+int shared_pcache_installed();
+void shared_pcache_stats(SharedPcacheStats *stats);
+
+/*
+ * 启动时内存池：SQLITE_CONFIG_PAGECACHE / LOOKASIDE / HEAP，须在 sqlite3_initialize 之前配置。
+ * 命令行 --pagecache=槽大小,槽数 --lookaside=槽大小,槽数 --heap-mb=N，数值可由 profile-memory 模式给出。
+ */
+struct MemoryArenaConfig {
+    int pagecache_slot_size;        // 0 表示不配置
+    int pagecache_slots;
+    int lookaside_slot_size;        // 0 表示不配置（每个连接的默认 lookaside）
+    int lookaside_slots;
+    long long heap_bytes;           // 0 表示不配置，需要 SQLITE_ENABLE_MEMSYS5 或 MEMSYS3，不能超过 INT_MAX
+    int heap_min_alloc;
+    size_t pcache_budget;           // 已安装的自定义页缓存预算，非 0 时不配置 PAGECACHE 槽
+};
+
+int memory_arenas_configure(const MemoryArenaConfig *config);
+int memory_arenas_configure_from_options();
+void memory_profile_sample(sqlite3 *db);
+
+/*
+ * io_uring VFS（名为 "uring"）：包装默认 unix VFS，主库、回滚日志和 WAL 的写入先复制到
+ * 注册的固定缓冲区排队，在 xSync 或任何其他文件操作之前一次提交，xSync 的 fsync 以
+ * IOSQE_IO_DRAIN 排在这些写入之后；读取也经 io_uring 提交。内核不支持 io_uring 或
+ * 所需操作码（IORING_REGISTER_PROBE 探测）、或无法确认文件描述符时，文件操作全部交给默认 VFS。
+ */
+struct UringVfsStats {
+    int available;
+    long long files;                // 走 io_uring 的文件数
+    long long fallback_files;       // 交给默认 VFS 的文件数
+    long long reads;
+    long long writes;
+    long long fsyncs;
+    long long submits;              // io_uring_enter 调用次数
+};
+
+int uring_vfs_register(int make_default);
+void uring_vfs_stats(UringVfsStats *stats);
+sqlite3* open_database_vfs(const char *db_path, const char *key, const char *vfs_name);
+
+/*
+ * 顺序预读 VFS（名为 "readahead"）：按文件句柄识别顺序读取，连续顺序读达到阈值后
+ * 用 posix_fadvise(WILLNEED) 提前读入后面的区间，窗口随顺序读加倍；一旦出现随机读
+ * 就回到初始状态，随机访问只多几次比较。
+ */
+struct ReadaheadVfsStats {
+    long long reads;
+    long long sequential_reads;
+    long long advises;
+    long long advised_bytes;
+};
+
+int readahead_vfs_register(int make_default);
+void readahead_vfs_stats(ReadaheadVfsStats *stats);
+
+/*
+ * 引擎指标：open_database* 打开的连接都登记在表里，采样时读取每个连接的全部
+ * SQLITE_DBSTATUS_* 和进程级 SQLITE_STATUS_*，按数据库文件名汇总；连接关闭时把累计型
+ * 计数并入该文件的已关闭合计，所以计数不会因连接关闭而回退。定期写 Prometheus 文本
+ * 文件（写临时文件后改名）并追加一行 JSON 快照；print_test_result 打印每个测试的增量。
+ */
+struct MetricsSnapshot {
+    double timestamp;
+    int connections;
+    std::map<std::string, long long> process;                           // 指标名 -> 值
+    std::map<std::string, std::map<std::string, long long>> databases;  // 文件名 -> 指标名 -> 值
+};
+
+void metrics_register_connection(sqlite3 *db);
+void metrics_unregister_connection(sqlite3 *db);
+void metrics_collect(MetricsSnapshot *snapshot);
+int metrics_write_prometheus(const char *path, const MetricsSnapshot &snapshot);
+int metrics_append_json(const char *path, const MetricsSnapshot &snapshot);
+int metrics_start(int interval_ms, const char *prom_path, const char *json_path);
+void metrics_stop();
+void metrics_print_test_delta(const char *test_name);
+
+/*
+ * SQL 剖析：经 sqlite3_auto_extension 给每个新连接注册 sqlite3_trace_v2
+ * （STMT/ROW/PROFILE），SQL 去掉字面量后归并为指纹，每个指纹一个原子计数的
+ * 对数分桶直方图，记录调用次数、行数和耗时；退出时或收到 SIGUSR1 时打印耗时最多的指纹。
+ */
+int sql_profiler_install(int top_n);
+std::string sql_fingerprint(const char *sql);
+void sql_profiler_report(FILE *out, int top_n);
+
+/*
+ * 执行计划剖析：执行一条语句（写语句在保存点里执行后回滚），收集每个循环的执行次数、
+ * 访问行数、估计行数和周期数（sqlite3_stmt_scanstatus_v2），以及语句级的全表扫描步数、
+ * 排序和自动索引次数。scanstatus 需要库以 SQLITE_ENABLE_STMT_SCANSTATUS 编译，
+ * 编译本程序时也要定义同名宏；否则循环信息来自 EXPLAIN QUERY PLAN，只有语句级计数。
+ */
+struct PlanLoop {
+    int id;
+    int parent;
+    std::string detail;
+    long long loops;                // -1 表示没有 scanstatus
+    long long visits;
+    double estimated;
+    long long cycles;               // -1 表示不可用
+    int full_scan;
+    int flagged;                    // 大表全表扫描
+};
+
+struct PlanReport {
+    std::string sql;
+    int scanstatus;                 // 循环信息来自 scanstatus
+    double seconds;
+    long long rows;
+    long long vm_steps;
+    long long fullscan_steps;
+    long long sorts;
+    long long autoindexes;
+    int flagged;
+    std::vector<PlanLoop> loops;
+};
+
+int plan_scanstatus_available();
+int plan_profile_sql(sqlite3 *db, const char *sql, const long long *params, int param_count, PlanReport *report);
+void plan_print_report(const PlanReport &report);
+
+// 命令行选项 --name=value
+void parse_options(int argc, char *argv[]);
+long long option_int(const char *name, long long default_value);
+const char *option_str(const char *name, const char *default_value);
+
+/*
+ * 基准测试框架：steady_clock 墙上时间，预热 + N 轮计时，逐操作记录延迟
+ */
+struct LatencySummary {
+    size_t samples;
+    double mean_us;
+    double min_us;
+    double max_us;
+    double p50_us;
+    double p95_us;
+    double p99_us;
+    double p999_us;
+};
+
+// 每轮开始前的准备（不计时），返回 SQLite 返回码
+typedef int (*BenchSetup)(void *ctx);
+// 被计时的单个操作，iteration 为本轮内的序号
+typedef int (*BenchOp)(void *ctx, long long iteration);
+
+struct BenchCase {
+    const char *name;
+    BenchSetup setup;           // 可为 NULL
+    BenchOp op;
+    long long ops_per_rep;      // 每轮调用 op 的次数
+    long long items_per_op;     // 每次操作处理的行数，用于计算行吞吐
+    void *ctx;
+};
+
+struct BenchResult {
+    std::string name;
+    int warmup;
+    int reps;
+    long long ops;
+    long long items;
+    double total_seconds;       // 所有计时操作的墙上时间之和
+    double ops_per_sec;
+    double items_per_sec;
+    LatencySummary latency;
+};
+
+LatencySummary summarize_latencies(std::vector<double> &samples_ns);
+int bench_run(const BenchCase &bench, int warmup, int reps, BenchResult *result);
+BenchResult bench_result_from_samples(const char *name, std::vector<double> &samples_ns, double wall_seconds);
+void bench_print_header();
+void bench_print(const BenchResult &result);
+int bench_write_json(const char *path, sqlite3 *db, const std::vector<BenchResult> &results);
+
+int main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+    // 内存统计、内存池和页缓存都只能在 sqlite3_initialize 之前配置
+    if (argc > 1 && strcmp(argv[1], "profile-memory") == 0 && sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 1) != SQLITE_OK) {
+        fprintf(stderr, "开启内存统计失败\n");
+        return 1;
+    }
+    if (memory_arenas_configure_from_options() != SQLITE_OK) {
+        return 1;
+    }
+    if (option_int("pcache-mb", 0) > 0 &&
+        shared_pcache_install((size_t)option_int("pcache-mb", 0) << 20) != SQLITE_OK) {
+        return 1;
+    }
+    // 注册 VFS 会初始化 SQLite，必须在上面的 sqlite3_config 之后
+    if (strcmp(option_str("vfs", ""), "uring") == 0) {
+        uring_vfs_register(1);
+    } else if (strcmp(option_str("vfs", ""), "readahead") == 0) {
+        readahead_vfs_register(1);
+    }
+    if (strcmp(option_str("kdf", ""), "argon2id") == 0) {
+        if (!argon2_available()) {
+            fprintf(stderr, "--kdf=argon2id 需要 OpenSSL 3.2+ 运行库，当前为 %s\n", OpenSSL_version(OPENSSL_VERSION));
+            return 1;
+        }
+        Argon2Params argon2 = {(uint32_t)option_int("argon2-memory-kib", ARGON2_MEMORY_KIB),
+                               (uint32_t)option_int("argon2-iterations", ARGON2_ITERATIONS),
+                               (uint32_t)option_int("argon2-lanes", ARGON2_LANES)};
+        kdf_set_default_argon2(&argon2);
+    }
+    // 须在启动任何线程之前调用：SIGUSR1 在所有线程里屏蔽，由剖析器的线程 sigwait
+    if (option_int("profile-sql", 0)) {
+        sql_profiler_install((int)option_int("profile-sql-top", SQL_PROFILE_TOP_N));
+    }
+    int metrics_interval = (int)option_int("metrics-interval", 0);
+    if (metrics_interval > 0) {
+        metrics_start(metrics_interval, option_str("metrics-prom", METRICS_PROM_PATH),
+                      option_str("metrics-json", METRICS_JSON_PATH));
+    } else if (option_int("metrics-delta", 0)) {
+        metrics_start(0, NULL, NULL);
+    }
+    if (argc > 1 && strncmp(argv[1], "--", 2) != 0) {
+        return run_mode(argv[1]);
+    }
+    
     printf("=== SQLCipher 测试套件 ===\n\n");
     
     int all_passed = 1;
@@ -53,9 +1067,6 @@ int main() {
     print_test_result("基本操作测试", result);
     all_passed &= result;
     
-	
-	return 0;
-	
     // 测试密钥管理
     result = test_key_management();
     print_test_result("密钥管理测试", result);
@@ -71,20 +1082,27 @@ int main() {
     print_test_result("数据库转换测试", result);
     all_passed &= result;
     
+    // 测试流水线迁移
+    result = test_database_migration();
+    print_test_result("流水线迁移测试", result);
+    all_passed &= result;
+    
     // 测试备份恢复
     result = test_backup_restore();
     print_test_result("备份恢复测试", result);
     all_passed &= result;
     
-    // 测试性能
-    result = test_performance();
-    print_test_result("性能测试", result);
-    all_passed &= result;
-    
-    // 测试并发（注意：此测试需要多线程支持）
-    // result = test_concurrency();
-    // print_test_result("并发测试", result);
-    // all_passed &= result;
+    // 性能与并发测试耗时较长，默认只跑功能测试，--bench=1 时一并运行（也可用同名模式单独运行）
+    if (option_int("bench", 0)) {
+        result = test_performance();
+        print_test_result("性能测试", result);
+        all_passed &= result;
+        
+        // 测试并发（WAL 模式下的多线程读写）
+        result = test_concurrency();
+        print_test_result("并发测试", result);
+        all_passed &= result;
+    }
     
     printf("\n=== 测试完成 ===\n");
     if (all_passed) {
@@ -94,13 +1112,52 @@ int main() {
     }
     
     // 清理测试文件
+    connection_pool_shutdown_all();
+    key_cache_clear();
     remove(TEST_DB);
+    kdf_sidecar_remove(TEST_DB);
     remove(TEST_DB_COPY);
+    kdf_sidecar_remove(TEST_DB_COPY);
     remove(PLAINTEXT_DB);
     
     return all_passed ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+/**
+ * 按名称运行单个模式（基准测试等），未知名称时打印可用模式
+ */
+int run_mode(const char *name) {
+    const RunMode *mode = NULL;
+    for (size_t i = 0; i < sizeof(g_run_modes) / sizeof(g_run_modes[0]); i++) {
+        if (strcmp(g_run_modes[i].name, name) == 0) {
+            mode = &g_run_modes[i];
+            break;
+        }
+    }
+    
+    if (!mode) {
+        fprintf(stderr, "未知模式: %s\n可用模式:\n", name);
+        for (size_t i = 0; i < sizeof(g_run_modes) / sizeof(g_run_modes[0]); i++) {
+            fprintf(stderr, "  %-20s %s\n", g_run_modes[i].name, g_run_modes[i].desc);
+        }
+        return EXIT_FAILURE;
+    }
+    
+    printf("=== SQLCipher 模式: %s ===\n", mode->name);
+    int result = mode->fn();
+    print_test_result(mode->desc, result);
+    
+    connection_pool_shutdown_all();
+    key_cache_clear();
+    remove(TEST_DB);
+    kdf_sidecar_remove(TEST_DB);
+    remove(TEST_DB_COPY);
+    kdf_sidecar_remove(TEST_DB_COPY);
+    remove(PLAINTEXT_DB);
+    
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 /**
  * 测试基本数据库操作
  */
@@ -238,17 +1295,45 @@ int test_key_management() {
         return 0;
     }
     
-    // 更改密钥
-    char rekey_sql[128];
-    snprintf(rekey_sql, sizeof(rekey_sql), "PRAGMA rekey = '%s'", NEW_KEY);
-    rc = execute_sql(db, rekey_sql);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "更改密钥失败: %s\n", sqlite3_errmsg(db));
+    // 更改密钥：PBKDF2 库用 PRAGMA rekey；Argon2id 库 SQLCipher 无法按口令派生，换成按附属文件参数
+    // 派生的原始密钥；--online-rekey=1 时用分步复制加原子替换
+    Argon2Params argon2;
+    int sidecar = kdf_sidecar_read(TEST_DB, &argon2);
+    if (sidecar < 0) {
         close_database(db);
         return 0;
     }
+    if (option_int("online-rekey", 0)) {
+        close_database(db);
+        OnlineRekeyOptions rekey_opts;
+        online_rekey_default_options(&rekey_opts);
+        OnlineRekeyStats rekey_stats;
+        rc = online_rekey(TEST_DB, TEST_KEY, NEW_KEY, &rekey_opts, &rekey_stats);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "在线更改密钥失败: %d\n", rc);
+            return 0;
+        }
+        db = NULL;
+    } else if (sidecar) {
+        rc = key_cache_rekey(db, TEST_DB, NEW_KEY);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "更改密钥失败: %s\n", sqlite3_errmsg(db));
+            close_database(db);
+            return 0;
+        }
+    } else {
+        char rekey_sql[128];
+        snprintf(rekey_sql, sizeof(rekey_sql), "PRAGMA rekey = '%s'", NEW_KEY);
+        rc = execute_sql(db, rekey_sql);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "更改密钥失败: %s\n", sqlite3_errmsg(db));
+            close_database(db);
+            return 0;
+        }
+    }
     
     printf("密钥已从 '%s' 更改为 '%s'\n", TEST_KEY, NEW_KEY);
+    key_cache_invalidate(TEST_DB);
     
     // 关闭数据库
     close_database(db);
@@ -264,12 +1349,12 @@ int test_key_management() {
             rc = sqlite3_exec(db_old, "SELECT * FROM test_keys", NULL, NULL, &err_msg);
             if (rc == SQLITE_OK) {
                 fprintf(stderr, "错误：使用旧密钥仍能访问数据库\n");
-                sqlite3_close(db_old);
+                close_database(db_old);
                 return 0;
             }
             sqlite3_free(err_msg);
         }
-        sqlite3_close(db_old);
+        close_database(db_old);
     }
     
     // 验证使用新密钥可以打开
@@ -328,13 +1413,13 @@ int test_error_handling() {
             if (rc == SQLITE_OK) {
                 fprintf(stderr, "错误：使用错误密钥仍能访问数据库\n");
                 sqlite3_free(err_msg);
-                sqlite3_close(db);
+                close_database(db);
                 return 0;
             }
             printf("错误处理测试1通过：使用错误密钥得到预期错误\n");
             sqlite3_free(err_msg);
         }
-        sqlite3_close(db);
+        close_database(db);
     }
     
     // 测试2: 数据库文件损坏
@@ -355,13 +1440,13 @@ int test_error_handling() {
                 if (rc == SQLITE_OK) {
                     fprintf(stderr, "错误：损坏的数据库仍能正常访问\n");
                     sqlite3_free(err_msg);
-                    sqlite3_close(db);
+                    close_database(db);
                     return 0;
                 }
                 printf("错误处理测试2通过：损坏的数据库得到预期错误\n");
                 sqlite3_free(err_msg);
             }
-            sqlite3_close(db);
+            close_database(db);
         }
     }
     
@@ -373,12 +1458,12 @@ int test_error_handling() {
         if (rc == SQLITE_OK) {
             fprintf(stderr, "错误：无效的SQL语句未报错\n");
             sqlite3_free(err_msg);
-            sqlite3_close(db);
+            close_database(db);
             return 0;
         }
         printf("错误处理测试3通过：无效SQL语句得到预期错误\n");
         sqlite3_free(err_msg);
-        sqlite3_close(db);
+        close_database(db);
     }
     
     printf("错误处理测试通过\n");
@@ -405,30 +1490,22 @@ int test_database_conversion() {
     // 在明文数据库中创建表和数据
     rc = execute_sql(db_plain, "CREATE TABLE IF NOT EXISTS plain_data (id INTEGER PRIMARY KEY, value TEXT)");
     if (rc != SQLITE_OK) {
-        sqlite3_close(db_plain);
+        close_database(db_plain);
         return 0;
     }
     
     rc = execute_sql(db_plain, "INSERT INTO plain_data (value) VALUES ('plain text data')");
     if (rc != SQLITE_OK) {
-        sqlite3_close(db_plain);
+        close_database(db_plain);
         return 0;
     }
     
-    sqlite3_close(db_plain);
+    close_database(db_plain);
     
     // 将明文数据库转换为加密数据库
-    rc = sqlite3_open(TEST_DB, &db_encrypted);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "无法创建加密数据库: %s\n", sqlite3_errmsg(db_encrypted));
-        return 0;
-    }
-    
-    // 设置加密密钥
-    rc = sqlite3_key(db_encrypted, TEST_KEY, strlen(TEST_KEY));
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "设置密钥失败: %s\n", sqlite3_errmsg(db_encrypted));
-        sqlite3_close(db_encrypted);
+    db_encrypted = open_database(TEST_DB, TEST_KEY);
+    if (!db_encrypted) {
+        fprintf(stderr, "无法创建加密数据库\n");
         return 0;
     }
     
@@ -438,7 +1515,7 @@ int test_database_conversion() {
     rc = execute_sql(db_encrypted, attach_sql);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "附加明文数据库失败: %s\n", sqlite3_errmsg(db_encrypted));
-        sqlite3_close(db_encrypted);
+        close_database(db_encrypted);
         return 0;
     }
     
@@ -446,7 +1523,7 @@ int test_database_conversion() {
     rc = execute_sql(db_encrypted, "SELECT sqlcipher_export('main', 'plaintext')");
     if (rc != SQLITE_OK) {
         fprintf(stderr, "导出数据失败: %s\n", sqlite3_errmsg(db_encrypted));
-        sqlite3_close(db_encrypted);
+        close_database(db_encrypted);
         return 0;
     }
     
@@ -454,11 +1531,11 @@ int test_database_conversion() {
     rc = execute_sql(db_encrypted, "DETACH DATABASE plaintext");
     if (rc != SQLITE_OK) {
         fprintf(stderr, "分离数据库失败: %s\n", sqlite3_errmsg(db_encrypted));
-        sqlite3_close(db_encrypted);
+        close_database(db_encrypted);
         return 0;
     }
     
-    sqlite3_close(db_encrypted);
+    close_database(db_encrypted);
     
     // 验证加密数据库
     db_encrypted = open_database(TEST_DB, TEST_KEY);
@@ -472,7 +1549,7 @@ int test_database_conversion() {
     rc = sqlite3_prepare_v2(db_encrypted, "SELECT value FROM plain_data", -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "查询准备失败: %s\n", sqlite3_errmsg(db_encrypted));
-        sqlite3_close(db_encrypted);
+        close_database(db_encrypted);
         return 0;
     }
     
@@ -485,7 +1562,7 @@ int test_database_conversion() {
     }
     
     sqlite3_finalize(stmt);
-    sqlite3_close(db_encrypted);
+    close_database(db_encrypted);
     
     if (!found) {
         fprintf(stderr, "转换后数据丢失\n");
@@ -497,80 +1574,154 @@ int test_database_conversion() {
 }
 
 /**
- * 测试备份和恢复功能
+ * 测试明文库经读写流水线迁移为加密库（migrate_plaintext_database）
  */
-int test_backup_restore() {
-    printf("\n--- 备份恢复测试 ---\n");
+int test_database_migration() {
+    printf("\n--- 流水线迁移测试 ---\n");
     
-    sqlite3 *db = NULL;
-    sqlite3 *backup_db = NULL;
+    sqlite3 *db_plain = NULL;
+    sqlite3 *db_encrypted = NULL;
     int rc = 0;
     
-    // 创建源数据库并添加测试数据
-    db = open_database(TEST_DB, TEST_KEY);
-    if (!db) {
-        fprintf(stderr, "无法打开源数据库\n");
-        return 0;
-    }
-    
-    rc = execute_sql(db, "CREATE TABLE IF NOT EXISTS backup_test (id INTEGER PRIMARY KEY, data TEXT)");
+    // 创建明文数据库
+    rc = sqlite3_open(PLAINTEXT_DB, &db_plain);
     if (rc != SQLITE_OK) {
-        sqlite3_close(db);
+        fprintf(stderr, "无法创建明文数据库: %s\n", sqlite3_errmsg(db_plain));
         return 0;
     }
     
-    rc = execute_sql(db, "INSERT INTO backup_test (data) VALUES ('backup test data')");
+    // 在明文数据库中创建表和数据
+    rc = execute_sql(db_plain, "CREATE TABLE IF NOT EXISTS plain_data (id INTEGER PRIMARY KEY, value TEXT)");
     if (rc != SQLITE_OK) {
-        sqlite3_close(db);
+        close_database(db_plain);
         return 0;
     }
     
-    // 创建备份数据库
-    rc = sqlite3_open(TEST_DB_COPY, &backup_db);
+    rc = execute_sql(db_plain, "INSERT INTO plain_data (value) VALUES ('plain text data')");
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "无法创建备份数据库: %s\n", sqlite3_errmsg(backup_db));
-        sqlite3_close(db);
+        close_database(db_plain);
         return 0;
     }
     
-    // 设置备份数据库的密钥
-    rc = sqlite3_key(backup_db, TEST_KEY, strlen(TEST_KEY));
+    close_database(db_plain);
+    
+    // 将明文数据库迁移到新的加密库：读线程流式读取，单写线程分批写入
+    remove(TEST_DB_COPY);
+    kdf_sidecar_remove(TEST_DB_COPY);
+    key_cache_invalidate(TEST_DB_COPY);
+    MigrationOptions migrate_opts;
+    migration_default_options(&migrate_opts);
+    MigrationStats migrate_stats;
+    rc = migrate_plaintext_database(PLAINTEXT_DB, TEST_DB_COPY, TEST_KEY, &migrate_opts, &migrate_stats);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "设置备份数据库密钥失败: %s\n", sqlite3_errmsg(backup_db));
-        sqlite3_close(db);
-        sqlite3_close(backup_db);
+        fprintf(stderr, "迁移数据失败: %d\n", rc);
         return 0;
     }
+    migration_print_report(&migrate_stats);
     
-    // 执行备份
-    sqlite3_backup *backup = sqlite3_backup_init(backup_db, "main", db, "main");
-    if (!backup) {
-        fprintf(stderr, "备份初始化失败: %s\n", sqlite3_errmsg(backup_db));
-        sqlite3_close(db);
-        sqlite3_close(backup_db);
+    // 验证加密数据库
+    db_encrypted = open_database(TEST_DB_COPY, TEST_KEY);
+    if (!db_encrypted) {
+        fprintf(stderr, "无法打开加密数据库\n");
         return 0;
     }
     
-    rc = sqlite3_backup_step(backup, -1);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "备份执行失败: %d\n", rc);
-        sqlite3_backup_finish(backup);
-        sqlite3_close(db);
-        sqlite3_close(backup_db);
+    // 验证数据
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(db_encrypted, "SELECT value FROM plain_data", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "查询准备失败: %s\n", sqlite3_errmsg(db_encrypted));
+        close_database(db_encrypted);
+        return 0;
+    }
+    
+    int found = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *value = (const char *)sqlite3_column_text(stmt, 0);
+        if (strcmp(value, "plain text data") == 0) {
+            found = 1;
+        }
+    }
+    
+    sqlite3_finalize(stmt);
+    close_database(db_encrypted);
+    
+    remove(TEST_DB_COPY);
+    kdf_sidecar_remove(TEST_DB_COPY);
+    key_cache_invalidate(TEST_DB_COPY);
+    
+    if (!found) {
+        fprintf(stderr, "迁移后数据丢失\n");
+        return 0;
+    }
+    
+    printf("流水线迁移测试通过\n");
+    return 1;
+}
+
+/**
+ * 测试备份和恢复功能
+ */
+int test_backup_restore() {
+    printf("\n--- 备份恢复测试 ---\n");
+    
+    sqlite3 *db = NULL;
+    sqlite3 *backup_db = NULL;
+    int rc = 0;
+    
+    // 创建源数据库并添加测试数据
+    db = open_database(TEST_DB, TEST_KEY);
+    if (!db) {
+        fprintf(stderr, "无法打开源数据库\n");
         return 0;
     }
     
-    rc = sqlite3_backup_finish(backup);
+    rc = execute_sql(db, "CREATE TABLE IF NOT EXISTS backup_test (id INTEGER PRIMARY KEY, data TEXT)");
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "备份完成失败: %d\n", rc);
-        sqlite3_close(db);
-        sqlite3_close(backup_db);
+        close_database(db);
+        return 0;
+    }
+    
+    rc = execute_sql(db, "INSERT INTO backup_test (data) VALUES ('backup test data')");
+    if (rc != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    
+    // 创建备份数据库
+    rc = sqlite3_open(TEST_DB_COPY, &backup_db);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "无法创建备份数据库: %s\n", sqlite3_errmsg(backup_db));
+        close_database(db);
+        return 0;
+    }
+    
+    // 设置备份数据库的密钥
+    rc = sqlite3_key(backup_db, TEST_KEY, strlen(TEST_KEY));
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "设置备份数据库密钥失败: %s\n", sqlite3_errmsg(backup_db));
+        close_database(db);
+        close_database(backup_db);
+        return 0;
+    }
+    
+    // 分步执行在线备份：每步复制少量页，步间让出源库，按带宽/CPU 上限限速
+    PacedBackupOptions backup_opts;
+    paced_backup_default_options(&backup_opts);
+    PacedBackupStats backup_stats;
+    rc = paced_backup(backup_db, db, &backup_opts, &backup_stats);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "备份执行失败: %d\n", rc);
+        close_database(db);
+        close_database(backup_db);
         return 0;
     }
+    printf("备份完成: %d 页, %d 步, 重新开始 %d 次, 耗时 %.3f 秒\n",
+           backup_stats.pagecount, backup_stats.steps, backup_stats.restarts, backup_stats.seconds);
     
     // 关闭数据库
-    sqlite3_close(db);
-    sqlite3_close(backup_db);
+    close_database(db);
+    close_database(backup_db);
     
     // 验证备份
     db = open_database(TEST_DB, TEST_KEY);
@@ -578,8 +1729,8 @@ int test_backup_restore() {
     
     if (!db || !backup_db) {
         fprintf(stderr, "无法打开数据库进行验证\n");
-        sqlite3_close(db);
-        sqlite3_close(backup_db);
+        close_database(db);
+        close_database(backup_db);
         return 0;
     }
     
@@ -588,314 +1739,8153 @@ int test_backup_restore() {
         printf("备份恢复测试通过\n");
     } else {
         fprintf(stderr, "备份与源数据库不一致\n");
-        sqlite3_close(db);
-        sqlite3_close(backup_db);
+        close_database(db);
+        close_database(backup_db);
         return 0;
     }
     
-    sqlite3_close(db);
-    sqlite3_close(backup_db);
+    close_database(db);
+    close_database(backup_db);
+    
+    return 1;
+}
+
+// performance_test 表的插入列与行生成器
+static const char *const g_perf_columns[] = {"data", "value"};
+
+struct PerfRowSource {
+    long long count;
+    char text[64];
+    long long base;             // 第一行的编号
+};
+
+static int perf_row_generator(void *ctx, long long row, BulkValue *values) {
+    PerfRowSource *source = (PerfRowSource *)ctx;
+    if (row >= source->count) {
+        return 0;
+    }
     
+    long long n = source->base + row;
+    int len = snprintf(source->text, sizeof(source->text), "test data %lld", n);
+    values[0].type = BULK_TEXT;
+    values[0].p = source->text;
+    values[0].n = len;
+    values[1].type = BULK_INT64;
+    values[1].i = n * 2;
     return 1;
 }
 
+// 性能测试各阶段共用的上下文
+struct PerfWorkload {
+    sqlite3 *db;
+    long long rows;
+    long long next_row;
+};
+
+static int perf_reset_table(void *ctx) {
+    PerfWorkload *work = (PerfWorkload *)ctx;
+    work->next_row = 0;
+    return execute_sql(work->db, "DROP TABLE IF EXISTS performance_test;"
+                                 "CREATE TABLE performance_test ("
+                                 "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                                 "data TEXT NOT NULL,"
+                                 "value INTEGER NOT NULL)");
+}
+
+static int perf_populate(void *ctx) {
+    PerfWorkload *work = (PerfWorkload *)ctx;
+    int rc = perf_reset_table(ctx);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    PerfRowSource rows = {work->rows, {0}, 0};
+    BulkInsertOptions bulk_opts = {0, 0};
+    return bulk_insert_generated(work->db, "performance_test", g_perf_columns, 2,
+                                 perf_row_generator, &rows, &bulk_opts, NULL);
+}
+
+// 插入：每次操作用批量接口插入 BENCH_INSERT_BATCH 行（含提交）
+static int perf_insert_op(void *ctx, long long iteration) {
+    PerfWorkload *work = (PerfWorkload *)ctx;
+    (void)iteration;
+    
+    PerfRowSource rows = {BENCH_INSERT_BATCH, {0}, work->next_row};
+    BulkInsertOptions bulk_opts = {0, 0};
+    work->next_row += BENCH_INSERT_BATCH;
+    return bulk_insert_generated(work->db, "performance_test", g_perf_columns, 2,
+                                 perf_row_generator, &rows, &bulk_opts, NULL);
+}
+
+// 查询：完整执行一次范围查询
+static int perf_select_op(void *ctx, long long iteration) {
+    PerfWorkload *work = (PerfWorkload *)ctx;
+    (void)iteration;
+    
+    sqlite3_stmt *stmt = stmt_cache_acquire(work->db, "SELECT id, data, value FROM performance_test WHERE value > ?");
+    if (!stmt) {
+        fprintf(stderr, "查询准备失败: %s\n", sqlite3_errmsg(work->db));
+        return SQLITE_ERROR;
+    }
+    
+    sqlite3_bind_int64(stmt, 1, work->rows / 2);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    }
+    stmt_cache_release(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int perf_update_op(void *ctx, long long iteration) {
+    PerfWorkload *work = (PerfWorkload *)ctx;
+    (void)iteration;
+    return execute_sql(work->db, "UPDATE performance_test SET value = value * 2 WHERE id % 2 = 0");
+}
+
+static int perf_delete_op(void *ctx, long long iteration) {
+    PerfWorkload *work = (PerfWorkload *)ctx;
+    (void)iteration;
+    return execute_sql(work->db, "DELETE FROM performance_test WHERE id % 3 = 0");
+}
+
+#define PERF_PHASE_COUNT 4
+
+/**
+ * 填写插入/查询/更新/删除四个阶段的基准用例，每个阶段在不计时的准备步骤里重建自己的数据
+ */
+static void perf_bench_cases(PerfWorkload *work, BenchCase *cases) {
+    long long insert_ops = work->rows / BENCH_INSERT_BATCH > 0 ? work->rows / BENCH_INSERT_BATCH : 1;
+    const BenchCase phases[PERF_PHASE_COUNT] = {
+        {"insert", perf_reset_table, perf_insert_op, insert_ops, BENCH_INSERT_BATCH, work},
+        {"select", perf_populate, perf_select_op, BENCH_SELECT_OPS, 1, work},
+        {"update", perf_populate, perf_update_op, 1, 1, work},
+        {"delete", perf_populate, perf_delete_op, 1, 1, work},
+    };
+    for (int i = 0; i < PERF_PHASE_COUNT; i++) {
+        cases[i] = phases[i];
+    }
+}
+
 /**
- * 测试性能
+ * 测试性能：插入/查询/更新/删除各阶段预热后重复计时，输出延迟分位数并写 JSON
  */
 int test_performance() {
     printf("\n--- 性能测试 ---\n");
     
-    sqlite3 *db = NULL;
-    int rc = 0;
-    clock_t start, end;
-    double time_taken;
+    int warmup = (int)option_int("warmup", BENCH_WARMUP_REPS);
+    int reps = (int)option_int("reps", BENCH_MEASURED_REPS);
+    const char *json_path = option_str("json", BENCH_JSON_PATH);
     
     // 打开数据库
-    db = open_database(TEST_DB, TEST_KEY);
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
     if (!db) {
         fprintf(stderr, "无法打开数据库\n");
         return 0;
     }
     
-    // 创建测试表
-    rc = execute_sql(db, "CREATE TABLE IF NOT EXISTS performance_test ("
-                      "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                      "data TEXT NOT NULL,"
-                      "value INTEGER NOT NULL)");
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
-        return 0;
-    }
+    // 启用预编译语句缓存，重复执行的语句不再重新解析
+    stmt_cache_attach(db, STMT_CACHE_CAPACITY);
     
-    // 测试插入性能
-    start = clock();
+    PerfWorkload work = {db, option_int("rows", TEST_DATA_COUNT), 0};
+    BenchCase phases[PERF_PHASE_COUNT];
+    perf_bench_cases(&work, phases);
     
-    // 使用事务批量插入
-    rc = execute_sql(db, "BEGIN TRANSACTION");
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
-        return 0;
-    }
+    printf("数据量 %lld 行, 预热 %d 轮, 计时 %d 轮\n", work.rows, warmup, reps);
+    bench_print_header();
     
-    char insert_sql[128];
-    for (int i = 0; i < TEST_DATA_COUNT; i++) {
-        snprintf(insert_sql, sizeof(insert_sql), 
-                "INSERT INTO performance_test (data, value) VALUES ('test data %d', %d)", 
-                i, i * 2);
-        rc = execute_sql(db, insert_sql);
-        if (rc != SQLITE_OK) {
-            execute_sql(db, "ROLLBACK");
-            sqlite3_close(db);
+    std::vector<BenchResult> results;
+    for (int i = 0; i < PERF_PHASE_COUNT; i++) {
+        BenchResult result;
+        if (!bench_run(phases[i], warmup, reps, &result)) {
+            close_database(db);
             return 0;
         }
+        bench_print(result);
+        results.push_back(result);
     }
     
-    rc = execute_sql(db, "COMMIT");
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
-        return 0;
+    StmtCacheStats cache_stats;
+    if (stmt_cache_stats(db, &cache_stats)) {
+        printf("语句缓存: 命中 %llu 次, 未命中 %llu 次, 淘汰 %llu 次\n",
+               cache_stats.hits, cache_stats.misses, cache_stats.evictions);
     }
     
-    end = clock();
-    time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
-    printf("插入 %d 条记录耗时: %.3f 秒\n", TEST_DATA_COUNT, time_taken);
+    if (bench_write_json(json_path, db, results)) {
+        printf("基准结果已写入 %s\n", json_path);
+    }
     
-    // 测试查询性能
-    start = clock();
+    // 关闭数据库
+    close_database(db);
     
-    sqlite3_stmt *stmt;
-    const char *query_sql = "SELECT id, data, value FROM performance_test WHERE value > ?";
-    rc = sqlite3_prepare_v2(db, query_sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "查询准备失败: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
+    printf("性能测试完成\n");
+    return 1;
+}
+
+/**
+ * 派生密钥缓存基准：比较每次都跑 PBKDF2 的冷打开与走缓存的原始密钥打开
+ */
+int bench_key_cache() {
+    printf("\n--- 派生密钥缓存基准 ---\n");
+    
+    // 先建好数据库，保证文件头部已有盐值
+    sqlite3 *db = open_database_uncached(TEST_DB, TEST_KEY);
+    if (!db) {
         return 0;
     }
-    
-    // 绑定参数
-    int param_value = TEST_DATA_COUNT / 2;
-    rc = sqlite3_bind_int(stmt, 1, param_value);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "参数绑定失败: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
+    if (execute_sql(db, "CREATE TABLE IF NOT EXISTS key_cache_test (id INTEGER PRIMARY KEY)") != SQLITE_OK) {
+        close_database(db);
         return 0;
     }
+    close_database(db);
     
-    // 执行查询
-    int count = 0;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        count++;
+    // 密钥派生是惰性的，第一次读页时才发生，因此每次打开后都读一次 schema
+    const char *probe_sql = "SELECT count(*) FROM sqlite_master";
+    double cold_total = 0.0;
+    double cached_total = 0.0;
+    double first_cached = 0.0;
+    
+    for (int i = 0; i < KEY_CACHE_BENCH_OPENS; i++) {
+        double start = now_seconds();
+        db = open_database_uncached(TEST_DB, TEST_KEY);
+        if (!db || execute_sql(db, probe_sql) != SQLITE_OK) {
+            close_database(db);
+            return 0;
+        }
+        close_database(db);
+        cold_total += now_seconds() - start;
     }
     
-    sqlite3_finalize(stmt);
+    key_cache_clear();
+    for (int i = 0; i <= KEY_CACHE_BENCH_OPENS; i++) {
+        double start = now_seconds();
+        db = open_database(TEST_DB, TEST_KEY);
+        if (!db || execute_sql(db, probe_sql) != SQLITE_OK) {
+            close_database(db);
+            return 0;
+        }
+        close_database(db);
+        
+        // 第一次打开负责填充缓存，单独统计
+        if (i == 0) {
+            first_cached = now_seconds() - start;
+        } else {
+            cached_total += now_seconds() - start;
+        }
+    }
     
-    end = clock();
-    time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
-    printf("查询 %d 条记录耗时: %.3f 秒\n", count, time_taken);
+    double cold_avg = cold_total / KEY_CACHE_BENCH_OPENS;
+    double cached_avg = cached_total / KEY_CACHE_BENCH_OPENS;
+    printf("冷打开（口令 + PBKDF2 %d 轮）平均: %.3f ms\n", CIPHER_KDF_ITER, cold_avg * 1000.0);
+    printf("首次缓存打开（派生并填充缓存）: %.3f ms\n", first_cached * 1000.0);
+    printf("缓存打开（原始密钥）平均: %.3f ms\n", cached_avg * 1000.0);
+    if (cached_avg > 0.0) {
+        printf("加速比: %.1fx\n", cold_avg / cached_avg);
+    }
     
-    // 测试更新性能
-    start = clock();
+    return 1;
+}
+
+/**
+ * 批量插入基准：逐行拼 SQL、单行预编译语句、多行 VALUES 批量接口三种方式对比
+ */
+int bench_bulk_insert() {
+    printf("\n--- 批量插入基准（%d 行）---\n", BULK_BENCH_ROWS);
     
-    rc = execute_sql(db, "BEGIN TRANSACTION");
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+    if (!db) {
         return 0;
     }
     
-    rc = execute_sql(db, "UPDATE performance_test SET value = value * 2 WHERE id % 2 = 0");
-    if (rc != SQLITE_OK) {
-        execute_sql(db, "ROLLBACK");
-        sqlite3_close(db);
+    const char *reset_sql = "DROP TABLE IF EXISTS performance_test;"
+                            "CREATE TABLE performance_test ("
+                            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                            "data TEXT NOT NULL,"
+                            "value INTEGER NOT NULL)";
+    PerfRowSource rows = {BULK_BENCH_ROWS, {0}, 0};
+    
+    // 1. 逐行 snprintf + sqlite3_exec
+    if (execute_sql(db, reset_sql) != SQLITE_OK || execute_sql(db, "BEGIN") != SQLITE_OK) {
+        close_database(db);
         return 0;
     }
-    
-    rc = execute_sql(db, "COMMIT");
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
+    double start = now_seconds();
+    char insert_sql[128];
+    for (int i = 0; i < BULK_BENCH_ROWS; i++) {
+        snprintf(insert_sql, sizeof(insert_sql),
+                "INSERT INTO performance_test (data, value) VALUES ('test data %d', %d)",
+                i, i * 2);
+        if (execute_sql(db, insert_sql) != SQLITE_OK) {
+            execute_sql(db, "ROLLBACK");
+            close_database(db);
+            return 0;
+        }
+    }
+    if (execute_sql(db, "COMMIT") != SQLITE_OK) {
+        close_database(db);
         return 0;
     }
+    double exec_time = now_seconds() - start;
     
-    end = clock();
-    time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
-    printf("更新记录耗时: %.3f 秒\n", time_taken);
-    
-    // 测试删除性能
-    start = clock();
-    
-    rc = execute_sql(db, "DELETE FROM performance_test WHERE id % 3 = 0");
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
+    // 2. 每条语句一行
+    BulkInsertOptions single_row = {1, 0};
+    if (execute_sql(db, reset_sql) != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    start = now_seconds();
+    if (bulk_insert_generated(db, "performance_test", g_perf_columns, 2, perf_row_generator,
+                              &rows, &single_row, NULL) != SQLITE_OK) {
+        close_database(db);
         return 0;
     }
+    double single_time = now_seconds() - start;
     
-    end = clock();
-    time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
-    printf("删除记录耗时: %.3f 秒\n", time_taken);
+    // 3. 多行 VALUES，每条语句 BULK_ROWS_PER_STATEMENT 行
+    BulkInsertOptions multi_row = {0, 0};
+    if (execute_sql(db, reset_sql) != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    start = now_seconds();
+    if (bulk_insert_generated(db, "performance_test", g_perf_columns, 2, perf_row_generator,
+                              &rows, &multi_row, NULL) != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    double multi_time = now_seconds() - start;
     
-    // 关闭数据库
-    sqlite3_close(db);
+    close_database(db);
     
-    printf("性能测试完成\n");
+    printf("逐行拼接 SQL:      %.3f 秒, %.0f 行/秒\n", exec_time, BULK_BENCH_ROWS / exec_time);
+    printf("单行预编译语句:    %.3f 秒, %.0f 行/秒\n", single_time, BULK_BENCH_ROWS / single_time);
+    printf("多行 VALUES 批量:  %.3f 秒, %.0f 行/秒\n", multi_time, BULK_BENCH_ROWS / multi_time);
     return 1;
 }
 
-/**
- * 测试并发访问（需要多线程支持）
- */
-int test_concurrency() {
-    printf("\n--- 并发测试 ---\n");
-    printf("注意：此测试需要多线程支持，当前未实现\n");
-    return 1;
+static std::vector<std::string> split_list(const char *text) {
+    std::vector<std::string> items;
+    std::string item;
+    for (const char *p = text; ; p++) {
+        if (*p == ',' || *p == '\0') {
+            if (!item.empty()) {
+                items.push_back(item);
+            }
+            item.clear();
+            if (*p == '\0') {
+                break;
+            }
+        } else if (*p != ' ') {
+            item += *p;
+        }
+    }
+    return items;
 }
 
 /**
- * 执行SQL语句
+ * 是否满足安全基线：KDF 迭代次数足够、启用 HMAC、HMAC 与 KDF 都不用 SHA1
  */
-int execute_sql(sqlite3 *db, const char *sql) {
-    char *err_msg = NULL;
-    int rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+static int meets_security_baseline(const CipherSettings &settings, int min_kdf_iter) {
+    return settings.kdf_iter >= min_kdf_iter && settings.use_hmac &&
+           strcmp(settings.hmac_algorithm, "SHA1") != 0 &&
+           strcmp(settings.kdf_algorithm, "SHA1") != 0;
+}
+
+struct SweepOpenContext {
+    const CipherSettings *settings;
+};
+
+// 打开延迟：打开 + 口令 + 参数 + 首次读页（触发 KDF），不走派生密钥缓存
+static int sweep_open_op(void *ctx, long long iteration) {
+    SweepOpenContext *open_ctx = (SweepOpenContext *)ctx;
+    (void)iteration;
     
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL执行失败: %s\nSQL语句: %s\n", err_msg, sql);
-        sqlite3_free(err_msg);
+    sqlite3 *db = open_database_with_settings(SWEEP_DB, TEST_KEY, open_ctx->settings);
+    if (!db) {
+        return SQLITE_CANTOPEN;
     }
-    
+    int rc = sqlite3_exec(db, "SELECT count(*) FROM sqlite_master", NULL, NULL, NULL);
+    close_database(db);
     return rc;
 }
 
 /**
- * 比较两个数据库的内容
+ * 加密参数扫描：对每组参数新建数据库，跑完 test_performance 的四个阶段，
+ * 再测重新打开的延迟，最后给出满足安全基线的最快组合
  */
-int compare_databases(const char *db1_path, const char *db2_path, const char *key1, const char *key2) {
-    sqlite3 *db1 = open_database(db1_path, key1);
-    sqlite3 *db2 = open_database(db2_path, key2);
-    
-    if (!db1 || !db2) {
-        fprintf(stderr, "无法打开数据库进行比较\n");
-        sqlite3_close(db1);
-        sqlite3_close(db2);
-        return 0;
-    }
+int bench_cipher_sweep() {
+    printf("\n--- 加密参数扫描 ---\n");
     
-    // 获取表列表
-    sqlite3_stmt *stmt;
-    const char *sql = "SELECT name FROM sqlite_master WHERE type='table' AND name NOT LIKE 'sqlite_%'";
+    std::vector<std::string> kdf_iters = split_list(option_str("kdf-iter", SWEEP_KDF_ITERS));
+    std::vector<std::string> page_sizes = split_list(option_str("page-size", SWEEP_PAGE_SIZES));
+    std::vector<std::string> algorithms = split_list(option_str("hmac", SWEEP_ALGORITHMS));
+    std::vector<std::string> use_hmacs = split_list(option_str("use-hmac", SWEEP_USE_HMAC));
+    int full_grid = (int)option_int("full-grid", 0);
+    int min_kdf_iter = (int)option_int("min-kdf-iter", SECURITY_MIN_KDF_ITER);
+    int warmup = (int)option_int("warmup", SWEEP_WARMUP_REPS);
+    int reps = (int)option_int("reps", SWEEP_MEASURED_REPS);
+    long long rows = option_int("rows", TEST_DATA_COUNT);
+    const char *json_path = option_str("json", SWEEP_JSON_PATH);
     
-    if (sqlite3_prepare_v2(db1, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        fprintf(stderr, "获取表列表失败: %s\n", sqlite3_errmsg(db1));
-        sqlite3_close(db1);
-        sqlite3_close(db2);
-        return 0;
+    // 默认 HMAC 与 KDF 使用同一摘要算法，--full-grid 时取二者的笛卡尔积
+    std::vector<CipherSettings> grid;
+    for (auto &iter : kdf_iters) {
+        for (auto &page : page_sizes) {
+            for (auto &hmac : algorithms) {
+                for (auto &kdf : algorithms) {
+                    if (!full_grid && hmac != kdf) {
+                        continue;
+                    }
+                    for (auto &use_hmac : use_hmacs) {
+                        CipherSettings settings = {atoi(iter.c_str()), atoi(page.c_str()),
+                                                   hmac.c_str(), kdf.c_str(), atoi(use_hmac.c_str())};
+                        grid.push_back(settings);
+                    }
+                }
+            }
+        }
     }
     
-    int tables_match = 1;
+    printf("共 %zu 组参数, 每组 %lld 行, 预热 %d 轮, 计时 %d 轮, 安全基线 kdf_iter >= %d\n",
+           grid.size(), rows, warmup, reps, min_kdf_iter);
+    printf("%8s %6s %6s %6s %4s | %10s %12s %10s %10s %10s | %s\n",
+           "kdf_iter", "page", "hmac", "kdf", "mac", "open(ms)", "insert行/秒", "select/秒",
+           "update/秒", "delete/秒", "基线");
     
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const char *table_name = (const char *)sqlite3_column_text(stmt, 0);
-        
-        // 检查表是否存在于第二个数据库
-        sqlite3_stmt *stmt2;
-        char check_sql[128];
-        snprintf(check_sql, sizeof(check_sql), 
-                "SELECT name FROM sqlite_master WHERE type='table' AND name='%s'", 
-                table_name);
+    std::vector<BenchResult> all_results;
+    int best = -1;
+    double best_score = 0.0;
+    
+    for (size_t g = 0; g < grid.size(); g++) {
+        const CipherSettings &settings = grid[g];
+        char label[96];
+        snprintf(label, sizeof(label), "k%d_p%d_%s_%s_mac%d", settings.kdf_iter, settings.page_size,
+                 settings.hmac_algorithm, settings.kdf_algorithm, settings.use_hmac);
         
-        if (sqlite3_prepare_v2(db2, check_sql, -1, &stmt2, NULL) != SQLITE_OK) {
-            fprintf(stderr, "检查表存在失败: %s\n", sqlite3_errmsg(db2));
-            tables_match = 0;
-            break;
+        remove(SWEEP_DB);
+        kdf_sidecar_remove(SWEEP_DB);
+        sqlite3 *db = open_database_with_settings(SWEEP_DB, TEST_KEY, &settings);
+        if (!db) {
+            return 0;
         }
+        stmt_cache_attach(db, STMT_CACHE_CAPACITY);
         
-        if (sqlite3_step(stmt2) != SQLITE_ROW) {
-            fprintf(stderr, "表 %s 在第二个数据库中不存在\n", table_name);
-            tables_match = 0;
-            sqlite3_finalize(stmt2);
-            break;
+        PerfWorkload work = {db, rows, 0};
+        BenchCase phases[PERF_PHASE_COUNT];
+        perf_bench_cases(&work, phases);
+        
+        BenchResult results[PERF_PHASE_COUNT + 1];
+        for (int i = 0; i < PERF_PHASE_COUNT; i++) {
+            if (!bench_run(phases[i], warmup, reps, &results[i])) {
+                fprintf(stderr, "参数组 %s 运行失败\n", label);
+                close_database(db);
+                remove(SWEEP_DB);
+                kdf_sidecar_remove(SWEEP_DB);
+                return 0;
+            }
         }
+        close_database(db);
         
-        sqlite3_finalize(stmt2);
+        SweepOpenContext open_ctx = {&settings};
+        BenchCase open_case = {"open", NULL, sweep_open_op, 1, 1, &open_ctx};
+        if (!bench_run(open_case, 0, reps, &results[PERF_PHASE_COUNT])) {
+            fprintf(stderr, "参数组 %s 重新打开失败\n", label);
+            remove(SWEEP_DB);
+            kdf_sidecar_remove(SWEEP_DB);
+            return 0;
+        }
         
-        // 比较表内容
-        char count_sql[128];
-        snprintf(count_sql, sizeof(count_sql), "SELECT COUNT(*) FROM %s", table_name);
+        int compliant = meets_security_baseline(settings, min_kdf_iter);
+        printf("%8d %6d %6s %6s %4d | %10.2f %12.0f %10.1f %10.1f %10.1f | %s\n",
+               settings.kdf_iter, settings.page_size, settings.hmac_algorithm, settings.kdf_algorithm,
+               settings.use_hmac, results[PERF_PHASE_COUNT].latency.p50_us / 1000.0,
+               results[0].items_per_sec, results[1].ops_per_sec, results[2].ops_per_sec,
+               results[3].ops_per_sec, compliant ? "满足" : "-");
         
-        sqlite3_stmt *count_stmt1, *count_stmt2;
+        // 以四个阶段吞吐的几何平均作为综合得分
+        double score = 1.0;
+        for (int i = 0; i < PERF_PHASE_COUNT; i++) {
+            score *= results[i].ops_per_sec > 0.0 ? results[i].ops_per_sec : 1.0;
+        }
+        score = pow(score, 1.0 / PERF_PHASE_COUNT);
+        if (compliant && score > best_score) {
+            best_score = score;
+            best = (int)g;
+        }
         
-        if (sqlite3_prepare_v2(db1, count_sql, -1, &count_stmt1, NULL) != SQLITE_OK ||
-            sqlite3_prepare_v2(db2, count_sql, -1, &count_stmt2, NULL) != SQLITE_OK) {
-            fprintf(stderr, "准备计数查询失败\n");
-            tables_match = 0;
-            break;
+        for (int i = 0; i <= PERF_PHASE_COUNT; i++) {
+            results[i].name = std::string(label) + "/" + results[i].name;
+            all_results.push_back(results[i]);
+        }
+    }
+    remove(SWEEP_DB);
+    kdf_sidecar_remove(SWEEP_DB);
+    
+    if (best >= 0) {
+        const CipherSettings &settings = grid[best];
+        printf("满足基线的最快组合: kdf_iter=%d cipher_page_size=%d cipher_hmac_algorithm=HMAC_%s "
+               "cipher_kdf_algorithm=PBKDF2_HMAC_%s cipher_use_hmac=%s\n",
+               settings.kdf_iter, settings.page_size, settings.hmac_algorithm, settings.kdf_algorithm,
+               settings.use_hmac ? "ON" : "OFF");
+    } else {
+        printf("没有参数组满足安全基线\n");
+    }
+    
+    if (bench_write_json(json_path, NULL, all_results)) {
+        printf("扫描结果已写入 %s\n", json_path);
+    }
+    return 1;
+}
+
+// 写队列基准：每个生产者线程的延迟样本
+struct WriterProducer {
+    int id;
+    int writes;
+    WriterQueue *queue;             // 为 NULL 时使用自己的连接逐条自动提交
+    std::vector<double> latency_ns;
+    int failed;
+};
+
+static void writer_producer_main(WriterProducer *producer) {
+    sqlite3 *db = NULL;
+    if (!producer->queue) {
+        db = open_database(WRITER_QUEUE_DB, TEST_KEY);
+        if (!db) {
+            producer->failed = 1;
+            return;
         }
+        stmt_cache_attach(db, STMT_CACHE_CAPACITY);
+        sqlite3_busy_timeout(db, 10000);
+    }
+    
+    char data[64];
+    for (int i = 0; i < producer->writes; i++) {
+        snprintf(data, sizeof(data), "producer %d write %d", producer->id, i);
+        auto start = std::chrono::steady_clock::now();
         
-        int count1 = 0, count2 = 0;
+        int rc;
+        if (producer->queue) {
+            BulkValue params[2];
+            memset(params, 0, sizeof(params));
+            params[0].type = BULK_TEXT;
+            params[0].p = data;
+            params[0].n = -1;
+            params[1].type = BULK_INT64;
+            params[1].i = i;
+            rc = producer->queue->submit("INSERT INTO writer_test (data, value) VALUES (?, ?)", params, 2).get();
+        } else {
+            sqlite3_stmt *stmt = stmt_cache_acquire(db, "INSERT INTO writer_test (data, value) VALUES (?, ?)");
+            rc = SQLITE_ERROR;
+            if (stmt) {
+                sqlite3_bind_text(stmt, 1, data, -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int(stmt, 2, i);
+                rc = sqlite3_step(stmt);
+                rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+                stmt_cache_release(stmt);
+            }
+        }
         
-        if (sqlite3_step(count_stmt1) == SQLITE_ROW) {
-            count1 = sqlite3_column_int(count_stmt1, 0);
+        auto end = std::chrono::steady_clock::now();
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "生产者 %d 写入失败: %d\n", producer->id, rc);
+            producer->failed = 1;
+            break;
+        }
+        producer->latency_ns.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+    }
+    
+    close_database(db);
+}
+
+/**
+ * 多个生产者并发写入：自动提交（每条写入一个事务，各自争抢写锁）与
+ * 单写线程组提交各跑一遍，比较吞吐与单条写入的完成延迟
+ */
+static int writer_bench_round(const char *name, WriterQueue *queue, int producers, int writes,
+                              BenchResult *result) {
+    std::vector<WriterProducer> workers(producers);
+    std::vector<std::thread> threads;
+    
+    double start = now_seconds();
+    for (int i = 0; i < producers; i++) {
+        workers[i].id = i;
+        workers[i].writes = writes;
+        workers[i].queue = queue;
+        workers[i].failed = 0;
+        threads.emplace_back(writer_producer_main, &workers[i]);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double elapsed = now_seconds() - start;
+    
+    std::vector<double> samples;
+    int failed = 0;
+    for (auto &worker : workers) {
+        samples.insert(samples.end(), worker.latency_ns.begin(), worker.latency_ns.end());
+        failed |= worker.failed;
+    }
+    
+    *result = bench_result_from_samples(name, samples, elapsed);
+    return !failed;
+}
+
+int bench_writer_queue() {
+    printf("\n--- 写队列组提交基准 ---\n");
+    
+    int producers = (int)option_int("producers", WRITER_BENCH_PRODUCERS);
+    int writes = (int)option_int("writes", WRITER_BENCH_WRITES);
+    
+    remove(WRITER_QUEUE_DB);
+    kdf_sidecar_remove(WRITER_QUEUE_DB);
+    sqlite3 *db = open_database(WRITER_QUEUE_DB, TEST_KEY);
+    if (!db) {
+        return 0;
+    }
+    if (execute_sql(db, "PRAGMA journal_mode = WAL") != SQLITE_OK ||
+        execute_sql(db, "CREATE TABLE writer_test ("
+                        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                        "data TEXT NOT NULL,"
+                        "value INTEGER NOT NULL)") != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    
+    printf("生产者 %d 个, 每个写入 %d 条, 组提交窗口 %d 条 / %d us\n",
+           producers, writes, WRITER_MAX_BATCH, WRITER_MAX_DELAY_US);
+    
+    std::vector<BenchResult> results(2);
+    int ok = writer_bench_round("autocommit", NULL, producers, writes, &results[0]);
+    
+    WriterQueueOptions opts = {WRITER_MAX_BATCH, WRITER_MAX_DELAY_US};
+    WriterQueue queue(WRITER_QUEUE_DB, TEST_KEY, opts);
+    if (ok && !queue.start()) {
+        ok = 0;
+    }
+    if (ok) {
+        ok = writer_bench_round("group-commit", &queue, producers, writes, &results[1]);
+    }
+    queue.stop();
+    
+    if (ok) {
+        bench_print_header();
+        for (auto &result : results) {
+            bench_print(result);
         }
+        WriterQueueStats stats = queue.stats();
+        printf("组提交: %lld 条写入合并为 %lld 个事务（平均每事务 %.1f 条）\n",
+               stats.writes, stats.batches, stats.batches ? (double)stats.writes / stats.batches : 0.0);
         
-        if (sqlite3_step(count_stmt2) == SQLITE_ROW) {
-            count2 = sqlite3_column_int(count_stmt2, 0);
+        // 两轮都写完后核对总行数
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(db, "SELECT count(*) FROM writer_test", -1, &stmt, NULL) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW) {
+            long long expected = 2LL * producers * writes;
+            if (sqlite3_column_int64(stmt, 0) != expected) {
+                fprintf(stderr, "写入行数不符: %lld vs %lld\n", sqlite3_column_int64(stmt, 0), expected);
+                ok = 0;
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    close_database(db);
+    remove(WRITER_QUEUE_DB);
+    kdf_sidecar_remove(WRITER_QUEUE_DB);
+    std::string wal = std::string(WRITER_QUEUE_DB) + "-wal";
+    std::string shm = std::string(WRITER_QUEUE_DB) + "-shm";
+    remove(wal.c_str());
+    remove(shm.c_str());
+    return ok;
+}
+
+// 异步接口测试中事件循环与异步流程共享的状态
+struct AsyncDemoState {
+    Executor *executor;
+    EventLoop *loop;
+    int off_loop;                   // co_await 之后没有回到循环线程的次数
+    long long value_sum;
+    std::atomic<int> done;
+    int ok;
+    long long rows_streamed;
+    std::vector<SqlRow> summary;
+};
+
+static void async_demo_check_loop(AsyncDemoState *state) {
+    if (EventLoop::current() != state->loop) {
+        state->off_loop++;
+    }
+}
+
+/**
+ * 在事件循环上启动：每次 co_await 之后都应回到循环线程，逐行累加也在循环线程上进行
+ */
+static DetachedTask async_demo_flow(AsyncDemoState *state) {
+    Executor &executor = *state->executor;
+    state->ok = 0;
+    
+    // 打开（含密钥派生）在执行器上完成
+    key_cache_clear();
+    sqlite3 *db = co_await async_open(executor, TEST_DB, TEST_KEY);
+    async_demo_check_loop(state);
+    if (db) {
+        int rc = co_await async_exec(executor, db, "CREATE TABLE IF NOT EXISTS async_test ("
+                                                   "id INTEGER PRIMARY KEY,"
+                                                   "value INTEGER NOT NULL)");
+        async_demo_check_loop(state);
+        if (rc == SQLITE_OK) {
+            rc = co_await async_exec(executor, db,
+                                     "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 10000) "
+                                     "INSERT INTO async_test (value) SELECT i * 3 FROM n");
+            async_demo_check_loop(state);
+        }
+        if (rc == SQLITE_OK) {
+            state->summary = co_await async_query(executor, db, "SELECT count(*), sum(value) FROM async_test");
+            async_demo_check_loop(state);
+            
+            RowStream stream = async_query_stream(executor, db, "SELECT id, value FROM async_test ORDER BY id");
+            while (std::optional<SqlRow> row = co_await stream.next()) {
+                async_demo_check_loop(state);
+                state->rows_streamed++;
+                state->value_sum += std::get<sqlite3_int64>((*row)[1]);
+            }
+            state->ok = state->summary.size() == 1;
         }
+        co_await async_close(executor, db);
+        async_demo_check_loop(state);
+    }
+    
+    state->done.store(1);
+}
+
+/**
+ * 协程异步接口测试：主线程运行 EventLoop，异步流程从循环上启动，
+ * 打开、写入、查询和逐批 step 在执行器上完成，续体与逐行处理回到循环线程执行；
+ * 统计循环相邻两轮的最大间隔，确认循环在运行协程代码的同时没有被密钥派生或页解密卡住
+ */
+int test_async_api() {
+    printf("\n--- 协程异步接口测试 ---\n");
+    
+    // 循环先于执行器构造、后于执行器析构，执行器线程退出前投递的续体总有去处
+    EventLoop loop;
+    Executor executor((int)option_int("threads", ASYNC_EXECUTOR_THREADS));
+    AsyncDemoState state;
+    state.executor = &executor;
+    state.loop = &loop;
+    state.off_loop = 0;
+    state.value_sum = 0;
+    state.done.store(0);
+    state.ok = 0;
+    state.rows_streamed = 0;
+    
+    double start = now_seconds();
+    loop.post([&state] { async_demo_flow(&state); });
+    EventLoopStats loop_stats;
+    loop.run_until([&state] { return state.done.load() != 0; }, ASYNC_LOOP_TICK_MS, &loop_stats);
+    double elapsed = now_seconds() - start;
+    
+    if (!state.ok) {
+        fprintf(stderr, "异步流程执行失败\n");
+        return 0;
+    }
+    
+    const SqlRow &row = state.summary[0];
+    printf("异步流程耗时 %.3f 秒: 共 %lld 行, value 合计 %lld, 流式读取 %lld 行\n", elapsed,
+           std::get<sqlite3_int64>(row[0]), std::get<sqlite3_int64>(row[1]), state.rows_streamed);
+    printf("事件循环 %lld 轮, 在循环线程上执行 %lld 项工作, 最大间隔 %.2f ms\n", loop_stats.ticks, loop_stats.tasks,
+           loop_stats.max_gap_seconds * 1000.0);
+    
+    if (state.rows_streamed != std::get<sqlite3_int64>(row[0]) || state.value_sum != std::get<sqlite3_int64>(row[1])) {
+        fprintf(stderr, "流式读取结果不符\n");
+        return 0;
+    }
+    if (state.off_loop > 0) {
+        fprintf(stderr, "有 %d 次 co_await 之后没有回到事件循环线程\n", state.off_loop);
+        return 0;
+    }
+    int max_gap_ms = (int)option_int("max-loop-gap-ms", ASYNC_MAX_LOOP_GAP_MS);
+    if (loop_stats.max_gap_seconds * 1000.0 > max_gap_ms) {
+        fprintf(stderr, "事件循环最大间隔 %.2f ms 超过 %d ms\n", loop_stats.max_gap_seconds * 1000.0, max_gap_ms);
+        return 0;
+    }
+    return 1;
+}
+
+// 在线备份基准：写线程与备份共用源连接，记录备份期间每次写入的延迟
+struct BackupBenchWriter {
+    sqlite3 *db;
+    const std::atomic<int> *stop;
+    std::vector<double> latency_ns;
+    int failed;
+};
+
+static void backup_bench_writer_main(BackupBenchWriter *writer) {
+    char data[64];
+    long long i = 0;
+    while (!writer->stop->load()) {
+        snprintf(data, sizeof(data), "written during backup %lld", i);
+        auto start = std::chrono::steady_clock::now();
         
-        sqlite3_finalize(count_stmt1);
-        sqlite3_finalize(count_stmt2);
+        sqlite3_stmt *stmt = NULL;
+        int rc = sqlite3_prepare_v2(writer->db, "INSERT INTO performance_test (data, value) VALUES (?, ?)", -1, &stmt, NULL);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, data, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 2, i);
+            rc = sqlite3_step(stmt);
+            rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+        }
+        sqlite3_finalize(stmt);
         
-        if (count1 != count2) {
-            fprintf(stderr, "表 %s 记录数不匹配: %d vs %d\n", table_name, count1, count2);
-            tables_match = 0;
+        auto end = std::chrono::steady_clock::now();
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "备份期间写入失败: %s\n", sqlite3_errmsg(writer->db));
+            writer->failed = 1;
             break;
         }
+        writer->latency_ns.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+        i++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static int backup_bench_round(sqlite3 *src, const PacedBackupOptions *opts, const char *name,
+                              std::vector<BenchResult> *results) {
+    remove(TEST_DB_COPY);
+    kdf_sidecar_remove(TEST_DB_COPY);
+    sqlite3 *dest = open_database(TEST_DB_COPY, TEST_KEY);
+    if (!dest) {
+        return 0;
+    }
+    
+    std::atomic<int> stop(0);
+    BackupBenchWriter writer = {src, &stop, std::vector<double>(), 0};
+    std::thread thread(backup_bench_writer_main, &writer);
+    
+    PacedBackupStats stats;
+    int rc;
+    if (opts) {
+        rc = paced_backup(dest, src, opts, &stats);
+    } else {
+        // 一次性复制：sqlite3_backup_step(-1)，期间一直占着源连接
+        double start = now_seconds();
+        sqlite3_backup *backup = sqlite3_backup_init(dest, "main", src, "main");
+        rc = backup ? sqlite3_backup_step(backup, -1) : sqlite3_errcode(dest);
+        rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+        memset(&stats, 0, sizeof(stats));
+        if (backup) {
+            stats.pagecount = sqlite3_backup_pagecount(backup);
+            sqlite3_backup_finish(backup);
+        }
+        stats.steps = 1;
+        stats.seconds = now_seconds() - start;
     }
     
-    sqlite3_finalize(stmt);
-    sqlite3_close(db1);
-    sqlite3_close(db2);
+    stop.store(1);
+    thread.join();
+    close_database(dest);
+    
+    if (rc != SQLITE_OK || writer.failed) {
+        fprintf(stderr, "%s 备份失败: %d\n", name, rc);
+        return 0;
+    }
     
-    return tables_match;
+    BenchResult result = bench_result_from_samples(name, writer.latency_ns, stats.seconds);
+    printf("%-10s 备份 %d 页, %d 步, 重新开始 %d 次, 耗时 %.3f 秒; 期间写入 %lld 次, 写延迟 p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           name, stats.pagecount, stats.steps, stats.restarts, stats.seconds, result.ops,
+           result.latency.p50_us, result.latency.p99_us, result.latency.max_us);
+    results->push_back(result);
+    return 1;
 }
 
 /**
- * 打印测试结果
+ * 在线备份基准：写线程以约 1ms 间隔持续插入，比较一次性备份与分步备份期间的写延迟。
+ * 写入与备份共用源连接，此时 SQLite 把写入同步到目标库而不会让备份重新开始。
  */
-void print_test_result(const char *test_name, int result) {
-    if (result) {
-        printf(ANSI_COLOR_GREEN "[PASS] %s\n" ANSI_COLOR_RESET, test_name);
+int bench_paced_backup() {
+    printf("\n--- 在线备份基准 ---\n");
+    
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+    if (!db) {
+        return 0;
+    }
+    PerfWorkload work = {db, option_int("rows", BACKUP_BENCH_ROWS), 0};
+    if (perf_populate(&work) != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    
+    std::vector<BenchResult> results;
+    PacedBackupOptions opts;
+    paced_backup_default_options(&opts);
+    
+    int ok = backup_bench_round(db, NULL, "one-shot", &results) &&
+             backup_bench_round(db, &opts, "paced", &results);
+    
+    close_database(db);
+    remove(TEST_DB_COPY);
+    kdf_sidecar_remove(TEST_DB_COPY);
+    return ok;
+}
+
+/**
+ * 内容比较基准：先比较一份完整备份，再改动副本中的几行，检查不一致范围是否被定位出来
+ */
+int bench_compare_databases() {
+    printf("\n--- 数据库内容比较基准 ---\n");
+    
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+    if (!db) {
+        return 0;
+    }
+    PerfWorkload work = {db, option_int("rows", COMPARE_BENCH_ROWS), 0};
+    if (perf_populate(&work) != SQLITE_OK ||
+        execute_sql(db, "DROP TABLE IF EXISTS compare_keyed") != SQLITE_OK ||
+        execute_sql(db, "CREATE TABLE compare_keyed (k TEXT, seq INTEGER, v BLOB, PRIMARY KEY (k, seq)) WITHOUT ROWID") != SQLITE_OK ||
+        execute_sql(db, "INSERT INTO compare_keyed SELECT 'key' || (id % 100), id, randomblob(16) FROM performance_test WHERE id <= 10000") != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    
+    remove(TEST_DB_COPY);
+    kdf_sidecar_remove(TEST_DB_COPY);
+    sqlite3 *copy = open_database(TEST_DB_COPY, TEST_KEY);
+    PacedBackupOptions opts;
+    paced_backup_default_options(&opts);
+    opts.sleep_us = 0;
+    opts.progress = [](void *, int, int, int) {};
+    PacedBackupStats stats;
+    int ok = copy && paced_backup(copy, db, &opts, &stats) == SQLITE_OK;
+    close_database(db);
+    if (!ok) {
+        close_database(copy);
+        return 0;
+    }
+    
+    double start = now_seconds();
+    int same = compare_databases(TEST_DB, TEST_DB_COPY, TEST_KEY, TEST_KEY);
+    printf("相同副本: %s, 耗时 %.3f 秒 (%lld 行)\n", same ? "一致" : "不一致", now_seconds() - start, work.rows);
+    
+    // 改一行、删一行，期望比较结果报告两个很小的 rowid 范围
+    long long changed = work.rows / 3, deleted = work.rows * 2 / 3;
+    char sql[256];
+    snprintf(sql, sizeof(sql), "UPDATE performance_test SET value = value + 1 WHERE id = %lld", changed);
+    ok = execute_sql(copy, sql) == SQLITE_OK;
+    snprintf(sql, sizeof(sql), "DELETE FROM performance_test WHERE id = %lld", deleted);
+    ok = ok && execute_sql(copy, sql) == SQLITE_OK;
+    close_database(copy);
+    if (!ok) {
+        return 0;
+    }
+    
+    printf("已修改 rowid %lld、删除 rowid %lld，期望定位到这两处:\n", changed, deleted);
+    start = now_seconds();
+    int differs = !compare_databases(TEST_DB, TEST_DB_COPY, TEST_KEY, TEST_KEY);
+    printf("改动后的副本: %s, 耗时 %.3f 秒\n", differs ? "不一致" : "一致", now_seconds() - start);
+    
+    remove(TEST_DB_COPY);
+    kdf_sidecar_remove(TEST_DB_COPY);
+    return same && differs;
+}
+
+// 换密钥基准的读写线程：库文件或密钥变化后用当前密钥重新打开
+struct RekeyBenchWorker {
+    int is_writer;
+    const std::atomic<int> *stop;
+    const std::atomic<int> *generation;     // 每次换密钥完成后加一
+    const char *const *current_key;
+    std::mutex *key_mutex;
+    std::vector<double> latency_ns;
+    long long errors;
+    long long reopens;
+};
+
+static sqlite3 *rekey_bench_open(RekeyBenchWorker *worker) {
+    std::string key;
+    {
+        std::lock_guard<std::mutex> lock(*worker->key_mutex);
+        key = *worker->current_key;
+    }
+    sqlite3 *db = open_database(TEST_DB, key.c_str());
+    if (db) {
+        sqlite3_busy_timeout(db, REKEY_LOCK_TIMEOUT_MS);
+    }
+    return db;
+}
+
+static void rekey_bench_worker_main(RekeyBenchWorker *worker) {
+    sqlite3 *db = rekey_bench_open(worker);
+    int seen = worker->generation->load();
+    std::mt19937_64 rng(worker->is_writer ? 7 : (uint64_t)(uintptr_t)worker);
+    long long i = 0;
+    
+    while (!worker->stop->load()) {
+        int generation = worker->generation->load();
+        if (!db || generation != seen) {
+            close_database(db);
+            db = rekey_bench_open(worker);
+            seen = generation;
+            worker->reopens++;
+            if (!db) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        int rc;
+        if (worker->is_writer) {
+            char sql[128];
+            snprintf(sql, sizeof(sql), "INSERT INTO performance_test (data, value) VALUES ('written during rekey', %lld)", i++);
+            rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        } else {
+            char sql[128];
+            snprintf(sql, sizeof(sql), "SELECT data FROM performance_test WHERE id = %llu", (unsigned long long)(rng() % 1000 + 1));
+            rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        }
+        auto end = std::chrono::steady_clock::now();
+        
+        if (rc == SQLITE_OK) {
+            worker->latency_ns.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+        } else {
+            // 旧密钥失效 (NOTADB) 或文件已被替换 (READONLY_DBMOVED)：重新打开
+            worker->errors++;
+            close_database(db);
+            db = NULL;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    close_database(db);
+}
+
+static int rekey_bench_round(const char *name, int online, const char *from_key, const char *to_key,
+                             const char **current_key, std::mutex *key_mutex, std::atomic<int> *generation) {
+    std::atomic<int> stop(0);
+    int nreaders = (int)option_int("readers", REKEY_BENCH_READERS);
+    int nwriters = (int)option_int("writers", REKEY_BENCH_WRITERS);
+    std::vector<RekeyBenchWorker> workers(nreaders + nwriters);
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers.size(); w++) {
+        workers[w] = {(int)w < nwriters, &stop, generation, current_key, key_mutex, std::vector<double>(), 0, 0};
+        threads.push_back(std::thread(rekey_bench_worker_main, &workers[w]));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    
+    double start = now_seconds();
+    int rc;
+    if (online) {
+        OnlineRekeyOptions opts;
+        online_rekey_default_options(&opts);
+        opts.backup.progress = [](void *, int, int, int) {};
+        OnlineRekeyStats stats;
+        rc = online_rekey(TEST_DB, from_key, to_key, &opts, &stats);
+        printf("%-12s %d 轮, 持写锁 %.3f 秒%s\n", name, stats.rounds, stats.lock_seconds,
+               stats.locked_copy ? "（最后一轮持锁复制）" : "");
     } else {
-        printf(ANSI_COLOR_RED "[FAIL] %s\n" ANSI_COLOR_RESET, test_name);
+        sqlite3 *db = open_database(TEST_DB, from_key);
+        rc = db ? SQLITE_OK : SQLITE_CANTOPEN;
+        if (db) {
+            sqlite3_busy_timeout(db, REKEY_LOCK_TIMEOUT_MS);
+            Argon2Params argon2;
+            int sidecar = kdf_sidecar_read(TEST_DB, &argon2);
+            if (sidecar < 0) {
+                rc = SQLITE_CORRUPT;
+            } else if (sidecar) {
+                // SQLCipher 只会用 PBKDF2 派生新口令，Argon2id 库只能换成按附属文件参数派生的原始密钥
+                rc = key_cache_rekey(db, TEST_DB, to_key);
+            } else {
+                char *sql = sqlite3_mprintf("PRAGMA rekey = %Q", to_key);
+                rc = execute_sql(db, sql);
+                sqlite3_free(sql);
+                key_cache_invalidate(TEST_DB);
+            }
+            close_database(db);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    {
+        std::lock_guard<std::mutex> lock(*key_mutex);
+        *current_key = to_key;
+    }
+    (*generation)++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    stop.store(1);
+    
+    std::vector<double> reads, writes;
+    long long errors = 0, reopens = 0;
+    for (size_t w = 0; w < workers.size(); w++) {
+        threads[w].join();
+        std::vector<double> *into = workers[w].is_writer ? &writes : &reads;
+        into->insert(into->end(), workers[w].latency_ns.begin(), workers[w].latency_ns.end());
+        errors += workers[w].errors;
+        reopens += workers[w].reopens;
+    }
+    
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "%s 换密钥失败: %d\n", name, rc);
+        return 0;
     }
+    LatencySummary r = summarize_latencies(reads);
+    LatencySummary w = summarize_latencies(writes);
+    printf("%-12s 耗时 %.3f 秒; 读 %zu 次 max %.1f ms; 写 %zu 次 p99 %.1f ms, max %.1f ms; 出错 %lld 次, 重新打开 %lld 次\n",
+           name, elapsed, reads.size(), r.max_us / 1000.0, writes.size(), w.p99_us / 1000.0, w.max_us / 1000.0,
+           errors, reopens);
+    return 1;
 }
 
 /**
- * 打开数据库并设置密钥
+ * 换密钥基准：读写线程持续访问数据库，分别用原地换密钥（PBKDF2 库为 PRAGMA rekey，
+ * Argon2id 库为按附属文件参数派生的原始密钥）和在线换密钥轮换一次密钥
  */
-sqlite3* open_database(const char *db_path, const char *key) {
-    sqlite3 *db = NULL;
-    int rc = sqlite3_open(db_path, &db);
+int bench_online_rekey() {
+    printf("\n--- 在线换密钥基准 ---\n");
+    
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+    if (!db) {
+        return 0;
+    }
+    PerfWorkload work = {db, option_int("rows", REKEY_BENCH_ROWS), 0};
+    int rc = perf_populate(&work);
+    close_database(db);
+    if (rc != SQLITE_OK) {
+        return 0;
+    }
+    
+    const char *current_key = TEST_KEY;
+    std::mutex key_mutex;
+    std::atomic<int> generation(0);
+    Argon2Params argon2;
+    const char *inplace = kdf_sidecar_read(TEST_DB, &argon2) > 0 ? "raw rekey" : "PRAGMA rekey";
+    int ok = rekey_bench_round(inplace, 0, TEST_KEY, NEW_KEY, &current_key, &key_mutex, &generation) &&
+             rekey_bench_round("online", 1, NEW_KEY, TEST_KEY, &current_key, &key_mutex, &generation);
+    
+    // 验证最终密钥可用且数据完整
+    db = open_database(TEST_DB, current_key);
+    ok = ok && db && execute_sql(db, "SELECT count(*) FROM performance_test") == SQLITE_OK;
+    close_database(db);
+    return ok;
+}
+
+/**
+ * 迁移基准：同一个明文库分别用 sqlcipher_export 和流水线迁移转为加密库，并核对内容
+ */
+int bench_migration() {
+    printf("\n--- 明文转加密迁移基准 ---\n");
     
+    remove(PLAINTEXT_DB);
+    sqlite3 *plain = open_database(PLAINTEXT_DB, "");
+    if (!plain) {
+        return 0;
+    }
+    PerfWorkload work = {plain, option_int("rows", MIGRATE_BENCH_ROWS), 0};
+    int rc = perf_populate(&work);
+    if (rc == SQLITE_OK) {
+        rc = execute_sql(plain,
+            "CREATE TABLE IF NOT EXISTS migrate_tags (tag TEXT PRIMARY KEY, weight REAL, payload BLOB) WITHOUT ROWID;"
+            "INSERT INTO migrate_tags SELECT 'tag' || id, id / 7.0, randomblob(32) FROM performance_test WHERE id % 10 = 0;"
+            "CREATE INDEX IF NOT EXISTS idx_performance_value ON performance_test (value);"
+            "CREATE INDEX IF NOT EXISTS idx_migrate_weight ON migrate_tags (weight)");
+    }
+    close_database(plain);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "无法打开数据库 %s: %s\n", db_path, sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return NULL;
+        return 0;
     }
     
-    // 设置密钥
-    rc = sqlite3_key(db, key, strlen(key));
+    // 对照组：单线程、一次完成的 sqlcipher_export
+    remove(TEST_DB);
+    kdf_sidecar_remove(TEST_DB);
+    key_cache_invalidate(TEST_DB);
+    sqlite3 *target = open_database(TEST_DB, TEST_KEY);
+    if (!target) {
+        return 0;
+    }
+    std::string attach = "ATTACH DATABASE '" + std::string(PLAINTEXT_DB) + "' AS plaintext KEY ''";
+    double start = now_seconds();
+    rc = execute_sql(target, attach.c_str());
+    if (rc == SQLITE_OK) {
+        rc = execute_sql(target, "SELECT sqlcipher_export('main', 'plaintext')");
+        execute_sql(target, "DETACH DATABASE plaintext");
+    }
+    double export_seconds = now_seconds() - start;
+    close_database(target);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "设置密钥失败: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return NULL;
+        // 未链接 SQLCipher 时没有 sqlcipher_export，只跑流水线
+        printf("sqlcipher_export 不可用，跳过对照组\n");
+    } else {
+        printf("sqlcipher_export  耗时 %.3f 秒\n", export_seconds);
     }
     
-    return db;
+    remove(TEST_DB);
+    kdf_sidecar_remove(TEST_DB);
+    key_cache_invalidate(TEST_DB);
+    MigrationOptions opts;
+    migration_default_options(&opts);
+    MigrationStats stats;
+    rc = migrate_plaintext_database(PLAINTEXT_DB, TEST_DB, TEST_KEY, &opts, &stats);
+    if (rc != SQLITE_OK) {
+        return 0;
+    }
+    migration_print_report(&stats);
+    
+    int same = compare_databases(PLAINTEXT_DB, TEST_DB, "", TEST_KEY);
+    printf("迁移结果与明文库%s\n", same ? "一致" : "不一致");
+    remove(PLAINTEXT_DB);
+    return same;
+}
+
+// 页缓存基准的读线程：随机点查，统计次数
+struct PcacheBenchReader {
+    sqlite3 *db;
+    long long rows;
+    const std::atomic<int> *go;
+    const std::atomic<int> *stop;
+    long long ops;
+    int failed;
+};
+
+static void pcache_bench_reader_main(PcacheBenchReader *reader) {
+    std::mt19937_64 rng((uint64_t)(uintptr_t)reader);
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(reader->db, "SELECT data, value FROM performance_test WHERE id = ?", -1, &stmt, NULL) != SQLITE_OK) {
+        reader->failed = 1;
+        return;
+    }
+    while (!reader->go->load()) {
+        std::this_thread::yield();
+    }
+    while (!reader->stop->load()) {
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)(rng() % reader->rows) + 1);
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            reader->failed = 1;
+            break;
+        }
+        reader->ops++;
+    }
+    sqlite3_finalize(stmt);
+}
+
+static int pcache_bench_round(const char *name, long long rows, int nreaders, int duration) {
+    std::vector<sqlite3 *> dbs;
+    for (int r = 0; r < nreaders; r++) {
+        sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+        if (!db) {
+            break;
+        }
+        // 每个连接的 cache_size 不设上限，内存只受全局预算约束
+        execute_sql(db, "PRAGMA cache_size = -1048576");
+        dbs.push_back(db);
+    }
+    
+    int ok = (int)dbs.size() == nreaders;
+    std::atomic<int> go(0), stop(0);
+    std::vector<PcacheBenchReader> readers(dbs.size());
+    std::vector<std::thread> threads;
+    for (size_t r = 0; r < dbs.size(); r++) {
+        readers[r] = {dbs[r], rows, &go, &stop, 0, 0};
+        threads.push_back(std::thread(pcache_bench_reader_main, &readers[r]));
+    }
+    
+    SharedPcacheStats before, after;
+    shared_pcache_stats(&before);
+    double start = now_seconds();
+    go.store(1);
+    std::this_thread::sleep_for(std::chrono::seconds(duration));
+    stop.store(1);
+    long long ops = 0;
+    for (size_t r = 0; r < threads.size(); r++) {
+        threads[r].join();
+        ops += readers[r].ops;
+        ok = ok && !readers[r].failed;
+    }
+    double elapsed = now_seconds() - start;
+    shared_pcache_stats(&after);
+    
+    for (size_t r = 0; r < dbs.size(); r++) {
+        close_database(dbs[r]);
+    }
+    if (!ok) {
+        fprintf(stderr, "%s 读线程失败\n", name);
+        return 0;
+    }
+    
+    long long loads = after.loads - before.loads;
+    long long hits = after.hits - before.hits;
+    printf("%-8s %8.0f 次查询/秒, 页加载(解密+校验) %lld 次 = %.2f 次/千次查询, 命中率 %.1f%%, 淘汰 %lld 页, 缓存占用 %.1f MB\n",
+           name, ops / elapsed, loads, ops ? loads * 1000.0 / ops : 0.0,
+           hits + loads ? 100.0 * hits / (hits + loads) : 0.0, after.evictions - before.evictions,
+           after.bytes / 1048576.0);
+    return 1;
 }
 
 /**
- * 关闭数据库
+ * 页缓存基准：同一个全局预算下，单个读连接与多个读连接的页加载次数对比。
+ * 页不在连接之间共享，多个连接各自加载同一批热点页，预算不足时相互淘汰
  */
-void close_database(sqlite3 *db) {
+int bench_page_cache() {
+    printf("\n--- 全局页缓存基准 ---\n");
+    
+    // 页缓存只能在 SQLite 初始化前安装；命令行已用 --pcache-mb= 安装时沿用
+    if (!shared_pcache_installed() &&
+        shared_pcache_install((size_t)option_int("pcache-mb", PCACHE_BENCH_MB) << 20) != SQLITE_OK) {
+        return 0;
+    }
+    
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+    if (!db) {
+        return 0;
+    }
+    PerfWorkload work = {db, option_int("rows", PCACHE_BENCH_ROWS), 0};
+    int rc = perf_populate(&work);
+    close_database(db);
+    if (rc != SQLITE_OK) {
+        return 0;
+    }
+    
+    SharedPcacheStats stats;
+    shared_pcache_stats(&stats);
+    int nreaders = (int)option_int("readers", PCACHE_BENCH_READERS);
+    int duration = (int)option_int("duration", PCACHE_BENCH_DURATION);
+    printf("预算 %.1f MB, %lld 行, %d 个读连接, 每轮 %d 秒\n", stats.budget / 1048576.0, work.rows, nreaders, duration);
+    
+    char name[32];
+    snprintf(name, sizeof(name), "%d conns", nreaders);
+    return pcache_bench_round("1 conn", work.rows, 1, duration) &&
+           pcache_bench_round(name, work.rows, nreaders, duration);
+}
+
+/**
+ * VFS 基准：分别用默认 unix VFS 和 io_uring VFS 跑性能测试的各阶段
+ */
+int bench_uring_vfs() {
+    printf("\n--- io_uring VFS 基准 ---\n");
+    
+    if (uring_vfs_register(0) != SQLITE_OK) {
+        return 0;
+    }
+    UringVfsStats before, after;
+    uring_vfs_stats(&before);
+    if (!before.available) {
+        printf("io_uring 不可用，uring VFS 将全部交给默认 VFS\n");
+    }
+    
+    int warmup = (int)option_int("warmup", BENCH_WARMUP_REPS);
+    int reps = (int)option_int("reps", BENCH_MEASURED_REPS);
+    long long rows = option_int("rows", URING_BENCH_ROWS);
+    printf("数据量 %lld 行, 预热 %d 轮, 计时 %d 轮\n", rows, warmup, reps);
+    bench_print_header();
+    
+    const char *vfs_names[] = {"unix", "uring"};
+    std::vector<BenchResult> results;
+    sqlite3 *last_db = NULL;
+    for (size_t v = 0; v < sizeof(vfs_names) / sizeof(vfs_names[0]); v++) {
+        remove(TEST_DB);
+        kdf_sidecar_remove(TEST_DB);
+        key_cache_invalidate(TEST_DB);
+        sqlite3 *db = open_database_vfs(TEST_DB, TEST_KEY, vfs_names[v]);
+        if (!db) {
+            close_database(last_db);
+            return 0;
+        }
+        stmt_cache_attach(db, STMT_CACHE_CAPACITY);
+        
+        PerfWorkload work = {db, rows, 0};
+        BenchCase phases[PERF_PHASE_COUNT];
+        perf_bench_cases(&work, phases);
+        for (int i = 0; i < PERF_PHASE_COUNT; i++) {
+            BenchResult result;
+            if (!bench_run(phases[i], warmup, reps, &result)) {
+                close_database(db);
+                close_database(last_db);
+                return 0;
+            }
+            result.name = std::string(vfs_names[v]) + "/" + result.name;
+            bench_print(result);
+            results.push_back(result);
+        }
+        close_database(last_db);
+        last_db = db;
+    }
+    
+    uring_vfs_stats(&after);
+    printf("io_uring: %lld 个文件 (%lld 个回退), 读 %lld 次, 写 %lld 次, fsync %lld 次, 提交 %lld 次\n",
+           after.files - before.files, after.fallback_files - before.fallback_files, after.reads - before.reads,
+           after.writes - before.writes, after.fsyncs - before.fsyncs, after.submits - before.submits);
+    
+    const char *json_path = option_str("json", NULL);
+    if (json_path && bench_write_json(json_path, last_db, results)) {
+        printf("基准结果已写入 %s\n", json_path);
+    }
+    close_database(last_db);
+    return 1;
+}
+
+// 冷缓存扫描基准：每轮先把数据库文件逐出操作系统页缓存，再用新连接扫描
+struct ReadaheadBench {
+    const char *vfs_name;
+    PerfWorkload work;
+};
+
+static int readahead_bench_drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return SQLITE_CANTOPEN;
+    }
+    fdatasync(fd);
+    int rc = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return rc == 0 ? SQLITE_OK : SQLITE_IOERR;
+}
+
+static int readahead_bench_setup(void *ctx) {
+    ReadaheadBench *bench = (ReadaheadBench *)ctx;
+    close_database(bench->work.db);
+    bench->work.db = NULL;
+    int rc = readahead_bench_drop_cache(TEST_DB);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    bench->work.db = open_database_vfs(TEST_DB, TEST_KEY, bench->vfs_name);
+    if (!bench->work.db) {
+        return SQLITE_CANTOPEN;
+    }
+    return stmt_cache_attach(bench->work.db, STMT_CACHE_CAPACITY) ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+static int readahead_bench_select(void *ctx, long long iteration) {
+    ReadaheadBench *bench = (ReadaheadBench *)ctx;
+    return perf_select_op(&bench->work, iteration);
+}
+
+static int readahead_bench_count(void *ctx, long long iteration) {
+    ReadaheadBench *bench = (ReadaheadBench *)ctx;
+    (void)iteration;
+    sqlite3_stmt *stmt = stmt_cache_acquire(bench->work.db, "SELECT COUNT(*) FROM performance_test");
+    if (!stmt) {
+        return SQLITE_ERROR;
+    }
+    int rc = sqlite3_step(stmt);
+    stmt_cache_release(stmt);
+    return rc == SQLITE_ROW ? SQLITE_OK : rc;
+}
+
+/**
+ * 预读基准：用性能测试的表，在冷缓存下比较默认 VFS 与预读 VFS 的范围查询和 COUNT(*)
+ */
+int bench_readahead_vfs() {
+    printf("\n--- 顺序预读 VFS 基准 ---\n");
+    
+    if (readahead_vfs_register(0) != SQLITE_OK) {
+        return 0;
+    }
+    int warmup = (int)option_int("warmup", 1);
+    int reps = (int)option_int("reps", BENCH_MEASURED_REPS);
+    long long rows = option_int("rows", READAHEAD_BENCH_ROWS);
+    
+    remove(TEST_DB);
+    kdf_sidecar_remove(TEST_DB);
+    key_cache_invalidate(TEST_DB);
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+    if (!db) {
+        return 0;
+    }
+    PerfWorkload populate = {db, rows, 0};
+    if (perf_populate(&populate) != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    close_database(db);
+    struct stat st;
+    stat(TEST_DB, &st);
+    printf("数据量 %lld 行 (%.1f MB), 预热 %d 轮, 计时 %d 轮, 每轮前逐出页缓存\n",
+           rows, st.st_size / 1048576.0, warmup, reps);
+    bench_print_header();
+    
+    const char *vfs_names[] = {"unix", "readahead"};
+    std::vector<BenchResult> results;
+    ReadaheadVfsStats before, after;
+    readahead_vfs_stats(&before);
+    for (size_t v = 0; v < sizeof(vfs_names) / sizeof(vfs_names[0]); v++) {
+        ReadaheadBench bench = {vfs_names[v], {NULL, rows, 0}};
+        const BenchCase cases[] = {
+            {"select", readahead_bench_setup, readahead_bench_select, 1, rows / 2, &bench},
+            {"count", readahead_bench_setup, readahead_bench_count, 1, rows, &bench},
+        };
+        for (const BenchCase &bench_case : cases) {
+            BenchResult result;
+            int ok = bench_run(bench_case, warmup, reps, &result);
+            if (!ok) {
+                close_database(bench.work.db);
+                return 0;
+            }
+            result.name = std::string(vfs_names[v]) + "/" + result.name;
+            bench_print(result);
+            results.push_back(result);
+        }
+        close_database(bench.work.db);
+    }
+    readahead_vfs_stats(&after);
+    printf("预读 VFS: 读 %lld 次 (顺序 %lld 次), fadvise %lld 次, 共 %.1f MB\n",
+           after.reads - before.reads, after.sequential_reads - before.sequential_reads,
+           after.advises - before.advises, (after.advised_bytes - before.advised_bytes) / 1048576.0);
+    
+    const char *json_path = option_str("json", NULL);
+    if (json_path) {
+        db = open_database(TEST_DB, TEST_KEY);
+        if (db && bench_write_json(json_path, db, results)) {
+            printf("基准结果已写入 %s\n", json_path);
+        }
+        close_database(db);
+    }
+    return 1;
+}
+
+/**
+ * 执行计划剖析：建性能测试的表，逐条剖析性能测试里的语句；--sql 可指定任意语句
+ */
+int profile_query_plans() {
+    printf("\n--- 执行计划剖析 ---\n");
+    
+    long long rows = option_int("rows", PLAN_BENCH_ROWS);
+    remove(TEST_DB);
+    kdf_sidecar_remove(TEST_DB);
+    key_cache_invalidate(TEST_DB);
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+    if (!db) {
+        return 0;
+    }
+    PerfWorkload work = {db, rows, 0};
+    if (perf_populate(&work) != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    printf("数据量 %lld 行, 全表扫描访问 >= %d 行时标记; scanstatus: %s\n", rows, PLAN_LARGE_SCAN_ROWS,
+           plan_scanstatus_available() ? "可用" : "不可用（循环信息来自 EXPLAIN QUERY PLAN）");
+    
+    struct PlanCase {
+        const char *sql;
+        long long param;
+        int param_count;
+    };
+    const PlanCase cases[] = {
+        {"SELECT id, data, value FROM performance_test WHERE value > ?", rows / 2, 1},
+        {"UPDATE performance_test SET value = value * 2 WHERE id % 2 = 0", 0, 0},
+        {"DELETE FROM performance_test WHERE id % 3 = 0", 0, 0},
+        {"SELECT COUNT(*) FROM performance_test", 0, 0},
+        {"SELECT data FROM performance_test WHERE id = ?", rows / 2, 1},
+    };
+    const char *custom_sql = option_str("sql", NULL);
+    
+    int flagged = 0;
+    int total = 0;
+    for (const PlanCase &plan_case : cases) {
+        const char *sql = custom_sql ? custom_sql : plan_case.sql;
+        PlanReport report;
+        if (plan_profile_sql(db, sql, &plan_case.param, custom_sql ? 0 : plan_case.param_count, &report) != SQLITE_OK) {
+            close_database(db);
+            return 0;
+        }
+        plan_print_report(report);
+        flagged += report.flagged;
+        total++;
+        if (custom_sql) {
+            break;
+        }
+    }
+    printf("\n%d 条语句中 %d 条有大表全表扫描\n", total, flagged);
+    close_database(db);
+    return 1;
+}
+
+/**
+ * 模拟服务启动时与打开数据库无关的初始化（读配置、连下游等，以等待为主）
+ */
+static void key_pool_other_init(int init_ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(init_ms));
+}
+
+/**
+ * 启动时批量打开加密库：串行逐个打开（每个都跑 PBKDF2）再做其他初始化，
+ * 与先把全部打开交给后台派生池、同时做其他初始化、最后等待全部就绪对比。
+ * 每轮前清空派生密钥缓存，两种方式都付出完整的 PBKDF2。
+ */
+int bench_key_pool() {
+    printf("\n--- 后台密钥派生池基准 ---\n");
+    
+    int threads = (int)option_int("threads", std::max(1u, std::thread::hardware_concurrency()));
+    int init_ms = (int)option_int("init-ms", KEYPOOL_INIT_MS);
+    int max_dbs = (int)option_int("dbs", 0);
+    std::vector<int> counts;
+    if (max_dbs > 0) {
+        counts.push_back(max_dbs);
+    } else {
+        counts = {1, 10, 100};
+    }
+    int total = *std::max_element(counts.begin(), counts.end());
+    
+    std::vector<std::string> paths;
+    for (int i = 0; i < total; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), KEYPOOL_DB_PATTERN, i);
+        paths.push_back(path);
+    }
+    printf("执行器 %d 线程, 其他初始化 %d ms, PBKDF2 %d 轮, CPU %u 个\n", threads, init_ms, CIPHER_KDF_ITER,
+           std::thread::hardware_concurrency());
+    
+    Executor executor(threads);
+    
+    // 建库也走派生池，否则准备 100 个库本身就要串行派生 100 次
+    std::vector<KeyedOpen> create;
+    for (const std::string &path : paths) {
+        remove(path.c_str());
+        kdf_sidecar_remove(path.c_str());
+        key_cache_invalidate(path.c_str());
+        create.push_back({path, TEST_KEY});
+    }
+    int ok = 1;
+    for (auto &future : open_databases_keyed(executor, std::move(create))) {
+        sqlite3 *db = future.get();
+        if (!db || execute_sql(db, "CREATE TABLE IF NOT EXISTS config (k TEXT PRIMARY KEY, v TEXT);"
+                                   "INSERT OR REPLACE INTO config VALUES ('version', '1')") != SQLITE_OK) {
+            ok = 0;
+        }
+        close_database(db);
+    }
+    if (!ok) {
+        fprintf(stderr, "创建测试库失败\n");
+        return 0;
+    }
+    
+    printf("%-8s %14s %14s %14s %10s\n", "库数", "串行 ms", "派生池 ms", "等待就绪 ms", "加速比");
+    for (int count : counts) {
+        std::vector<sqlite3 *> dbs;
+        
+        key_cache_clear();
+        double start = now_seconds();
+        for (int i = 0; i < count; i++) {
+            sqlite3 *db = open_database_keyed(paths[i].c_str(), TEST_KEY);
+            ok = ok && db;
+            dbs.push_back(db);
+        }
+        key_pool_other_init(init_ms);
+        double serial = now_seconds() - start;
+        for (sqlite3 *db : dbs) {
+            close_database(db);
+        }
+        dbs.clear();
+        
+        key_cache_clear();
+        std::vector<KeyedOpen> requests;
+        for (int i = 0; i < count; i++) {
+            requests.push_back({paths[i], TEST_KEY});
+        }
+        start = now_seconds();
+        std::vector<std::future<sqlite3 *> > futures = open_databases_keyed(executor, std::move(requests));
+        key_pool_other_init(init_ms);
+        double wait_start = now_seconds();
+        for (auto &future : futures) {
+            sqlite3 *db = future.get();
+            ok = ok && db;
+            dbs.push_back(db);
+        }
+        double pooled = now_seconds() - start;
+        double wait = now_seconds() - wait_start;
+        for (sqlite3 *db : dbs) {
+            close_database(db);
+        }
+        
+        if (!ok) {
+            fprintf(stderr, "打开测试库失败\n");
+            break;
+        }
+        printf("%-8d %14.1f %14.1f %14.1f %9.2fx\n", count, serial * 1000.0, pooled * 1000.0, wait * 1000.0,
+               serial / pooled);
+    }
+    
+    key_cache_clear();
+    for (const std::string &path : paths) {
+        remove(path.c_str());
+        kdf_sidecar_remove(path.c_str());
+    }
+    return ok;
+}
+
+/**
+ * 冷打开一次（清空派生密钥缓存）并读 schema，返回耗时秒数，失败返回负数
+ */
+static double kdf_bench_cold_open(const char *db_path) {
+    key_cache_clear();
+    double start = now_seconds();
+    sqlite3 *db = open_database_keyed(db_path, TEST_KEY);
+    double elapsed = now_seconds() - start;
+    if (!db) {
+        return -1.0;
+    }
+    close_database(db);
+    return elapsed;
+}
+
+/**
+ * 打开延迟：SQLCipher 默认 PBKDF2 与几组 Argon2id 参数对比。
+ * Argon2id 每次猜测都要填满 memory_kib 内存，GPU/ASIC 上的并行猜测受内存带宽和容量限制；
+ * lane 数大于 1 时 OpenSSL 在自己的线程池上并行填充，多核上墙钟时间随之下降。
+ */
+int bench_kdf() {
+    printf("\n--- 密钥派生打开延迟基准 ---\n");
+    
+    int opens = (int)option_int("opens", KDF_BENCH_OPENS);
+    if (opens < 1) {
+        opens = 1;
+    }
+    printf("运行库 %s, CPU %u 个, 每组冷打开 %d 次取平均\n", OpenSSL_version(OPENSSL_VERSION),
+           std::thread::hardware_concurrency(), opens);
+    printf("%-28s %8s %12s %10s\n", "KDF", "内存", "打开 ms", "相对 PBKDF2");
+    
+    // PBKDF2：没有附属文件的普通库
+    remove(TEST_DB);
+    kdf_sidecar_remove(TEST_DB);
+    key_cache_invalidate(TEST_DB);
+    sqlite3 *db = open_database(TEST_DB, TEST_KEY);
+    if (!db || execute_sql(db, "CREATE TABLE IF NOT EXISTS kdf_test (id INTEGER PRIMARY KEY)") != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    close_database(db);
+    double pbkdf2 = 0.0;
+    for (int i = 0; i < opens; i++) {
+        double elapsed = kdf_bench_cold_open(TEST_DB);
+        if (elapsed < 0) {
+            return 0;
+        }
+        pbkdf2 += elapsed / opens;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "PBKDF2-HMAC-SHA512 %d", CIPHER_KDF_ITER);
+    printf("%-28s %8s %12.1f %10.2fx\n", name, "-", pbkdf2 * 1000.0, 1.0);
+    
+    if (!argon2_available()) {
+        printf("Argon2id 不可用：运行库需 OpenSSL 3.2+（编译头文件 %s）\n", OPENSSL_VERSION_TEXT);
+        remove(TEST_DB);
+        kdf_sidecar_remove(TEST_DB);
+        return 1;
+    }
+    
+    // 第一组为 RFC 9106 第二推荐（64 MiB, t=3），--argon2-* 追加一组自定义参数
+    std::vector<Argon2Params> configs = {
+        {19456, 2, 1},
+        {65536, 3, 1},
+        {65536, 3, 4},
+        {262144, 3, 4},
+    };
+    if (option_int("argon2-memory-kib", 0) > 0) {
+        configs.push_back({(uint32_t)option_int("argon2-memory-kib", ARGON2_MEMORY_KIB),
+                           (uint32_t)option_int("argon2-iterations", ARGON2_ITERATIONS),
+                           (uint32_t)option_int("argon2-lanes", ARGON2_LANES)});
+    }
+    int ok = 1;
+    for (const Argon2Params &params : configs) {
+        remove(TEST_DB);
+        kdf_sidecar_remove(TEST_DB);
+        key_cache_invalidate(TEST_DB);
+        db = open_database_argon2(TEST_DB, TEST_KEY, &params);
+        if (!db || execute_sql(db, "CREATE TABLE IF NOT EXISTS kdf_test (id INTEGER PRIMARY KEY)") != SQLITE_OK) {
+            close_database(db);
+            ok = 0;
+            break;
+        }
+        close_database(db);
+        
+        double argon2 = 0.0;
+        for (int i = 0; ok && i < opens; i++) {
+            double elapsed = kdf_bench_cold_open(TEST_DB);
+            ok = elapsed >= 0;
+            argon2 += elapsed / opens;
+        }
+        if (!ok) {
+            break;
+        }
+        snprintf(name, sizeof(name), "Argon2id t=%u p=%u (线程 %u)", params.iterations, params.lanes,
+                 argon2_threads(params.lanes));
+        printf("%-28s %6u M %12.1f %10.2fx\n", name, params.memory_kib / 1024, argon2 * 1000.0, argon2 / pbkdf2);
+    }
+    
+    remove(TEST_DB);
+    kdf_sidecar_remove(TEST_DB);
+    key_cache_invalidate(TEST_DB);
+    return ok;
+}
+
+// 每个工作线程的统计，线程结束后汇总
+struct ConcurrencyWorker {
+    int is_writer;
+    double read_ratio;
+    long long rows;
+    unsigned seed;
+    std::atomic<int> *ready;        // 已打开连接的线程数
+    const std::atomic<int> *go;     // 全部就绪后开始计时
+    const std::atomic<int> *stop;
+    
+    std::vector<double> read_ns;
+    std::vector<double> write_ns;
+    long long busy_retries;         // 忙等处理函数被调用的次数
+    long long busy_failures;        // 重试用尽后仍返回 SQLITE_BUSY 的操作数
+    int failed;
+};
+
+/**
+ * 计数型忙等处理：先让出 CPU，再逐步短暂休眠，最多重试 CONCURRENCY_BUSY_RETRIES 次
+ */
+static int concurrency_busy_handler(void *ctx, int count) {
+    ConcurrencyWorker *worker = (ConcurrencyWorker *)ctx;
+    if (count >= CONCURRENCY_BUSY_RETRIES) {
+        return 0;
+    }
+    worker->busy_retries++;
+    if (count < 10) {
+        sched_yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50 * (count < 100 ? count : 100)));
+    }
+    return 1;
+}
+
+static int concurrency_step(sqlite3_stmt *stmt) {
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    }
+    stmt_cache_release(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void concurrency_worker_main(ConcurrencyWorker *worker) {
+    // 每个线程一个连接；派生密钥缓存保证只有第一次打开付出 PBKDF2
+    sqlite3 *db = open_database(CONCURRENCY_DB, TEST_KEY);
     if (db) {
-        sqlite3_close(db);
+        stmt_cache_attach(db, STMT_CACHE_CAPACITY);
+        sqlite3_busy_handler(db, concurrency_busy_handler, worker);
+    } else {
+        worker->failed = 1;
+    }
+    
+    // 打开连接不计入测量时长
+    worker->ready->fetch_add(1);
+    while (!worker->go->load()) {
+        std::this_thread::yield();
+    }
+    if (!db) {
+        return;
+    }
+    
+    std::mt19937 rng(worker->seed);
+    std::uniform_int_distribution<long long> pick_row(1, worker->rows);
+    std::uniform_real_distribution<double> pick_op(0.0, 1.0);
+    
+    while (!worker->stop->load(std::memory_order_relaxed)) {
+        int is_read = !worker->is_writer || pick_op(rng) < worker->read_ratio;
+        const char *sql = is_read ? "SELECT data, value FROM concurrency_test WHERE id = ?"
+                                  : "UPDATE concurrency_test SET value = value + 1 WHERE id = ?";
+        
+        auto start = std::chrono::steady_clock::now();
+        sqlite3_stmt *stmt = stmt_cache_acquire(db, sql);
+        if (!stmt) {
+            fprintf(stderr, "并发测试语句准备失败: %s\n", sqlite3_errmsg(db));
+            worker->failed = 1;
+            break;
+        }
+        sqlite3_bind_int64(stmt, 1, pick_row(rng));
+        int rc = concurrency_step(stmt);
+        auto end = std::chrono::steady_clock::now();
+        
+        if ((rc & 0xFF) == SQLITE_BUSY) {
+            worker->busy_failures++;
+            continue;
+        }
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "并发测试操作失败: %s\n", sqlite3_errmsg(db));
+            worker->failed = 1;
+            break;
+        }
+        
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        (is_read ? worker->read_ns : worker->write_ns).push_back(ns);
+    }
+    
+    close_database(db);
+}
+
+/**
+ * 测试并发访问：同一加密库开启 WAL，读线程只读，写线程按比例混合读写，
+ * 每个线程独立连接，固定时长后汇总吞吐、延迟分位数和 BUSY/重试次数
+ */
+int test_concurrency() {
+    printf("\n--- 并发测试 ---\n");
+    
+    int readers = (int)option_int("readers", CONCURRENCY_READERS);
+    int writers = (int)option_int("writers", CONCURRENCY_WRITERS);
+    double read_ratio = atof(option_str("read-ratio", CONCURRENCY_READ_RATIO));
+    int duration = (int)option_int("duration", CONCURRENCY_DURATION);
+    long long rows = option_int("rows", CONCURRENCY_ROWS);
+    
+    remove(CONCURRENCY_DB);
+    kdf_sidecar_remove(CONCURRENCY_DB);
+    sqlite3 *db = open_database(CONCURRENCY_DB, TEST_KEY);
+    if (!db) {
+        return 0;
+    }
+    
+    if (execute_sql(db, "PRAGMA journal_mode = WAL") != SQLITE_OK ||
+        execute_sql(db, "CREATE TABLE concurrency_test ("
+                        "id INTEGER PRIMARY KEY,"
+                        "data TEXT NOT NULL,"
+                        "value INTEGER NOT NULL)") != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    
+    static const char *const columns[] = {"data", "value"};
+    PerfRowSource source = {rows, {0}, 0};
+    BulkInsertOptions bulk_opts = {0, 0};
+    if (bulk_insert_generated(db, "concurrency_test", columns, 2, perf_row_generator,
+                              &source, &bulk_opts, NULL) != SQLITE_OK) {
+        close_database(db);
+        return 0;
+    }
+    close_database(db);
+    
+    printf("读线程 %d, 写线程 %d（读比例 %.2f）, 时长 %d 秒, %lld 行\n",
+           readers, writers, read_ratio, duration, rows);
+    
+    std::atomic<int> ready(0), go(0), stop(0);
+    std::vector<ConcurrencyWorker> workers(readers + writers);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < readers + writers; i++) {
+        ConcurrencyWorker &worker = workers[i];
+        worker.is_writer = i >= readers;
+        worker.read_ratio = read_ratio;
+        worker.rows = rows;
+        worker.seed = 12345u + i;
+        worker.ready = &ready;
+        worker.go = &go;
+        worker.stop = &stop;
+        worker.busy_retries = 0;
+        worker.busy_failures = 0;
+        worker.failed = 0;
+    }
+    
+    for (int i = 0; i < readers + writers; i++) {
+        threads.emplace_back(concurrency_worker_main, &workers[i]);
+    }
+    while (ready.load() < readers + writers) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    
+    double start = now_seconds();
+    go.store(1);
+    std::this_thread::sleep_for(std::chrono::seconds(duration));
+    stop.store(1);
+    for (auto &t : threads) {
+        t.join();
+    }
+    double elapsed = now_seconds() - start;
+    
+    std::vector<double> read_ns, write_ns;
+    long long busy_retries = 0, busy_failures = 0;
+    int failed = 0;
+    for (auto &worker : workers) {
+        read_ns.insert(read_ns.end(), worker.read_ns.begin(), worker.read_ns.end());
+        write_ns.insert(write_ns.end(), worker.write_ns.begin(), worker.write_ns.end());
+        busy_retries += worker.busy_retries;
+        busy_failures += worker.busy_failures;
+        failed |= worker.failed;
+    }
+    
+    std::vector<BenchResult> results;
+    results.push_back(bench_result_from_samples("read", read_ns, elapsed));
+    results.push_back(bench_result_from_samples("write", write_ns, elapsed));
+    
+    bench_print_header();
+    for (auto &result : results) {
+        bench_print(result);
+    }
+    printf("总吞吐: %.1f 操作/秒, BUSY 重试 %lld 次, 重试用尽失败 %lld 次\n",
+           (results[0].ops + results[1].ops) / elapsed, busy_retries, busy_failures);
+    
+    const char *json_path = option_str("json", NULL);
+    if (json_path && bench_write_json(json_path, NULL, results)) {
+        printf("并发测试结果已写入 %s\n", json_path);
+    }
+    
+    remove(CONCURRENCY_DB);
+    kdf_sidecar_remove(CONCURRENCY_DB);
+    std::string wal = std::string(CONCURRENCY_DB) + "-wal";
+    std::string shm = std::string(CONCURRENCY_DB) + "-shm";
+    remove(wal.c_str());
+    remove(shm.c_str());
+    
+    if (failed) {
+        fprintf(stderr, "部分并发线程执行失败\n");
+        return 0;
+    }
+    printf("并发测试完成\n");
+    return 1;
+}
+
+/**
+ * 执行SQL语句；连接启用了语句缓存时复用缓存中的预编译语句
+ */
+int execute_sql(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt = stmt_cache_acquire(db, sql);
+    if (stmt) {
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        }
+        if (rc == SQLITE_DONE) {
+            rc = SQLITE_OK;
+        } else {
+            fprintf(stderr, "SQL执行失败: %s\nSQL语句: %s\n", sqlite3_errmsg(db), sql);
+        }
+        stmt_cache_release(stmt);
+        return rc;
+    }
+    
+    // 未启用缓存、多条语句或准备失败时走 sqlite3_exec（失败时由它给出错误信息）
+    char *err_msg = NULL;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+    
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL执行失败: %s\nSQL语句: %s\n", err_msg, sql);
+        sqlite3_free(err_msg);
+    }
+    
+    return rc;
+}
+
+static std::string quote_identifier(const char *name);
+
+/*
+ * 数据库内容比较
+ *
+ * 每张表由一个工作线程用自己的两条连接按主键顺序流式哈希，哈希覆盖每列的类型和值。
+ * 有 rowid 的表每次扫描把 rowid 区间分成 COMPARE_FANOUT 个桶分别哈希，只对不一致的桶
+ * 递归缩小，直到桶内行数不超过 COMPARE_LEAF_ROWS，报告不一致的 rowid 范围；
+ * WITHOUT ROWID 表只比较整表哈希。
+ */
+struct ContentHash {
+    uint64_t state;
+    uint64_t rows;
+};
+
+static inline uint64_t content_hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline void content_hash_word(ContentHash *hash, uint64_t word) {
+    hash->state = (hash->state ^ content_hash_mix(word)) * 0x9e3779b97f4a7c15ULL;
+    hash->state = (hash->state << 31) | (hash->state >> 33);
+}
+
+static void content_hash_bytes(ContentHash *hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    content_hash_word(hash, len);
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        content_hash_word(hash, word);
+    }
+    if (len > 0) {
+        uint64_t word = 0;
+        memcpy(&word, p, len);
+        content_hash_word(hash, word);
+    }
+}
+
+// 类型标签参与哈希，整数 1、实数 1.0 与文本 '1' 不会相等
+static void content_hash_column(ContentHash *hash, sqlite3_stmt *stmt, int col) {
+    int type = sqlite3_column_type(stmt, col);
+    content_hash_word(hash, (uint64_t)type);
+    switch (type) {
+        case SQLITE_INTEGER:
+            content_hash_word(hash, (uint64_t)sqlite3_column_int64(stmt, col));
+            break;
+        case SQLITE_FLOAT: {
+            double d = sqlite3_column_double(stmt, col);
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            content_hash_word(hash, bits);
+            break;
+        }
+        case SQLITE_TEXT:
+            content_hash_bytes(hash, sqlite3_column_text(stmt, col), sqlite3_column_bytes(stmt, col));
+            break;
+        case SQLITE_BLOB:
+            content_hash_bytes(hash, sqlite3_column_blob(stmt, col), sqlite3_column_bytes(stmt, col));
+            break;
+        default:
+            break;
+    }
+}
+
+struct CompareTable {
+    std::string name;
+    int rowid_key;                  // rowid 是 INTEGER PRIMARY KEY 别名，可按 rowid 区间分桶定位
+    std::string order_by;           // rowid 或 WITHOUT ROWID 表的主键列
+};
+
+struct CompareJob {
+    const char *db1_path;
+    const char *db2_path;
+    const char *key1;
+    const char *key2;
+    std::vector<CompareTable> tables;
+    std::atomic<size_t> next_table;
+    std::atomic<int> mismatches;
+    std::mutex report_mutex;
+};
+
+/**
+ * 按主键顺序哈希 [lo, hi] 区间内的行，区间按 rowid 均分为 hashes->size() 个桶，
+ * 一次扫描得到每个桶的哈希（rowid_key 为 0 时只有一个桶，覆盖整表）
+ *
+ * 只哈希 * 中的声明列，第 0 列的 rowid 仅用于分桶：rowid 是 INTEGER PRIMARY KEY
+ * 别名时它本来就在声明列里
+ */
+static int hash_table_range(sqlite3 *db, const CompareTable *table, long long lo, long long hi,
+                            std::vector<ContentHash> *hashes) {
+    std::string sql = "SELECT rowid, * FROM " + quote_identifier(table->name.c_str());
+    if (table->rowid_key) {
+        sql += " WHERE rowid BETWEEN ?1 AND ?2";
+    } else {
+        sql = "SELECT NULL, * FROM " + quote_identifier(table->name.c_str());
+    }
+    sql += " ORDER BY " + table->order_by;
+    
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "准备哈希查询失败: %s\nSQL语句: %s\n", sqlite3_errmsg(db), sql.c_str());
+        return rc;
+    }
+    if (table->rowid_key) {
+        sqlite3_bind_int64(stmt, 1, lo);
+        sqlite3_bind_int64(stmt, 2, hi);
+    }
+    
+    for (size_t b = 0; b < hashes->size(); b++) {
+        (*hashes)[b].state = 0x243f6a8885a308d3ULL;
+        (*hashes)[b].rows = 0;
+    }
+    unsigned __int128 span = (unsigned __int128)((__int128)hi - lo) + 1;
+    int ncols = sqlite3_column_count(stmt);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        size_t bucket = 0;
+        if (table->rowid_key) {
+            unsigned __int128 offset = (unsigned __int128)((__int128)sqlite3_column_int64(stmt, 0) - lo);
+            bucket = (size_t)(offset * hashes->size() / span);
+        }
+        ContentHash *hash = &(*hashes)[bucket];
+        for (int c = 1; c < ncols; c++) {
+            content_hash_column(hash, stmt, c);
+        }
+        hash->rows++;
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int rowid_bounds(sqlite3 *db, const CompareTable *table, long long *lo, long long *hi) {
+    std::string sql = "SELECT min(rowid), max(rowid) FROM " + quote_identifier(table->name.c_str());
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+            *lo = std::min(*lo, (long long)sqlite3_column_int64(stmt, 0));
+            *hi = std::max(*hi, (long long)sqlite3_column_int64(stmt, 1));
+        }
+        rc = SQLITE_OK;
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+// 桶的 rowid 边界，与 hash_table_range 的分桶公式一致
+static long long bucket_start(long long lo, long long hi, size_t bucket, size_t nbuckets) {
+    unsigned __int128 span = (unsigned __int128)((__int128)hi - lo) + 1;
+    unsigned __int128 offset = (span * bucket + nbuckets - 1) / nbuckets;
+    return (long long)((__int128)lo + (__int128)offset);
+}
+
+/**
+ * 比较一个区间：一次扫描得到各桶哈希，只对不一致的桶递归，
+ * 桶内行数不超过 COMPARE_LEAF_ROWS 时把它作为不一致范围追加到 ranges
+ */
+static int compare_range(sqlite3 *db1, sqlite3 *db2, const CompareTable *table, long long lo, long long hi,
+                         std::vector<std::pair<long long, long long>> *ranges) {
+    size_t nbuckets = 1;
+    if (table->rowid_key) {
+        unsigned __int128 span = (unsigned __int128)((__int128)hi - lo) + 1;
+        nbuckets = span < COMPARE_FANOUT ? (size_t)span : COMPARE_FANOUT;
+    }
+    std::vector<ContentHash> h1(nbuckets), h2(nbuckets);
+    int rc = hash_table_range(db1, table, lo, hi, &h1);
+    if (rc == SQLITE_OK) {
+        rc = hash_table_range(db2, table, lo, hi, &h2);
+    }
+    
+    for (size_t b = 0; rc == SQLITE_OK && b < nbuckets && ranges->size() < COMPARE_MAX_RANGES; b++) {
+        if (h1[b].state == h2[b].state && h1[b].rows == h2[b].rows) {
+            continue;
+        }
+        if (!table->rowid_key) {
+            ranges->push_back(std::make_pair(lo, hi));
+            break;
+        }
+        long long b_lo = bucket_start(lo, hi, b, nbuckets);
+        long long b_hi = b + 1 < nbuckets ? bucket_start(lo, hi, b + 1, nbuckets) - 1 : hi;
+        if (b_lo >= b_hi || std::max(h1[b].rows, h2[b].rows) <= COMPARE_LEAF_ROWS) {
+            ranges->push_back(std::make_pair(b_lo, b_hi));
+        } else {
+            rc = compare_range(db1, db2, table, b_lo, b_hi, ranges);
+        }
+    }
+    return rc;
+}
+
+static int compare_worker_run(CompareJob *job, sqlite3 *db1, sqlite3 *db2) {
+    int last_rc = SQLITE_OK;
+    size_t i;
+    while ((i = job->next_table.fetch_add(1)) < job->tables.size()) {
+        const CompareTable *table = &job->tables[i];
+        long long lo = LLONG_MAX, hi = LLONG_MIN;
+        std::vector<std::pair<long long, long long>> ranges;
+        
+        // 读事务保证同一张表的多次区间查询看到同一快照
+        execute_sql(db1, "BEGIN");
+        execute_sql(db2, "BEGIN");
+        int rc = SQLITE_OK;
+        if (table->rowid_key) {
+            rc = rowid_bounds(db1, table, &lo, &hi);
+            if (rc == SQLITE_OK) {
+                rc = rowid_bounds(db2, table, &lo, &hi);
+            }
+        }
+        if (rc == SQLITE_OK && (!table->rowid_key || lo <= hi)) {
+            rc = compare_range(db1, db2, table, lo, hi, &ranges);
+        }
+        execute_sql(db1, "COMMIT");
+        execute_sql(db2, "COMMIT");
+        
+        if (rc != SQLITE_OK) {
+            last_rc = rc;
+        }
+        if (rc != SQLITE_OK || !ranges.empty()) {
+            job->mismatches++;
+            std::lock_guard<std::mutex> lock(job->report_mutex);
+            if (rc != SQLITE_OK) {
+                fprintf(stderr, "表 %s 比较失败: %d\n", table->name.c_str(), rc);
+            } else if (!table->rowid_key) {
+                fprintf(stderr, "表 %s 内容不一致\n", table->name.c_str());
+            } else {
+                for (size_t r = 0; r < ranges.size(); r++) {
+                    fprintf(stderr, "表 %s 内容不一致: rowid %lld..%lld\n",
+                            table->name.c_str(), ranges[r].first, ranges[r].second);
+                }
+            }
+        }
+    }
+    return last_rc;
+}
+
+/**
+ * 比较工作线程：从两个库的连接池各借一条连接；借不到说明池已被占满，
+ * 直接退出，剩余的表由调用线程和其它工作线程领取
+ */
+static void compare_worker_main(CompareJob *job) {
+    PooledConnection conn1(connection_pool_for(job->db1_path, job->key1));
+    PooledConnection conn2(connection_pool_for(job->db2_path, job->key2));
+    if (!conn1.get() || !conn2.get()) {
+        return;
+    }
+    int rc = compare_worker_run(job, conn1.get(), conn2.get());
+    conn1.report(rc);
+    conn2.report(rc);
+}
+
+/**
+ * 读取用户表名及建表语句，按名字排序
+ */
+static int list_tables(sqlite3 *db, std::vector<std::pair<std::string, std::string>> *tables) {
+    sqlite3_stmt *stmt = NULL;
+    const char *sql = "SELECT name, sql FROM sqlite_master WHERE type='table' AND name NOT LIKE 'sqlite_%' ORDER BY name";
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "获取表列表失败: %s\n", sqlite3_errmsg(db));
+        return rc;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+        const char *create = (const char *)sqlite3_column_text(stmt, 1);
+        tables->push_back(std::make_pair(std::string(name), std::string(create ? create : "")));
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * 确定表的比较顺序：有 rowid 按 rowid，WITHOUT ROWID 表按主键列；
+ * 只有 rowid 是 INTEGER PRIMARY KEY 别名时才按 rowid 区间分桶
+ */
+static int describe_compare_table(sqlite3 *db, const std::string &name, CompareTable *table) {
+    table->name = name;
+    std::string quoted = quote_identifier(name.c_str());
+    
+    sqlite3_stmt *stmt = NULL;
+    std::string probe = "SELECT rowid FROM " + quoted + " LIMIT 0";
+    int has_rowid = sqlite3_prepare_v2(db, probe.c_str(), -1, &stmt, NULL) == SQLITE_OK;
+    sqlite3_finalize(stmt);
+    table->rowid_key = 0;
+    if (has_rowid) {
+        // 没有 INTEGER PRIMARY KEY 的表经 VACUUM/sqlcipher_export 后 rowid 可能重新编号，
+        // 只能按 rowid 排序整表哈希，不能拿 rowid 区间在两个库之间对齐
+        std::string alias = "SELECT count(*) = 1 AND max(pk = 1 AND upper(type) = 'INTEGER') "
+                            "FROM pragma_table_info(?1) WHERE pk > 0";
+        int rc = sqlite3_prepare_v2(db, alias.c_str(), -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+        if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            table->rowid_key = sqlite3_column_int(stmt, 0);
+            rc = SQLITE_OK;
+        }
+        sqlite3_finalize(stmt);
+        table->order_by = "rowid";
+        return rc;
+    }
+    
+    std::string info = "SELECT name FROM pragma_table_info(?1) WHERE pk > 0 ORDER BY pk";
+    int rc = sqlite3_prepare_v2(db, info.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (!table->order_by.empty()) {
+            table->order_by += ", ";
+        }
+        table->order_by += quote_identifier((const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * 比较两个数据库的内容：表集合与建表语句一致，且每张表按主键顺序的内容哈希一致
+ */
+int compare_databases(const char *db1_path, const char *db2_path, const char *key1, const char *key2) {
+    std::shared_ptr<ConnectionPool> pool1 = connection_pool_for(db1_path, key1);
+    std::shared_ptr<ConnectionPool> pool2 = connection_pool_for(db2_path, key2);
+    PooledConnection conn1(pool1);
+    PooledConnection conn2(pool2);
+    sqlite3 *db1 = conn1.get();
+    sqlite3 *db2 = conn2.get();
+    
+    if (!db1 || !db2) {
+        fprintf(stderr, "无法打开数据库进行比较\n");
+        return 0;
+    }
+    
+    std::vector<std::pair<std::string, std::string>> tables1, tables2;
+    if (conn1.report(list_tables(db1, &tables1)) != SQLITE_OK ||
+        conn2.report(list_tables(db2, &tables2)) != SQLITE_OK) {
+        return 0;
+    }
+    
+    CompareJob job;
+    job.db1_path = db1_path;
+    job.db2_path = db2_path;
+    job.key1 = key1;
+    job.key2 = key2;
+    job.next_table = 0;
+    job.mismatches = 0;
+    
+    int tables_match = 1;
+    size_t i = 0, j = 0;
+    while (i < tables1.size() || j < tables2.size()) {
+        if (j == tables2.size() || (i < tables1.size() && tables1[i].first < tables2[j].first)) {
+            fprintf(stderr, "表 %s 在第二个数据库中不存在\n", tables1[i++].first.c_str());
+            tables_match = 0;
+        } else if (i == tables1.size() || tables2[j].first < tables1[i].first) {
+            fprintf(stderr, "表 %s 在第一个数据库中不存在\n", tables2[j++].first.c_str());
+            tables_match = 0;
+        } else {
+            if (tables1[i].second != tables2[j].second) {
+                fprintf(stderr, "表 %s 结构不一致\n", tables1[i].first.c_str());
+                tables_match = 0;
+            } else {
+                CompareTable table;
+                if (conn1.report(describe_compare_table(db1, tables1[i].first, &table)) != SQLITE_OK) {
+                    fprintf(stderr, "读取表 %s 结构失败: %s\n", tables1[i].first.c_str(), sqlite3_errmsg(db1));
+                    return 0;
+                }
+                job.tables.push_back(table);
+            }
+            i++;
+            j++;
+        }
+    }
+    
+    // 调用线程用已借到的两条连接参与比较，额外线程从连接池各借两条，从共享下标领取下一张表；
+    // 线程数受池容量限制（同一个库自比时两条连接出自同一个池），避免借出排队超时
+    size_t per_worker = pool1 == pool2 ? 2 : 1;
+    size_t max_extra = (POOL_MAX_SIZE - per_worker) / per_worker;
+    size_t nthreads = std::min<size_t>(job.tables.size(),
+                                       std::max(1u, std::min<unsigned>(std::thread::hardware_concurrency(), COMPARE_MAX_THREADS)));
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < nthreads && t <= max_extra; t++) {
+        workers.push_back(std::thread(compare_worker_main, &job));
+    }
+    int rc = compare_worker_run(&job, db1, db2);
+    conn1.report(rc);
+    conn2.report(rc);
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    
+    return tables_match && job.mismatches.load() == 0;
+}
+
+/**
+ * 打印测试结果
+ */
+void print_test_result(const char *test_name, int result) {
+    if (result) {
+        printf(ANSI_COLOR_GREEN "[PASS] %s\n" ANSI_COLOR_RESET, test_name);
+    } else {
+        printf(ANSI_COLOR_RED "[FAIL] %s\n" ANSI_COLOR_RESET, test_name);
+    }
+    metrics_print_test_delta(test_name);
+}
+
+static int key_cache_apply_kdf(sqlite3 *db, const char *db_path, const char *key, const Argon2Params *new_argon2);
+
+/**
+ * 各打开函数的公共部分：按 flags / vfs_name（NULL 为默认 VFS）打开，设置密钥并登记指标。
+ * use_key_cache 为 0 时直接把口令交给 SQLCipher 派生，否则经派生密钥缓存（新库按 params 选 KDF）
+ */
+static sqlite3 *open_database_common(const char *db_path, const char *key, int flags, const char *vfs_name,
+                                     int use_key_cache, const Argon2Params *params) {
+    sqlite3 *db = NULL;
+    int rc = sqlite3_open_v2(db_path, &db, flags, vfs_name);
+    
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "无法打开数据库 %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    
+    // 设置密钥
+    rc = use_key_cache ? key_cache_apply_kdf(db, db_path, key, params) : sqlite3_key(db, key, (int)strlen(key));
+    if (rc != SQLITE_OK) {
+        // 附属文件损坏等错误发生在 SQLite 之外，连接上没有错误信息
+        fprintf(stderr, "设置密钥失败: %s\n", sqlite3_errcode(db) != SQLITE_OK ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+        sqlite3_close(db);
+        return NULL;
+    }
+    
+    metrics_register_connection(db);
+    return db;
+}
+
+/**
+ * 打开数据库并设置密钥，口令经派生密钥缓存转换为原始密钥
+ */
+sqlite3* open_database(const char *db_path, const char *key) {
+    return open_database_argon2(db_path, key, NULL);
+}
+
+/**
+ * 同 open_database；新建数据库时 params 非 NULL 则以 Argon2id 派生，
+ * 附属文件在设置密钥成功后才写入。库已存在时忽略 params，按它自己的附属文件（或 PBKDF2）打开
+ */
+sqlite3* open_database_argon2(const char *db_path, const char *key, const Argon2Params *params) {
+    return open_database_common(db_path, key, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL, 1, params);
+}
+
+/**
+ * 打开数据库并直接用口令设置密钥，每次打开都会由 SQLCipher 执行 PBKDF2
+ */
+sqlite3* open_database_uncached(const char *db_path, const char *key) {
+    return open_database_common(db_path, key, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL, 0, NULL);
+}
+
+/**
+ * 用口令打开数据库并在首次读页前设置加密参数，不走派生密钥缓存（参数不同则派生结果不同）
+ */
+sqlite3* open_database_with_settings(const char *db_path, const char *key, const CipherSettings *settings) {
+    sqlite3 *db = open_database_uncached(db_path, key);
+    if (!db) {
+        return NULL;
+    }
+    // 之后经 open_database 打开同一文件时按这里的 KDF 参数派生原始密钥
+    key_cache_set_kdf(db_path, settings ? settings->kdf_iter : 0, settings ? settings->kdf_algorithm : NULL);
+    if (!settings) {
+        return db;
+    }
+    
+    char sql[128];
+    int rc = SQLITE_OK;
+    if (settings->page_size > 0) {
+        snprintf(sql, sizeof(sql), "PRAGMA cipher_page_size = %d", settings->page_size);
+        rc = execute_sql(db, sql);
+    }
+    if (rc == SQLITE_OK && settings->kdf_iter > 0) {
+        snprintf(sql, sizeof(sql), "PRAGMA kdf_iter = %d", settings->kdf_iter);
+        rc = execute_sql(db, sql);
+    }
+    if (rc == SQLITE_OK && settings->hmac_algorithm) {
+        snprintf(sql, sizeof(sql), "PRAGMA cipher_hmac_algorithm = HMAC_%s", settings->hmac_algorithm);
+        rc = execute_sql(db, sql);
+    }
+    if (rc == SQLITE_OK && settings->kdf_algorithm) {
+        snprintf(sql, sizeof(sql), "PRAGMA cipher_kdf_algorithm = PBKDF2_HMAC_%s", settings->kdf_algorithm);
+        rc = execute_sql(db, sql);
+    }
+    if (rc == SQLITE_OK && settings->use_hmac >= 0) {
+        snprintf(sql, sizeof(sql), "PRAGMA cipher_use_hmac = %s", settings->use_hmac ? "ON" : "OFF");
+        rc = execute_sql(db, sql);
+    }
+    
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "设置加密参数失败: %s\n", sqlite3_errmsg(db));
+        close_database(db);
+        return NULL;
+    }
+    return db;
+}
+
+/**
+ * 关闭数据库
+ */
+void close_database(sqlite3 *db) {
+    if (db) {
+        memory_profile_sample(db);
+        metrics_unregister_connection(db);
+        key_cache_confirm(db, 1);
+        stmt_cache_detach(db);
+        sqlite3_close(db);
+    }
+}
+
+
+/**
+ * 返回单调时钟的当前时间（秒），用于测量墙上时间
+ */
+double now_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * 派生密钥缓存
+ *
+ * SQLCipher 4 对口令执行 PBKDF2-HMAC-SHA512（256000 轮）得到 32 字节页密钥，
+ * 盐值保存在数据库文件前 16 字节。同一文件、同一盐值、同一口令派生出的密钥不变，
+ * 因此按 (路径, 盐值, KDF 参数) 缓存派生结果，之后用 x'...' 原始密钥形式打开，跳过 KDF。
+ * 条目同时保存 SHA-256(盐值 || 口令) 作为校验值，口令不符时不会命中。
+ * 已有库的派生结果先以“未确认”写入缓存，不额外执行查询；连接关闭或归还连接池时
+ * 若已成功加载 schema（口令正确）再标记为已确认。已确认的条目不会被校验值不同的口令替换，
+ * 未确认的条目随时可被替换，连接以 SQLITE_NOTADB 结束时直接删除，输错口令不会把正确的条目挤掉。
+ * 新库在按路径串行的建库锁内写入首页，盐值落盘后才释放锁：并发首次打开同一新路径时
+ * 只有一个连接生成盐值，其余连接读到它；首页写入成功即证明密钥可用，直接记为已确认。
+ * 以非默认 kdf_iter / cipher_kdf_algorithm 建的库（open_database_with_settings）登记其 KDF 参数，
+ * 经缓存打开时按登记的参数派生。
+ * 条目被淘汰、替换或清空时用 OPENSSL_cleanse 擦除密钥。
+ */
+struct KeyCacheEntry {
+    std::string id;                              // 规范路径 + 盐值十六进制
+    unsigned char verifier[32];                  // SHA-256(盐值 || 口令)
+    unsigned char key[CIPHER_KEY_SIZE];          // 派生出的原始密钥
+    int verified;                                // 已有连接用它成功读过 schema
+};
+
+// 用未确认条目打开、尚未关闭的连接
+struct KeyCachePending {
+    std::string id;
+    unsigned char verifier[32];
+};
+
+static std::mutex g_key_cache_mutex;
+static std::list<KeyCacheEntry> g_key_cache_lru;  // 表头为最近使用
+static std::unordered_map<std::string, std::list<KeyCacheEntry>::iterator> g_key_cache_index;
+static std::unordered_map<sqlite3 *, KeyCachePending> g_key_cache_pending;
+static std::unordered_map<std::string, std::shared_ptr<std::mutex>> g_key_cache_create_locks;
+
+// 使用非默认 PBKDF2 参数的库：规范路径 -> (迭代次数, 摘要算法名)
+struct KeyCacheKdf {
+    int iterations;
+    std::string digest;
+};
+static std::unordered_map<std::string, KeyCacheKdf> g_key_cache_kdf;
+
+static void key_cache_wipe(KeyCacheEntry &entry) {
+    OPENSSL_cleanse(entry.key, sizeof(entry.key));
+    OPENSSL_cleanse(entry.verifier, sizeof(entry.verifier));
+}
+
+/**
+ * 规范化所在目录再拼上文件名：文件删除后（key_cache_invalidate 常在此时调用）结果不变
+ */
+static std::string canonical_path(const char *db_path) {
+    std::string path(db_path);
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+    char *resolved = realpath(dir.c_str(), NULL);
+    if (!resolved) {
+        return path;
+    }
+    std::string canonical(resolved);
+    free(resolved);
+    if (canonical.empty() || canonical.back() != '/') {
+        canonical += '/';
+    }
+    return canonical + base;
+}
+
+static void hex_encode(const unsigned char *data, size_t len, char *out) {
+    static const char digits[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < len; i++) {
+        out[i * 2] = digits[data[i] >> 4];
+        out[i * 2 + 1] = digits[data[i] & 0x0F];
+    }
+    out[len * 2] = '\0';
+}
+
+/**
+ * 读取数据库文件头部的盐值，文件不存在或尚未写入时返回 0
+ */
+static int read_database_salt(const char *db_path, unsigned char *salt) {
+    FILE *f = fopen(db_path, "rb");
+    if (!f) {
+        return 0;
+    }
+    size_t n = fread(salt, 1, CIPHER_SALT_SIZE, f);
+    fclose(f);
+    return n == CIPHER_SALT_SIZE;
+}
+
+static int key_cache_verifier(const unsigned char *salt, const char *key, unsigned char *out) {
+    unsigned int out_len = 0;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int ok = ctx &&
+             EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+             EVP_DigestUpdate(ctx, salt, CIPHER_SALT_SIZE) &&
+             EVP_DigestUpdate(ctx, key, strlen(key)) &&
+             EVP_DigestFinal_ex(ctx, out, &out_len);
+    EVP_MD_CTX_free(ctx);
+    return ok;
+}
+
+static int derive_cipher_key(const char *key, const unsigned char *salt, const KeyCacheKdf &kdf, unsigned char *out) {
+    const EVP_MD *md = EVP_get_digestbyname(kdf.digest.c_str());
+    if (!md) {
+        fprintf(stderr, "未知的 KDF 摘要算法: %s\n", kdf.digest.c_str());
+        return 0;
+    }
+    return PKCS5_PBKDF2_HMAC(key, (int)strlen(key), salt, CIPHER_SALT_SIZE,
+                             kdf.iterations, md, CIPHER_KEY_SIZE, out);
+}
+
+/*
+ * Argon2id
+ *
+ * OpenSSL 3.2 起提供 ARGON2ID KDF，各 lane 可在 OpenSSL 自己的线程池上并行填充内存；
+ * 线程池默认为空，需要 OSSL_set_max_threads 打开，请求的线程数超过池容量时派生会失败。
+ */
+static std::mutex g_kdf_mutex;
+static int g_kdf_default_argon2 = 0;
+static Argon2Params g_kdf_default_params;
+
+// OpenSSL 3.2+ 的线程池接口
+typedef uint64_t (*OsslGetMaxThreadsFn)(OSSL_LIB_CTX *ctx);
+typedef int (*OsslSetMaxThreadsFn)(OSSL_LIB_CTX *ctx, uint64_t max_threads);
+
+/**
+ * 按运行库版本而不是编译时的头文件版本取线程池接口（调用方持 g_kdf_mutex）：
+ * 头文件是 3.0 而运行库是 3.2+ 时经 dlsym 查找；静态链接的 libcrypto 不在动态符号表里，
+ * 只有用 3.2+ 头文件编译时才能直接引用，查不到就单线程派生
+ */
+static int argon2_thread_api(OsslGetMaxThreadsFn *get_max_threads, OsslSetMaxThreadsFn *set_max_threads) {
+    static int resolved = 0;
+    static OsslGetMaxThreadsFn get_fn = NULL;
+    static OsslSetMaxThreadsFn set_fn = NULL;
+    if (!resolved) {
+        resolved = 1;
+        if (OpenSSL_version_num() >= 0x30200000L) {
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+            get_fn = OSSL_get_max_threads;
+            set_fn = OSSL_set_max_threads;
+#else
+            get_fn = (OsslGetMaxThreadsFn)dlsym(RTLD_DEFAULT, "OSSL_get_max_threads");
+            set_fn = (OsslSetMaxThreadsFn)dlsym(RTLD_DEFAULT, "OSSL_set_max_threads");
+#endif
+        }
+    }
+    *get_max_threads = get_fn;
+    *set_max_threads = set_fn;
+    return get_fn && set_fn;
+}
+
+/**
+ * 本次派生使用的线程数：不超过 lane 数和 CPU 数，线程池不够时先扩容，扩容失败则单线程
+ */
+uint32_t argon2_threads(uint32_t lanes) {
+    uint32_t want = std::min<uint32_t>(lanes, std::max(1u, std::thread::hardware_concurrency()));
+    std::lock_guard<std::mutex> lock(g_kdf_mutex);
+    OsslGetMaxThreadsFn get_max_threads;
+    OsslSetMaxThreadsFn set_max_threads;
+    if (!argon2_thread_api(&get_max_threads, &set_max_threads)) {
+        return 1;
+    }
+    if (want > 1 && get_max_threads(NULL) < want) {
+        set_max_threads(NULL, want);
+    }
+    uint64_t available = get_max_threads(NULL);
+    return available >= want ? want : std::max<uint32_t>(1, (uint32_t)available);
+}
+
+static int derive_argon2id_key(const char *key, const unsigned char *salt, const Argon2Params *params,
+                               unsigned char *out) {
+    EVP_KDF *kdf = argon2_available() ? EVP_KDF_fetch(NULL, "ARGON2ID", NULL) : NULL;
+    if (!kdf) {
+        fprintf(stderr, "OpenSSL 运行库不支持 Argon2id（需要 3.2+）或自检未通过: %s\n", OpenSSL_version(OPENSSL_VERSION));
+        return 0;
+    }
+    EVP_KDF_CTX *ctx = EVP_KDF_CTX_new(kdf);
+    EVP_KDF_free(kdf);
+    
+    uint32_t iterations = params->iterations;
+    uint32_t lanes = params->lanes;
+    uint32_t memory_kib = params->memory_kib;
+    uint32_t threads = argon2_threads(lanes);
+    OSSL_PARAM kdf_params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD, (void *)key, strlen(key)),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, (void *)salt, CIPHER_SALT_SIZE),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ITER, &iterations),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &lanes),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST, &memory_kib),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_THREADS, &threads),
+        OSSL_PARAM_construct_end()
+    };
+    int ok = ctx && EVP_KDF_derive(ctx, out, CIPHER_KEY_SIZE, kdf_params) == 1;
+    if (!ok) {
+        fprintf(stderr, "Argon2id 派生失败 (m=%u KiB, t=%u, p=%u, 线程 %u)\n", memory_kib, iterations, lanes, threads);
+    }
+    EVP_KDF_CTX_free(ctx);
+    return ok;
+}
+
+static int argon2_params_valid(const Argon2Params *params) {
+    if (params->memory_kib == 0 || params->iterations == 0 || params->lanes == 0) {
+        fprintf(stderr, "Argon2id 参数无效: m=%u KiB, t=%u, p=%u\n", params->memory_kib, params->iterations,
+                params->lanes);
+        return 0;
+    }
+    return 1;
+}
+
+static int kdf_default_argon2(Argon2Params *params) {
+    std::lock_guard<std::mutex> lock(g_kdf_mutex);
+    if (g_kdf_default_argon2) {
+        *params = g_kdf_default_params;
+    }
+    return g_kdf_default_argon2;
+}
+
+static void key_cache_insert(const std::string &id, const unsigned char *verifier, const unsigned char *key,
+                             int verified) {
+    std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+    
+    auto found = g_key_cache_index.find(id);
+    if (found != g_key_cache_index.end()) {
+        // 同一 (路径, 盐值) 已确认了另一口令的密钥：保留原条目，换密钥后应先 key_cache_invalidate
+        if (found->second->verified &&
+            CRYPTO_memcmp(found->second->verifier, verifier, sizeof(found->second->verifier)) != 0) {
+            return;
+        }
+        key_cache_wipe(*found->second);
+        g_key_cache_lru.erase(found->second);
+        g_key_cache_index.erase(found);
+    }
+    
+    while (g_key_cache_lru.size() >= KEY_CACHE_CAPACITY) {
+        KeyCacheEntry &oldest = g_key_cache_lru.back();
+        g_key_cache_index.erase(oldest.id);
+        key_cache_wipe(oldest);
+        g_key_cache_lru.pop_back();
+    }
+    
+    g_key_cache_lru.emplace_front();
+    KeyCacheEntry &entry = g_key_cache_lru.front();
+    entry.id = id;
+    memcpy(entry.verifier, verifier, sizeof(entry.verifier));
+    memcpy(entry.key, key, sizeof(entry.key));
+    entry.verified = verified;
+    g_key_cache_index[id] = g_key_cache_lru.begin();
+}
+
+static int key_cache_lookup(const std::string &id, const unsigned char *verifier, unsigned char *key, int *verified) {
+    std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+    
+    auto found = g_key_cache_index.find(id);
+    if (found == g_key_cache_index.end()) {
+        return 0;
+    }
+    if (CRYPTO_memcmp(found->second->verifier, verifier, sizeof(found->second->verifier)) != 0) {
+        return 0;
+    }
+    
+    g_key_cache_lru.splice(g_key_cache_lru.begin(), g_key_cache_lru, found->second);
+    memcpy(key, found->second->key, CIPHER_KEY_SIZE);
+    *verified = found->second->verified;
+    return 1;
+}
+
+/**
+ * 为已打开的连接设置密钥：命中缓存时使用原始密钥，否则派生一次并写入缓存。
+ * 新数据库由本函数生成盐值，并以 x'密钥+盐值' 形式交给 SQLCipher。
+ */
+int key_cache_apply(sqlite3 *db, const char *db_path, const char *key) {
+    return key_cache_apply_kdf(db, db_path, key, NULL);
+}
+
+/**
+ * 同 key_cache_apply；新数据库在 new_argon2 非 NULL（或设置了 --kdf=argon2id）时改用 Argon2id
+ */
+static int key_cache_apply_kdf(sqlite3 *db, const char *db_path, const char *key, const Argon2Params *new_argon2) {
+    size_t key_len = strlen(key);
+    
+    // 空口令表示明文数据库，x'...' 已是原始密钥，二者都无需派生
+    if (key_len == 0 || (key_len > 3 && (key[0] == 'x' || key[0] == 'X') && key[1] == '\'')) {
+        return sqlite3_key(db, key, (int)key_len);
+    }
+    
+    std::string path = canonical_path(db_path);
+    unsigned char salt[CIPHER_SALT_SIZE];
+    int is_new = !read_database_salt(db_path, salt);
+    std::shared_ptr<std::mutex> create_lock;
+    std::unique_lock<std::mutex> creating;
+    if (is_new) {
+        // 同一路径串行建库：拿到建库锁后再读一次，别的连接可能刚写好首页
+        {
+            std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+            std::shared_ptr<std::mutex> &slot = g_key_cache_create_locks[path];
+            if (!slot) {
+                slot = std::make_shared<std::mutex>();
+            }
+            create_lock = slot;
+        }
+        creating = std::unique_lock<std::mutex>(*create_lock);
+        is_new = !read_database_salt(db_path, salt);
+    }
+    if (is_new && RAND_bytes(salt, sizeof(salt)) != 1) {
+        return sqlite3_key(db, key, (int)key_len);
+    }
+    
+    char salt_hex[CIPHER_SALT_SIZE * 2 + 1];
+    hex_encode(salt, sizeof(salt), salt_hex);
+    std::string id = path + "#" + salt_hex;
+    
+    KeyCacheKdf kdf = {CIPHER_KDF_ITER, "SHA512"};
+    {
+        std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+        auto found = g_key_cache_kdf.find(path);
+        if (found != g_key_cache_kdf.end() && is_new) {
+            // 经缓存新建的库一律使用默认参数，之前登记的是同名旧文件的
+            g_key_cache_kdf.erase(found);
+        } else if (found != g_key_cache_kdf.end()) {
+            kdf = found->second;
+            id += "#" + kdf.digest + ":" + std::to_string(kdf.iterations);
+        }
+    }
+    
+    unsigned char verifier[32];
+    unsigned char derived[CIPHER_KEY_SIZE];
+    if (!key_cache_verifier(salt, key, verifier)) {
+        return sqlite3_key(db, key, (int)key_len);
+    }
+    
+    Argon2Params argon2;
+    int use_argon2;
+    if (is_new) {
+        // 同名旧库留下的附属文件不属于这个新库；新库的附属文件等 sqlite3_key 成功后再写
+        kdf_sidecar_remove(db_path);
+        if (new_argon2) {
+            argon2 = *new_argon2;
+            use_argon2 = 1;
+        } else {
+            use_argon2 = kdf_default_argon2(&argon2);
+        }
+        if (use_argon2 && !argon2_params_valid(&argon2)) {
+            OPENSSL_cleanse(verifier, sizeof(verifier));
+            return SQLITE_ERROR;
+        }
+    } else if ((use_argon2 = kdf_sidecar_read(db_path, &argon2)) < 0) {
+        // 附属文件损坏时不能当作 PBKDF2 库打开：派生出的是另一把密钥，只会得到 SQLITE_NOTADB
+        OPENSSL_cleanse(verifier, sizeof(verifier));
+        return SQLITE_CORRUPT;
+    }
+    
+    int verified = 0;
+    int cached = key_cache_lookup(id, verifier, derived, &verified);
+    if (!cached) {
+        int ok = use_argon2 ? derive_argon2id_key(key, salt, &argon2, derived) : derive_cipher_key(key, salt, kdf, derived);
+        if (!ok) {
+            OPENSSL_cleanse(verifier, sizeof(verifier));
+            // Argon2id 库不能退回口令形式：SQLCipher 会用 PBKDF2 派生出另一把密钥
+            return use_argon2 ? SQLITE_ERROR : sqlite3_key(db, key, (int)key_len);
+        }
+    }
+    
+    // x'<64 位十六进制密钥>' 或新库的 x'<密钥><盐值>'
+    char raw_key[3 + (CIPHER_KEY_SIZE + CIPHER_SALT_SIZE) * 2 + 1];
+    raw_key[0] = 'x';
+    raw_key[1] = '\'';
+    hex_encode(derived, sizeof(derived), raw_key + 2);
+    size_t pos = 2 + CIPHER_KEY_SIZE * 2;
+    if (is_new) {
+        memcpy(raw_key + pos, salt_hex, CIPHER_SALT_SIZE * 2);
+        pos += CIPHER_SALT_SIZE * 2;
+    }
+    raw_key[pos++] = '\'';
+    raw_key[pos] = '\0';
+    
+    int rc = sqlite3_key(db, raw_key, (int)pos);
+    if (rc == SQLITE_OK && is_new && use_argon2 && !kdf_sidecar_write(db_path, &argon2)) {
+        rc = SQLITE_CANTOPEN;
+    }
+    if (rc == SQLITE_OK && is_new) {
+        // 仍持建库锁：写入首页让盐值落盘，写入成功也就证明了这把密钥
+        rc = sqlite3_exec(db, "PRAGMA user_version = 0", NULL, NULL, NULL);
+        verified = rc == SQLITE_OK;
+        if (rc != SQLITE_OK && use_argon2) {
+            kdf_sidecar_remove(db_path);
+        }
+    }
+    
+    // 已有库的条目先记为未确认，由 key_cache_confirm 在连接关闭/归还时确认
+    if (rc == SQLITE_OK) {
+        if (!cached) {
+            key_cache_insert(id, verifier, derived, verified);
+        }
+        std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+        if (verified) {
+            g_key_cache_pending.erase(db);
+        } else {
+            KeyCachePending &pending = g_key_cache_pending[db];
+            pending.id = id;
+            memcpy(pending.verifier, verifier, sizeof(pending.verifier));
+        }
+    }
+    
+    OPENSSL_cleanse(raw_key, sizeof(raw_key));
+    OPENSSL_cleanse(derived, sizeof(derived));
+    OPENSSL_cleanse(verifier, sizeof(verifier));
+    return rc;
+}
+
+/**
+ * 给已打开的连接换成新口令：按库现有的 KDF（Argon2id 附属文件或登记的 PBKDF2 参数）
+ * 以原盐值派生原始密钥再 sqlite3_rekey。直接拿口令 rekey 时 SQLCipher 总按 PBKDF2 派生，
+ * Argon2id 库换密钥后就无法再按附属文件打开
+ */
+int key_cache_rekey(sqlite3 *db, const char *db_path, const char *new_key) {
+    size_t key_len = strlen(new_key);
+    unsigned char salt[CIPHER_SALT_SIZE];
+    int rc;
+    
+    if (key_len == 0 || (key_len > 3 && (new_key[0] == 'x' || new_key[0] == 'X') && new_key[1] == '\'') ||
+        !read_database_salt(db_path, salt)) {
+        rc = sqlite3_rekey(db, new_key, (int)key_len);
+    } else {
+        KeyCacheKdf kdf = {CIPHER_KDF_ITER, "SHA512"};
+        {
+            std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+            auto found = g_key_cache_kdf.find(canonical_path(db_path));
+            if (found != g_key_cache_kdf.end()) {
+                kdf = found->second;
+            }
+        }
+        Argon2Params argon2;
+        int use_argon2 = kdf_sidecar_read(db_path, &argon2);
+        unsigned char derived[CIPHER_KEY_SIZE];
+        int ok = use_argon2 >= 0 && (use_argon2 ? derive_argon2id_key(new_key, salt, &argon2, derived)
+                                                : derive_cipher_key(new_key, salt, kdf, derived));
+        if (ok) {
+            char raw_key[3 + CIPHER_KEY_SIZE * 2 + 1];
+            raw_key[0] = 'x';
+            raw_key[1] = '\'';
+            hex_encode(derived, sizeof(derived), raw_key + 2);
+            raw_key[2 + CIPHER_KEY_SIZE * 2] = '\'';
+            raw_key[3 + CIPHER_KEY_SIZE * 2] = '\0';
+            rc = sqlite3_rekey(db, raw_key, 3 + CIPHER_KEY_SIZE * 2);
+            OPENSSL_cleanse(raw_key, sizeof(raw_key));
+        } else {
+            rc = SQLITE_ERROR;
+        }
+        OPENSSL_cleanse(derived, sizeof(derived));
+    }
+    
+    key_cache_invalidate(db_path);
+    return rc;
+}
+
+/**
+ * 确认连接所用的未确认条目：已成功加载 schema 说明口令正确，标记为已确认；
+ * 最近一次出错是 SQLITE_NOTADB 则口令或盐值不对，删除条目。
+ * closing 为 0（归还连接池）时尚无结论的连接留待下次再判断
+ */
+void key_cache_confirm(sqlite3 *db, int closing) {
+    int schema_bytes = 0, highwater = 0;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_SCHEMA_USED, &schema_bytes, &highwater, 0);
+    int notadb = sqlite3_errcode(db) == SQLITE_NOTADB;
+    
+    std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+    auto pending = g_key_cache_pending.find(db);
+    if (pending == g_key_cache_pending.end()) {
+        return;
+    }
+    auto found = g_key_cache_index.find(pending->second.id);
+    if (found != g_key_cache_index.end() && !found->second->verified &&
+        CRYPTO_memcmp(found->second->verifier, pending->second.verifier, sizeof(pending->second.verifier)) == 0) {
+        if (schema_bytes > 0) {
+            found->second->verified = 1;
+        } else if (notadb) {
+            key_cache_wipe(*found->second);
+            g_key_cache_lru.erase(found->second);
+            g_key_cache_index.erase(found);
+        }
+    }
+    if (closing || schema_bytes > 0 || notadb) {
+        OPENSSL_cleanse(pending->second.verifier, sizeof(pending->second.verifier));
+        g_key_cache_pending.erase(pending);
+    }
+}
+
+/**
+ * 丢弃某个数据库的所有缓存条目（例如 rekey 之后）
+ */
+void key_cache_invalidate(const char *db_path) {
+    std::string prefix = canonical_path(db_path) + "#";
+    std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+    
+    for (auto it = g_key_cache_lru.begin(); it != g_key_cache_lru.end();) {
+        if (it->id.compare(0, prefix.size(), prefix) == 0) {
+            g_key_cache_index.erase(it->id);
+            key_cache_wipe(*it);
+            it = g_key_cache_lru.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * 登记数据库的 PBKDF2 参数；kdf_iter 为 0 / kdf_algorithm 为 NULL 表示该项使用 SQLCipher 默认值，
+ * 两项都是默认值时取消登记
+ */
+void key_cache_set_kdf(const char *db_path, int kdf_iter, const char *kdf_algorithm) {
+    KeyCacheKdf kdf = {kdf_iter > 0 ? kdf_iter : CIPHER_KDF_ITER, kdf_algorithm ? kdf_algorithm : "SHA512"};
+    std::string path = canonical_path(db_path);
+    std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+    if (kdf.iterations == CIPHER_KDF_ITER && kdf.digest == "SHA512") {
+        g_key_cache_kdf.erase(path);
+    } else {
+        g_key_cache_kdf[path] = kdf;
+    }
+}
+
+/**
+ * 查询数据库登记的 PBKDF2 参数，未登记（使用默认值）时返回 0
+ */
+int key_cache_get_kdf(const char *db_path, int *kdf_iter, std::string *kdf_algorithm) {
+    std::string path = canonical_path(db_path);
+    std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+    auto found = g_key_cache_kdf.find(path);
+    if (found == g_key_cache_kdf.end()) {
+        return 0;
+    }
+    *kdf_iter = found->second.iterations;
+    *kdf_algorithm = found->second.digest;
+    return 1;
+}
+
+/**
+ * 擦除并清空整个缓存
+ */
+void key_cache_clear() {
+    std::lock_guard<std::mutex> lock(g_key_cache_mutex);
+    for (auto &entry : g_key_cache_lru) {
+        key_cache_wipe(entry);
+    }
+    g_key_cache_lru.clear();
+    g_key_cache_index.clear();
+}
+
+/**
+ * 用 RFC 9106 第 5.3 节的 Argon2id 测试向量核对运行库的实现（含 secret 和 associated data）
+ */
+static int argon2_known_answer(EVP_KDF *kdf) {
+    static const unsigned char expected[32] = {
+        0x0d, 0x64, 0x0d, 0xf5, 0x8d, 0x78, 0x76, 0x6c, 0x08, 0xc0, 0x37, 0xa3, 0x4a, 0x8b, 0x53, 0xc9,
+        0xd0, 0x1e, 0xf0, 0x45, 0x2d, 0x75, 0xb6, 0x5e, 0xb5, 0x25, 0x20, 0xe9, 0x6b, 0x01, 0xe6, 0x59
+    };
+    unsigned char password[32], salt[16], secret[8], ad[12], out[32];
+    memset(password, 0x01, sizeof(password));
+    memset(salt, 0x02, sizeof(salt));
+    memset(secret, 0x03, sizeof(secret));
+    memset(ad, 0x04, sizeof(ad));
+    uint32_t iterations = 3, lanes = 4, memory_kib = 32;
+    OSSL_PARAM kdf_params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD, password, sizeof(password)),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, salt, sizeof(salt)),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, secret, sizeof(secret)),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_ARGON2_AD, ad, sizeof(ad)),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ITER, &iterations),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &lanes),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST, &memory_kib),
+        OSSL_PARAM_construct_end()
+    };
+    EVP_KDF_CTX *ctx = EVP_KDF_CTX_new(kdf);
+    int ok = ctx && EVP_KDF_derive(ctx, out, sizeof(out), kdf_params) == 1 && memcmp(out, expected, sizeof(out)) == 0;
+    EVP_KDF_CTX_free(ctx);
+    return ok;
+}
+
+/**
+ * 运行库是否提供 Argon2id，且通过了测试向量自检（只检查一次）
+ */
+int argon2_available() {
+    static std::once_flag once;
+    static int available = 0;
+    std::call_once(once, [] {
+        EVP_KDF *kdf = EVP_KDF_fetch(NULL, "ARGON2ID", NULL);
+        if (kdf) {
+            available = argon2_known_answer(kdf);
+            if (!available) {
+                fprintf(stderr, "Argon2id 自检失败（RFC 9106 测试向量不符），不启用: %s\n", OpenSSL_version(OPENSSL_VERSION));
+            }
+        }
+        EVP_KDF_free(kdf);
+    });
+    return available;
+}
+
+/**
+ * 之后新建的数据库默认使用 Argon2id（--kdf=argon2id）；已有的库不受影响
+ */
+void kdf_set_default_argon2(const Argon2Params *params) {
+    std::lock_guard<std::mutex> lock(g_kdf_mutex);
+    g_kdf_default_params = *params;
+    g_kdf_default_argon2 = 1;
+}
+
+static std::string kdf_sidecar_path(const char *db_path) {
+    return std::string(db_path) + KDF_SIDECAR_SUFFIX;
+}
+
+/**
+ * 参数行的 SHA-256，十六进制写在附属文件第二行，读取时核对
+ */
+static int kdf_sidecar_digest(const std::string &line, char *hex) {
+    unsigned char md[32];
+    unsigned int md_len = 0;
+    if (EVP_Digest(line.data(), line.size(), md, &md_len, EVP_sha256(), NULL) != 1 || md_len != sizeof(md)) {
+        return 0;
+    }
+    hex_encode(md, sizeof(md), hex);
+    return 1;
+}
+
+/**
+ * 写入附属文件：第一行是 PHC 格式的 KDF 标识与参数（不含盐值，盐值在数据库文件头），
+ * 第二行是它的校验和。先写临时文件再 rename，中途失败不会留下半个参数文件
+ */
+int kdf_sidecar_write(const char *db_path, const Argon2Params *params) {
+    if (!argon2_params_valid(params)) {
+        return 0;
+    }
+    char line[128];
+    snprintf(line, sizeof(line), "$argon2id$v=%u$m=%u,t=%u,p=%u\n", KDF_ARGON2_VERSION, params->memory_kib,
+             params->iterations, params->lanes);
+    char digest[65];
+    if (!kdf_sidecar_digest(line, digest)) {
+        return 0;
+    }
+    std::string path = kdf_sidecar_path(db_path);
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "无法写入 %s\n", tmp.c_str());
+        return 0;
+    }
+    int ok = fprintf(f, "%ssha256=%s\n", line, digest) > 0;
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * 读取附属文件：不存在返回 0（PBKDF2 库）；存在且有效返回 1；
+ * 存在但无法读取、被截断、校验和不符或不是支持的 KDF 时报错并返回 -1，调用方不能退回 PBKDF2
+ */
+int kdf_sidecar_read(const char *db_path, Argon2Params *params) {
+    std::string path = kdf_sidecar_path(db_path);
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "无法读取 KDF 附属文件 %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    char buf[256];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    int read_error = ferror(f);
+    fclose(f);
+    buf[n] = '\0';
+    if (read_error) {
+        fprintf(stderr, "无法读取 KDF 附属文件 %s\n", path.c_str());
+        return -1;
+    }
+    
+    const char *newline = strchr(buf, '\n');
+    char stored[65] = {0}, computed[65];
+    int tail = 0;
+    if (!newline || sscanf(newline + 1, "sha256=%64[0-9A-F]\n%n", stored, &tail) != 1 || tail == 0 ||
+        newline[1 + tail] != '\0') {
+        fprintf(stderr, "KDF 附属文件不完整: %s\n", path.c_str());
+        return -1;
+    }
+    std::string line(buf, newline + 1 - buf);
+    if (!kdf_sidecar_digest(line, computed) || strcmp(stored, computed) != 0) {
+        fprintf(stderr, "KDF 附属文件校验和不符，文件已损坏: %s\n", path.c_str());
+        return -1;
+    }
+    
+    unsigned version = 0;
+    int end = 0;
+    if (sscanf(line.c_str(), "$argon2id$v=%u$m=%u,t=%u,p=%u\n%n", &version, &params->memory_kib,
+               &params->iterations, &params->lanes, &end) != 4 || end != (int)line.size()) {
+        fprintf(stderr, "KDF 附属文件声明的不是支持的 KDF: %s\n", path.c_str());
+        return -1;
+    }
+    if (version != KDF_ARGON2_VERSION || !argon2_params_valid(params)) {
+        fprintf(stderr, "KDF 附属文件参数无效 (v=%u m=%u t=%u p=%u): %s\n", version, params->memory_kib,
+                params->iterations, params->lanes, path.c_str());
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * 删除数据库文件时一并删除附属文件，否则同名新库会沿用旧参数
+ */
+void kdf_sidecar_remove(const char *db_path) {
+    remove(kdf_sidecar_path(db_path).c_str());
+}
+
+static std::mutex g_db_generation_mutex;
+static std::unordered_map<std::string, unsigned long long> g_db_generations;
+
+unsigned long long database_generation(const char *db_path) {
+    std::string path = canonical_path(db_path);
+    std::lock_guard<std::mutex> lock(g_db_generation_mutex);
+    auto found = g_db_generations.find(path);
+    return found == g_db_generations.end() ? 0 : found->second;
+}
+
+/**
+ * 替换数据库文件后调用：之后归还或借出的旧连接都会被连接池关闭
+ */
+void database_generation_bump(const char *db_path) {
+    std::string path = canonical_path(db_path);
+    std::lock_guard<std::mutex> lock(g_db_generation_mutex);
+    g_db_generations[path]++;
+}
+
+/*
+ * 加密连接池
+ */
+ConnectionPool::ConnectionPool(const char *db_path, const char *key, int min_size, int max_size)
+    : path_(db_path), key_(key), min_size_(min_size), max_size_(max_size), total_(0), closed_(0) {
+    // 预先打开最小数量的连接，密钥派生经缓存只发生一次
+    unsigned long long generation = database_generation(db_path);
+    for (int i = 0; i < min_size_; i++) {
+        sqlite3 *db = open_database(path_.c_str(), key_.c_str());
+        if (!db) {
+            break;
+        }
+        stmt_cache_attach(db, STMT_CACHE_CAPACITY);
+        idle_.push_back({db, std::thread::id()});
+        generation_[db] = generation;
+        total_++;
+    }
+}
+
+ConnectionPool::~ConnectionPool() {
+    shutdown();
+    if (!key_.empty()) {
+        OPENSSL_cleanse(&key_[0], key_.size());
+    }
+}
+
+/**
+ * 借出一个连接；池满时最多等待 timeout_ms 毫秒，超时或失败返回 NULL
+ */
+sqlite3 *ConnectionPool::checkout(int timeout_ms) {
+    unsigned long long generation = database_generation(path_.c_str());
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::thread::id self = std::this_thread::get_id();
+    
+    // 文件已被本进程的在线换密钥替换：替换前打开的空闲连接仍指向旧文件，全部丢弃
+    std::vector<sqlite3 *> stale;
+    for (size_t i = 0; i < idle_.size();) {
+        if (generation_[idle_[i].db] != generation) {
+            stale.push_back(idle_[i].db);
+            generation_.erase(idle_[i].db);
+            idle_.erase(idle_.begin() + i);
+            total_--;
+        } else {
+            i++;
+        }
+    }
+    if (!stale.empty()) {
+        lock.unlock();
+        for (size_t i = 0; i < stale.size(); i++) {
+            close_database(stale[i]);
+        }
+        lock.lock();
+        cond_.notify_all();
+    }
+    
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for (;;) {
+        while (!closed_ && idle_.empty() && total_ >= max_size_) {
+            if (cond_.wait_until(lock, deadline) == std::cv_status::timeout) {
+                fprintf(stderr, "连接池借出超时: %s\n", path_.c_str());
+                return NULL;
+            }
+        }
+        if (closed_) {
+            return NULL;
+        }
+        if (idle_.empty()) {
+            break;
+        }
+        
+        // 线程亲和：优先取本线程上次归还的连接
+        size_t pick = idle_.size() - 1;
+        for (size_t i = 0; i < idle_.size(); i++) {
+            if (idle_[i].owner == self) {
+                pick = i;
+                break;
+            }
+        }
+        sqlite3 *db = idle_[pick].db;
+        idle_.erase(idle_.begin() + pick);
+        lock.unlock();
+        
+        // 其他进程替换了文件时代次不变，连接仍读已 unlink 的旧 inode 且不报错：借出前比对 inode
+        int moved = 0;
+        if (sqlite3_file_control(db, "main", SQLITE_FCNTL_HAS_MOVED, &moved) != SQLITE_OK || !moved) {
+            return db;
+        }
+        fprintf(stderr, "数据库文件已被替换，丢弃连接: %s\n", path_.c_str());
+        key_cache_invalidate(path_.c_str());
+        lock.lock();
+        generation_.erase(db);
+        total_--;
+        lock.unlock();
+        close_database(db);
+        lock.lock();
+    }
+    
+    // 池未满，在锁外新建连接
+    total_++;
+    lock.unlock();
+    sqlite3 *db = open_database(path_.c_str(), key_.c_str());
+    if (!db) {
+        lock.lock();
+        total_--;
+        cond_.notify_one();
+        return NULL;
+    }
+    stmt_cache_attach(db, STMT_CACHE_CAPACITY);
+    lock.lock();
+    generation_[db] = generation;
+    return db;
+}
+
+/**
+ * 归还连接；最近一次操作返回 SQLITE_NOTADB 时先做健康检查，文件已被替换的连接直接关闭
+ */
+void ConnectionPool::checkin(sqlite3 *db, int last_rc) {
+    if (!db) {
+        return;
+    }
+    
+    int healthy = 1;
+    unsigned long long generation = database_generation(path_.c_str());
+    if (last_rc == SQLITE_READONLY_DBMOVED || sqlite3_extended_errcode(db) == SQLITE_READONLY_DBMOVED) {
+        // 文件已被在线换密钥替换，这条连接仍指向旧文件
+        healthy = 0;
+        key_cache_invalidate(path_.c_str());
+    } else if ((last_rc & 0xFF) == SQLITE_NOTADB) {
+        healthy = health_check(db);
+        if (!healthy) {
+            // 文件可能已被 rekey 或替换，派生密钥也一并作废
+            fprintf(stderr, "连接健康检查失败，丢弃连接: %s\n", path_.c_str());
+            key_cache_invalidate(path_.c_str());
+        }
+    }
+    
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_ || !healthy || generation_[db] != generation) {
+        generation_.erase(db);
+        total_--;
+        lock.unlock();
+        close_database(db);
+        cond_.notify_one();
+        return;
+    }
+    
+    // 结束调用方遗留的事务，避免把锁带回池中
+    if (!sqlite3_get_autocommit(db)) {
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    }
+    key_cache_confirm(db, 0);
+    idle_.push_back({db, std::this_thread::get_id()});
+    cond_.notify_one();
+}
+
+/**
+ * 用一次 schema 读取验证密钥和文件是否仍然有效
+ */
+int ConnectionPool::health_check(sqlite3 *db) {
+    return sqlite3_exec(db, "SELECT count(*) FROM sqlite_master", NULL, NULL, NULL) == SQLITE_OK;
+}
+
+/**
+ * 关闭所有空闲连接；借出中的连接在归还时关闭
+ */
+void ConnectionPool::shutdown() {
+    std::vector<IdleConnection> idle;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = 1;
+        idle.swap(idle_);
+        total_ -= (int)idle.size();
+        for (auto &conn : idle) {
+            generation_.erase(conn.db);
+        }
+    }
+    cond_.notify_all();
+    
+    for (auto &conn : idle) {
+        close_database(conn.db);
+    }
+}
+
+PooledConnection::PooledConnection(std::shared_ptr<ConnectionPool> pool, int timeout_ms)
+    : pool_(pool), db_(NULL), last_rc_(SQLITE_OK) {
+    if (pool_) {
+        db_ = pool_->checkout(timeout_ms);
+    }
+}
+
+PooledConnection::~PooledConnection() {
+    if (pool_ && db_) {
+        pool_->checkin(db_, last_rc_);
+    }
+}
+
+static std::mutex g_pool_registry_mutex;
+static std::unordered_map<std::string, std::shared_ptr<ConnectionPool> > g_pool_registry;
+
+/**
+ * 取得某个数据库的进程级连接池；同一文件换了口令时重建连接池
+ */
+std::shared_ptr<ConnectionPool> connection_pool_for(const char *db_path, const char *key) {
+    std::string path = canonical_path(db_path);
+    std::lock_guard<std::mutex> lock(g_pool_registry_mutex);
+    
+    auto found = g_pool_registry.find(path);
+    if (found != g_pool_registry.end()) {
+        if (found->second->matches_key(key)) {
+            return found->second;
+        }
+        found->second->shutdown();
+    }
+    
+    std::shared_ptr<ConnectionPool> pool = std::make_shared<ConnectionPool>(db_path, key, POOL_MIN_SIZE, POOL_MAX_SIZE);
+    g_pool_registry[path] = pool;
+    return pool;
+}
+
+/**
+ * 关闭所有连接池（删除测试文件之前调用）
+ */
+void connection_pool_shutdown_all() {
+    std::lock_guard<std::mutex> lock(g_pool_registry_mutex);
+    for (auto &entry : g_pool_registry) {
+        entry.second->shutdown();
+    }
+    g_pool_registry.clear();
+}
+
+/*
+ * 预编译语句缓存
+ *
+ * 每个连接一份 LRU，键为规范化后的 SQL 文本（去掉首尾空白、结尾分号和注释，
+ * 合并引号外的连续空白），语句用 SQLITE_PREPARE_PERSISTENT 准备。
+ * 借出的语句标记为使用中：同一连接上再取同一条 SQL（例如在逐行循环里嵌套执行）时
+ * 另准备一条不缓存的语句，归还时 finalize；使用中的语句也不会被淘汰。
+ * 只有显式 attach 的连接才启用；关闭前必须归还全部语句并 detach（close_database 会做），
+ * 否则未 finalize 的语句会让 sqlite3_close 返回 SQLITE_BUSY。
+ */
+struct StmtCacheEntry {
+    std::string key;
+    sqlite3_stmt *stmt;
+    int in_use;
+};
+
+struct StmtCache {
+    typedef std::list<StmtCacheEntry> LruList;
+    
+    LruList lru;                                 // 表头为最近使用
+    std::unordered_map<std::string, LruList::iterator> index;
+    std::unordered_map<sqlite3_stmt *, LruList::iterator> by_stmt;
+    size_t capacity;
+    StmtCacheStats stats;
+};
+
+static std::mutex g_stmt_cache_mutex;
+static std::unordered_map<sqlite3 *, StmtCache *> g_stmt_caches;
+
+static StmtCache *stmt_cache_find(sqlite3 *db) {
+    std::lock_guard<std::mutex> lock(g_stmt_cache_mutex);
+    auto found = g_stmt_caches.find(db);
+    return found == g_stmt_caches.end() ? NULL : found->second;
+}
+
+/**
+ * 规范化 SQL 文本作为缓存键，字符串和标识符引号内的内容保持原样；
+ * 行注释（--）与块注释按空白处理，不进入键（否则注释吞掉的内容会与未注释的文本撞键）
+ */
+static std::string normalize_sql(const char *sql) {
+    std::string out;
+    char quote = 0;
+    int pending_space = 0;
+    
+    for (const char *p = sql; *p; p++) {
+        char c = *p;
+        if (quote) {
+            out += c;
+            if (c == quote) {
+                quote = 0;
+            }
+            continue;
+        }
+        if (c == '-' && p[1] == '-') {
+            while (p[1] && p[1] != '\n') {
+                p++;
+            }
+            pending_space = !out.empty();
+            continue;
+        }
+        if (c == '/' && p[1] == '*') {
+            p++;
+            while (p[1] && !(p[1] == '*' && p[2] == '/')) {
+                p++;
+            }
+            if (p[1]) {
+                p += 2;
+            }
+            pending_space = !out.empty();
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            pending_space = !out.empty();
+            continue;
+        }
+        if (pending_space) {
+            out += ' ';
+            pending_space = 0;
+        }
+        if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+        } else if (c == '[') {
+            quote = ']';
+        }
+        out += c;
+    }
+    
+    while (!out.empty() && (out[out.size() - 1] == ';' || out[out.size() - 1] == ' ')) {
+        out.erase(out.size() - 1);
+    }
+    return out;
+}
+
+static int sql_tail_is_empty(const char *tail) {
+    if (!tail) {
+        return 1;
+    }
+    for (; *tail; tail++) {
+        if (*tail != ' ' && *tail != '\t' && *tail != '\n' && *tail != '\r' && *tail != ';') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * 为连接启用语句缓存，已启用时只调整容量
+ */
+int stmt_cache_attach(sqlite3 *db, size_t capacity) {
+    std::lock_guard<std::mutex> lock(g_stmt_cache_mutex);
+    StmtCache *&cache = g_stmt_caches[db];
+    if (!cache) {
+        cache = new StmtCache();
+        memset(&cache->stats, 0, sizeof(cache->stats));
+    }
+    cache->capacity = capacity > 0 ? capacity : 1;
+    return 1;
+}
+
+/**
+ * finalize 连接上缓存的全部语句并停用缓存
+ */
+void stmt_cache_detach(sqlite3 *db) {
+    StmtCache *cache = NULL;
+    {
+        std::lock_guard<std::mutex> lock(g_stmt_cache_mutex);
+        auto found = g_stmt_caches.find(db);
+        if (found == g_stmt_caches.end()) {
+            return;
+        }
+        cache = found->second;
+        g_stmt_caches.erase(found);
+    }
+    
+    for (auto &entry : cache->lru) {
+        sqlite3_finalize(entry.stmt);
+    }
+    delete cache;
+}
+
+/**
+ * 取出可直接绑定参数的语句：命中时 reset 并清空绑定，未命中时准备并加入缓存；
+ * 缓存的那条正被本连接使用时返回一条新准备的不缓存语句。
+ * 连接未启用缓存、文本含多条语句或准备失败时返回 NULL。
+ * 用完调用 stmt_cache_release，不要 finalize。
+ */
+sqlite3_stmt *stmt_cache_acquire(sqlite3 *db, const char *sql) {
+    StmtCache *cache = stmt_cache_find(db);
+    if (!cache) {
+        return NULL;
+    }
+    
+    std::string key = normalize_sql(sql);
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_mutex *db_mutex = sqlite3_db_mutex(db);
+    sqlite3_mutex_enter(db_mutex);
+    
+    auto found = cache->index.find(key);
+    if (found != cache->index.end() && !found->second->in_use) {
+        cache->lru.splice(cache->lru.begin(), cache->lru, found->second);
+        found->second->in_use = 1;
+        stmt = found->second->stmt;
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        cache->stats.hits++;
+        sqlite3_mutex_leave(db_mutex);
+        return stmt;
+    }
+    
+    cache->stats.misses++;
+    const char *tail = NULL;
+    int busy = found != cache->index.end();
+    if (sqlite3_prepare_v3(db, sql, -1, busy ? 0 : SQLITE_PREPARE_PERSISTENT, &stmt, &tail) != SQLITE_OK ||
+        !stmt || !sql_tail_is_empty(tail)) {
+        sqlite3_finalize(stmt);
+        sqlite3_mutex_leave(db_mutex);
+        return NULL;
+    }
+    if (busy) {
+        sqlite3_mutex_leave(db_mutex);
+        return stmt;
+    }
+    
+    // 从表尾淘汰未借出的语句；全部借出时暂时超出容量
+    for (auto it = cache->lru.end(); cache->lru.size() >= cache->capacity && it != cache->lru.begin();) {
+        --it;
+        if (it->in_use) {
+            continue;
+        }
+        cache->index.erase(it->key);
+        cache->by_stmt.erase(it->stmt);
+        sqlite3_finalize(it->stmt);
+        it = cache->lru.erase(it);
+        cache->stats.evictions++;
+    }
+    cache->lru.push_front({key, stmt, 1});
+    cache->index[key] = cache->lru.begin();
+    cache->by_stmt[stmt] = cache->lru.begin();
+    
+    sqlite3_mutex_leave(db_mutex);
+    return stmt;
+}
+
+/**
+ * 归还语句：缓存中的语句 reset 以结束其持有的读事务并标记为空闲，绑定值留到下次取出时清空；
+ * 不在缓存中的（使用中时另准备的）直接 finalize
+ */
+void stmt_cache_release(sqlite3_stmt *stmt) {
+    if (!stmt) {
+        return;
+    }
+    sqlite3 *db = sqlite3_db_handle(stmt);
+    StmtCache *cache = stmt_cache_find(db);
+    sqlite3_mutex *db_mutex = sqlite3_db_mutex(db);
+    sqlite3_mutex_enter(db_mutex);
+    int cached = 0;
+    if (cache) {
+        auto found = cache->by_stmt.find(stmt);
+        if (found != cache->by_stmt.end()) {
+            sqlite3_reset(stmt);
+            found->second->in_use = 0;
+            cached = 1;
+        }
+    }
+    if (!cached) {
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_mutex_leave(db_mutex);
+}
+
+/**
+ * 读取命中/未命中计数，连接未启用缓存时返回 0
+ */
+int stmt_cache_stats(sqlite3 *db, StmtCacheStats *stats) {
+    StmtCache *cache = stmt_cache_find(db);
+    if (!cache) {
+        return 0;
+    }
+    
+    sqlite3_mutex *db_mutex = sqlite3_db_mutex(db);
+    sqlite3_mutex_enter(db_mutex);
+    *stats = cache->stats;
+    stats->size = cache->lru.size();
+    sqlite3_mutex_leave(db_mutex);
+    return 1;
+}
+
+/*
+ * 批量插入
+ *
+ * 把行绑定到一条 "INSERT INTO t (...) VALUES (?,?),(?,?)..." 预编译语句里，
+ * 每条语句的行数受 SQLITE_LIMIT_VARIABLE_NUMBER 和 SQL 长度上限约束，尾部不足一批的行用
+ * 按剩余行数准备的语句插入。调用方未开启事务时按 commit_every 分段提交。
+ */
+static std::string quote_identifier(const char *name) {
+    std::string out = "\"";
+    for (const char *p = name; *p; p++) {
+        if (*p == '"') {
+            out += '"';
+        }
+        out += *p;
+    }
+    out += '"';
+    return out;
+}
+
+static int prepare_multi_row_insert(sqlite3 *db, const char *table, const char *const *column_names,
+                                    int ncols, int nrows, sqlite3_stmt **stmt) {
+    std::string sql = "INSERT INTO " + quote_identifier(table) + " (";
+    for (int c = 0; c < ncols; c++) {
+        if (c > 0) {
+            sql += ", ";
+        }
+        sql += quote_identifier(column_names[c]);
+    }
+    sql += ") VALUES ";
+    
+    std::string row = "(";
+    for (int c = 0; c < ncols; c++) {
+        row += c > 0 ? ",?" : "?";
+    }
+    row += ")";
+    
+    sql.reserve(sql.size() + (row.size() + 1) * nrows);
+    for (int r = 0; r < nrows; r++) {
+        if (r > 0) {
+            sql += ',';
+        }
+        sql += row;
+    }
+    
+    int rc = sqlite3_prepare_v3(db, sql.c_str(), (int)sql.size(), SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "批量插入语句准备失败: %s\n", sqlite3_errmsg(db));
+    }
+    return rc;
+}
+
+/**
+ * 计算每条语句的行数：不超过变量上限和 SQL 长度上限
+ */
+static int bulk_rows_per_statement(sqlite3 *db, int ncols, const BulkInsertOptions *opts) {
+    int max_vars = sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+    int max_sql = sqlite3_limit(db, SQLITE_LIMIT_SQL_LENGTH, -1);
+    int rows = max_vars / ncols;
+    int by_length = (max_sql - 1024) / (2 * ncols + 2);
+    
+    if (by_length < rows) {
+        rows = by_length;
+    }
+    int wanted = opts && opts->rows_per_statement > 0 ? opts->rows_per_statement : BULK_ROWS_PER_STATEMENT;
+    if (wanted < rows) {
+        rows = wanted;
+    }
+    if (opts && opts->commit_every > 0 && opts->commit_every < rows) {
+        rows = (int)opts->commit_every;
+    }
+    return rows > 0 ? rows : 1;
+}
+
+/*
+ * 批量写入器：管理整批/尾批语句和分段事务，由数组接口和生成器接口共用
+ */
+class BulkWriter {
+public:
+    BulkWriter(sqlite3 *db, const char *table, const char *const *column_names, int ncols,
+               const BulkInsertOptions *opts)
+        : db_(db), table_(table), column_names_(column_names), ncols_(ncols),
+          rows_per_stmt_(bulk_rows_per_statement(db, ncols, opts)),
+          commit_every_(opts ? opts->commit_every : 0), full_stmt_(NULL),
+          own_txn_(0), rows_in_txn_(0) {
+    }
+    
+    ~BulkWriter() {
+        sqlite3_finalize(full_stmt_);
+    }
+    
+    int rows_per_statement() const { return rows_per_stmt_; }
+    
+    int begin() {
+        // 调用方已在事务中时不插手提交
+        if (!sqlite3_get_autocommit(db_)) {
+            return SQLITE_OK;
+        }
+        int rc = execute_sql(db_, "BEGIN");
+        own_txn_ = rc == SQLITE_OK;
+        rows_in_txn_ = 0;
+        return rc;
+    }
+    
+    /**
+     * 提交自己开启的事务；COMMIT 失败（如 SQLITE_BUSY）时回滚，不把打开的事务留给调用方
+     */
+    int finish() {
+        if (!own_txn_) {
+            return SQLITE_OK;
+        }
+        int rc = execute_sql(db_, "COMMIT");
+        if (rc != SQLITE_OK) {
+            abort();
+            return rc;
+        }
+        own_txn_ = 0;
+        return SQLITE_OK;
+    }
+    
+    void abort() {
+        if (own_txn_) {
+            // 某些错误已让 SQLite 自动回滚，此时不再发 ROLLBACK
+            if (!sqlite3_get_autocommit(db_)) {
+                execute_sql(db_, "ROLLBACK");
+            }
+            own_txn_ = 0;
+        }
+    }
+    
+    /**
+     * 取得 nrows 行的语句：整批语句常驻，尾批语句由调用方 finalize
+     */
+    int statement(int nrows, sqlite3_stmt **stmt) {
+        if (nrows == rows_per_stmt_) {
+            if (!full_stmt_) {
+                int rc = prepare_multi_row_insert(db_, table_, column_names_, ncols_, nrows, &full_stmt_);
+                if (rc != SQLITE_OK) {
+                    return rc;
+                }
+            }
+            *stmt = full_stmt_;
+            return SQLITE_OK;
+        }
+        return prepare_multi_row_insert(db_, table_, column_names_, ncols_, nrows, stmt);
+    }
+    
+    /**
+     * 执行已绑定好的语句，并在达到 commit_every 时提交；成功与否尾批语句都在这里 finalize，
+     * 否则失败路径上残留的语句会让之后的 sqlite3_close 返回 SQLITE_BUSY
+     */
+    int execute(sqlite3_stmt *stmt, int nrows) {
+        int rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "批量插入失败: %s\n", sqlite3_errmsg(db_));
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (stmt != full_stmt_) {
+            sqlite3_finalize(stmt);
+        }
+        if (rc != SQLITE_DONE) {
+            return rc;
+        }
+        
+        rows_in_txn_ += nrows;
+        if (own_txn_ && commit_every_ > 0 && rows_in_txn_ >= commit_every_) {
+            rc = finish();
+            if (rc == SQLITE_OK) {
+                rc = begin();
+            }
+            return rc;
+        }
+        return SQLITE_OK;
+    }
+    
+private:
+    sqlite3 *db_;
+    const char *table_;
+    const char *const *column_names_;
+    int ncols_;
+    int rows_per_stmt_;
+    long long commit_every_;
+    sqlite3_stmt *full_stmt_;
+    int own_txn_;
+    long long rows_in_txn_;
+};
+
+static int bulk_bind_value(sqlite3_stmt *stmt, int param, const BulkValue &value, sqlite3_destructor_type lifetime) {
+    switch (value.type) {
+    case BULK_INT64:
+        return sqlite3_bind_int64(stmt, param, value.i);
+    case BULK_DOUBLE:
+        return sqlite3_bind_double(stmt, param, value.d);
+    case BULK_TEXT:
+        return value.p ? sqlite3_bind_text(stmt, param, (const char *)value.p, value.n, lifetime)
+                       : sqlite3_bind_null(stmt, param);
+    case BULK_BLOB:
+        return value.p ? sqlite3_bind_blob(stmt, param, value.p, value.n, lifetime)
+                       : sqlite3_bind_null(stmt, param);
+    default:
+        return sqlite3_bind_null(stmt, param);
+    }
+}
+
+static void bulk_array_value(const BulkColumn &column, long long row, BulkValue *value) {
+    value->type = column.type;
+    switch (column.type) {
+    case BULK_INT64:
+        value->i = ((const sqlite3_int64 *)column.data)[row];
+        break;
+    case BULK_DOUBLE:
+        value->d = ((const double *)column.data)[row];
+        break;
+    case BULK_TEXT:
+        value->p = ((const char *const *)column.data)[row];
+        value->n = -1;
+        break;
+    case BULK_BLOB:
+        value->p = ((const BulkBlob *)column.data)[row].data;
+        value->n = ((const BulkBlob *)column.data)[row].size;
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * 从按列连续存放的数组批量插入 nrows 行，数组在调用期间保持有效，绑定时不复制
+ */
+int bulk_insert_arrays(sqlite3 *db, const char *table, const BulkColumn *columns, int ncols,
+                       long long nrows, const BulkInsertOptions *opts) {
+    std::vector<const char *> names(ncols);
+    for (int c = 0; c < ncols; c++) {
+        names[c] = columns[c].name;
+    }
+    
+    BulkWriter writer(db, table, names.data(), ncols, opts);
+    int rc = writer.begin();
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    BulkValue value;
+    long long row = 0;
+    while (row < nrows) {
+        int batch = (int)std::min<long long>(writer.rows_per_statement(), nrows - row);
+        sqlite3_stmt *stmt = NULL;
+        rc = writer.statement(batch, &stmt);
+        if (rc != SQLITE_OK) {
+            writer.abort();
+            return rc;
+        }
+        
+        int param = 1;
+        for (int r = 0; r < batch; r++, row++) {
+            for (int c = 0; c < ncols; c++) {
+                bulk_array_value(columns[c], row, &value);
+                bulk_bind_value(stmt, param++, value, SQLITE_STATIC);
+            }
+        }
+        
+        rc = writer.execute(stmt, batch);
+        if (rc != SQLITE_OK) {
+            writer.abort();
+            return rc;
+        }
+    }
+    
+    return writer.finish();
+}
+
+/**
+ * 由行生成器逐行产生数据并批量插入；文本/BLOB 值复制到批缓冲区，
+ * 凑满一批后一次绑定执行，rows_inserted 可为 NULL
+ */
+int bulk_insert_generated(sqlite3 *db, const char *table, const char *const *column_names, int ncols,
+                          BulkRowGenerator generator, void *ctx, const BulkInsertOptions *opts,
+                          long long *rows_inserted) {
+    BulkWriter writer(db, table, column_names, ncols, opts);
+    int batch_rows = writer.rows_per_statement();
+    
+    // 一批的值及其文本/BLOB 副本，容量在批之间复用
+    std::vector<BulkValue> values((size_t)batch_rows * ncols);
+    std::vector<std::string> storage((size_t)batch_rows * ncols);
+    
+    int rc = writer.begin();
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    long long row = 0;
+    int pending = 0;
+    int more = 1;
+    while (more) {
+        BulkValue *slot = &values[(size_t)pending * ncols];
+        memset(slot, 0, sizeof(BulkValue) * ncols);
+        
+        int produced = generator(ctx, row, slot);
+        if (produced < 0) {
+            fprintf(stderr, "批量插入行生成失败: 第 %lld 行\n", row);
+            writer.abort();
+            return SQLITE_ABORT;
+        }
+        
+        if (produced > 0) {
+            for (int c = 0; c < ncols; c++) {
+                BulkValue &value = slot[c];
+                if ((value.type == BULK_TEXT || value.type == BULK_BLOB) && value.p) {
+                    size_t len = value.n >= 0 ? (size_t)value.n : strlen((const char *)value.p);
+                    std::string &copy = storage[(size_t)pending * ncols + c];
+                    copy.assign((const char *)value.p, len);
+                    value.p = copy.data();
+                    value.n = (int)len;
+                }
+            }
+            pending++;
+            row++;
+        } else {
+            more = 0;
+        }
+        
+        if (pending == batch_rows || (!more && pending > 0)) {
+            sqlite3_stmt *stmt = NULL;
+            rc = writer.statement(pending, &stmt);
+            if (rc != SQLITE_OK) {
+                writer.abort();
+                return rc;
+            }
+            for (int i = 0; i < pending * ncols; i++) {
+                bulk_bind_value(stmt, i + 1, values[i], SQLITE_STATIC);
+            }
+            rc = writer.execute(stmt, pending);
+            if (rc != SQLITE_OK) {
+                writer.abort();
+                return rc;
+            }
+            pending = 0;
+        }
+    }
+    
+    if (rows_inserted) {
+        *rows_inserted = row;
+    }
+    return writer.finish();
+}
+
+/*
+ * 命令行选项
+ */
+static std::unordered_map<std::string, std::string> g_options;
+
+/**
+ * 收集 --name=value 形式的参数；单独的 --name 视为 1
+ */
+void parse_options(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            continue;
+        }
+        const char *name = argv[i] + 2;
+        const char *eq = strchr(name, '=');
+        if (eq) {
+            g_options[std::string(name, eq - name)] = eq + 1;
+        } else {
+            g_options[name] = "1";
+        }
+    }
+}
+
+long long option_int(const char *name, long long default_value) {
+    auto found = g_options.find(name);
+    return found == g_options.end() ? default_value : atoll(found->second.c_str());
+}
+
+const char *option_str(const char *name, const char *default_value) {
+    auto found = g_options.find(name);
+    return found == g_options.end() ? default_value : found->second.c_str();
+}
+
+/*
+ * 基准测试框架
+ */
+
+/**
+ * 计算延迟分位数（最近秩法），samples_ns 会被排序
+ */
+LatencySummary summarize_latencies(std::vector<double> &samples_ns) {
+    LatencySummary summary;
+    memset(&summary, 0, sizeof(summary));
+    summary.samples = samples_ns.size();
+    if (samples_ns.empty()) {
+        return summary;
+    }
+    
+    std::sort(samples_ns.begin(), samples_ns.end());
+    double sum = 0.0;
+    for (double v : samples_ns) {
+        sum += v;
+    }
+    
+    size_t n = samples_ns.size();
+    auto rank = [&](double q) {
+        size_t idx = (size_t)(q * n + 0.999999);
+        idx = idx == 0 ? 0 : idx - 1;
+        return samples_ns[idx < n ? idx : n - 1] / 1000.0;
+    };
+    
+    summary.mean_us = sum / n / 1000.0;
+    summary.min_us = samples_ns.front() / 1000.0;
+    summary.max_us = samples_ns.back() / 1000.0;
+    summary.p50_us = rank(0.50);
+    summary.p95_us = rank(0.95);
+    summary.p99_us = rank(0.99);
+    summary.p999_us = rank(0.999);
+    return summary;
+}
+
+/**
+ * 运行一个基准用例：warmup 轮不记录，reps 轮逐操作计时；失败返回 0
+ */
+int bench_run(const BenchCase &bench, int warmup, int reps, BenchResult *result) {
+    std::vector<double> samples;
+    samples.reserve((size_t)(reps * bench.ops_per_rep));
+    
+    for (int rep = 0; rep < warmup + reps; rep++) {
+        int measured = rep >= warmup;
+        if (bench.setup && bench.setup(bench.ctx) != SQLITE_OK) {
+            fprintf(stderr, "基准 %s 准备失败\n", bench.name);
+            return 0;
+        }
+        
+        for (long long i = 0; i < bench.ops_per_rep; i++) {
+            auto start = std::chrono::steady_clock::now();
+            int rc = bench.op(bench.ctx, i);
+            auto end = std::chrono::steady_clock::now();
+            if (rc != SQLITE_OK) {
+                fprintf(stderr, "基准 %s 第 %lld 次操作失败: %d\n", bench.name, i, rc);
+                return 0;
+            }
+            if (measured) {
+                samples.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+            }
+        }
+    }
+    
+    result->name = bench.name;
+    result->warmup = warmup;
+    result->reps = reps;
+    result->ops = (long long)samples.size();
+    result->items = result->ops * bench.items_per_op;
+    result->total_seconds = 0.0;
+    for (double v : samples) {
+        result->total_seconds += v / 1e9;
+    }
+    result->ops_per_sec = result->total_seconds > 0.0 ? result->ops / result->total_seconds : 0.0;
+    result->items_per_sec = result->total_seconds > 0.0 ? result->items / result->total_seconds : 0.0;
+    result->latency = summarize_latencies(samples);
+    return 1;
+}
+
+/**
+ * 由多线程测得的延迟样本构造结果，吞吐按整段墙上时间计算
+ */
+BenchResult bench_result_from_samples(const char *name, std::vector<double> &samples_ns, double wall_seconds) {
+    BenchResult result;
+    result.name = name;
+    result.warmup = 0;
+    result.reps = 1;
+    result.ops = (long long)samples_ns.size();
+    result.items = result.ops;
+    result.total_seconds = wall_seconds;
+    result.ops_per_sec = wall_seconds > 0.0 ? result.ops / wall_seconds : 0.0;
+    result.items_per_sec = result.ops_per_sec;
+    result.latency = summarize_latencies(samples_ns);
+    return result;
+}
+
+void bench_print_header() {
+    printf("%-10s %8s %12s %12s %10s %10s %10s %10s %10s\n",
+           "阶段", "操作数", "操作/秒", "行/秒", "p50(us)", "p95(us)", "p99(us)", "p999(us)", "max(us)");
+}
+
+void bench_print(const BenchResult &result) {
+    printf("%-10s %8lld %12.1f %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           result.name.c_str(), result.ops, result.ops_per_sec, result.items_per_sec,
+           result.latency.p50_us, result.latency.p95_us, result.latency.p99_us,
+           result.latency.p999_us, result.latency.max_us);
+}
+
+static std::string json_escape(const char *text) {
+    std::string out;
+    for (const char *p = text ? text : ""; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += (char)c;
+        }
+    }
+    return out;
+}
+
+static std::string pragma_text(sqlite3 *db, const char *sql) {
+    std::string value;
+    sqlite3_stmt *stmt = NULL;
+    if (db && sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+        value = (const char *)sqlite3_column_text(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+/**
+ * 把结果连同 SQLite/SQLCipher 版本与加密参数写成 JSON，便于跨构建对比
+ */
+int bench_write_json(const char *path, sqlite3 *db, const std::vector<BenchResult> &results) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "无法写入基准结果 %s\n", path);
+        return 0;
+    }
+    
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    
+    fprintf(f, "{\n");
+    fprintf(f, "  \"timestamp\": %lld,\n", (long long)time(NULL));
+    fprintf(f, "  \"host\": \"%s\",\n", json_escape(host).c_str());
+    fprintf(f, "  \"sqlite_version\": \"%s\",\n", json_escape(sqlite3_libversion()).c_str());
+    fprintf(f, "  \"cipher_version\": \"%s\",\n", json_escape(pragma_text(db, "PRAGMA cipher_version").c_str()).c_str());
+    fprintf(f, "  \"cipher_provider\": \"%s\",\n", json_escape(pragma_text(db, "PRAGMA cipher_provider").c_str()).c_str());
+    fprintf(f, "  \"kdf_iter\": \"%s\",\n", json_escape(pragma_text(db, "PRAGMA kdf_iter").c_str()).c_str());
+    fprintf(f, "  \"cipher_page_size\": \"%s\",\n", json_escape(pragma_text(db, "PRAGMA cipher_page_size").c_str()).c_str());
+    fprintf(f, "  \"results\": [\n");
+    
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"warmup\": %d, \"reps\": %d, \"ops\": %lld, \"items\": %lld, "
+                   "\"total_seconds\": %.9f, \"ops_per_sec\": %.3f, \"items_per_sec\": %.3f, "
+                   "\"latency_us\": {\"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p95\": %.3f, "
+                   "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}}%s\n",
+                json_escape(r.name.c_str()).c_str(), r.warmup, r.reps, r.ops, r.items,
+                r.total_seconds, r.ops_per_sec, r.items_per_sec,
+                r.latency.mean_us, r.latency.min_us, r.latency.p50_us, r.latency.p95_us,
+                r.latency.p99_us, r.latency.p999_us, r.latency.max_us,
+                i + 1 < results.size() ? "," : "");
+    }
+    
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    return 1;
+}
+
+/*
+ * 单写线程队列
+ */
+MpscQueue::MpscQueue() : head_(&stub_), tail_(&stub_) {
+    stub_.next.store(NULL, std::memory_order_relaxed);
+}
+
+void MpscQueue::push(MpscNode *node) {
+    node->next.store(NULL, std::memory_order_relaxed);
+    MpscNode *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+/**
+ * 取出最早入队的节点；队列为空或生产者正处于 push 中途时返回 NULL
+ */
+MpscNode *MpscQueue::pop() {
+    MpscNode *tail = tail_;
+    MpscNode *next = tail->next.load(std::memory_order_acquire);
+    
+    if (tail == &stub_) {
+        if (!next) {
+            return NULL;
+        }
+        tail_ = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    if (tail != head_.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    
+    push(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    return NULL;
+}
+
+struct WriterQueue::Request : MpscNode {
+    std::string sql;
+    std::vector<BulkValue> params;
+    std::vector<std::string> storage;
+    std::promise<int> done;
+    int rc;
+};
+
+WriterQueue::WriterQueue(const char *db_path, const char *key, const WriterQueueOptions &opts)
+    : path_(db_path), key_(key), opts_(opts), db_(NULL), running_(0), inflight_(0), queued_(0), stopping_(0), sleeping_(0),
+      writes_(0), batches_(0), failed_writes_(0) {
+}
+
+WriterQueue::~WriterQueue() {
+    stop();
+    if (!key_.empty()) {
+        OPENSSL_cleanse(&key_[0], key_.size());
+    }
+}
+
+/**
+ * 打开写连接并启动写线程
+ */
+int WriterQueue::start() {
+    db_ = open_database(path_.c_str(), key_.c_str());
+    if (!db_) {
+        return 0;
+    }
+    stmt_cache_attach(db_, STMT_CACHE_CAPACITY);
+    sqlite3_busy_timeout(db_, 10000);
+    thread_ = std::thread(&WriterQueue::run, this);
+    running_.store(1);
+    return 1;
+}
+
+/**
+ * 停止写线程：已入队的写入会先全部执行完，写线程退出后仍留在队列里的请求以 SQLITE_MISUSE 兑现
+ */
+void WriterQueue::stop() {
+    if (!running_.exchange(0)) {
+        return;
+    }
+    stopping_.store(1);
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        wake_cond_.notify_one();
+    }
+    thread_.join();
+    
+    // 等已通过检查的 submit 完成入队，再把写线程没来得及处理的请求取出
+    while (inflight_.load() > 0) {
+        std::this_thread::yield();
+    }
+    Request *request;
+    while ((request = next_request())) {
+        failed_writes_.fetch_add(1, std::memory_order_relaxed);
+        request->done.set_value(SQLITE_MISUSE);
+        delete request;
+    }
+    close_database(db_);
+    db_ = NULL;
+}
+
+std::future<int> WriterQueue::submit(const char *sql, const BulkValue *params, int nparams) {
+    Request *request = new Request();
+    request->sql = sql;
+    request->rc = SQLITE_OK;
+    request->params.assign(params, params + nparams);
+    request->storage.resize(nparams);
+    for (int i = 0; i < nparams; i++) {
+        BulkValue &value = request->params[i];
+        if ((value.type == BULK_TEXT || value.type == BULK_BLOB) && value.p) {
+            size_t len = value.n >= 0 ? (size_t)value.n : strlen((const char *)value.p);
+            request->storage[i].assign((const char *)value.p, len);
+            value.p = request->storage[i].data();
+            value.n = (int)len;
+        }
+    }
+    
+    std::future<int> result = request->done.get_future();
+    inflight_.fetch_add(1);
+    if (!running_.load()) {
+        inflight_.fetch_sub(1);
+        request->done.set_value(SQLITE_MISUSE);
+        delete request;
+        return result;
+    }
+    queue_.push(request);
+    queued_.fetch_add(1, std::memory_order_release);
+    if (sleeping_.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        wake_cond_.notify_one();
+    }
+    // 最后才离开：stop 等到 inflight_ 归零后才会返回并允许析构
+    inflight_.fetch_sub(1, std::memory_order_release);
+    return result;
+}
+
+WriterQueueStats WriterQueue::stats() const {
+    WriterQueueStats stats = {writes_.load(), batches_.load(), failed_writes_.load()};
+    return stats;
+}
+
+/**
+ * 取下一条请求；生产者 push 到一半时 pop 会短暂返回 NULL，此时自旋等待
+ */
+WriterQueue::Request *WriterQueue::next_request() {
+    if (queued_.load(std::memory_order_acquire) == 0) {
+        return NULL;
+    }
+    MpscNode *node;
+    while (!(node = queue_.pop())) {
+        std::this_thread::yield();
+    }
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+    return static_cast<Request *>(node);
+}
+
+void WriterQueue::wait_for_work(int timeout_us) {
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    sleeping_.store(1, std::memory_order_release);
+    wake_cond_.wait_for(lock, std::chrono::microseconds(timeout_us), [this] {
+        return queued_.load(std::memory_order_acquire) > 0 || stopping_.load();
+    });
+    sleeping_.store(0, std::memory_order_release);
+}
+
+int WriterQueue::execute(Request *request) {
+    sqlite3_stmt *stmt = stmt_cache_acquire(db_, request->sql.c_str());
+    if (!stmt) {
+        fprintf(stderr, "写队列语句准备失败: %s\nSQL语句: %s\n", sqlite3_errmsg(db_), request->sql.c_str());
+        return SQLITE_ERROR;
+    }
+    for (size_t i = 0; i < request->params.size(); i++) {
+        bulk_bind_value(stmt, (int)i + 1, request->params[i], SQLITE_STATIC);
+    }
+    
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    }
+    stmt_cache_release(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * 写线程主循环：等到第一条写入后开启事务，继续收集直到批满或窗口到期，
+ * 然后提交并依次兑现各请求的 future
+ */
+void WriterQueue::run() {
+    std::vector<Request *> batch;
+    batch.reserve(opts_.max_batch);
+    
+    for (;;) {
+        Request *first = next_request();
+        if (!first) {
+            if (stopping_.load()) {
+                break;
+            }
+            wait_for_work(10000);
+            continue;
+        }
+        
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(opts_.max_delay_us);
+        int txn_rc = execute_sql(db_, "BEGIN IMMEDIATE");
+        
+        batch.push_back(first);
+        first->rc = txn_rc == SQLITE_OK ? execute(first) : txn_rc;
+        if (txn_rc == SQLITE_OK && sqlite3_get_autocommit(db_)) {
+            txn_rc = first->rc != SQLITE_OK ? first->rc : SQLITE_ABORT;
+        }
+        
+        while ((int)batch.size() < opts_.max_batch) {
+            Request *request = next_request();
+            if (!request) {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline || stopping_.load()) {
+                    break;
+                }
+                wait_for_work((int)std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count());
+                continue;
+            }
+            batch.push_back(request);
+            request->rc = txn_rc == SQLITE_OK ? execute(request) : txn_rc;
+            
+            // 某些错误会让 SQLite 回滚整个事务，之后的写入不再执行
+            if (txn_rc == SQLITE_OK && sqlite3_get_autocommit(db_)) {
+                txn_rc = request->rc != SQLITE_OK ? request->rc : SQLITE_ABORT;
+            }
+        }
+        
+        if (txn_rc == SQLITE_OK) {
+            txn_rc = execute_sql(db_, "COMMIT");
+            if (txn_rc != SQLITE_OK && !sqlite3_get_autocommit(db_)) {
+                execute_sql(db_, "ROLLBACK");
+            }
+        }
+        
+        // 事务没能提交时，原本成功的写入也一并视为失败
+        for (Request *request : batch) {
+            int rc = request->rc;
+            if (rc == SQLITE_OK && txn_rc != SQLITE_OK) {
+                rc = txn_rc;
+            }
+            if (rc != SQLITE_OK) {
+                failed_writes_.fetch_add(1, std::memory_order_relaxed);
+            }
+            request->done.set_value(rc);
+            delete request;
+        }
+        
+        writes_.fetch_add((long long)batch.size(), std::memory_order_relaxed);
+        batches_.fetch_add(1, std::memory_order_relaxed);
+        batch.clear();
+    }
+}
+
+/*
+ * 协程异步接口
+ */
+Executor::Executor(int threads) : stopping_(0) {
+    for (int i = 0; i < (threads > 0 ? threads : 1); i++) {
+        threads_.emplace_back(&Executor::run, this);
+    }
+}
+
+/**
+ * 执行完队列中已有的工作后退出所有线程
+ */
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = 1;
+    }
+    cond_.notify_all();
+    for (auto &t : threads_) {
+        t.join();
+    }
+}
+
+void Executor::post(std::function<void()> work) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(work));
+    }
+    cond_.notify_one();
+}
+
+void Executor::run() {
+    for (;;) {
+        std::function<void()> work;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            work = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        work();
+    }
+}
+
+static thread_local EventLoop *t_current_loop = NULL;
+
+EventLoop *EventLoop::current() {
+    return t_current_loop;
+}
+
+/**
+ * 持锁通知：循环取走最后一项工作后可能立即退出并被销毁，锁外 notify 会访问已销毁的条件变量
+ */
+void EventLoop::post(std::function<void()> work) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(work));
+    cond_.notify_one();
+}
+
+void EventLoop::run_until(const std::function<bool()> &done, int tick_ms, EventLoopStats *stats) {
+    EventLoop *outer = t_current_loop;
+    t_current_loop = this;
+    memset(stats, 0, sizeof(*stats));
+    
+    double last = now_seconds();
+    while (!done()) {
+        std::deque<std::function<void()> > ready;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait_for(lock, std::chrono::milliseconds(tick_ms), [this] { return !queue_.empty(); });
+            ready.swap(queue_);
+        }
+        for (auto &work : ready) {
+            work();
+            stats->tasks++;
+        }
+        
+        double now = now_seconds();
+        if (now - last > stats->max_gap_seconds) {
+            stats->max_gap_seconds = now - last;
+        }
+        last = now;
+        stats->ticks++;
+    }
+    
+    t_current_loop = outer;
+}
+
+static SqlValue column_value(sqlite3_stmt *stmt, int col) {
+    switch (sqlite3_column_type(stmt, col)) {
+    case SQLITE_INTEGER:
+        return SqlValue(sqlite3_column_int64(stmt, col));
+    case SQLITE_FLOAT:
+        return SqlValue(sqlite3_column_double(stmt, col));
+    case SQLITE_TEXT:
+    case SQLITE_BLOB: {
+        const char *data = (const char *)sqlite3_column_blob(stmt, col);
+        return SqlValue(std::string(data ? data : "", sqlite3_column_bytes(stmt, col)));
+    }
+    default:
+        return SqlValue();
+    }
+}
+
+static SqlRow read_row(sqlite3_stmt *stmt) {
+    int ncols = sqlite3_column_count(stmt);
+    SqlRow row;
+    row.reserve(ncols);
+    for (int c = 0; c < ncols; c++) {
+        row.push_back(column_value(stmt, c));
+    }
+    return row;
+}
+
+/**
+ * 在执行器上打开数据库并设置密钥，失败时返回 NULL
+ */
+Task<sqlite3 *> async_open(Executor &executor, std::string db_path, std::string key) {
+    co_await executor.schedule();
+    sqlite3 *db = open_database(db_path.c_str(), key.c_str());
+    OPENSSL_cleanse(&key[0], key.size());
+    if (db) {
+        stmt_cache_attach(db, STMT_CACHE_CAPACITY);
+    }
+    co_return db;
+}
+
+Task<int> async_exec(Executor &executor, sqlite3 *db, std::string sql) {
+    co_await executor.schedule();
+    co_return execute_sql(db, sql.c_str());
+}
+
+/**
+ * 在执行器上执行查询并收集全部结果行；出错时返回已读到的行并打印错误
+ */
+Task<std::vector<SqlRow> > async_query(Executor &executor, sqlite3 *db, std::string sql) {
+    co_await executor.schedule();
+    
+    std::vector<SqlRow> rows;
+    sqlite3_stmt *stmt = stmt_cache_acquire(db, sql.c_str());
+    int owned = 0;
+    if (!stmt) {
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "查询准备失败: %s\n", sqlite3_errmsg(db));
+            co_return rows;
+        }
+        owned = 1;
+    }
+    
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        rows.push_back(read_row(stmt));
+    }
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "查询失败: %s\nSQL语句: %s\n", sqlite3_errmsg(db), sql.c_str());
+    }
+    
+    if (owned) {
+        sqlite3_finalize(stmt);
+    } else {
+        stmt_cache_release(stmt);
+    }
+    co_return rows;
+}
+
+/**
+ * 流式查询：每批在执行器上 step ASYNC_STREAM_BATCH 行，再逐行 co_yield 给消费者。
+ * 语句独立准备而不走语句缓存，避免流尚未读完时同一语句被其他调用复用。
+ */
+RowStream async_query_stream(Executor &executor, sqlite3 *db, std::string sql) {
+    co_await executor.schedule();
+    
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "查询准备失败: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        co_return;
+    }
+    // 消费者中途放弃并销毁流时也要 finalize
+    std::unique_ptr<sqlite3_stmt, int (*)(sqlite3_stmt *)> stmt_guard(stmt, sqlite3_finalize);
+    
+    std::vector<SqlRow> batch;
+    int rc = SQLITE_ROW;
+    while (rc == SQLITE_ROW) {
+        co_await executor.schedule();
+        batch.clear();
+        while (batch.size() < ASYNC_STREAM_BATCH && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            batch.push_back(read_row(stmt));
+        }
+        for (const SqlRow &row : batch) {
+            co_yield row;
+        }
+    }
+    
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "查询失败: %s\nSQL语句: %s\n", sqlite3_errmsg(db), sql.c_str());
+    }
+}
+
+Task<int> async_close(Executor &executor, sqlite3 *db) {
+    co_await executor.schedule();
+    close_database(db);
+    co_return SQLITE_OK;
+}
+
+/**
+ * 打开并设置密钥后立即读一次 schema：SQLCipher 在首次读页时才用密钥解密并校验 HMAC，
+ * 在工作线程上提前做完，调用方拿到的连接第一次查询不会再付出这部分开销
+ */
+sqlite3 *open_database_keyed(const char *db_path, const char *key) {
+    sqlite3 *db = open_database(db_path, key);
+    if (!db) {
+        return NULL;
+    }
+    int rc = sqlite3_exec(db, "SELECT count(*) FROM sqlite_master", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "密钥校验失败 %s: %s\n", db_path, sqlite3_errmsg(db));
+        close_database(db);
+        return NULL;
+    }
+    stmt_cache_attach(db, STMT_CACHE_CAPACITY);
+    return db;
+}
+
+/**
+ * 每个请求一个执行器任务；同一口令的多个库互不等待，派生结果照常进入派生密钥缓存
+ */
+std::vector<std::future<sqlite3 *> > open_databases_keyed(Executor &executor, std::vector<KeyedOpen> requests) {
+    std::vector<std::future<sqlite3 *> > futures;
+    futures.reserve(requests.size());
+    for (KeyedOpen &request : requests) {
+        auto promise = std::make_shared<std::promise<sqlite3 *> >();
+        futures.push_back(promise->get_future());
+        auto shared = std::make_shared<KeyedOpen>(std::move(request));
+        executor.post([promise, shared] {
+            sqlite3 *db = open_database_keyed(shared->db_path.c_str(), shared->key.c_str());
+            OPENSSL_cleanse(&shared->key[0], shared->key.size());
+            promise->set_value(db);
+        });
+    }
+    return futures;
+}
+
+/*
+ * 分步在线备份
+ *
+ * 每步只复制 pages_per_step 页，步与步之间释放源库的读锁并休眠，
+ * 休眠时长取固定间隔、带宽上限和 CPU 占用上限三者要求的最大值。
+ * 源库被其他连接修改时 SQLite 会在下一步自动从头开始，这里通过
+ * remaining 回升检测并计数；超过 max_restarts 后一次性复制剩余页以保证结束。
+ * 通过源连接本身的修改会直接同步到目标库，不会导致重新开始。
+ */
+void paced_backup_default_options(PacedBackupOptions *opts) {
+    opts->pages_per_step = (int)option_int("backup-pages", BACKUP_PAGES_PER_STEP);
+    opts->sleep_us = (int)option_int("backup-sleep-us", BACKUP_SLEEP_US);
+    opts->max_bytes_per_sec = option_int("backup-bps", 0);
+    opts->max_cpu_fraction = atof(option_str("backup-cpu", "1.0"));
+    opts->max_restarts = BACKUP_MAX_RESTARTS;
+    opts->progress = NULL;
+    opts->progress_ctx = NULL;
+}
+
+static double thread_cpu_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * 默认进度输出：每跨过 10% 打印一次
+ */
+static void print_backup_progress(int remaining, int pagecount, int restarts, int *last_decile) {
+    if (pagecount <= 0) {
+        return;
+    }
+    int decile = (pagecount - remaining) * 10 / pagecount;
+    if (decile != *last_decile) {
+        *last_decile = decile;
+        printf("备份进度: %d%% (%d/%d 页, 重新开始 %d 次)\n",
+               decile * 10, pagecount - remaining, pagecount, restarts);
+    }
+}
+
+int paced_backup(sqlite3 *dest, sqlite3 *src, const PacedBackupOptions *opts, PacedBackupStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    
+    sqlite3_backup *backup = sqlite3_backup_init(dest, "main", src, "main");
+    if (!backup) {
+        fprintf(stderr, "备份初始化失败: %s\n", sqlite3_errmsg(dest));
+        return sqlite3_errcode(dest);
+    }
+    
+    long long page_size = 4096;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(src, "PRAGMA page_size", -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        page_size = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    
+    int pages_per_step = opts->pages_per_step > 0 ? opts->pages_per_step : BACKUP_PAGES_PER_STEP;
+    double start = now_seconds();
+    int last_remaining = -1;
+    int last_decile = -1;
+    int rc;
+    
+    for (;;) {
+        // 重新开始次数用尽后不再分步，一次性复制剩余页
+        int step_pages = stats->restarts > opts->max_restarts ? -1 : pages_per_step;
+        double cpu_before = thread_cpu_seconds();
+        rc = sqlite3_backup_step(backup, step_pages);
+        double cpu_used = thread_cpu_seconds() - cpu_before;
+        stats->steps++;
+        
+        int remaining = sqlite3_backup_remaining(backup);
+        int pagecount = sqlite3_backup_pagecount(backup);
+        if (last_remaining >= 0) {
+            if (remaining > last_remaining) {
+                stats->restarts++;
+            } else {
+                stats->bytes += (long long)(last_remaining - remaining) * page_size;
+            }
+        } else {
+            stats->bytes += (long long)(pagecount - remaining) * page_size;
+        }
+        last_remaining = remaining;
+        stats->pagecount = pagecount;
+        
+        if (opts->progress) {
+            opts->progress(opts->progress_ctx, remaining, pagecount, stats->restarts);
+        } else {
+            print_backup_progress(remaining, pagecount, stats->restarts, &last_decile);
+        }
+        
+        if (rc == SQLITE_DONE) {
+            rc = SQLITE_OK;
+            break;
+        }
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) {
+            fprintf(stderr, "备份步骤失败: %d\n", rc);
+            break;
+        }
+        
+        // 步间休眠：固定间隔、带宽上限、CPU 占用上限取最大
+        double sleep_s = opts->sleep_us / 1e6;
+        if (opts->max_bytes_per_sec > 0) {
+            double due = (double)stats->bytes / opts->max_bytes_per_sec - (now_seconds() - start);
+            if (due > sleep_s) {
+                sleep_s = due;
+            }
+        }
+        if (opts->max_cpu_fraction > 0.0 && opts->max_cpu_fraction < 1.0) {
+            double idle = cpu_used * (1.0 - opts->max_cpu_fraction) / opts->max_cpu_fraction;
+            if (idle > sleep_s) {
+                sleep_s = idle;
+            }
+        }
+        if (sleep_s > 0.0) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(sleep_s));
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    
+    int finish_rc = sqlite3_backup_finish(backup);
+    if (rc == SQLITE_OK && finish_rc != SQLITE_OK) {
+        fprintf(stderr, "备份完成失败: %d\n", finish_rc);
+        rc = finish_rc;
+    }
+    stats->seconds = now_seconds() - start;
+    return rc;
+}
+
+/*
+ * 在线换密钥
+ *
+ * 1. 状态文件记为 copy，把源库分步备份到 "<库>-rekey"（新密钥）；
+ * 2. 持 RESERVED 写锁检查 PRAGMA data_version：复制期间没有其他连接提交则副本一致，
+ *    否则释放锁重做一轮，REKEY_MAX_ROUNDS 轮后持锁完成最后一轮；
+ * 3. 状态文件记为 swap 并记录源文件大小和修改时间，rename 原子替换，删除状态文件。
+ * 中断后重新调用：copy 阶段丢弃副本从头复制；swap 阶段若源文件未被改动则直接完成替换。
+ * 副本与源库使用同一种 KDF 及参数，Argon2id 库的附属文件内容不变，只 rename 数据库文件即可。
+ * 只支持回滚日志模式，WAL 模式下旧文件的 -wal/-shm 会被新文件沿用。
+ *
+ * rename 之后仍打开着的连接指向已 unlink 的旧 inode：写入得到 SQLITE_READONLY_DBMOVED，
+ * 读取却照常返回旧数据而不报错。本进程的连接池按 database_generation 丢弃替换前打开的连接，
+ * 借出前再用 SQLITE_FCNTL_HAS_MOVED 比对 inode；连接池之外自行持有的连接需由调用方重新打开。
+ * 其他进程的连接不受本进程控制：换密钥前应让它们关闭连接，或在每次使用前自行检查
+ * SQLITE_FCNTL_HAS_MOVED，否则会在替换后继续读到旧文件的内容。
+ */
+void online_rekey_default_options(OnlineRekeyOptions *opts) {
+    paced_backup_default_options(&opts->backup);
+    opts->max_rounds = (int)option_int("rekey-rounds", REKEY_MAX_ROUNDS);
+    opts->lock_timeout_ms = REKEY_LOCK_TIMEOUT_MS;
+}
+
+static int fsync_parent_dir(const std::string &path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+static long long file_mtime_ns(const struct stat *st) {
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/**
+ * 原子写状态文件：先写临时文件并 fsync，再 rename 覆盖
+ */
+static int write_rekey_state(const std::string &state_path, const char *phase, const struct stat *src) {
+    std::string tmp = state_path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        return -1;
+    }
+    fprintf(f, "phase=%s\nsize=%lld\nmtime=%lld\n", phase,
+            src ? (long long)src->st_size : -1LL, src ? file_mtime_ns(src) : -1LL);
+    int rc = fflush(f) == 0 && fsync(fileno(f)) == 0 ? 0 : -1;
+    fclose(f);
+    if (rc == 0) {
+        rc = rename(tmp.c_str(), state_path.c_str());
+    }
+    return rc == 0 ? fsync_parent_dir(state_path) : rc;
+}
+
+static int read_rekey_state(const std::string &state_path, std::string *phase, long long *size, long long *mtime) {
+    FILE *f = fopen(state_path.c_str(), "r");
+    if (!f) {
+        return 0;
+    }
+    char buf[32] = {0};
+    int n = fscanf(f, "phase=%31s size=%lld mtime=%lld", buf, size, mtime);
+    fclose(f);
+    *phase = buf;
+    return n == 3;
+}
+
+static long long pragma_data_version(sqlite3 *db) {
+    sqlite3_stmt *stmt = NULL;
+    long long version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+/**
+ * 持源库写锁时替换文件
+ */
+static int rekey_swap(const char *db_path, const std::string &tmp_path, const std::string &state_path) {
+    struct stat st;
+    if (stat(db_path, &st) != 0 || write_rekey_state(state_path, "swap", &st) != 0) {
+        fprintf(stderr, "写入换密钥状态失败: %s\n", state_path.c_str());
+        return SQLITE_IOERR;
+    }
+    if (rename(tmp_path.c_str(), db_path) != 0 || fsync_parent_dir(db_path) != 0) {
+        fprintf(stderr, "替换数据库文件失败: %s\n", db_path);
+        return SQLITE_IOERR;
+    }
+    database_generation_bump(db_path);
+    remove(state_path.c_str());
+    fsync_parent_dir(state_path);
+    return SQLITE_OK;
+}
+
+int online_rekey(const char *db_path, const char *old_key, const char *new_key,
+                 const OnlineRekeyOptions *opts, OnlineRekeyStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    double start = now_seconds();
+    std::string tmp_path = std::string(db_path) + "-rekey";
+    std::string state_path = tmp_path + ".state";
+    
+    std::string phase;
+    long long state_size = -1, state_mtime = -1;
+    int have_state = read_rekey_state(state_path, &phase, &state_size, &state_mtime);
+    stats->resumed = have_state;
+    struct stat tmp_st;
+    int have_tmp = stat(tmp_path.c_str(), &tmp_st) == 0;
+    if (have_state && phase == "swap" && !have_tmp) {
+        // 上次已完成 rename，只差删除状态文件
+        database_generation_bump(db_path);
+        remove(state_path.c_str());
+        kdf_sidecar_remove(tmp_path.c_str());
+        key_cache_invalidate(db_path);
+        stats->seconds = now_seconds() - start;
+        return SQLITE_OK;
+    }
+    
+    // src 用于备份读取；写锁由另一条连接持有，源连接自身处于写事务时备份会返回 SQLITE_LOCKED
+    sqlite3 *src = open_database(db_path, old_key);
+    sqlite3 *lock_db = src ? open_database(db_path, old_key) : NULL;
+    if (!src || !lock_db) {
+        close_database(src);
+        return SQLITE_CANTOPEN;
+    }
+    sqlite3_busy_timeout(lock_db, opts->lock_timeout_ms);
+    std::string journal_mode = pragma_text(src, "PRAGMA journal_mode");
+    if (journal_mode == "wal") {
+        fprintf(stderr, "在线换密钥不支持 WAL 模式，请先切换为 DELETE 日志模式: %s\n", db_path);
+        close_database(src);
+        close_database(lock_db);
+        return SQLITE_MISUSE;
+    }
+    
+    int rc;
+    double lock_start = now_seconds();
+    if (have_state && phase == "swap") {
+        // 副本已完整写入；源文件自记录以来未被改动才能直接替换
+        rc = execute_sql(lock_db, "BEGIN IMMEDIATE");
+        struct stat st;
+        if (rc == SQLITE_OK && stat(db_path, &st) == 0 &&
+            (long long)st.st_size == state_size && file_mtime_ns(&st) == state_mtime) {
+            rc = rekey_swap(db_path, tmp_path, state_path);
+            if (rc == SQLITE_OK) {
+                kdf_sidecar_remove(tmp_path.c_str());
+            }
+            execute_sql(lock_db, "COMMIT");
+            stats->lock_seconds = now_seconds() - lock_start;
+            close_database(src);
+            close_database(lock_db);
+            key_cache_invalidate(db_path);
+            key_cache_invalidate(tmp_path.c_str());
+            stats->seconds = now_seconds() - start;
+            return rc;
+        }
+        if (rc == SQLITE_OK) {
+            execute_sql(lock_db, "COMMIT");
+        }
+        printf("源库在中断后被修改，重新复制\n");
+    }
+    
+    // 副本不完整或已过期，从头复制；PBKDF2 库的副本绕过缓存建库，不受 --kdf=argon2id 影响，
+    // 并沿用源库登记的非默认 PBKDF2 参数，替换后按原路径登记的参数派生的密钥才对得上
+    remove(tmp_path.c_str());
+    remove((tmp_path + "-journal").c_str());
+    kdf_sidecar_remove(tmp_path.c_str());
+    key_cache_invalidate(tmp_path.c_str());
+    Argon2Params argon2;
+    int use_argon2 = kdf_sidecar_read(db_path, &argon2);
+    if (use_argon2 < 0) {
+        close_database(src);
+        close_database(lock_db);
+        return SQLITE_CORRUPT;
+    }
+    CipherSettings kdf_settings = {0, 0, NULL, NULL, -1};
+    std::string kdf_algorithm;
+    if (key_cache_get_kdf(db_path, &kdf_settings.kdf_iter, &kdf_algorithm)) {
+        kdf_settings.kdf_algorithm = kdf_algorithm.c_str();
+    }
+    sqlite3 *dest = NULL;
+    if (write_rekey_state(state_path, "copy", NULL) != 0 ||
+        !(dest = use_argon2 ? open_database_argon2(tmp_path.c_str(), new_key, &argon2)
+                            : open_database_with_settings(tmp_path.c_str(), new_key, &kdf_settings))) {
+        key_cache_set_kdf(tmp_path.c_str(), 0, NULL);
+        close_database(src);
+        close_database(lock_db);
+        return SQLITE_CANTOPEN;
+    }
+    
+    int consistent = 0;
+    for (stats->rounds = 1; ; stats->rounds++) {
+        long long version = pragma_data_version(src);
+        rc = paced_backup(dest, src, &opts->backup, &stats->backup);
+        if (rc != SQLITE_OK) {
+            break;
+        }
+        
+        lock_start = now_seconds();
+        rc = execute_sql(lock_db, "BEGIN IMMEDIATE");
+        if (rc != SQLITE_OK) {
+            break;
+        }
+        consistent = pragma_data_version(src) == version;
+        if (consistent || stats->rounds >= opts->max_rounds) {
+            break;
+        }
+        execute_sql(lock_db, "COMMIT");
+        stats->lock_seconds += now_seconds() - lock_start;
+        printf("复制期间源库被修改，第 %d 轮重新复制\n", stats->rounds + 1);
+    }
+    
+    if (rc == SQLITE_OK && !consistent) {
+        // 写入一直不停：持写锁一次性完成最后一轮，持锁期间分步只会拉长写阻塞，读操作不受影响
+        PacedBackupOptions locked = opts->backup;
+        locked.max_restarts = -1;
+        stats->locked_copy = 1;
+        rc = paced_backup(dest, src, &locked, &stats->backup);
+    }
+    close_database(dest);
+    key_cache_set_kdf(tmp_path.c_str(), 0, NULL);
+    
+    if (rc == SQLITE_OK) {
+        rc = rekey_swap(db_path, tmp_path, state_path);
+    }
+    if (rc == SQLITE_OK) {
+        kdf_sidecar_remove(tmp_path.c_str());
+    }
+    if (!sqlite3_get_autocommit(lock_db)) {
+        execute_sql(lock_db, "COMMIT");
+        stats->lock_seconds += now_seconds() - lock_start;
+    }
+    close_database(src);
+    close_database(lock_db);
+    
+    key_cache_invalidate(db_path);
+    key_cache_invalidate(tmp_path.c_str());
+    stats->seconds = now_seconds() - start;
+    return rc;
+}
+
+/*
+ * 明文转加密迁移
+ */
+// 一批行：values 按行连续存放，文本/BLOB 的字节保存在 storage 中，deque 扩容不移动已有元素
+struct MigrationBatch {
+    size_t table;
+    int ncols;
+    long long rows;
+    long long last_rowid;
+    long long bytes;
+    int last;                       // 该表的最后一批（可能没有行）
+    std::vector<BulkValue> values;
+    std::deque<std::string> storage;
+};
+
+struct MigrationTable {
+    std::string name;
+    std::string create_sql;
+    int has_rowid;
+    std::vector<std::string> columns;       // 插入列，rowid 表以 "rowid" 开头
+    int resume;                     // 进度表中有已提交的位置
+    long long resume_after;
+    int done;
+    long long total_rows;
+};
+
+struct MigrationPipeline {
+    const char *plain_path;
+    const MigrationOptions *opts;
+    std::vector<MigrationTable> tables;
+    std::atomic<size_t> next_table;
+    std::atomic<int> failed;
+    
+    // 读线程与写线程之间的有界队列
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::deque<std::unique_ptr<MigrationBatch>> queue;
+    int active_readers;
+};
+
+void migration_default_options(MigrationOptions *opts) {
+    opts->readers = (int)option_int("migrate-readers", MIGRATE_READERS);
+    opts->batch_rows = (int)option_int("migrate-batch", MIGRATE_BATCH_ROWS);
+    opts->queue_depth = MIGRATE_QUEUE_DEPTH;
+    opts->progress = 1;
+}
+
+static int migration_push(MigrationPipeline *pipe, std::unique_ptr<MigrationBatch> batch) {
+    std::unique_lock<std::mutex> lock(pipe->mutex);
+    pipe->not_full.wait(lock, [pipe] {
+        return pipe->queue.size() < (size_t)pipe->opts->queue_depth || pipe->failed.load();
+    });
+    if (pipe->failed.load()) {
+        return 0;
+    }
+    pipe->queue.push_back(std::move(batch));
+    pipe->not_empty.notify_one();
+    return 1;
+}
+
+// 队列空且读线程全部结束时返回空指针
+static std::unique_ptr<MigrationBatch> migration_pop(MigrationPipeline *pipe) {
+    std::unique_lock<std::mutex> lock(pipe->mutex);
+    pipe->not_empty.wait(lock, [pipe] { return !pipe->queue.empty() || pipe->active_readers == 0; });
+    if (pipe->queue.empty()) {
+        return NULL;
+    }
+    std::unique_ptr<MigrationBatch> batch = std::move(pipe->queue.front());
+    pipe->queue.pop_front();
+    pipe->not_full.notify_one();
+    return batch;
+}
+
+static void migration_fail(MigrationPipeline *pipe) {
+    std::lock_guard<std::mutex> lock(pipe->mutex);
+    pipe->failed = 1;
+    pipe->not_full.notify_all();
+    pipe->not_empty.notify_all();
+}
+
+static std::unique_ptr<MigrationBatch> new_migration_batch(size_t table, int ncols, int batch_rows) {
+    std::unique_ptr<MigrationBatch> batch(new MigrationBatch());
+    batch->table = table;
+    batch->ncols = ncols;
+    batch->rows = 0;
+    batch->last_rowid = 0;
+    batch->bytes = 0;
+    batch->last = 0;
+    batch->values.reserve((size_t)batch_rows * ncols);
+    return batch;
+}
+
+/**
+ * 读一张表：rowid 表按 rowid 顺序从进度位置之后读，WITHOUT ROWID 表整表读
+ */
+static int migration_read_table(MigrationPipeline *pipe, sqlite3 *db, size_t index) {
+    const MigrationTable &table = pipe->tables[index];
+    std::string sql = "SELECT ";
+    for (size_t c = 0; c < table.columns.size(); c++) {
+        sql += (c ? ", " : "") + (table.has_rowid && c == 0 ? std::string("rowid") : quote_identifier(table.columns[c].c_str()));
+    }
+    sql += " FROM " + quote_identifier(table.name.c_str());
+    if (table.has_rowid) {
+        sql += table.resume ? " WHERE rowid > ?1 ORDER BY rowid" : " ORDER BY rowid";
+    }
+    
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "准备读取失败: %s\nSQL语句: %s\n", sqlite3_errmsg(db), sql.c_str());
+        return rc;
+    }
+    if (table.resume) {
+        sqlite3_bind_int64(stmt, 1, table.resume_after);
+    }
+    
+    int ncols = (int)table.columns.size();
+    int batch_rows = pipe->opts->batch_rows;
+    std::unique_ptr<MigrationBatch> batch = new_migration_batch(index, ncols, batch_rows);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        for (int c = 0; c < ncols; c++) {
+            BulkValue value;
+            memset(&value, 0, sizeof(value));
+            switch (sqlite3_column_type(stmt, c)) {
+                case SQLITE_INTEGER:
+                    value.type = BULK_INT64;
+                    value.i = sqlite3_column_int64(stmt, c);
+                    batch->bytes += 8;
+                    break;
+                case SQLITE_FLOAT:
+                    value.type = BULK_DOUBLE;
+                    value.d = sqlite3_column_double(stmt, c);
+                    batch->bytes += 8;
+                    break;
+                case SQLITE_TEXT:
+                case SQLITE_BLOB: {
+                    int is_text = sqlite3_column_type(stmt, c) == SQLITE_TEXT;
+                    const void *data = is_text ? (const void *)sqlite3_column_text(stmt, c) : sqlite3_column_blob(stmt, c);
+                    int n = sqlite3_column_bytes(stmt, c);
+                    batch->storage.push_back(std::string((const char *)data, n));
+                    value.type = is_text ? BULK_TEXT : BULK_BLOB;
+                    value.p = batch->storage.back().data();
+                    value.n = n;
+                    batch->bytes += n;
+                    break;
+                }
+                default:
+                    value.type = BULK_NULL;
+                    break;
+            }
+            batch->values.push_back(value);
+        }
+        if (table.has_rowid) {
+            batch->last_rowid = sqlite3_column_int64(stmt, 0);
+        }
+        if (++batch->rows == batch_rows) {
+            if (!migration_push(pipe, std::move(batch))) {
+                sqlite3_finalize(stmt);
+                return SQLITE_ABORT;
+            }
+            batch = new_migration_batch(index, ncols, batch_rows);
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "读取表 %s 失败: %s\n", table.name.c_str(), sqlite3_errmsg(db));
+        return rc;
+    }
+    
+    batch->last = 1;
+    return migration_push(pipe, std::move(batch)) ? SQLITE_OK : SQLITE_ABORT;
+}
+
+static void migration_reader_main(MigrationPipeline *pipe) {
+    sqlite3 *db = open_database(pipe->plain_path, "");
+    if (!db) {
+        migration_fail(pipe);
+    }
+    
+    size_t i;
+    while (db && !pipe->failed.load() && (i = pipe->next_table.fetch_add(1)) < pipe->tables.size()) {
+        if (pipe->tables[i].done) {
+            continue;
+        }
+        // 整个表在一个读事务里，读到的是一致快照
+        execute_sql(db, "BEGIN");
+        int rc = migration_read_table(pipe, db, i);
+        execute_sql(db, "COMMIT");
+        if (rc != SQLITE_OK) {
+            migration_fail(pipe);
+        }
+    }
+    close_database(db);
+    
+    std::lock_guard<std::mutex> lock(pipe->mutex);
+    pipe->active_readers--;
+    pipe->not_empty.notify_all();
+}
+
+static int migration_batch_row(void *ctx, long long row, BulkValue *values) {
+    const MigrationBatch *batch = (const MigrationBatch *)ctx;
+    if (row >= batch->rows) {
+        return 0;
+    }
+    memcpy(values, &batch->values[(size_t)row * batch->ncols], sizeof(BulkValue) * batch->ncols);
+    return 1;
+}
+
+/**
+ * 写入一批：数据与进度在同一个事务里提交，中断后从最后提交的 rowid 继续
+ */
+static int migration_write_batch(sqlite3 *db, MigrationPipeline *pipe, MigrationBatch *batch) {
+    MigrationTable &table = pipe->tables[batch->table];
+    int rc = execute_sql(db, "BEGIN");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    if (batch->rows > 0) {
+        std::vector<const char *> names;
+        for (size_t c = 0; c < table.columns.size(); c++) {
+            names.push_back(table.columns[c].c_str());
+        }
+        BulkInsertOptions bulk = {0, 0};
+        rc = bulk_insert_generated(db, table.name.c_str(), names.data(), (int)names.size(),
+                                   migration_batch_row, batch, &bulk, NULL);
+    }
+    
+    sqlite3_stmt *stmt = NULL;
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "UPDATE _migration_progress SET rows_done = rows_done + ?1, "
+                                    "last_rowid = coalesce(?2, last_rowid), done = ?3 WHERE name = ?4",
+                                -1, &stmt, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, batch->rows);
+        if (table.has_rowid && batch->rows > 0) {
+            sqlite3_bind_int64(stmt, 2, batch->last_rowid);
+        }
+        sqlite3_bind_int(stmt, 3, batch->last);
+        sqlite3_bind_text(stmt, 4, table.name.c_str(), -1, SQLITE_TRANSIENT);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+    }
+    sqlite3_finalize(stmt);
+    
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "写入表 %s 失败: %s\n", table.name.c_str(), sqlite3_errmsg(db));
+        execute_sql(db, "ROLLBACK");
+        return rc;
+    }
+    rc = execute_sql(db, "COMMIT");
+    if (rc == SQLITE_OK && batch->last) {
+        table.done = 1;
+    }
+    return rc;
+}
+
+static long long query_int64(sqlite3 *db, const std::string &sql, long long default_value) {
+    sqlite3_stmt *stmt = NULL;
+    long long value = default_value;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+/**
+ * 读取明文库的表结构和行数，确定每张表的插入列
+ */
+static int migration_load_schema(sqlite3 *plain, std::vector<MigrationTable> *tables) {
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(plain, "SELECT name, sql FROM sqlite_master WHERE type='table' "
+                                       "AND name NOT LIKE 'sqlite_%' ORDER BY name", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "读取明文库结构失败: %s\n", sqlite3_errmsg(plain));
+        return rc;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        MigrationTable table;
+        table.name = (const char *)sqlite3_column_text(stmt, 0);
+        table.create_sql = (const char *)sqlite3_column_text(stmt, 1);
+        table.resume = 0;
+        table.resume_after = 0;
+        table.done = 0;
+        tables->push_back(table);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        return rc;
+    }
+    
+    for (size_t t = 0; t < tables->size(); t++) {
+        MigrationTable &table = (*tables)[t];
+        std::string quoted = quote_identifier(table.name.c_str());
+        std::string probe = "SELECT rowid FROM " + quoted + " LIMIT 0";
+        table.has_rowid = sqlite3_prepare_v2(plain, probe.c_str(), -1, &stmt, NULL) == SQLITE_OK;
+        sqlite3_finalize(stmt);
+        if (table.has_rowid) {
+            // 显式写入 rowid，迁移后 rowid 与明文库一致
+            table.columns.push_back("rowid");
+        }
+        
+        // table_info 不含生成列，生成列由目标库自行计算
+        rc = sqlite3_prepare_v2(plain, "SELECT name FROM pragma_table_info(?1) ORDER BY cid", -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        sqlite3_bind_text(stmt, 1, table.name.c_str(), -1, SQLITE_TRANSIENT);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            table.columns.push_back((const char *)sqlite3_column_text(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+        
+        table.total_rows = query_int64(plain, "SELECT count(*) FROM " + quoted, 0);
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * 首次迁移建表并写入进度表；再次调用时从进度表恢复位置，未完成的 WITHOUT ROWID 表清空重来
+ */
+static int migration_prepare_target(sqlite3 *target, std::vector<MigrationTable> *tables, int *resumed) {
+    *resumed = query_int64(target, "SELECT count(*) FROM sqlite_master WHERE name = '_migration_progress'", 0) > 0;
+    int rc = execute_sql(target, "BEGIN");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    if (!*resumed) {
+        rc = execute_sql(target, "CREATE TABLE _migration_progress (name TEXT PRIMARY KEY, "
+                                 "last_rowid INTEGER, rows_done INTEGER NOT NULL DEFAULT 0, done INTEGER NOT NULL DEFAULT 0)");
+    }
+    
+    for (size_t t = 0; rc == SQLITE_OK && t < tables->size(); t++) {
+        MigrationTable &table = (*tables)[t];
+        std::string quoted = quote_identifier(table.name.c_str());
+        sqlite3_stmt *stmt = NULL;
+        
+        if (!*resumed) {
+            rc = sqlite3_prepare_v2(target, "SELECT 1 FROM sqlite_master WHERE type='table' AND name = ?1", -1, &stmt, NULL);
+            if (rc != SQLITE_OK) {
+                break;
+            }
+            sqlite3_bind_text(stmt, 1, table.name.c_str(), -1, SQLITE_TRANSIENT);
+            int exists = sqlite3_step(stmt) == SQLITE_ROW;
+            sqlite3_finalize(stmt);
+            stmt = NULL;
+            if (exists) {
+                fprintf(stderr, "目标库中已存在表 %s\n", table.name.c_str());
+                rc = SQLITE_CONSTRAINT;
+                break;
+            }
+            rc = execute_sql(target, table.create_sql.c_str());
+            if (rc == SQLITE_OK) {
+                rc = sqlite3_prepare_v2(target, "INSERT INTO _migration_progress (name) VALUES (?1)", -1, &stmt, NULL);
+            }
+            if (rc == SQLITE_OK) {
+                sqlite3_bind_text(stmt, 1, table.name.c_str(), -1, SQLITE_TRANSIENT);
+                rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(target);
+            }
+            sqlite3_finalize(stmt);
+            continue;
+        }
+        
+        rc = sqlite3_prepare_v2(target, "SELECT last_rowid, done FROM _migration_progress WHERE name = ?1", -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            break;
+        }
+        sqlite3_bind_text(stmt, 1, table.name.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            fprintf(stderr, "进度表中没有表 %s，明文库结构已改变\n", table.name.c_str());
+            rc = SQLITE_MISMATCH;
+        } else {
+            table.done = sqlite3_column_int(stmt, 1);
+            table.resume = sqlite3_column_type(stmt, 0) != SQLITE_NULL;
+            table.resume_after = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        
+        if (rc == SQLITE_OK && !table.done && !table.has_rowid) {
+            rc = execute_sql(target, ("DELETE FROM " + quoted).c_str());
+        }
+    }
+    
+    if (rc != SQLITE_OK) {
+        execute_sql(target, "ROLLBACK");
+        return rc;
+    }
+    return execute_sql(target, "COMMIT");
+}
+
+/**
+ * 数据写完后建索引、触发器、视图，同步 AUTOINCREMENT 计数，最后删除进度表
+ */
+static int migration_finish_schema(sqlite3 *plain, sqlite3 *target) {
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(plain, "SELECT name, sql FROM sqlite_master WHERE type IN ('index', 'trigger', 'view') "
+                                       "AND sql IS NOT NULL ORDER BY CASE type WHEN 'index' THEN 0 ELSE 1 END", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    rc = execute_sql(target, "BEGIN");
+    while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+        sqlite3_stmt *exists = NULL;
+        int found = 0;
+        if (sqlite3_prepare_v2(target, "SELECT 1 FROM sqlite_master WHERE name = ?1", -1, &exists, NULL) == SQLITE_OK) {
+            sqlite3_bind_text(exists, 1, name, -1, SQLITE_TRANSIENT);
+            found = sqlite3_step(exists) == SQLITE_ROW;
+        }
+        sqlite3_finalize(exists);
+        if (!found) {
+            rc = execute_sql(target, (const char *)sqlite3_column_text(stmt, 1));
+        }
+    }
+    sqlite3_finalize(stmt);
+    
+    // sqlite_sequence 只在存在 AUTOINCREMENT 表时才有
+    if (rc == SQLITE_OK && query_int64(plain, "SELECT count(*) FROM sqlite_master WHERE name = 'sqlite_sequence'", 0) > 0) {
+        rc = sqlite3_prepare_v2(plain, "SELECT name, seq FROM sqlite_sequence", -1, &stmt, NULL);
+        while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+            sqlite3_stmt *update = NULL;
+            rc = sqlite3_prepare_v2(target, "UPDATE sqlite_sequence SET seq = max(seq, ?2) WHERE name = ?1", -1, &update, NULL);
+            if (rc == SQLITE_OK) {
+                sqlite3_bind_text(update, 1, (const char *)sqlite3_column_text(stmt, 0), -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int64(update, 2, sqlite3_column_int64(stmt, 1));
+                rc = sqlite3_step(update) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(target);
+            }
+            sqlite3_finalize(update);
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    if (rc == SQLITE_OK) {
+        rc = execute_sql(target, "DROP TABLE _migration_progress");
+    }
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "迁移后建索引失败: %s\n", sqlite3_errmsg(target));
+        execute_sql(target, "ROLLBACK");
+        return rc;
+    }
+    return execute_sql(target, "COMMIT");
+}
+
+int migrate_plaintext_database(const char *plain_path, const char *target_path, const char *key,
+                               const MigrationOptions *opts, MigrationStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    double start = now_seconds();
+    
+    sqlite3 *plain = open_database(plain_path, "");
+    sqlite3 *target = plain ? open_database(target_path, key) : NULL;
+    if (!plain || !target) {
+        close_database(plain);
+        return SQLITE_CANTOPEN;
+    }
+    
+    MigrationPipeline pipe;
+    pipe.plain_path = plain_path;
+    pipe.opts = opts;
+    pipe.next_table = 0;
+    pipe.failed = 0;
+    pipe.active_readers = 0;
+    
+    int rc = migration_load_schema(plain, &pipe.tables);
+    if (rc == SQLITE_OK) {
+        rc = migration_prepare_target(target, &pipe.tables, &stats->resumed);
+    }
+    if (rc != SQLITE_OK) {
+        close_database(plain);
+        close_database(target);
+        return rc;
+    }
+    stats->tables = (int)pipe.tables.size();
+    
+    long long total_rows = 0, base_rows = 0;
+    for (size_t t = 0; t < pipe.tables.size(); t++) {
+        total_rows += pipe.tables[t].total_rows;
+    }
+    if (stats->resumed) {
+        base_rows = query_int64(target, "SELECT sum(rows_done) FROM _migration_progress", 0);
+        printf("从上次中断处继续迁移: 已完成 %lld/%lld 行\n", base_rows, total_rows);
+    }
+    
+    int nreaders = std::max(1, std::min(opts->readers, (int)pipe.tables.size()));
+    pipe.active_readers = nreaders;
+    std::vector<std::thread> readers;
+    for (int r = 0; r < nreaders; r++) {
+        readers.push_back(std::thread(migration_reader_main, &pipe));
+    }
+    
+    // 本线程是唯一的写线程
+    int last_decile = -1;
+    std::unique_ptr<MigrationBatch> batch;
+    while ((batch = migration_pop(&pipe))) {
+        double write_start = now_seconds();
+        rc = migration_write_batch(target, &pipe, batch.get());
+        stats->write_seconds += now_seconds() - write_start;
+        if (rc != SQLITE_OK) {
+            migration_fail(&pipe);
+            break;
+        }
+        stats->rows += batch->rows;
+        stats->bytes += batch->bytes;
+        
+        if (opts->progress && total_rows > 0) {
+            int decile = (int)((base_rows + stats->rows) * 10 / total_rows);
+            if (decile != last_decile) {
+                last_decile = decile;
+                printf("迁移进度: %d%% (%lld/%lld 行, %.0f 行/秒)\n", decile * 10, base_rows + stats->rows,
+                       total_rows, stats->rows / std::max(now_seconds() - start, 1e-9));
+            }
+        }
+    }
+    for (size_t r = 0; r < readers.size(); r++) {
+        readers[r].join();
+    }
+    if (rc == SQLITE_OK && pipe.failed.load()) {
+        rc = SQLITE_ABORT;
+    }
+    
+    if (rc == SQLITE_OK) {
+        double index_start = now_seconds();
+        rc = migration_finish_schema(plain, target);
+        stats->index_seconds = now_seconds() - index_start;
+    }
+    
+    close_database(plain);
+    close_database(target);
+    stats->seconds = now_seconds() - start;
+    return rc;
+}
+
+void migration_print_report(const MigrationStats *stats) {
+    double seconds = std::max(stats->seconds, 1e-9);
+    printf("迁移完成: %d 张表, %lld 行, %.1f MB, 耗时 %.3f 秒 (建索引 %.3f 秒)%s\n",
+           stats->tables, stats->rows, stats->bytes / 1048576.0, stats->seconds, stats->index_seconds,
+           stats->resumed ? ", 续传" : "");
+    printf("吞吐: %.0f 行/秒, %.1f MB/秒; 写线程忙碌 %.0f%%\n",
+           stats->rows / seconds, stats->bytes / 1048576.0 / seconds,
+           100.0 * stats->write_seconds / std::max(stats->seconds - stats->index_seconds, 1e-9));
+}
+
+/*
+ * 全局预算页缓存
+ *
+ * 每个 pager 的缓存（xCreate）有自己的页表和未钉住页 LRU，页表由缓存自身的互斥锁保护；
+ * 可淘汰的未钉住页同时挂在按 (缓存, 页号) 散列的分片 LRU 上。新建页超出全局预算时，
+ * 从分片 LRU 尾部淘汰任意连接的未钉住页；对其他缓存只 try_lock，避免与其持有者互锁。
+ */
+struct PcachePage;
+
+struct PcacheCache {
+    std::mutex mutex;
+    int sz_page;
+    int sz_extra;
+    int purgeable;
+    unsigned max_pages;
+    std::unordered_map<unsigned, PcachePage *> pages;
+    PcachePage *own_head;           // 本缓存未钉住页的 LRU，头部最新
+    PcachePage *own_tail;
+};
+
+struct PcachePage {
+    sqlite3_pcache_page base;
+    PcacheCache *cache;
+    unsigned key;
+    int pinned;
+    size_t shard;
+    PcachePage *lru_prev;           // 分片 LRU，受分片锁保护
+    PcachePage *lru_next;
+    PcachePage *own_prev;           // 缓存 LRU，受缓存锁保护
+    PcachePage *own_next;
+};
+
+struct PcacheShard {
+    std::mutex mutex;
+    PcachePage *head;
+    PcachePage *tail;
+};
+
+static struct {
+    int installed;
+    size_t budget;
+    std::atomic<size_t> bytes;
+    std::atomic<long long> loads;
+    std::atomic<long long> hits;
+    std::atomic<long long> evictions;
+    PcacheShard shards[PCACHE_SHARDS];
+} g_pcache;
+
+static size_t pcache_page_bytes(const PcacheCache *cache) {
+    return sizeof(PcachePage) + cache->sz_page + cache->sz_extra;
+}
+
+static void pcache_shard_push(PcachePage *page) {
+    PcacheShard &shard = g_pcache.shards[page->shard];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    page->lru_prev = NULL;
+    page->lru_next = shard.head;
+    if (shard.head) {
+        shard.head->lru_prev = page;
+    } else {
+        shard.tail = page;
+    }
+    shard.head = page;
+}
+
+// 调用方持有分片锁
+static void pcache_shard_unlink_locked(PcachePage *page) {
+    PcacheShard &shard = g_pcache.shards[page->shard];
+    if (page->lru_prev) {
+        page->lru_prev->lru_next = page->lru_next;
+    } else {
+        shard.head = page->lru_next;
+    }
+    if (page->lru_next) {
+        page->lru_next->lru_prev = page->lru_prev;
+    } else {
+        shard.tail = page->lru_prev;
+    }
+}
+
+static void pcache_shard_unlink(PcachePage *page) {
+    std::lock_guard<std::mutex> lock(g_pcache.shards[page->shard].mutex);
+    pcache_shard_unlink_locked(page);
+}
+
+// 以下 own_* 与 pcache_free_page 由持有缓存锁的调用方使用
+static void pcache_own_push(PcacheCache *cache, PcachePage *page) {
+    page->own_prev = NULL;
+    page->own_next = cache->own_head;
+    if (cache->own_head) {
+        cache->own_head->own_prev = page;
+    } else {
+        cache->own_tail = page;
+    }
+    cache->own_head = page;
+}
+
+static void pcache_own_unlink(PcacheCache *cache, PcachePage *page) {
+    if (page->own_prev) {
+        page->own_prev->own_next = page->own_next;
+    } else {
+        cache->own_head = page->own_next;
+    }
+    if (page->own_next) {
+        page->own_next->own_prev = page->own_prev;
+    } else {
+        cache->own_tail = page->own_prev;
+    }
+}
+
+static void pcache_free_page(PcacheCache *cache, PcachePage *page) {
+    cache->pages.erase(page->key);
+    g_pcache.bytes -= pcache_page_bytes(cache);
+    free(page);
+}
+
+// 移除一个页：未钉住的可淘汰页先从两条 LRU 上摘下
+static void pcache_discard_page(PcacheCache *cache, PcachePage *page, int shard_locked) {
+    if (!page->pinned && cache->purgeable) {
+        if (shard_locked) {
+            pcache_shard_unlink_locked(page);
+        } else {
+            pcache_shard_unlink(page);
+        }
+        pcache_own_unlink(cache, page);
+    }
+    pcache_free_page(cache, page);
+}
+
+/**
+ * 从各分片 LRU 尾部淘汰未钉住页，直到能放下 needed 字节；调用方持有 self 的缓存锁
+ */
+static int pcache_evict_global(PcacheCache *self, size_t start_shard, size_t needed) {
+    for (size_t n = 0; n < PCACHE_SHARDS && g_pcache.bytes + needed > g_pcache.budget; n++) {
+        PcacheShard &shard = g_pcache.shards[(start_shard + n) % PCACHE_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        PcachePage *page = shard.tail;
+        while (page && g_pcache.bytes + needed > g_pcache.budget) {
+            PcachePage *prev = page->lru_prev;
+            PcacheCache *owner = page->cache;
+            if (owner == self) {
+                pcache_discard_page(owner, page, 1);
+                g_pcache.evictions++;
+            } else if (owner->mutex.try_lock()) {
+                pcache_discard_page(owner, page, 1);
+                owner->mutex.unlock();
+                g_pcache.evictions++;
+            }
+            page = prev;
+        }
+    }
+    return g_pcache.bytes + needed <= g_pcache.budget;
+}
+
+static int pcache_init(void *) {
+    return SQLITE_OK;
+}
+
+static void pcache_shutdown(void *) {
+}
+
+static sqlite3_pcache *pcache_create(int sz_page, int sz_extra, int purgeable) {
+    PcacheCache *cache = new PcacheCache();
+    cache->sz_page = sz_page;
+    cache->sz_extra = sz_extra;
+    cache->purgeable = purgeable;
+    cache->max_pages = 0;
+    cache->own_head = NULL;
+    cache->own_tail = NULL;
+    return (sqlite3_pcache *)cache;
+}
+
+static void pcache_cachesize(sqlite3_pcache *p, int n) {
+    PcacheCache *cache = (PcacheCache *)p;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->max_pages = n > 0 ? (unsigned)n : 0;
+}
+
+static int pcache_pagecount(sqlite3_pcache *p) {
+    PcacheCache *cache = (PcacheCache *)p;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    return (int)cache->pages.size();
+}
+
+static sqlite3_pcache_page *pcache_fetch(sqlite3_pcache *p, unsigned key, int create_flag) {
+    PcacheCache *cache = (PcacheCache *)p;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    
+    auto it = cache->pages.find(key);
+    if (it != cache->pages.end()) {
+        PcachePage *page = it->second;
+        if (!page->pinned && cache->purgeable) {
+            pcache_shard_unlink(page);
+            pcache_own_unlink(cache, page);
+        }
+        page->pinned = 1;
+        g_pcache.hits++;
+        return &page->base;
+    }
+    if (create_flag == 0) {
+        return NULL;
+    }
+    
+    // 连接自身 cache_size 已满时优先回收它自己最久未用的页
+    if (cache->purgeable && cache->max_pages && cache->pages.size() >= cache->max_pages) {
+        if (cache->own_tail) {
+            pcache_discard_page(cache, cache->own_tail, 0);
+        } else if (create_flag == 1) {
+            return NULL;
+        }
+    }
+    
+    size_t shard = (std::hash<const void *>()(cache) ^ (key * 0x9e3779b1u)) % PCACHE_SHARDS;
+    size_t size = pcache_page_bytes(cache);
+    if (g_pcache.bytes + size > g_pcache.budget && !pcache_evict_global(cache, shard, size) && create_flag == 1) {
+        // 预算不足且没有可淘汰的页：返回 NULL 让 pager 先溢出脏页，再以 create_flag=2 重试
+        return NULL;
+    }
+    
+    PcachePage *page = (PcachePage *)malloc(size);
+    if (!page) {
+        return NULL;
+    }
+    page->base.pBuf = (void *)(page + 1);
+    page->base.pExtra = (char *)page->base.pBuf + cache->sz_page;
+    memset(page->base.pExtra, 0, cache->sz_extra);
+    page->cache = cache;
+    page->key = key;
+    page->pinned = 1;
+    page->shard = shard;
+    cache->pages[key] = page;
+    g_pcache.bytes += size;
+    g_pcache.loads++;
+    return &page->base;
+}
+
+static void pcache_unpin(sqlite3_pcache *p, sqlite3_pcache_page *pg, int discard) {
+    PcacheCache *cache = (PcacheCache *)p;
+    PcachePage *page = (PcachePage *)pg;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    if (discard) {
+        pcache_discard_page(cache, page, 0);
+        return;
+    }
+    page->pinned = 0;
+    if (cache->purgeable) {
+        pcache_own_push(cache, page);
+        pcache_shard_push(page);
+    }
+}
+
+static void pcache_rekey(sqlite3_pcache *p, sqlite3_pcache_page *pg, unsigned old_key, unsigned new_key) {
+    PcacheCache *cache = (PcacheCache *)p;
+    PcachePage *page = (PcachePage *)pg;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    auto it = cache->pages.find(new_key);
+    if (it != cache->pages.end()) {
+        pcache_discard_page(cache, it->second, 0);
+    }
+    cache->pages.erase(old_key);
+    page->key = new_key;
+    cache->pages[new_key] = page;
+}
+
+static void pcache_truncate(sqlite3_pcache *p, unsigned limit) {
+    PcacheCache *cache = (PcacheCache *)p;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    std::vector<PcachePage *> doomed;
+    for (auto it = cache->pages.begin(); it != cache->pages.end(); ++it) {
+        if (it->first >= limit) {
+            doomed.push_back(it->second);
+        }
+    }
+    for (size_t i = 0; i < doomed.size(); i++) {
+        pcache_discard_page(cache, doomed[i], 0);
+    }
+}
+
+static void pcache_destroy(sqlite3_pcache *p) {
+    pcache_truncate(p, 0);
+    delete (PcacheCache *)p;
+}
+
+static void pcache_shrink(sqlite3_pcache *p) {
+    PcacheCache *cache = (PcacheCache *)p;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    while (cache->own_tail) {
+        pcache_discard_page(cache, cache->own_tail, 0);
+    }
+}
+
+int shared_pcache_install(size_t budget_bytes) {
+    static const sqlite3_pcache_methods2 methods = {
+        1, NULL, pcache_init, pcache_shutdown, pcache_create, pcache_cachesize, pcache_pagecount,
+        pcache_fetch, pcache_unpin, pcache_rekey, pcache_truncate, pcache_destroy, pcache_shrink
+    };
+    g_pcache.budget = budget_bytes;
+    int rc = sqlite3_config(SQLITE_CONFIG_PCACHE2, &methods);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "安装页缓存失败: %d（需在 SQLite 初始化前调用）\n", rc);
+        return rc;
+    }
+    g_pcache.installed = 1;
+    return SQLITE_OK;
+}
+
+int shared_pcache_installed() {
+    return g_pcache.installed;
+}
+
+void shared_pcache_stats(SharedPcacheStats *stats) {
+    stats->budget = g_pcache.budget;
+    stats->bytes = g_pcache.bytes.load();
+    stats->loads = g_pcache.loads.load();
+    stats->hits = g_pcache.hits.load();
+    stats->evictions = g_pcache.evictions.load();
+}
+
+/*
+ * 启动时内存池与内存剖析
+ */
+static int parse_int_pair(const char *text, int *a, int *b) {
+    return text && sscanf(text, "%d,%d", a, b) == 2 && *a > 0 && *b > 0;
+}
+
+int memory_arenas_configure(const MemoryArenaConfig *config) {
+    // 内存池在进程生命周期内一直由 SQLite 使用，不释放
+    static void *pagecache_mem = NULL;
+    static void *heap_mem = NULL;
+    int rc = SQLITE_OK;
+    
+    if (config->heap_bytes > INT_MAX) {
+        // SQLITE_CONFIG_HEAP 的大小参数是 int，截断后 SQLite 只会用到一小部分甚至得到负数
+        fprintf(stderr, "堆内存池过大: %lld 字节，SQLITE_CONFIG_HEAP 最多 %d 字节\n", config->heap_bytes, INT_MAX);
+        return SQLITE_RANGE;
+    }
+    
+    if (config->pagecache_slot_size > 0 && config->pagecache_slots > 0) {
+        if (config->pcache_budget > 0) {
+            printf("已安装自定义页缓存，SQLITE_CONFIG_PAGECACHE 不会被使用，跳过\n");
+        } else {
+            int slot = (config->pagecache_slot_size + 7) & ~7;
+            pagecache_mem = aligned_alloc(8, (size_t)slot * config->pagecache_slots);
+            rc = pagecache_mem ? sqlite3_config(SQLITE_CONFIG_PAGECACHE, pagecache_mem, slot, config->pagecache_slots)
+                               : SQLITE_NOMEM;
+            if (rc != SQLITE_OK) {
+                fprintf(stderr, "配置页缓存内存池失败: %d\n", rc);
+                return rc;
+            }
+            printf("页缓存内存池: %d 个 %d 字节槽, 共 %.1f MB\n", config->pagecache_slots, slot,
+                   (double)slot * config->pagecache_slots / 1048576.0);
+        }
+    }
+    
+    if (config->lookaside_slot_size > 0 && config->lookaside_slots > 0) {
+        if (sqlite3_compileoption_used("OMIT_LOOKASIDE")) {
+            printf("SQLite 以 SQLITE_OMIT_LOOKASIDE 编译，跳过 lookaside 配置\n");
+        } else {
+            rc = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, config->lookaside_slot_size, config->lookaside_slots);
+            if (rc != SQLITE_OK) {
+                fprintf(stderr, "配置 lookaside 失败: %d\n", rc);
+                return rc;
+            }
+            printf("每连接 lookaside: %d 个 %d 字节槽\n", config->lookaside_slots, config->lookaside_slot_size);
+        }
+    }
+    
+    if (config->heap_bytes > 0) {
+        if (!sqlite3_compileoption_used("ENABLE_MEMSYS5") && !sqlite3_compileoption_used("ENABLE_MEMSYS3")) {
+            printf("SQLite 未启用 MEMSYS5/MEMSYS3，SQLITE_CONFIG_HEAP 不可用，继续使用系统 malloc\n");
+        } else {
+            heap_mem = aligned_alloc(8, (size_t)config->heap_bytes);
+            rc = heap_mem ? sqlite3_config(SQLITE_CONFIG_HEAP, heap_mem, (int)config->heap_bytes, config->heap_min_alloc)
+                          : SQLITE_NOMEM;
+            if (rc != SQLITE_OK) {
+                fprintf(stderr, "配置堆内存池失败: %d\n", rc);
+                return rc;
+            }
+            printf("堆内存池: %.1f MB, 最小分配 %d 字节\n", config->heap_bytes / 1048576.0, config->heap_min_alloc);
+        }
+    }
+    return rc;
+}
+
+int memory_arenas_configure_from_options() {
+    MemoryArenaConfig config;
+    memset(&config, 0, sizeof(config));
+    parse_int_pair(option_str("pagecache", NULL), &config.pagecache_slot_size, &config.pagecache_slots);
+    parse_int_pair(option_str("lookaside", NULL), &config.lookaside_slot_size, &config.lookaside_slots);
+    config.heap_bytes = option_int("heap-mb", 0) << 20;
+    config.heap_min_alloc = 64;
+    config.pcache_budget = (size_t)option_int("pcache-mb", 0) << 20;
+    return memory_arenas_configure(&config);
+}
+
+// 关闭连接时采样的每连接峰值
+static struct {
+    std::mutex mutex;
+    int enabled;
+    long long connections;
+    long long cache_used;           // 单个连接页缓存字节数的最大值
+    long long schema_used;
+    long long stmt_used;
+    long long lookaside_used;       // 单个连接 lookaside 槽位高水位的最大值
+    long long lookaside_hit;
+    long long lookaside_miss_size;
+    long long lookaside_miss_full;
+} g_memory_profile;
+
+static int db_status_value(sqlite3 *db, int op, int highwater) {
+    int current = 0, high = 0;
+    sqlite3_db_status(db, op, &current, &high, 0);
+    return highwater ? high : current;
+}
+
+/**
+ * 连接关闭前记录其内存用量（剖析开启时由 close_database 调用）
+ */
+void memory_profile_sample(sqlite3 *db) {
+    if (!g_memory_profile.enabled) {
+        return;
+    }
+    // 关闭前缓存未清空，当前值接近该连接的峰值
+    long long cache = db_status_value(db, SQLITE_DBSTATUS_CACHE_USED, 0);
+    long long schema = db_status_value(db, SQLITE_DBSTATUS_SCHEMA_USED, 0);
+    long long stmt = db_status_value(db, SQLITE_DBSTATUS_STMT_USED, 0);
+    long long lookaside = db_status_value(db, SQLITE_DBSTATUS_LOOKASIDE_USED, 1);
+    
+    std::lock_guard<std::mutex> lock(g_memory_profile.mutex);
+    g_memory_profile.connections++;
+    g_memory_profile.cache_used = std::max(g_memory_profile.cache_used, cache);
+    g_memory_profile.schema_used = std::max(g_memory_profile.schema_used, schema);
+    g_memory_profile.stmt_used = std::max(g_memory_profile.stmt_used, stmt);
+    g_memory_profile.lookaside_used = std::max(g_memory_profile.lookaside_used, lookaside);
+    g_memory_profile.lookaside_hit += db_status_value(db, SQLITE_DBSTATUS_LOOKASIDE_HIT, 1);
+    g_memory_profile.lookaside_miss_size += db_status_value(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, 1);
+    g_memory_profile.lookaside_miss_full += db_status_value(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, 1);
+}
+
+static void memory_profile_reset() {
+    std::lock_guard<std::mutex> lock(g_memory_profile.mutex);
+    g_memory_profile.connections = 0;
+    g_memory_profile.cache_used = 0;
+    g_memory_profile.schema_used = 0;
+    g_memory_profile.stmt_used = 0;
+    g_memory_profile.lookaside_used = 0;
+    g_memory_profile.lookaside_hit = 0;
+    g_memory_profile.lookaside_miss_size = 0;
+    g_memory_profile.lookaside_miss_full = 0;
+}
+
+static sqlite3_int64 status_highwater(int op) {
+    sqlite3_int64 current = 0, high = 0;
+    sqlite3_status64(op, &current, &high, 0);
+    return high;
+}
+
+// 进程级高水位与每连接峰值，按工作负载取最大值汇总
+struct MemoryProfile {
+    sqlite3_int64 memory_used;
+    sqlite3_int64 malloc_size;
+    sqlite3_int64 malloc_count;
+    sqlite3_int64 pagecache_size;   // 最大的页缓存分配（页 + pcache 头）
+    sqlite3_int64 pagecache_used;   // 内存池中使用的槽位
+    sqlite3_int64 pagecache_overflow;   // 未能放进内存池、改用 malloc 的字节数
+    long long connections;
+    long long cache_used;
+    long long schema_used;
+    long long stmt_used;
+    long long lookaside_used;
+    long long lookaside_hit;
+    long long lookaside_miss_size;
+    long long lookaside_miss_full;
+};
+
+static void memory_profile_collect(MemoryProfile *out) {
+    out->memory_used = status_highwater(SQLITE_STATUS_MEMORY_USED);
+    out->malloc_size = status_highwater(SQLITE_STATUS_MALLOC_SIZE);
+    out->malloc_count = status_highwater(SQLITE_STATUS_MALLOC_COUNT);
+    out->pagecache_size = status_highwater(SQLITE_STATUS_PAGECACHE_SIZE);
+    out->pagecache_used = status_highwater(SQLITE_STATUS_PAGECACHE_USED);
+    out->pagecache_overflow = status_highwater(SQLITE_STATUS_PAGECACHE_OVERFLOW);
+    
+    std::lock_guard<std::mutex> lock(g_memory_profile.mutex);
+    out->connections = g_memory_profile.connections;
+    out->cache_used = g_memory_profile.cache_used;
+    out->schema_used = g_memory_profile.schema_used;
+    out->stmt_used = g_memory_profile.stmt_used;
+    out->lookaside_used = g_memory_profile.lookaside_used;
+    out->lookaside_hit = g_memory_profile.lookaside_hit;
+    out->lookaside_miss_size = g_memory_profile.lookaside_miss_size;
+    out->lookaside_miss_full = g_memory_profile.lookaside_miss_full;
+}
+
+static void memory_profile_merge(MemoryProfile *total, const MemoryProfile *p) {
+    total->memory_used = std::max(total->memory_used, p->memory_used);
+    total->malloc_size = std::max(total->malloc_size, p->malloc_size);
+    total->malloc_count = std::max(total->malloc_count, p->malloc_count);
+    total->pagecache_size = std::max(total->pagecache_size, p->pagecache_size);
+    total->pagecache_used = std::max(total->pagecache_used, p->pagecache_used);
+    total->pagecache_overflow = std::max(total->pagecache_overflow, p->pagecache_overflow);
+    total->connections += p->connections;
+    total->cache_used = std::max(total->cache_used, p->cache_used);
+    total->schema_used = std::max(total->schema_used, p->schema_used);
+    total->stmt_used = std::max(total->stmt_used, p->stmt_used);
+    total->lookaside_used = std::max(total->lookaside_used, p->lookaside_used);
+    total->lookaside_hit += p->lookaside_hit;
+    total->lookaside_miss_size += p->lookaside_miss_size;
+    total->lookaside_miss_full += p->lookaside_miss_full;
+}
+
+/**
+ * 由剖析结果推荐内存池大小：
+ * 页缓存槽 = 最大页缓存分配，槽数 = 目标连接数 × 单连接峰值页数 × 余量；
+ * lookaside 槽数 = 单连接槽位高水位 × 余量，按尺寸未命中占比决定是否加大槽；
+ * 堆 = 2 × 目标连接数 × 单连接峰值（memsys5 按 2 的幂分配，碎片上限约为 2 倍）
+ */
+static void memory_profile_recommend(const MemoryProfile *p, int target) {
+    printf("\n按 %d 个并发连接推荐（余量 %.0f%%）:\n", target, (ARENA_HEADROOM - 1.0) * 100);
+    std::string flags;
+    char buf[128];
+    
+    if (p->pagecache_size > 0) {
+        int slot = (int)((p->pagecache_size + 7) & ~7LL);
+        long long pages = (p->cache_used + slot - 1) / slot;
+        int slots = (int)std::max(16.0, ceil(target * pages * ARENA_HEADROOM));
+        printf("  页缓存: 每槽 %d 字节, 单连接峰值 %lld 页, 共 %d 槽 (%.1f MB)\n",
+               slot, pages, slots, (double)slot * slots / 1048576.0);
+        snprintf(buf, sizeof(buf), " --pagecache=%d,%d", slot, slots);
+        flags += buf;
+    } else {
+        printf("  页缓存: 未观测到默认页缓存的分配（已安装自定义页缓存？）\n");
+    }
+    
+    if (sqlite3_compileoption_used("OMIT_LOOKASIDE")) {
+        printf("  lookaside: SQLite 以 SQLITE_OMIT_LOOKASIDE 编译，不适用\n");
+    } else {
+        int slot = ARENA_LOOKASIDE_SLOT;
+        long long attempts = p->lookaside_hit + p->lookaside_miss_size;
+        double miss_size_ratio = attempts ? (double)p->lookaside_miss_size / attempts : 0.0;
+        if (miss_size_ratio > 0.10) {
+            slot *= 2;
+        }
+        int slots = (int)std::max(16.0, ceil(p->lookaside_used * ARENA_HEADROOM));
+        printf("  lookaside: 单连接高水位 %lld 槽, 尺寸未命中 %.1f%%, 槽满未命中 %lld 次 -> %d 个 %d 字节槽\n",
+               p->lookaside_used, miss_size_ratio * 100, p->lookaside_miss_full, slots, slot);
+        snprintf(buf, sizeof(buf), " --lookaside=%d,%d", slot, slots);
+        flags += buf;
+    }
+    
+    long long per_connection = p->cache_used + p->schema_used + p->stmt_used;
+    long long heap = std::max((long long)p->memory_used, (long long)target * per_connection) * 2;
+    int heap_mb = (int)((heap + (1 << 20) - 1) >> 20);
+    if (sqlite3_compileoption_used("ENABLE_MEMSYS5") || sqlite3_compileoption_used("ENABLE_MEMSYS3")) {
+        printf("  堆: 单连接峰值 %.1f KB, 进程峰值 %.1f MB -> %d MB\n",
+               per_connection / 1024.0, p->memory_used / 1048576.0, heap_mb);
+        snprintf(buf, sizeof(buf), " --heap-mb=%d", heap_mb);
+        flags += buf;
+    } else {
+        printf("  堆: 未启用 MEMSYS5/MEMSYS3；若启用，建议 %d MB\n", heap_mb);
+    }
+    printf("建议启动参数:%s\n", flags.c_str());
+}
+
+/**
+ * 内存剖析：依次运行各工作负载，记录进程级高水位和每连接峰值，并给出内存池大小建议
+ */
+int profile_memory_arenas() {
+    printf("\n--- 内存池剖析 ---\n");
+    
+    // 内存统计由 main 在 sqlite3_initialize 之前开启，初始化之后再调用 SQLITE_CONFIG_MEMSTATUS 只会得到 SQLITE_MISUSE
+    g_memory_profile.enabled = 1;
+    
+    struct {
+        const char *name;
+        int (*fn)();
+    } workloads[] = {
+        {"basic", test_basic_operations},
+        {"performance", test_performance},
+        {"conversion", test_database_conversion},
+        {"migration", test_database_migration},
+        {"backup", test_backup_restore},
+        {"concurrency", test_concurrency},
+        {"writer-queue", bench_writer_queue},
+    };
+    
+    MemoryProfile total;
+    memset(&total, 0, sizeof(total));
+    std::vector<std::pair<const char *, MemoryProfile>> rows;
+    int ok = 1;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        remove(TEST_DB);
+        kdf_sidecar_remove(TEST_DB);
+        remove(TEST_DB_COPY);
+        kdf_sidecar_remove(TEST_DB_COPY);
+        remove(PLAINTEXT_DB);
+        key_cache_clear();
+        memory_profile_reset();
+        sqlite3_int64 current, high;
+        int reset_ops[] = {SQLITE_STATUS_MEMORY_USED, SQLITE_STATUS_MALLOC_SIZE, SQLITE_STATUS_MALLOC_COUNT,
+                           SQLITE_STATUS_PAGECACHE_SIZE, SQLITE_STATUS_PAGECACHE_USED, SQLITE_STATUS_PAGECACHE_OVERFLOW};
+        for (size_t r = 0; r < sizeof(reset_ops) / sizeof(reset_ops[0]); r++) {
+            sqlite3_status64(reset_ops[r], &current, &high, 1);
+        }
+        
+        int result = workloads[w].fn();
+        // 池中的连接在这里关闭，才能被采样
+        connection_pool_shutdown_all();
+        ok &= result;
+        
+        MemoryProfile profile;
+        memory_profile_collect(&profile);
+        memory_profile_merge(&total, &profile);
+        rows.push_back(std::make_pair(workloads[w].name, profile));
+    }
+    g_memory_profile.enabled = 0;
+    
+    printf("\n%-14s %10s %10s %10s %8s %10s %6s %12s %10s %10s\n", "workload", "peak(MB)", "max-alloc",
+           "allocs", "pc-slot", "pc-ovf(MB)", "conns", "cache/conn", "stmt/conn", "la-slots");
+    for (size_t r = 0; r < rows.size(); r++) {
+        const MemoryProfile &p = rows[r].second;
+        printf("%-14s %10.2f %10lld %10lld %8lld %10.2f %6lld %10.1fKB %8.1fKB %10lld\n", rows[r].first,
+               p.memory_used / 1048576.0, (long long)p.malloc_size, (long long)p.malloc_count,
+               (long long)p.pagecache_size, p.pagecache_overflow / 1048576.0, p.connections,
+               p.cache_used / 1024.0, p.stmt_used / 1024.0, p.lookaside_used);
+    }
+    if (total.pagecache_used > 0) {
+        printf("页缓存内存池峰值使用 %lld 槽%s\n", (long long)total.pagecache_used,
+               total.pagecache_overflow > 0 ? "，仍有溢出到 malloc 的分配" : "，没有溢出");
+    }
+    
+    memory_profile_recommend(&total, (int)option_int("connections", ARENA_TARGET_CONNECTIONS));
+    return ok;
+}
+
+/*
+ * 包装 unix VFS 时取得底层文件描述符：经 xSetSystemCall 替换 unix VFS 的 open()，
+ * 在外层 xOpen 调用期间记录本线程为该路径新开的描述符，不依赖 unixFile 的内部布局
+ */
+static sqlite3_syscall_ptr g_shim_unix_open;
+static thread_local const char *t_shim_open_path;
+static thread_local int t_shim_open_fd;
+
+static int shim_unix_open(const char *path, int flags, int mode) {
+    int fd = ((int (*)(const char *, int, int))g_shim_unix_open)(path, flags, mode);
+    if (fd >= 0 && t_shim_open_path && strcmp(path, t_shim_open_path) == 0) {
+        t_shim_open_fd = fd;
+    }
+    return fd;
+}
+
+/**
+ * 在 base 的系统调用表中挂上 open() 钩子（所有 unix VFS 共用一张表，只挂一次）；
+ * base 不支持替换系统调用时返回 0。须在其他线程使用 SQLite 之前调用
+ */
+static int shim_install_open_hook(sqlite3_vfs *base) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (g_shim_unix_open) {
+        return 1;
+    }
+    if (base->iVersion < 3 || !base->xGetSystemCall || !base->xSetSystemCall) {
+        return 0;
+    }
+    g_shim_unix_open = base->xGetSystemCall(base, "open");
+    if (!g_shim_unix_open || base->xSetSystemCall(base, "open", (sqlite3_syscall_ptr)shim_unix_open) != SQLITE_OK) {
+        g_shim_unix_open = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * 用 base 打开文件并取得它为该文件新开的描述符，再用 fstat/stat 核对；
+ * 未挂钩子、unix VFS 复用了暂存的描述符没有调用 open()、或核对不上时 *fd 为 -1
+ */
+static int shim_open_with_fd(sqlite3_vfs *base, const char *name, sqlite3_file *real, int flags, int *out_flags, int *fd) {
+    *fd = -1;
+    t_shim_open_path = g_shim_unix_open ? name : NULL;
+    t_shim_open_fd = -1;
+    int rc = base->xOpen(base, name, real, flags, out_flags);
+    int opened = t_shim_open_fd;
+    t_shim_open_path = NULL;
+    if (rc != SQLITE_OK || opened < 0) {
+        return rc;
+    }
+    struct stat by_fd, by_path;
+    if (fstat(opened, &by_fd) == 0 && stat(name, &by_path) == 0 &&
+        by_fd.st_dev == by_path.st_dev && by_fd.st_ino == by_path.st_ino) {
+        *fd = opened;
+    }
+    return rc;
+}
+
+/*
+ * io_uring VFS
+ */
+// 直接用系统调用操作的最小 io_uring 环
+struct UringRing {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned queued;                // 已填写、尚未提交的 SQE
+    unsigned inflight;              // 已提交、尚未收割的 SQE
+};
+
+// 环和注册好的暂存区；每个事务都会新建日志文件，所以关闭后放回池里复用
+struct UringSlot {
+    UringRing ring;
+    char *staging;
+    int fixed;                      // 暂存区已注册为固定缓冲区
+};
+
+struct UringFile {
+    sqlite3_file base;
+    sqlite3_file *real;             // 默认 VFS 的文件对象，紧跟在本结构之后
+    int fd;                         // -1 表示全部交给默认 VFS
+    int dir_sync;                   // 新建的日志/WAL 首次 xSync 时交给默认 VFS 同步目录
+    UringSlot *slot;
+    size_t staging_used;
+};
+
+static struct {
+    int registered;
+    int available;
+    sqlite3_vfs vfs;
+    sqlite3_vfs *base;
+    std::atomic<long long> files;
+    std::atomic<long long> fallback_files;
+    std::atomic<long long> reads;
+    std::atomic<long long> writes;
+    std::atomic<long long> fsyncs;
+    std::atomic<long long> submits;
+    std::mutex pool_mutex;
+    std::vector<UringSlot *> pool;
+} g_uring;
+
+static void uring_teardown(UringRing *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static int uring_setup(UringRing *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+    
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_map_size = ring->cq_map_size = std::max(ring->sq_map_size, ring->cq_map_size);
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            uring_teardown(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+    
+    char *sq = (char *)ring->sq_map;
+    char *cq = (char *)ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// 取一个空闲 SQE，队列已满时返回 NULL
+static struct io_uring_sqe *uring_get_sqe(UringRing *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->queued;
+    if (tail - head >= ring->entries || ring->inflight + ring->queued >= ring->entries) {
+        return NULL;
+    }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+/**
+ * 提交全部排队的 SQE 并等待所有在途请求完成；
+ * 每个 SQE 的 user_data 是期望的字节数，结果不符时返回 SQLITE_IOERR
+ */
+static int uring_submit_and_drain(UringRing *ring, int *short_io) {
+    if (ring->queued) {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+        ring->inflight += ring->queued;
+    }
+    unsigned to_submit = ring->queued;
+    ring->queued = 0;
+    
+    int rc = SQLITE_OK;
+    while (ring->inflight > 0) {
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return SQLITE_IOERR;
+        }
+        to_submit = 0;
+        g_uring.submits++;
+        
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->res < 0) {
+                rc = SQLITE_IOERR;
+            } else if ((unsigned long long)cqe->res != cqe->user_data) {
+                if (short_io) {
+                    *short_io = cqe->res;
+                } else {
+                    rc = SQLITE_IOERR;
+                }
+            }
+            ring->inflight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return rc;
+}
+
+/**
+ * 提交暂存的写入；其他文件操作之前都要先调用，保证读、锁和共享内存看到的是已写入的数据
+ */
+static int uring_flush(UringFile *file) {
+    if (file->fd < 0 || (file->slot->ring.queued == 0 && file->slot->ring.inflight == 0)) {
+        return SQLITE_OK;
+    }
+    int rc = uring_submit_and_drain(&file->slot->ring, NULL);
+    file->staging_used = 0;
+    return rc == SQLITE_OK ? SQLITE_OK : SQLITE_IOERR_WRITE;
+}
+
+static UringSlot *uring_slot_acquire() {
+    {
+        std::lock_guard<std::mutex> lock(g_uring.pool_mutex);
+        if (!g_uring.pool.empty()) {
+            UringSlot *slot = g_uring.pool.back();
+            g_uring.pool.pop_back();
+            return slot;
+        }
+    }
+    
+    UringSlot *slot = new UringSlot();
+    if (uring_setup(&slot->ring, URING_QUEUE_DEPTH) != 0) {
+        delete slot;
+        return NULL;
+    }
+    slot->staging = (char *)aligned_alloc(4096, URING_STAGING_BYTES);
+    if (!slot->staging) {
+        uring_teardown(&slot->ring);
+        delete slot;
+        return NULL;
+    }
+    // 注册失败（如 RLIMIT_MEMLOCK 太小）时退回普通 IORING_OP_WRITE
+    struct iovec iov = {slot->staging, URING_STAGING_BYTES};
+    slot->fixed = syscall(__NR_io_uring_register, slot->ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return slot;
+}
+
+// 出过错的环可能还有未收割的请求，直接销毁
+static void uring_slot_release(UringSlot *slot, int reusable) {
+    if (reusable && slot->ring.queued == 0 && slot->ring.inflight == 0) {
+        std::lock_guard<std::mutex> lock(g_uring.pool_mutex);
+        if (g_uring.pool.size() < URING_POOL_SIZE) {
+            g_uring.pool.push_back(slot);
+            return;
+        }
+    }
+    uring_teardown(&slot->ring);
+    free(slot->staging);
+    delete slot;
+}
+
+static int uring_close(sqlite3_file *f) {
+    UringFile *file = (UringFile *)f;
+    int rc = uring_flush(file);
+    if (file->fd >= 0) {
+        uring_slot_release(file->slot, rc == SQLITE_OK);
+    }
+    int close_rc = file->real->pMethods->xClose(file->real);
+    return rc == SQLITE_OK ? close_rc : rc;
+}
+
+static int uring_read(sqlite3_file *f, void *buf, int amt, sqlite3_int64 offset) {
+    UringFile *file = (UringFile *)f;
+    if (file->fd < 0) {
+        return file->real->pMethods->xRead(file->real, buf, amt, offset);
+    }
+    int rc = uring_flush(file);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    int done = 0;
+    while (done < amt) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&file->slot->ring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = file->fd;
+        sqe->addr = (unsigned long long)(uintptr_t)((char *)buf + done);
+        sqe->len = amt - done;
+        sqe->off = offset + done;
+        sqe->user_data = amt - done;
+        int got = amt - done;
+        if (uring_submit_and_drain(&file->slot->ring, &got) != SQLITE_OK) {
+            return SQLITE_IOERR_READ;
+        }
+        g_uring.reads++;
+        if (got == 0) {
+            // 读到文件末尾：SQLite 要求把剩余部分填零并返回 SHORT_READ
+            memset((char *)buf + done, 0, amt - done);
+            return SQLITE_IOERR_SHORT_READ;
+        }
+        done += got;
+    }
+    return SQLITE_OK;
+}
+
+static int uring_write(sqlite3_file *f, const void *buf, int amt, sqlite3_int64 offset) {
+    UringFile *file = (UringFile *)f;
+    if (file->fd < 0) {
+        return file->real->pMethods->xWrite(file->real, buf, amt, offset);
+    }
+    if ((size_t)amt > URING_STAGING_BYTES) {
+        int rc = uring_flush(file);
+        return rc == SQLITE_OK ? file->real->pMethods->xWrite(file->real, buf, amt, offset) : rc;
+    }
+    
+    // 暂存区或队列放不下时先把已排队的写入提交掉；保持 8 字节对齐
+    size_t slot = ((size_t)amt + 7) & ~(size_t)7;
+    struct io_uring_sqe *sqe = NULL;
+    if (file->staging_used + slot > URING_STAGING_BYTES || !(sqe = uring_get_sqe(&file->slot->ring))) {
+        int rc = uring_flush(file);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        sqe = uring_get_sqe(&file->slot->ring);
+    }
+    
+    char *dst = file->slot->staging + file->staging_used;
+    memcpy(dst, buf, amt);
+    file->staging_used += slot;
+    sqe->opcode = file->slot->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = file->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)dst;
+    sqe->len = amt;
+    sqe->off = offset;
+    sqe->buf_index = 0;
+    sqe->user_data = amt;
+    g_uring.writes++;
+    return SQLITE_OK;
+}
+
+static int uring_sync(sqlite3_file *f, int flags) {
+    UringFile *file = (UringFile *)f;
+    if (file->fd < 0) {
+        return file->real->pMethods->xSync(file->real, flags);
+    }
+    
+    // fsync 以 DRAIN 排在已排队的写入之后，与它们一起提交
+    struct io_uring_sqe *sqe = uring_get_sqe(&file->slot->ring);
+    if (!sqe) {
+        int rc = uring_flush(file);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        sqe = uring_get_sqe(&file->slot->ring);
+    }
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = file->fd;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->fsync_flags = (flags & SQLITE_SYNC_DATAONLY) ? IORING_FSYNC_DATASYNC : 0;
+    sqe->user_data = 0;
+    int rc = uring_submit_and_drain(&file->slot->ring, NULL);
+    file->staging_used = 0;
+    g_uring.fsyncs++;
+    if (rc != SQLITE_OK) {
+        return SQLITE_IOERR_FSYNC;
+    }
+    
+    if (file->dir_sync) {
+        // 新建的日志/WAL 需要同步所在目录，这部分仍由默认 VFS 完成
+        file->dir_sync = 0;
+        return file->real->pMethods->xSync(file->real, flags);
+    }
+    return SQLITE_OK;
+}
+
+// 以下操作先提交暂存的写入，再交给默认 VFS
+#define URING_FLUSH_THEN(file, call)                        \
+    do {                                                    \
+        int flush_rc = uring_flush(file);                   \
+        if (flush_rc != SQLITE_OK) {                        \
+            return flush_rc;                                \
+        }                                                   \
+        return call;                                        \
+    } while (0)
+
+static int uring_truncate(sqlite3_file *f, sqlite3_int64 size) {
+    UringFile *file = (UringFile *)f;
+    URING_FLUSH_THEN(file, file->real->pMethods->xTruncate(file->real, size));
+}
+
+static int uring_file_size(sqlite3_file *f, sqlite3_int64 *size) {
+    UringFile *file = (UringFile *)f;
+    URING_FLUSH_THEN(file, file->real->pMethods->xFileSize(file->real, size));
+}
+
+static int uring_lock(sqlite3_file *f, int level) {
+    UringFile *file = (UringFile *)f;
+    URING_FLUSH_THEN(file, file->real->pMethods->xLock(file->real, level));
+}
+
+static int uring_unlock(sqlite3_file *f, int level) {
+    UringFile *file = (UringFile *)f;
+    URING_FLUSH_THEN(file, file->real->pMethods->xUnlock(file->real, level));
+}
+
+static int uring_check_reserved_lock(sqlite3_file *f, int *out) {
+    UringFile *file = (UringFile *)f;
+    return file->real->pMethods->xCheckReservedLock(file->real, out);
+}
+
+static int uring_file_control(sqlite3_file *f, int op, void *arg) {
+    UringFile *file = (UringFile *)f;
+    URING_FLUSH_THEN(file, file->real->pMethods->xFileControl(file->real, op, arg));
+}
+
+static int uring_sector_size(sqlite3_file *f) {
+    UringFile *file = (UringFile *)f;
+    return file->real->pMethods->xSectorSize(file->real);
+}
+
+static int uring_device_characteristics(sqlite3_file *f) {
+    UringFile *file = (UringFile *)f;
+    return file->real->pMethods->xDeviceCharacteristics(file->real);
+}
+
+static int uring_shm_map(sqlite3_file *f, int page, int page_size, int extend, void volatile **out) {
+    UringFile *file = (UringFile *)f;
+    URING_FLUSH_THEN(file, file->real->pMethods->xShmMap(file->real, page, page_size, extend, out));
+}
+
+static int uring_shm_lock(sqlite3_file *f, int offset, int n, int flags) {
+    UringFile *file = (UringFile *)f;
+    URING_FLUSH_THEN(file, file->real->pMethods->xShmLock(file->real, offset, n, flags));
+}
+
+// WAL 写完帧后更新 wal-index 之前会调用屏障，此时帧必须已写入文件
+static void uring_shm_barrier(sqlite3_file *f) {
+    UringFile *file = (UringFile *)f;
+    uring_flush(file);
+    file->real->pMethods->xShmBarrier(file->real);
+}
+
+static int uring_shm_unmap(sqlite3_file *f, int delete_flag) {
+    UringFile *file = (UringFile *)f;
+    return file->real->pMethods->xShmUnmap(file->real, delete_flag);
+}
+
+static int uring_fetch(sqlite3_file *f, sqlite3_int64 offset, int amt, void **out) {
+    UringFile *file = (UringFile *)f;
+    URING_FLUSH_THEN(file, file->real->pMethods->xFetch(file->real, offset, amt, out));
+}
+
+static int uring_unfetch(sqlite3_file *f, sqlite3_int64 offset, void *page) {
+    UringFile *file = (UringFile *)f;
+    return file->real->pMethods->xUnfetch(file->real, offset, page);
+}
+
+static const sqlite3_io_methods g_uring_io_methods = {
+    3,
+    uring_close,
+    uring_read,
+    uring_write,
+    uring_truncate,
+    uring_sync,
+    uring_file_size,
+    uring_lock,
+    uring_unlock,
+    uring_check_reserved_lock,
+    uring_file_control,
+    uring_sector_size,
+    uring_device_characteristics,
+    uring_shm_map,
+    uring_shm_lock,
+    uring_shm_barrier,
+    uring_shm_unmap,
+    uring_fetch,
+    uring_unfetch
+};
+
+static int uring_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *f, int flags, int *out_flags) {
+    (void)vfs;
+    UringFile *file = (UringFile *)f;
+    file->real = (sqlite3_file *)(file + 1);
+    file->fd = -1;
+    file->dir_sync = 0;
+    file->slot = NULL;
+    file->staging_used = 0;
+    
+    int fd;
+    int rc = shim_open_with_fd(g_uring.base, name, file->real, flags, out_flags, &fd);
+    if (rc != SQLITE_OK) {
+        file->base.pMethods = NULL;
+        return rc;
+    }
+    file->base.pMethods = &g_uring_io_methods;
+    
+    int eligible = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL;
+    if (!g_uring.available || !name || !(flags & eligible)) {
+        g_uring.fallback_files++;
+        return SQLITE_OK;
+    }
+    if (fd < 0 || !(file->slot = uring_slot_acquire())) {
+        g_uring.fallback_files++;
+        return SQLITE_OK;
+    }
+    file->fd = fd;
+    file->dir_sync = (flags & SQLITE_OPEN_CREATE) && (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL));
+    g_uring.files++;
+    return SQLITE_OK;
+}
+
+// 退出时销毁池中的环
+static void uring_pool_shutdown() {
+    std::lock_guard<std::mutex> lock(g_uring.pool_mutex);
+    for (UringSlot *slot : g_uring.pool) {
+        uring_teardown(&slot->ring);
+        free(slot->staging);
+        delete slot;
+    }
+    g_uring.pool.clear();
+}
+
+/**
+ * 探测内核是否允许 io_uring（可能被 seccomp 或 sysctl 禁用），并用 IORING_REGISTER_PROBE
+ * 确认用到的操作码都受支持：IORING_OP_READ/WRITE 需要 5.6+，更早的内核也不支持 PROBE 本身
+ */
+static int uring_probe_ops() {
+    UringRing ring;
+    if (uring_setup(&ring, 2) != 0) {
+        return 0;
+    }
+    static const unsigned needed[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_WRITE_FIXED, IORING_OP_FSYNC};
+    const unsigned nops = 256;
+    struct io_uring_probe *probe =
+        (struct io_uring_probe *)calloc(1, sizeof(*probe) + nops * sizeof(struct io_uring_probe_op));
+    int ok = probe && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, nops) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] < probe->ops_len && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    uring_teardown(&ring);
+    return ok;
+}
+
+int uring_vfs_register(int make_default) {
+    if (g_uring.registered) {
+        return make_default ? sqlite3_vfs_register(&g_uring.vfs, 1) : SQLITE_OK;
+    }
+    g_uring.base = sqlite3_vfs_find(NULL);
+    if (!g_uring.base) {
+        return SQLITE_ERROR;
+    }
+    
+    // 内核支持所需操作码、且能从默认 VFS 取得描述符时才走 io_uring
+    g_uring.available = uring_probe_ops() && shim_install_open_hook(g_uring.base);
+    
+    // 复制默认 VFS，只替换文件打开；其余方法仍由默认 VFS 实现
+    g_uring.vfs = *g_uring.base;
+    g_uring.vfs.zName = "uring";
+    g_uring.vfs.pNext = NULL;
+    g_uring.vfs.szOsFile = (int)sizeof(UringFile) + g_uring.base->szOsFile;
+    g_uring.vfs.xOpen = uring_open;
+    
+    int rc = sqlite3_vfs_register(&g_uring.vfs, make_default);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "注册 uring VFS 失败: %d\n", rc);
+        return rc;
+    }
+    g_uring.registered = 1;
+    atexit(uring_pool_shutdown);
+    if (!g_uring.available) {
+        printf("io_uring 不可用（内核不支持所需操作码或默认 VFS 不允许挂接 open），uring VFS 将直接使用默认 VFS\n");
+    }
+    return SQLITE_OK;
+}
+
+void uring_vfs_stats(UringVfsStats *stats) {
+    stats->available = g_uring.available;
+    stats->files = g_uring.files.load();
+    stats->fallback_files = g_uring.fallback_files.load();
+    stats->reads = g_uring.reads.load();
+    stats->writes = g_uring.writes.load();
+    stats->fsyncs = g_uring.fsyncs.load();
+    stats->submits = g_uring.submits.load();
+}
+
+/**
+ * 用指定 VFS 打开数据库并设置密钥，vfs_name 为 NULL 时使用默认 VFS
+ */
+sqlite3* open_database_vfs(const char *db_path, const char *key, const char *vfs_name) {
+    return open_database_common(db_path, key, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs_name, 1, NULL);
+}
+
+/*
+ * 顺序预读 VFS
+ */
+struct ReadaheadFile {
+    sqlite3_file base;
+    sqlite3_file *real;             // 默认 VFS 的文件对象，紧跟在本结构之后
+    int fd;                         // -1 表示不预读
+    int run;                        // 连续顺序读次数
+    int misses;                     // 连续不顺序的读取次数
+    sqlite3_int64 next_offset;      // 上次读取的结束位置
+    sqlite3_int64 window;           // 下一次预读的长度
+    sqlite3_int64 advised_end;      // 已预读区间的结束位置
+};
+
+static struct {
+    int registered;
+    sqlite3_vfs vfs;
+    sqlite3_vfs *base;
+    std::atomic<long long> reads;
+    std::atomic<long long> sequential_reads;
+    std::atomic<long long> advises;
+    std::atomic<long long> advised_bytes;
+} g_readahead;
+
+static int readahead_close(sqlite3_file *f) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xClose(file->real);
+}
+
+static int readahead_read(sqlite3_file *f, void *buf, int amt, sqlite3_int64 offset) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    if (file->fd >= 0) {
+        g_readahead.reads++;
+        
+        // 向前跳过少量字节也算顺序读；扫描途中偶尔回头读内部页不打断顺序流，
+        // 连续 READAHEAD_TRIGGER_READS 次不顺序才认为转为随机访问
+        if (offset >= file->next_offset && offset - file->next_offset <= READAHEAD_MAX_GAP) {
+            file->run++;
+            file->misses = 0;
+            file->next_offset = offset + amt;
+            g_readahead.sequential_reads++;
+        } else if (++file->misses >= READAHEAD_TRIGGER_READS) {
+            file->run = 0;
+            file->misses = 0;
+            file->window = READAHEAD_MIN_WINDOW;
+            file->advised_end = 0;
+            file->next_offset = offset + amt;
+        }
+        
+        // 读到已预读区间的后半段时再发下一段，窗口逐次加倍
+        if (file->run >= READAHEAD_TRIGGER_READS && file->next_offset + file->window / 2 > file->advised_end) {
+            sqlite3_int64 start = std::max(file->advised_end, file->next_offset);
+            if (posix_fadvise(file->fd, start, file->window, POSIX_FADV_WILLNEED) == 0) {
+                g_readahead.advises++;
+                g_readahead.advised_bytes += file->window;
+            }
+            file->advised_end = start + file->window;
+            file->window = std::min<sqlite3_int64>(file->window * 2, READAHEAD_MAX_WINDOW);
+        }
+    }
+    return file->real->pMethods->xRead(file->real, buf, amt, offset);
+}
+
+// 其余方法原样转发给默认 VFS 的文件对象
+static int readahead_write(sqlite3_file *f, const void *buf, int amt, sqlite3_int64 offset) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xWrite(file->real, buf, amt, offset);
+}
+
+static int readahead_truncate(sqlite3_file *f, sqlite3_int64 size) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xTruncate(file->real, size);
+}
+
+static int readahead_sync(sqlite3_file *f, int flags) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xSync(file->real, flags);
+}
+
+static int readahead_file_size(sqlite3_file *f, sqlite3_int64 *size) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xFileSize(file->real, size);
+}
+
+static int readahead_lock(sqlite3_file *f, int level) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xLock(file->real, level);
+}
+
+static int readahead_unlock(sqlite3_file *f, int level) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xUnlock(file->real, level);
+}
+
+static int readahead_check_reserved_lock(sqlite3_file *f, int *out) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xCheckReservedLock(file->real, out);
+}
+
+static int readahead_file_control(sqlite3_file *f, int op, void *arg) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xFileControl(file->real, op, arg);
+}
+
+static int readahead_sector_size(sqlite3_file *f) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xSectorSize(file->real);
+}
+
+static int readahead_device_characteristics(sqlite3_file *f) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xDeviceCharacteristics(file->real);
+}
+
+static int readahead_shm_map(sqlite3_file *f, int page, int page_size, int extend, void volatile **out) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xShmMap(file->real, page, page_size, extend, out);
+}
+
+static int readahead_shm_lock(sqlite3_file *f, int offset, int n, int flags) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xShmLock(file->real, offset, n, flags);
+}
+
+static void readahead_shm_barrier(sqlite3_file *f) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    file->real->pMethods->xShmBarrier(file->real);
+}
+
+static int readahead_shm_unmap(sqlite3_file *f, int delete_flag) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xShmUnmap(file->real, delete_flag);
+}
+
+static int readahead_fetch(sqlite3_file *f, sqlite3_int64 offset, int amt, void **out) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xFetch(file->real, offset, amt, out);
+}
+
+static int readahead_unfetch(sqlite3_file *f, sqlite3_int64 offset, void *page) {
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    return file->real->pMethods->xUnfetch(file->real, offset, page);
+}
+
+static const sqlite3_io_methods g_readahead_io_methods = {
+    3,
+    readahead_close,
+    readahead_read,
+    readahead_write,
+    readahead_truncate,
+    readahead_sync,
+    readahead_file_size,
+    readahead_lock,
+    readahead_unlock,
+    readahead_check_reserved_lock,
+    readahead_file_control,
+    readahead_sector_size,
+    readahead_device_characteristics,
+    readahead_shm_map,
+    readahead_shm_lock,
+    readahead_shm_barrier,
+    readahead_shm_unmap,
+    readahead_fetch,
+    readahead_unfetch
+};
+
+static int readahead_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *f, int flags, int *out_flags) {
+    (void)vfs;
+    ReadaheadFile *file = (ReadaheadFile *)f;
+    file->real = (sqlite3_file *)(file + 1);
+    file->fd = -1;
+    file->run = 0;
+    file->misses = 0;
+    file->next_offset = 0;
+    file->window = READAHEAD_MIN_WINDOW;
+    file->advised_end = 0;
+    
+    int fd;
+    int rc = shim_open_with_fd(g_readahead.base, name, file->real, flags, out_flags, &fd);
+    if (rc != SQLITE_OK) {
+        file->base.pMethods = NULL;
+        return rc;
+    }
+    file->base.pMethods = &g_readahead_io_methods;
+    
+    // 只有主库会被整表扫描；日志和临时文件不预读
+    if (name && (flags & SQLITE_OPEN_MAIN_DB)) {
+        file->fd = fd;
+    }
+    return SQLITE_OK;
+}
+
+int readahead_vfs_register(int make_default) {
+    if (g_readahead.registered) {
+        return make_default ? sqlite3_vfs_register(&g_readahead.vfs, 1) : SQLITE_OK;
+    }
+    // 直接包装 unix VFS，描述符经它的 open() 钩子取得
+    g_readahead.base = sqlite3_vfs_find("unix");
+    if (!g_readahead.base) {
+        return SQLITE_ERROR;
+    }
+    if (!shim_install_open_hook(g_readahead.base)) {
+        printf("unix VFS 不允许挂接 open()，readahead VFS 不会预读\n");
+    }
+    
+    g_readahead.vfs = *g_readahead.base;
+    g_readahead.vfs.zName = "readahead";
+    g_readahead.vfs.pNext = NULL;
+    g_readahead.vfs.szOsFile = (int)sizeof(ReadaheadFile) + g_readahead.base->szOsFile;
+    g_readahead.vfs.xOpen = readahead_open;
+    
+    int rc = sqlite3_vfs_register(&g_readahead.vfs, make_default);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "注册 readahead VFS 失败: %d\n", rc);
+        return rc;
+    }
+    g_readahead.registered = 1;
+    return SQLITE_OK;
+}
+
+void readahead_vfs_stats(ReadaheadVfsStats *stats) {
+    stats->reads = g_readahead.reads.load();
+    stats->sequential_reads = g_readahead.sequential_reads.load();
+    stats->advises = g_readahead.advises.load();
+    stats->advised_bytes = g_readahead.advised_bytes.load();
+}
+
+/*
+ * 引擎指标
+ */
+enum MetricKind {
+    METRIC_GAUGE,
+    METRIC_COUNTER
+};
+
+struct MetricDef {
+    int op;
+    const char *name;
+    MetricKind kind;
+    int from_highwater;             // 值在 highwater 参数里（lookaside 命中/未命中计数）
+    int with_highwater;             // 另外导出 <name>_highwater
+    const char *help;
+};
+
+static const MetricDef g_db_metrics[] = {
+    {SQLITE_DBSTATUS_LOOKASIDE_USED, "lookaside_used", METRIC_GAUGE, 0, 1, "lookaside 已用槽数"},
+    {SQLITE_DBSTATUS_LOOKASIDE_HIT, "lookaside_hit", METRIC_COUNTER, 1, 0, "lookaside 分配命中次数"},
+    {SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, "lookaside_miss_size", METRIC_COUNTER, 1, 0, "请求超过槽大小而未用 lookaside 的次数"},
+    {SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, "lookaside_miss_full", METRIC_COUNTER, 1, 0, "槽用尽而未用 lookaside 的次数"},
+    {SQLITE_DBSTATUS_CACHE_USED, "cache_used_bytes", METRIC_GAUGE, 0, 0, "页缓存占用字节数"},
+    {SQLITE_DBSTATUS_CACHE_USED_SHARED, "cache_used_shared_bytes", METRIC_GAUGE, 0, 0, "页缓存占用字节数（共享缓存按连接数均摊）"},
+    {SQLITE_DBSTATUS_SCHEMA_USED, "schema_used_bytes", METRIC_GAUGE, 0, 0, "schema 占用字节数"},
+    {SQLITE_DBSTATUS_STMT_USED, "stmt_used_bytes", METRIC_GAUGE, 0, 0, "预编译语句占用字节数"},
+    {SQLITE_DBSTATUS_CACHE_HIT, "cache_hit", METRIC_COUNTER, 0, 0, "页缓存命中次数"},
+    {SQLITE_DBSTATUS_CACHE_MISS, "cache_miss", METRIC_COUNTER, 0, 0, "页缓存未命中（读页并解密）次数"},
+    {SQLITE_DBSTATUS_CACHE_WRITE, "cache_write", METRIC_COUNTER, 0, 0, "写回数据库文件的页数"},
+#ifdef SQLITE_DBSTATUS_CACHE_SPILL
+    {SQLITE_DBSTATUS_CACHE_SPILL, "cache_spill", METRIC_COUNTER, 0, 0, "事务中途因缓存满溢出写出的页数"},
+#endif
+    {SQLITE_DBSTATUS_DEFERRED_FKS, "deferred_fks", METRIC_GAUGE, 0, 0, "未解决的延迟外键约束数"},
+};
+
+static const MetricDef g_process_metrics[] = {
+    {SQLITE_STATUS_MEMORY_USED, "memory_used_bytes", METRIC_GAUGE, 0, 1, "SQLite 分配的内存字节数"},
+    {SQLITE_STATUS_MALLOC_COUNT, "malloc_count", METRIC_GAUGE, 0, 1, "未释放的分配次数"},
+    {SQLITE_STATUS_MALLOC_SIZE, "malloc_size_bytes", METRIC_GAUGE, 0, 1, "最大单次分配请求字节数"},
+    {SQLITE_STATUS_PAGECACHE_USED, "pagecache_used", METRIC_GAUGE, 0, 1, "SQLITE_CONFIG_PAGECACHE 已用槽数"},
+    {SQLITE_STATUS_PAGECACHE_OVERFLOW, "pagecache_overflow_bytes", METRIC_GAUGE, 0, 1, "页缓存池放不下而走 malloc 的字节数"},
+    {SQLITE_STATUS_PAGECACHE_SIZE, "pagecache_size_bytes", METRIC_GAUGE, 0, 1, "最大页缓存分配请求字节数"},
+    {SQLITE_STATUS_PARSER_STACK, "parser_stack", METRIC_GAUGE, 0, 1, "解析器栈深度"},
+};
+
+#define METRIC_COUNT(defs) (sizeof(defs) / sizeof(defs[0]))
+
+static struct {
+    std::mutex mutex;
+    std::unordered_map<sqlite3 *, std::string> connections;             // 连接 -> 数据库文件名
+    std::map<std::string, std::map<std::string, long long>> retired;    // 已关闭连接的累计计数
+    int enabled;
+    std::string prom_path;
+    std::string json_path;
+    int interval_ms;
+    std::thread sampler;
+    std::mutex sampler_mutex;
+    std::condition_variable sampler_cond;
+    int stopping;
+    MetricsSnapshot mark;           // 上一个测试结束时的快照
+} g_metrics;
+
+static std::string metrics_db_label(sqlite3 *db) {
+    const char *path = sqlite3_db_filename(db, "main");
+    if (!path || !*path) {
+        return ":memory:";
+    }
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// 读取一个连接的全部 DBSTATUS 计数，调用方持有 g_metrics.mutex
+static void metrics_sample_connection(sqlite3 *db, std::map<std::string, long long> &values) {
+    for (size_t i = 0; i < METRIC_COUNT(g_db_metrics); i++) {
+        const MetricDef &def = g_db_metrics[i];
+        int current = 0, highwater = 0;
+        if (sqlite3_db_status(db, def.op, &current, &highwater, 0) != SQLITE_OK) {
+            continue;
+        }
+        values[def.name] += def.from_highwater ? highwater : current;
+        if (def.with_highwater) {
+            long long &peak = values[std::string(def.name) + "_highwater"];
+            peak = std::max(peak, (long long)highwater);
+        }
+    }
+}
+
+void metrics_register_connection(sqlite3 *db) {
+    std::string label = metrics_db_label(db);
+    std::lock_guard<std::mutex> lock(g_metrics.mutex);
+    g_metrics.connections[db] = label;
+}
+
+void metrics_unregister_connection(sqlite3 *db) {
+    std::lock_guard<std::mutex> lock(g_metrics.mutex);
+    auto found = g_metrics.connections.find(db);
+    if (found == g_metrics.connections.end()) {
+        return;
+    }
+    
+    std::map<std::string, long long> values;
+    metrics_sample_connection(db, values);
+    std::map<std::string, long long> &retired = g_metrics.retired[found->second];
+    for (size_t i = 0; i < METRIC_COUNT(g_db_metrics); i++) {
+        if (g_db_metrics[i].kind == METRIC_COUNTER) {
+            retired[g_db_metrics[i].name] += values[g_db_metrics[i].name];
+        }
+    }
+    g_metrics.connections.erase(found);
+}
+
+void metrics_collect(MetricsSnapshot *snapshot) {
+    snapshot->timestamp = (double)time(NULL);
+    snapshot->process.clear();
+    snapshot->databases.clear();
+    
+    for (size_t i = 0; i < METRIC_COUNT(g_process_metrics); i++) {
+        const MetricDef &def = g_process_metrics[i];
+        sqlite3_int64 current = 0, highwater = 0;
+        if (sqlite3_status64(def.op, &current, &highwater, 0) == SQLITE_OK) {
+            snapshot->process[def.name] = current;
+            snapshot->process[std::string(def.name) + "_highwater"] = highwater;
+        }
+    }
+    
+    std::lock_guard<std::mutex> lock(g_metrics.mutex);
+    snapshot->connections = (int)g_metrics.connections.size();
+    for (const auto &entry : g_metrics.connections) {
+        std::map<std::string, long long> &values = snapshot->databases[entry.second];
+        metrics_sample_connection(entry.first, values);
+        values["connections"]++;
+    }
+    for (const auto &entry : g_metrics.retired) {
+        std::map<std::string, long long> &values = snapshot->databases[entry.first];
+        for (const auto &counter : entry.second) {
+            values[counter.first] += counter.second;
+        }
+    }
+}
+
+static void metrics_write_family(FILE *f, const char *prefix, const MetricDef &def, int highwater) {
+    const char *suffix = def.kind == METRIC_COUNTER ? "_total" : "";
+    fprintf(f, "# HELP %s%s%s%s %s%s\n", prefix, def.name, highwater ? "_highwater" : "", suffix,
+            def.help, highwater ? "（高水位）" : "");
+    fprintf(f, "# TYPE %s%s%s%s %s\n", prefix, def.name, highwater ? "_highwater" : "", suffix,
+            def.kind == METRIC_COUNTER ? "counter" : "gauge");
+}
+
+// Prometheus 标签值需要转义反斜杠、双引号和换行
+static std::string metrics_label_escape(const std::string &value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+/**
+ * 写 Prometheus 文本格式；先写临时文件再改名，textfile 采集器不会读到半个文件
+ */
+int metrics_write_prometheus(const char *path, const MetricsSnapshot &snapshot) {
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "无法写入指标文件 %s\n", tmp_path.c_str());
+        return 0;
+    }
+    
+    for (size_t i = 0; i < METRIC_COUNT(g_process_metrics); i++) {
+        const MetricDef &def = g_process_metrics[i];
+        auto current = snapshot.process.find(def.name);
+        if (current == snapshot.process.end()) {
+            continue;
+        }
+        metrics_write_family(f, "sqlite_", def, 0);
+        fprintf(f, "sqlite_%s %lld\n", def.name, current->second);
+        metrics_write_family(f, "sqlite_", def, 1);
+        fprintf(f, "sqlite_%s_highwater %lld\n", def.name,
+                snapshot.process.at(std::string(def.name) + "_highwater"));
+    }
+    
+    fprintf(f, "# HELP sqlite_db_connections 已登记的打开连接数\n# TYPE sqlite_db_connections gauge\n");
+    for (const auto &db : snapshot.databases) {
+        auto value = db.second.find("connections");
+        fprintf(f, "sqlite_db_connections{db=\"%s\"} %lld\n", metrics_label_escape(db.first).c_str(),
+                value == db.second.end() ? 0LL : value->second);
+    }
+    for (size_t i = 0; i < METRIC_COUNT(g_db_metrics); i++) {
+        const MetricDef &def = g_db_metrics[i];
+        for (int highwater = 0; highwater <= def.with_highwater; highwater++) {
+            std::string name = std::string(def.name) + (highwater ? "_highwater" : "");
+            metrics_write_family(f, "sqlite_db_", def, highwater);
+            for (const auto &db : snapshot.databases) {
+                auto value = db.second.find(name);
+                fprintf(f, "sqlite_db_%s%s{db=\"%s\"} %lld\n", name.c_str(),
+                        def.kind == METRIC_COUNTER ? "_total" : "", metrics_label_escape(db.first).c_str(),
+                        value == db.second.end() ? 0LL : value->second);
+            }
+        }
+    }
+    
+    int ok = fclose(f) == 0;
+    if (!ok || rename(tmp_path.c_str(), path) != 0) {
+        fprintf(stderr, "无法写入指标文件 %s\n", path);
+        remove(tmp_path.c_str());
+        return 0;
+    }
+    return 1;
+}
+
+static void metrics_write_json_object(FILE *f, const std::map<std::string, long long> &values) {
+    fprintf(f, "{");
+    const char *sep = "";
+    for (const auto &entry : values) {
+        fprintf(f, "%s\"%s\": %lld", sep, json_escape(entry.first.c_str()).c_str(), entry.second);
+        sep = ", ";
+    }
+    fprintf(f, "}");
+}
+
+/**
+ * 以 JSON Lines 格式追加一个快照（每行一个对象）
+ */
+int metrics_append_json(const char *path, const MetricsSnapshot &snapshot) {
+    FILE *f = fopen(path, "a");
+    if (!f) {
+        fprintf(stderr, "无法写入指标快照 %s\n", path);
+        return 0;
+    }
+    fprintf(f, "{\"timestamp\": %.0f, \"connections\": %d, \"process\": ", snapshot.timestamp, snapshot.connections);
+    metrics_write_json_object(f, snapshot.process);
+    fprintf(f, ", \"databases\": {");
+    const char *sep = "";
+    for (const auto &db : snapshot.databases) {
+        fprintf(f, "%s\"%s\": ", sep, json_escape(db.first.c_str()).c_str());
+        metrics_write_json_object(f, db.second);
+        sep = ", ";
+    }
+    fprintf(f, "}}\n");
+    return fclose(f) == 0;
+}
+
+static void metrics_export() {
+    if (g_metrics.prom_path.empty() && g_metrics.json_path.empty()) {
+        return;
+    }
+    MetricsSnapshot snapshot;
+    metrics_collect(&snapshot);
+    if (!g_metrics.prom_path.empty()) {
+        metrics_write_prometheus(g_metrics.prom_path.c_str(), snapshot);
+    }
+    if (!g_metrics.json_path.empty()) {
+        metrics_append_json(g_metrics.json_path.c_str(), snapshot);
+    }
+}
+
+static void metrics_sampler_main() {
+    std::unique_lock<std::mutex> lock(g_metrics.sampler_mutex);
+    while (!g_metrics.stopping) {
+        g_metrics.sampler_cond.wait_for(lock, std::chrono::milliseconds(g_metrics.interval_ms));
+        if (g_metrics.stopping) {
+            break;
+        }
+        lock.unlock();
+        metrics_export();
+        lock.lock();
+    }
+}
+
+/**
+ * 开启指标：interval_ms > 0 时启动采样线程定期导出，路径为 NULL 则不写该格式；
+ * 退出时写最后一次快照
+ */
+int metrics_start(int interval_ms, const char *prom_path, const char *json_path) {
+    if (g_metrics.enabled) {
+        return 1;
+    }
+    g_metrics.enabled = 1;
+    g_metrics.interval_ms = interval_ms;
+    g_metrics.prom_path = prom_path ? prom_path : "";
+    g_metrics.json_path = json_path ? json_path : "";
+    g_metrics.stopping = 0;
+    metrics_collect(&g_metrics.mark);
+    if (interval_ms > 0) {
+        g_metrics.sampler = std::thread(metrics_sampler_main);
+        printf("指标每 %d ms 写入 %s / %s\n", interval_ms, g_metrics.prom_path.c_str(), g_metrics.json_path.c_str());
+    }
+    atexit(metrics_stop);
+    return 1;
+}
+
+void metrics_stop() {
+    if (!g_metrics.enabled) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_metrics.sampler_mutex);
+        g_metrics.stopping = 1;
+    }
+    g_metrics.sampler_cond.notify_all();
+    if (g_metrics.sampler.joinable()) {
+        g_metrics.sampler.join();
+    }
+    metrics_export();
+    g_metrics.enabled = 0;
+}
+
+static long long metrics_sum(const MetricsSnapshot &snapshot, const char *name) {
+    long long total = 0;
+    for (const auto &db : snapshot.databases) {
+        auto value = db.second.find(name);
+        if (value != db.second.end()) {
+            total += value->second;
+        }
+    }
+    return total;
+}
+
+/**
+ * 打印自上一个测试结束以来的计数增量；进程高水位随后重置，下一个测试的高水位只反映它自己
+ */
+void metrics_print_test_delta(const char *test_name) {
+    if (!g_metrics.enabled) {
+        return;
+    }
+    MetricsSnapshot now;
+    metrics_collect(&now);
+    
+    printf("  指标增量 [%s]:", test_name);
+    for (size_t i = 0; i < METRIC_COUNT(g_db_metrics); i++) {
+        const MetricDef &def = g_db_metrics[i];
+        if (def.kind != METRIC_COUNTER) {
+            continue;
+        }
+        long long delta = metrics_sum(now, def.name) - metrics_sum(g_metrics.mark, def.name);
+        if (delta != 0) {
+            printf(" %s +%lld", def.name, delta);
+        }
+    }
+    long long hits = metrics_sum(now, "cache_hit") - metrics_sum(g_metrics.mark, "cache_hit");
+    long long misses = metrics_sum(now, "cache_miss") - metrics_sum(g_metrics.mark, "cache_miss");
+    if (hits + misses > 0) {
+        printf(" (缓存命中率 %.1f%%)", 100.0 * hits / (hits + misses));
+    }
+    printf("\n  内存: 当前 %.1f KB, 峰值 %.1f KB, 页缓存溢出峰值 %.1f KB, 打开连接 %d\n",
+           now.process["memory_used_bytes"] / 1024.0, now.process["memory_used_bytes_highwater"] / 1024.0,
+           now.process["pagecache_overflow_bytes_highwater"] / 1024.0, now.connections);
+    
+    for (size_t i = 0; i < METRIC_COUNT(g_process_metrics); i++) {
+        sqlite3_int64 current, highwater;
+        sqlite3_status64(g_process_metrics[i].op, &current, &highwater, 1);
+    }
+    g_metrics.mark = now;
+}
+
+/*
+ * SQL 剖析
+ */
+#define SQL_HIST_SUB_BUCKETS (1 << SQL_HIST_SUB_BITS)
+#define SQL_HIST_BUCKETS     ((64 - SQL_HIST_SUB_BITS) * SQL_HIST_SUB_BUCKETS)
+
+// 对数线性分桶：小于 SUB_BUCKETS 的值各占一桶，其余每个 2 的幂区间再分 SUB_BUCKETS 份，相对误差约 1/16
+struct SqlFingerprintStats {
+    std::string fingerprint;
+    std::atomic<long long> calls{0};
+    std::atomic<long long> rows{0};
+    std::atomic<long long> total_ns{0};
+    std::atomic<long long> max_ns{0};
+    std::atomic<long long> buckets[SQL_HIST_BUCKETS];
+    
+    SqlFingerprintStats() {
+        for (auto &bucket : buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+static int sql_hist_index(unsigned long long value) {
+    if (value < SQL_HIST_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - SQL_HIST_SUB_BITS;
+    return (shift + 1) * SQL_HIST_SUB_BUCKETS + (int)((value >> shift) & (SQL_HIST_SUB_BUCKETS - 1));
+}
+
+// 桶的上界
+static unsigned long long sql_hist_value(int index) {
+    if (index < SQL_HIST_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / SQL_HIST_SUB_BUCKETS - 1;
+    unsigned long long base = (unsigned long long)(SQL_HIST_SUB_BUCKETS + index % SQL_HIST_SUB_BUCKETS) << shift;
+    return base + ((1ULL << shift) - 1);
+}
+
+static void sql_stats_record(SqlFingerprintStats *stats, long long ns, long long rows, int calls) {
+    stats->calls.fetch_add(calls, std::memory_order_relaxed);
+    stats->rows.fetch_add(rows, std::memory_order_relaxed);
+    stats->total_ns.fetch_add(ns, std::memory_order_relaxed);
+    stats->buckets[sql_hist_index((unsigned long long)ns)].fetch_add(1, std::memory_order_relaxed);
+    long long seen = stats->max_ns.load(std::memory_order_relaxed);
+    while (ns > seen && !stats->max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {
+    }
+}
+
+static struct {
+    int installed;
+    int top_n;
+    std::mutex mutex;               // 只在某线程第一次见到一条 SQL 时使用
+    // 不随静态析构释放：退出过程中信号线程和其他线程的跟踪回调仍可能访问
+    std::unordered_map<std::string, std::unique_ptr<SqlFingerprintStats>> *by_fingerprint;
+    sigset_t signals;
+} g_sql_profiler;
+
+// 每线程：SQL 原文 -> 指纹统计，命中时不加锁、不重新归一化
+static thread_local std::unordered_map<std::string, SqlFingerprintStats *> t_sql_profile_cache;
+
+// 每线程：最近执行的语句（触发器等嵌套语句会同时有多条）。PROFILE 回调给出的耗时
+// 取自 VFS 的毫秒时钟，所以自己在 STMT 时记下单调时钟，受影响行数用 total_changes 之差。
+// 因 schema 变化自动重新编译的语句先对失败的那次发 PROFILE，重跑时不再发 STMT，
+// 所以 PROFILE 之后条目不删除而是重新计时，重跑的那次不再计入调用次数。
+struct SqlProfileRunning {
+    sqlite3_stmt *stmt;
+    long long rows;
+    long long start_ns;
+    int start_changes;
+    int reprepares;
+};
+
+static long long sql_profile_now_ns() {
+    return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static thread_local std::vector<SqlProfileRunning> t_sql_running;
+
+static int sql_ident_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' ||
+           (unsigned char)c >= 0x80;
+}
+
+/**
+ * SQL 指纹：合并空白、关键字转大写，字符串/数字/BLOB 字面量和各种形式的参数替换为 ?，
+ * 多行 VALUES 中重复的相同元组合并为一个加 ", ..."；带引号的标识符保持原样
+ */
+std::string sql_fingerprint(const char *sql) {
+    std::string out;
+    int pending_space = 0;
+    
+    for (const char *p = sql; *p; p++) {
+        char c = *p;
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            pending_space = !out.empty();
+            continue;
+        }
+        if (pending_space) {
+            out += ' ';
+            pending_space = 0;
+        }
+        
+        if (c == '\'' || ((c == 'x' || c == 'X') && p[1] == '\'' && (p == sql || !sql_ident_char(p[-1])))) {
+            // 字符串或 BLOB 字面量，'' 是转义的单引号
+            p += (c == '\'') ? 1 : 2;
+            while (*p && !(*p == '\'' && p[1] != '\'')) {
+                p += (*p == '\'' && p[1] == '\'') ? 2 : 1;
+            }
+            if (!*p) {
+                p--;
+            }
+            out += '?';
+        } else if (c == '"' || c == '`' || c == '[') {
+            char close = c == '[' ? ']' : c;
+            out += c;
+            while (p[1] && p[1] != close) {
+                out += *++p;
+            }
+            if (p[1]) {
+                out += *++p;
+            }
+        } else if ((c == '?' || c == ':' || c == '@' || c == '$') && sql_ident_char(p[1])) {
+            // ?NNN、:name、@name、$name 形式的参数
+            while (sql_ident_char(p[1])) {
+                p++;
+            }
+            out += '?';
+        } else if ((c >= '0' && c <= '9') && (p == sql || !sql_ident_char(p[-1]))) {
+            while (sql_ident_char(p[1]) || p[1] == '.' ||
+                   ((p[1] == '+' || p[1] == '-') && (p[0] == 'e' || p[0] == 'E'))) {
+                p++;
+            }
+            out += '?';
+        } else if (sql_ident_char(c)) {
+            // 关键字转大写，表名列名保持原样
+            const char *start = p;
+            while (sql_ident_char(p[1])) {
+                p++;
+            }
+            int len = (int)(p - start + 1);
+            int keyword = sqlite3_keyword_check(start, len);
+            for (int i = 0; i < len; i++) {
+                out += (keyword && start[i] >= 'a' && start[i] <= 'z') ? (char)(start[i] - 'a' + 'A') : start[i];
+            }
+        } else {
+            out += c;
+        }
+    }
+    while (!out.empty() && (out[out.size() - 1] == ';' || out[out.size() - 1] == ' ')) {
+        out.erase(out.size() - 1);
+    }
+    
+    // "(?, ?), (?, ?), ..." -> "(?, ?), ..."
+    for (size_t open = out.find('('); open != std::string::npos; open = out.find('(', open + 1)) {
+        size_t close = out.find(')', open);
+        if (close == std::string::npos) {
+            break;
+        }
+        std::string group = out.substr(open, close - open + 1);
+        if (group.find('(', 1) != std::string::npos) {
+            continue;
+        }
+        size_t next = close + 1;
+        size_t end = next;
+        while (true) {
+            size_t at = end;
+            if (at < out.size() && out[at] == ',') {
+                at++;
+            } else {
+                break;
+            }
+            if (at < out.size() && out[at] == ' ') {
+                at++;
+            }
+            if (out.compare(at, group.size(), group) != 0) {
+                break;
+            }
+            end = at + group.size();
+        }
+        if (end > next) {
+            out.replace(next, end - next, ", ...");
+        }
+    }
+    return out;
+}
+
+static SqlFingerprintStats *sql_profiler_lookup(const char *sql) {
+    auto cached = t_sql_profile_cache.find(sql);
+    if (cached != t_sql_profile_cache.end()) {
+        return cached->second;
+    }
+    
+    std::string fingerprint = sql_fingerprint(sql);
+    SqlFingerprintStats *stats;
+    {
+        std::lock_guard<std::mutex> lock(g_sql_profiler.mutex);
+        std::unique_ptr<SqlFingerprintStats> &slot = (*g_sql_profiler.by_fingerprint)[fingerprint];
+        if (!slot) {
+            slot.reset(new SqlFingerprintStats());
+            slot->fingerprint = fingerprint;
+        }
+        stats = slot.get();
+    }
+    // 字面量拼进 SQL 的语句原文各不相同，缓存满了就整个丢掉
+    if (t_sql_profile_cache.size() >= SQL_PROFILE_CACHE_MAX) {
+        t_sql_profile_cache.clear();
+    }
+    t_sql_profile_cache.emplace(sql, stats);
+    return stats;
+}
+
+static int sql_profiler_trace(unsigned type, void *ctx, void *p, void *x) {
+    (void)ctx;
+    sqlite3_stmt *stmt = (sqlite3_stmt *)p;
+    
+    if (type == SQLITE_TRACE_STMT) {
+        // 触发器里的语句以 "--" 开头、和外层共用同一个 stmt
+        const char *text = (const char *)x;
+        if (text && text[0] == '-' && text[1] == '-') {
+            return 0;
+        }
+        for (size_t i = t_sql_running.size(); i-- > 0;) {
+            if (t_sql_running[i].stmt == stmt) {
+                t_sql_running.erase(t_sql_running.begin() + i);
+                break;
+            }
+        }
+        if (t_sql_running.size() >= 64) {
+            t_sql_running.erase(t_sql_running.begin());
+        }
+        t_sql_running.push_back({stmt, 0, sql_profile_now_ns(), sqlite3_total_changes(sqlite3_db_handle(stmt)),
+                                 sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0)});
+    } else if (type == SQLITE_TRACE_ROW) {
+        for (size_t i = t_sql_running.size(); i-- > 0;) {
+            if (t_sql_running[i].stmt == stmt) {
+                t_sql_running[i].rows++;
+                break;
+            }
+        }
+    } else if (type == SQLITE_TRACE_PROFILE) {
+        long long rows = 0;
+        long long elapsed = *(sqlite3_int64 *)x;
+        int calls = 1;
+        for (size_t i = t_sql_running.size(); i-- > 0;) {
+            SqlProfileRunning &running = t_sql_running[i];
+            if (running.stmt == stmt) {
+                long long now = sql_profile_now_ns();
+                int changes = sqlite3_total_changes(sqlite3_db_handle(stmt));
+                int reprepares = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0);
+                elapsed = now - running.start_ns;
+                // 写语句的行数取受影响行数
+                rows = sqlite3_stmt_readonly(stmt) ? running.rows : changes - running.start_changes;
+                calls = reprepares == running.reprepares ? 1 : 0;
+                running = {stmt, 0, now, changes, reprepares};
+                break;
+            }
+        }
+        const char *sql = sqlite3_sql(stmt);
+        if (sql) {
+            sql_stats_record(sql_profiler_lookup(sql), elapsed, rows, calls);
+        }
+    }
+    return 0;
+}
+
+static int sql_profiler_connection_init(sqlite3 *db, char **err_msg, const sqlite3_api_routines *api) {
+    (void)err_msg;
+    (void)api;
+    sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_ROW | SQLITE_TRACE_PROFILE, sql_profiler_trace, NULL);
+    return SQLITE_OK;
+}
+
+// 按桶计数求分位数（重新编译的语句一次调用有两个样本），取桶上界但不超过最大值
+static long long sql_stats_percentile(const SqlFingerprintStats &stats, double fraction) {
+    long long counts[SQL_HIST_BUCKETS];
+    long long samples = 0;
+    for (int i = 0; i < SQL_HIST_BUCKETS; i++) {
+        counts[i] = stats.buckets[i].load(std::memory_order_relaxed);
+        samples += counts[i];
+    }
+    long long max_ns = stats.max_ns.load(std::memory_order_relaxed);
+    long long target = (long long)ceil(samples * fraction);
+    long long seen = 0;
+    for (int i = 0; i < SQL_HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= target && seen > 0) {
+            return std::min((long long)sql_hist_value(i), max_ns);
+        }
+    }
+    return max_ns;
+}
+
+/**
+ * 按总耗时打印前 top_n 个指纹；统计边写边读，各列之间可能相差几次调用
+ */
+void sql_profiler_report(FILE *out, int top_n) {
+    std::vector<SqlFingerprintStats *> all;
+    {
+        std::lock_guard<std::mutex> lock(g_sql_profiler.mutex);
+        for (auto &entry : *g_sql_profiler.by_fingerprint) {
+            all.push_back(entry.second.get());
+        }
+    }
+    std::sort(all.begin(), all.end(), [](const SqlFingerprintStats *a, const SqlFingerprintStats *b) {
+        return a->total_ns.load(std::memory_order_relaxed) > b->total_ns.load(std::memory_order_relaxed);
+    });
+    
+    long long grand_total = 0;
+    for (const SqlFingerprintStats *stats : all) {
+        grand_total += stats->total_ns.load(std::memory_order_relaxed);
+    }
+    fprintf(out, "\n--- SQL 剖析：共 %zu 个指纹, 总耗时 %.1f ms ---\n", all.size(), grand_total / 1e6);
+    fprintf(out, "%6s %10s %12s %10s %9s %9s %9s %9s  %s\n", "占比", "调用", "行数", "总计(ms)",
+            "平均(us)", "p50(us)", "p99(us)", "max(us)", "SQL 指纹");
+    for (size_t i = 0; i < all.size() && (int)i < top_n; i++) {
+        const SqlFingerprintStats &stats = *all[i];
+        long long calls = stats.calls.load(std::memory_order_relaxed);
+        long long total = stats.total_ns.load(std::memory_order_relaxed);
+        if (calls == 0) {
+            continue;
+        }
+        std::string text = stats.fingerprint.size() > 100 ? stats.fingerprint.substr(0, 97) + "..." : stats.fingerprint;
+        fprintf(out, "%5.1f%% %10lld %12lld %10.1f %9.1f %9.1f %9.1f %9.1f  %s\n",
+                grand_total > 0 ? 100.0 * total / grand_total : 0.0, calls,
+                stats.rows.load(std::memory_order_relaxed), total / 1e6, total / 1e3 / calls,
+                sql_stats_percentile(stats, 0.50) / 1e3, sql_stats_percentile(stats, 0.99) / 1e3,
+                stats.max_ns.load(std::memory_order_relaxed) / 1e3, text.c_str());
+    }
+    fflush(out);
+}
+
+static void sql_profiler_report_at_exit() {
+    sql_profiler_report(stdout, g_sql_profiler.top_n);
+}
+
+/**
+ * 开启 SQL 剖析：之后打开的连接都会被跟踪；SIGUSR1 在调用线程（及其后创建的线程）里
+ * 屏蔽，由专门的线程 sigwait 后打印报告，不在信号处理函数里做 I/O
+ */
+int sql_profiler_install(int top_n) {
+    if (g_sql_profiler.installed) {
+        return SQLITE_OK;
+    }
+    g_sql_profiler.by_fingerprint = new std::unordered_map<std::string, std::unique_ptr<SqlFingerprintStats>>();
+    int rc = sqlite3_auto_extension((void (*)(void))sql_profiler_connection_init);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "注册 SQL 剖析失败: %d\n", rc);
+        return rc;
+    }
+    g_sql_profiler.installed = 1;
+    g_sql_profiler.top_n = top_n > 0 ? top_n : SQL_PROFILE_TOP_N;
+    
+    sigemptyset(&g_sql_profiler.signals);
+    sigaddset(&g_sql_profiler.signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &g_sql_profiler.signals, NULL);
+    std::thread([]() {
+        while (true) {
+            int sig = 0;
+            if (sigwait(&g_sql_profiler.signals, &sig) == 0) {
+                sql_profiler_report(stdout, g_sql_profiler.top_n);
+            }
+        }
+    }).detach();
+    
+    atexit(sql_profiler_report_at_exit);
+    printf("SQL 剖析已开启，kill -USR1 %d 可随时打印报告\n", (int)getpid());
+    return SQLITE_OK;
+}
+
+/*
+ * 执行计划剖析
+ */
+#if defined(SQLITE_ENABLE_STMT_SCANSTATUS) && SQLITE_VERSION_NUMBER >= 3042000
+#define PLAN_SCANSTATUS_V2 1
+#endif
+
+/**
+ * 本程序编译时启用了 scanstatus 且运行库也启用了
+ */
+int plan_scanstatus_available() {
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+    return sqlite3_compileoption_used("ENABLE_STMT_SCANSTATUS");
+#else
+    return 0;
+#endif
+}
+
+static void plan_load_eqp(sqlite3 *db, const char *sql, std::vector<PlanLoop> *loops) {
+    std::string eqp = std::string("EXPLAIN QUERY PLAN ") + sql;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, eqp.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+        PlanLoop loop = {sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), detail ? detail : "",
+                         -1, -1, -1.0, -1, 0, 0};
+        loops->push_back(loop);
+    }
+    sqlite3_finalize(stmt);
+}
+
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+// 读取 scanstatus 的循环信息；没有任何循环时返回 0
+static int plan_load_scanstatus(sqlite3_stmt *stmt, std::vector<PlanLoop> *loops) {
+    std::vector<PlanLoop> found;
+    for (int idx = 0;; idx++) {
+        sqlite3_int64 nloop = 0, nvisit = 0;
+        double est = 0.0;
+        const char *explain = NULL;
+        int select_id = 0;
+        PlanLoop loop;
+#ifdef PLAN_SCANSTATUS_V2
+        const int flags = SQLITE_SCANSTAT_COMPLEX;
+        sqlite3_int64 ncycle = -1;
+        int parent_id = 0;
+        if (sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_NLOOP, flags, &nloop) != 0) {
+            break;
+        }
+        sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_NVISIT, flags, &nvisit);
+        sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_EST, flags, &est);
+        sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_EXPLAIN, flags, (void *)&explain);
+        sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_SELECTID, flags, &select_id);
+        sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_PARENTID, flags, &parent_id);
+        sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_NCYCLE, flags, &ncycle);
+        loop.parent = parent_id;
+        loop.cycles = ncycle;
+#else
+        if (sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_NLOOP, &nloop) != 0) {
+            break;
+        }
+        sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_NVISIT, &nvisit);
+        sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_EST, &est);
+        sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_EXPLAIN, (void *)&explain);
+        sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_SELECTID, &select_id);
+        loop.parent = 0;
+        loop.cycles = -1;
+#endif
+        loop.id = select_id;
+        loop.detail = explain ? explain : "";
+        loop.loops = nloop;
+        loop.visits = nvisit;
+        loop.estimated = est;
+        loop.full_scan = 0;
+        loop.flagged = 0;
+        found.push_back(loop);
+    }
+    if (found.empty()) {
+        return 0;
+    }
+    *loops = found;
+    return 1;
+}
+#endif
+
+/**
+ * 剖析一条语句；params 按顺序绑定为整数
+ */
+int plan_profile_sql(sqlite3 *db, const char *sql, const long long *params, int param_count, PlanReport *report) {
+    report->sql = sql;
+    report->scanstatus = 0;
+    report->rows = 0;
+    report->flagged = 0;
+    report->loops.clear();
+    
+#ifdef SQLITE_DBCONFIG_STMT_SCANSTATUS
+    if (plan_scanstatus_available()) {
+        sqlite3_db_config(db, SQLITE_DBCONFIG_STMT_SCANSTATUS, 1, (int *)NULL);
+    }
+#endif
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "剖析语句准备失败: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return rc;
+    }
+    for (int i = 0; i < param_count; i++) {
+        sqlite3_bind_int64(stmt, i + 1, params[i]);
+    }
+    plan_load_eqp(db, sql, &report->loops);
+    
+    // 写语句在保存点里执行，剖析完回滚，不改变数据
+    int writes = !sqlite3_stmt_readonly(stmt);
+    if (writes && (rc = execute_sql(db, "SAVEPOINT plan_profile")) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return rc;
+    }
+    double start = now_seconds();
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        report->rows++;
+    }
+    report->seconds = now_seconds() - start;
+    if (rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+        if (writes) {
+            report->rows = sqlite3_changes(db);
+        }
+    } else {
+        fprintf(stderr, "剖析语句执行失败: %s\n", sqlite3_errmsg(db));
+    }
+    report->vm_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+    report->fullscan_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+    report->sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 0);
+    report->autoindexes = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 0);
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+    if (plan_scanstatus_available()) {
+        report->scanstatus = plan_load_scanstatus(stmt, &report->loops);
+    }
+#endif
+    sqlite3_finalize(stmt);
+    if (writes) {
+        execute_sql(db, "ROLLBACK TO plan_profile");
+        execute_sql(db, "RELEASE plan_profile");
+    }
+    
+    // 有 scanstatus 时按循环的访问行数判断；否则只能用语句级的全表扫描步数
+    for (PlanLoop &loop : report->loops) {
+        loop.full_scan = strncmp(loop.detail.c_str(), "SCAN ", 5) == 0 &&
+                         strncmp(loop.detail.c_str(), "SCAN CONSTANT ROW", 17) != 0;
+        long long visited = report->scanstatus ? loop.visits : report->fullscan_steps;
+        loop.flagged = loop.full_scan && visited >= PLAN_LARGE_SCAN_ROWS;
+        report->flagged |= loop.flagged;
+    }
+    return rc;
+}
+
+void plan_print_report(const PlanReport &report) {
+    printf("\n[%s] %s\n", report.flagged ? "全表扫描" : "正常", report.sql.c_str());
+    printf("  耗时 %.2f ms, 行数 %lld, VM 步数 %lld, 全表扫描步数 %lld, 排序 %lld, 自动索引 %lld\n",
+           report.seconds * 1e3, report.rows, report.vm_steps, report.fullscan_steps, report.sorts, report.autoindexes);
+    for (const PlanLoop &loop : report.loops) {
+        printf("    %-48s", loop.detail.c_str());
+        if (loop.loops >= 0) {
+            printf(" 循环 %lld, 访问 %lld, 估计 %.0f", loop.loops, loop.visits, loop.estimated);
+            if (loop.cycles >= 0) {
+                printf(", 周期 %lld", loop.cycles);
+            }
+        }
+        printf("%s\n", loop.flagged ? "  <- 大表全表扫描" : "");
     }
 }
@@ -0,0 +1,1137 @@
+// 加密原语微基准：单独测量 SQLCipher 每页用到的 AES-256-CBC、HMAC-SHA512 和 PBKDF2，
+// 以及 EVP 上下文的创建开销，按周期/字节报告，并打印 OpenSSL 实际使用的 CPU 特性。
+//g++ -std=c++20 -O2 -o cryptobench cryptobench.cpp -I../../sdk/openssl/3.5.4/include -lcrypto -pthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CB_HAVE_RDTSC 1
+#define CB_HAVE_AESNI 1
+#endif
+
+// SQLCipher 4 默认参数：AES-256-CBC，每页保留 16 字节 IV + 64 字节 HMAC-SHA512
+#define CB_KEY_BYTES        32
+#define CB_IV_BYTES         16
+#define CB_HMAC_BYTES       64
+#define CB_SALT_BYTES       16
+#define CB_RESERVE_BYTES    (CB_IV_BYTES + CB_HMAC_BYTES)
+
+// 每项测量至少持续的时间（秒），可用 --seconds 覆盖
+#define CB_MIN_SECONDS      0.2
+
+// 每页的测量用例：SQLCipher 支持的页大小
+static const int g_page_sizes[] = {1024, 2048, 4096, 8192, 16384, 32768, 65536};
+
+// 批量页加密：交错的独立 CBC 流数、默认批大小、超过多少页才拆分到多个线程
+#define CB_BATCH_LANES              8
+#define CB_BATCH_PAGES              256
+#define CB_BATCH_PARALLEL_MIN_PAGES 64
+
+// PBKDF2 迭代次数：1 为原始密钥路径，256000 为 SQLCipher 4 默认值
+static const int g_pbkdf2_iters[] = {1, 1000, 4000, 64000, 256000};
+
+// 一次测量的结果
+struct CbMeasure {
+    long long ops;
+    double seconds;
+    double cycles;              // 时间戳计数器周期，没有 rdtsc 时为 0
+};
+
+typedef int (*CbOp)(void *ctx);
+
+struct CbMode {
+    const char *name;
+    int (*fn)();
+    const char *desc;
+};
+
+// 命令行
+void cb_parse_options(int argc, char *argv[]);
+double cb_option_double(const char *name, double default_value);
+
+// 计时
+uint64_t cb_cycles_now();
+double cb_tsc_ghz();
+int cb_measure(CbOp op, void *ctx, CbMeasure *out);
+double cb_cycles_per_op(const CbMeasure &m);
+
+// 批量页加密（检查点、备份、rekey 连续写出大量页时的写路径原型）
+// 页布局与 SQLCipher 相同：密文 | IV | HMAC-SHA512(密文 + IV + 页号)
+struct CbBatchCodec {
+    unsigned char key[CB_KEY_BYTES];
+    unsigned char hmac_key[CB_KEY_BYTES];
+    EVP_CIPHER *cipher;
+    EVP_MAC_CTX *mac_template;      // 已设置 SHA512 和密钥，各线程 dup 后复用 ipad/opad 状态
+    alignas(16) unsigned char round_keys[15 * 16];
+    int aesni;
+};
+
+struct CbPageBatch {
+    int page_size;
+    int count;
+    const unsigned char *plain;     // count 个连续明文页（只用页大小减去保留区的部分）
+    unsigned char *pages;           // count 个连续输出页
+    const uint32_t *pgnos;
+};
+
+int cb_batch_codec_open(CbBatchCodec *codec, const unsigned char *key, const unsigned char *hmac_key);
+void cb_batch_codec_close(CbBatchCodec *codec);
+int cb_batch_encrypt(CbBatchCodec *codec, const CbPageBatch *batch, int threads);
+int cb_batch_verify(CbBatchCodec *codec, const CbPageBatch *batch);
+
+// 各项基准
+int cb_print_environment();
+int cb_bench_cipher();
+int cb_bench_hmac();
+int cb_bench_pbkdf2();
+int cb_bench_setup();
+int cb_bench_provider();
+int cb_bench_batch();
+int cb_bench_all();
+
+static const CbMode g_cb_modes[] = {
+    {"all", cb_bench_all, "全部测量（默认）"},
+    {"cipher", cb_bench_cipher, "各页大小的 AES-256-CBC 加密/解密"},
+    {"hmac", cb_bench_hmac, "各页大小的 HMAC-SHA512"},
+    {"pbkdf2", cb_bench_pbkdf2, "PBKDF2-HMAC-SHA512 各迭代次数"},
+    {"setup", cb_bench_setup, "EVP 上下文创建、初始化与算法获取开销"},
+    {"provider", cb_bench_provider, "每页加解密+HMAC：逐次获取算法 vs 预先获取并复用上下文"},
+    {"batch", cb_bench_batch, "批量写出：交错 CBC + 复用 HMAC 密钥 + 多线程 vs 逐页"},
+};
+
+static std::vector<std::string> g_cb_args;
+
+int main(int argc, char *argv[]) {
+    cb_parse_options(argc, argv);
+    const char *name = (argc > 1 && strncmp(argv[1], "--", 2) != 0) ? argv[1] : "all";
+
+    for (size_t i = 0; i < sizeof(g_cb_modes) / sizeof(g_cb_modes[0]); i++) {
+        if (strcmp(g_cb_modes[i].name, name) == 0) {
+            if (strcmp(name, "all") != 0) {
+                cb_print_environment();
+            }
+            return g_cb_modes[i].fn() ? 0 : 1;
+        }
+    }
+
+    fprintf(stderr, "未知模式: %s\n可用模式:\n", name);
+    for (size_t i = 0; i < sizeof(g_cb_modes) / sizeof(g_cb_modes[0]); i++) {
+        fprintf(stderr, "  %-10s %s\n", g_cb_modes[i].name, g_cb_modes[i].desc);
+    }
+    return 1;
+}
+
+/**
+ * 保存 --name=value 形式的参数
+ */
+void cb_parse_options(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            g_cb_args.push_back(argv[i] + 2);
+        }
+    }
+}
+
+double cb_option_double(const char *name, double default_value) {
+    size_t len = strlen(name);
+    for (const std::string &arg : g_cb_args) {
+        if (arg.compare(0, len, name) == 0 && arg.size() > len && arg[len] == '=') {
+            return atof(arg.c_str() + len + 1);
+        }
+    }
+    return default_value;
+}
+
+/*
+ * 计时
+ */
+uint64_t cb_cycles_now() {
+#ifdef CB_HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * 用单调时钟校准时间戳计数器频率（只算一次）；rdtsc 计的是恒定频率的参考周期，
+ * 睿频或降频时与核心周期不同，跨机器比较时应同时看 MB/s
+ */
+double cb_tsc_ghz() {
+    static double ghz = -1.0;
+    if (ghz >= 0.0) {
+        return ghz;
+    }
+#ifdef CB_HAVE_RDTSC
+    auto start = std::chrono::steady_clock::now();
+    uint64_t c0 = cb_cycles_now();
+    while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(50)) {
+    }
+    uint64_t c1 = cb_cycles_now();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    ghz = (double)(c1 - c0) / ns;
+#else
+    ghz = 0.0;
+#endif
+    return ghz;
+}
+
+/**
+ * 先预热一轮，再按批次反复调用 op，直到总时间达到 --seconds
+ */
+int cb_measure(CbOp op, void *ctx, CbMeasure *out) {
+    // 预热最多 8 次，慢操作（高迭代 PBKDF2）在用掉 1/10 测量时间后停止
+    double min_seconds = cb_option_double("seconds", CB_MIN_SECONDS);
+    auto warmup_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 8; i++) {
+        if (!op(ctx)) {
+            return 0;
+        }
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() - warmup_start).count() > min_seconds / 10) {
+            break;
+        }
+    }
+
+    long long batch = 1;
+    out->ops = 0;
+    out->seconds = 0.0;
+    out->cycles = 0.0;
+    while (out->seconds < min_seconds) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t c0 = cb_cycles_now();
+        for (long long i = 0; i < batch; i++) {
+            if (!op(ctx)) {
+                return 0;
+            }
+        }
+        uint64_t c1 = cb_cycles_now();
+        out->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        out->cycles += (double)(c1 - c0);
+        out->ops += batch;
+        if (batch < (1LL << 20)) {
+            batch *= 2;
+        }
+    }
+    return 1;
+}
+
+double cb_cycles_per_op(const CbMeasure &m) {
+    return m.ops > 0 ? m.cycles / m.ops : 0.0;
+}
+
+/*
+ * 环境：编译用的头文件版本、运行时库版本和 OpenSSL 选用的 CPU 特性
+ */
+static int cb_cap_bit(const unsigned long long *cap, int word, int bit) {
+    return (int)((cap[word] >> bit) & 1);
+}
+
+int cb_print_environment() {
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    printf("主机: %s, CPU 数: %ld\n", host, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("头文件: %s (0x%lx)\n", OPENSSL_VERSION_TEXT, (unsigned long)OPENSSL_VERSION_NUMBER);
+    printf("运行库: %s (0x%lx)\n", OpenSSL_version(OPENSSL_VERSION), OpenSSL_version_num());
+    if ((OpenSSL_version_num() >> 20) != ((unsigned long)OPENSSL_VERSION_NUMBER >> 20)) {
+        printf("注意: 头文件与运行库的主/次版本不同，只使用两者共有的接口\n");
+    }
+
+    // OPENSSL_ia32cap=0x<CPUID.1 ECX:EDX>:0x<CPUID.7 ECX:EBX>，已应用环境变量屏蔽
+    const char *info = OpenSSL_version(OPENSSL_CPU_INFO);
+    printf("%s\n", info);
+    unsigned long long cap[2] = {0, 0};
+    const char *eq = strstr(info, "OPENSSL_ia32cap=");
+    if (eq && sscanf(eq, "OPENSSL_ia32cap=0x%llx:0x%llx", &cap[0], &cap[1]) == 2) {
+        printf("OpenSSL 分派: AES-NI %s, PCLMULQDQ %s, AVX %s, AVX2 %s, SHA-NI %s, AVX512F %s, VAES %s\n",
+               cb_cap_bit(cap, 0, 32 + 25) ? "是" : "否", cb_cap_bit(cap, 0, 32 + 1) ? "是" : "否",
+               cb_cap_bit(cap, 0, 32 + 28) ? "是" : "否", cb_cap_bit(cap, 1, 5) ? "是" : "否",
+               cb_cap_bit(cap, 1, 29) ? "是" : "否", cb_cap_bit(cap, 1, 16) ? "是" : "否",
+               cb_cap_bit(cap, 1, 32 + 9) ? "是" : "否");
+    }
+    if (cb_tsc_ghz() > 0.0) {
+        printf("时间戳计数器: %.3f GHz（周期均为 TSC 参考周期）\n", cb_tsc_ghz());
+    } else {
+        printf("时间戳计数器: 不可用，只报告 MB/s\n");
+    }
+    printf("每项测量至少 %.2f 秒\n", cb_option_double("seconds", CB_MIN_SECONDS));
+    return 1;
+}
+
+/*
+ * 每页 AES-256-CBC：与 SQLCipher 相同，复用一个上下文，每页用新的 IV 重新初始化，关闭填充
+ */
+struct CbCipherCtx {
+    EVP_CIPHER_CTX *ctx;
+    const EVP_CIPHER *cipher;
+    unsigned char key[CB_KEY_BYTES];
+    unsigned char iv[CB_IV_BYTES];
+    std::vector<unsigned char> in;
+    std::vector<unsigned char> out;
+    int enc;
+};
+
+static int cb_cipher_page(void *arg) {
+    CbCipherCtx *c = (CbCipherCtx *)arg;
+    int len = 0, final_len = 0;
+    if (!EVP_CipherInit_ex(c->ctx, c->cipher, NULL, c->key, c->iv, c->enc) ||
+        !EVP_CIPHER_CTX_set_padding(c->ctx, 0) ||
+        !EVP_CipherUpdate(c->ctx, c->out.data(), &len, c->in.data(), (int)c->in.size()) ||
+        !EVP_CipherFinal_ex(c->ctx, c->out.data() + len, &final_len)) {
+        fprintf(stderr, "AES-256-CBC 失败\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void cb_print_row(const char *name, int bytes, const CbMeasure &m) {
+    double per_op_ns = m.seconds * 1e9 / m.ops;
+    double mbps = (double)bytes * m.ops / m.seconds / 1048576.0;
+    if (cb_tsc_ghz() > 0.0) {
+        printf("%-16s %8d %12.0f %10.2f %10.1f %10.0f\n", name, bytes, cb_cycles_per_op(m),
+               cb_cycles_per_op(m) / bytes, per_op_ns / 1e3, mbps);
+    } else {
+        printf("%-16s %8d %12s %10s %10.1f %10.0f\n", name, bytes, "-", "-", per_op_ns / 1e3, mbps);
+    }
+}
+
+static void cb_print_header() {
+    printf("%-16s %8s %12s %10s %10s %10s\n", "操作", "字节", "周期/次", "周期/字节", "us/次", "MB/s");
+}
+
+int cb_bench_cipher() {
+    printf("\n--- AES-256-CBC 每页加密/解密（页大小减去 %d 字节保留区） ---\n", CB_RESERVE_BYTES);
+    cb_print_header();
+
+    CbCipherCtx c;
+    c.ctx = EVP_CIPHER_CTX_new();
+    c.cipher = EVP_aes_256_cbc();
+    RAND_bytes(c.key, sizeof(c.key));
+    RAND_bytes(c.iv, sizeof(c.iv));
+    int ok = c.ctx != NULL;
+
+    for (size_t i = 0; ok && i < sizeof(g_page_sizes) / sizeof(g_page_sizes[0]); i++) {
+        int bytes = g_page_sizes[i] - CB_RESERVE_BYTES;
+        c.in.assign(bytes, 0);
+        c.out.assign(bytes + CB_IV_BYTES, 0);
+        RAND_bytes(c.in.data(), bytes);
+
+        const char *names[] = {"decrypt", "encrypt"};
+        for (int enc = 1; ok && enc >= 0; enc--) {
+            CbMeasure m;
+            c.enc = enc;
+            ok = cb_measure(cb_cipher_page, &c, &m);
+            if (ok) {
+                char name[32];
+                snprintf(name, sizeof(name), "%s/%dK", names[enc], g_page_sizes[i] / 1024);
+                cb_print_row(name, bytes, m);
+            }
+        }
+    }
+    EVP_CIPHER_CTX_free(c.ctx);
+    return ok;
+}
+
+/*
+ * 每页 HMAC-SHA512：覆盖密文 + IV + 4 字节页号，与 SQLCipher 的页校验相同
+ */
+struct CbHmacCtx {
+    EVP_MAC_CTX *ctx;
+    unsigned char key[CB_KEY_BYTES];
+    std::vector<unsigned char> page;
+    unsigned char mac[CB_HMAC_BYTES];
+    uint32_t pgno;
+};
+
+static int cb_hmac_page(void *arg) {
+    CbHmacCtx *h = (CbHmacCtx *)arg;
+    size_t mac_len = 0;
+    unsigned char pgno_le[4];
+    h->pgno++;
+    memcpy(pgno_le, &h->pgno, sizeof(pgno_le));
+    if (!EVP_MAC_init(h->ctx, h->key, sizeof(h->key), NULL) ||
+        !EVP_MAC_update(h->ctx, h->page.data(), h->page.size()) ||
+        !EVP_MAC_update(h->ctx, pgno_le, sizeof(pgno_le)) ||
+        !EVP_MAC_final(h->ctx, h->mac, &mac_len, sizeof(h->mac))) {
+        fprintf(stderr, "HMAC-SHA512 失败\n");
+        return 0;
+    }
+    return 1;
+}
+
+static EVP_MAC_CTX *cb_new_hmac_sha512() {
+    EVP_MAC *mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    if (!mac) {
+        return NULL;
+    }
+    EVP_MAC_CTX *ctx = EVP_MAC_CTX_new(mac);
+    EVP_MAC_free(mac);
+    if (!ctx) {
+        return NULL;
+    }
+    char digest[] = "SHA512";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end()
+    };
+    if (!EVP_MAC_CTX_set_params(ctx, params)) {
+        EVP_MAC_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+int cb_bench_hmac() {
+    printf("\n--- HMAC-SHA512 每页校验（密文 + IV + 页号） ---\n");
+    cb_print_header();
+
+    CbHmacCtx h;
+    h.ctx = cb_new_hmac_sha512();
+    h.pgno = 0;
+    RAND_bytes(h.key, sizeof(h.key));
+    int ok = h.ctx != NULL;
+    if (!ok) {
+        fprintf(stderr, "无法创建 HMAC-SHA512 上下文\n");
+    }
+
+    for (size_t i = 0; ok && i < sizeof(g_page_sizes) / sizeof(g_page_sizes[0]); i++) {
+        int bytes = g_page_sizes[i] - CB_HMAC_BYTES;
+        h.page.assign(bytes, 0);
+        RAND_bytes(h.page.data(), bytes);
+        CbMeasure m;
+        ok = cb_measure(cb_hmac_page, &h, &m);
+        if (ok) {
+            char name[32];
+            snprintf(name, sizeof(name), "hmac/%dK", g_page_sizes[i] / 1024);
+            cb_print_row(name, bytes, m);
+        }
+    }
+    EVP_MAC_CTX_free(h.ctx);
+    return ok;
+}
+
+/*
+ * PBKDF2-HMAC-SHA512：每次打开数据库用口令派生密钥的开销
+ */
+struct CbPbkdf2Ctx {
+    const char *password;
+    unsigned char salt[CB_SALT_BYTES];
+    unsigned char key[CB_KEY_BYTES];
+    int iterations;
+};
+
+static int cb_pbkdf2_once(void *arg) {
+    CbPbkdf2Ctx *p = (CbPbkdf2Ctx *)arg;
+    if (!PKCS5_PBKDF2_HMAC(p->password, (int)strlen(p->password), p->salt, sizeof(p->salt), p->iterations,
+                           EVP_sha512(), sizeof(p->key), p->key)) {
+        fprintf(stderr, "PBKDF2 失败\n");
+        return 0;
+    }
+    return 1;
+}
+
+int cb_bench_pbkdf2() {
+    printf("\n--- PBKDF2-HMAC-SHA512 派生 %d 字节密钥 ---\n", CB_KEY_BYTES);
+    printf("%-10s %12s %14s %12s %12s\n", "迭代次数", "ms/次", "周期/迭代", "迭代/秒", "派生/秒");
+
+    CbPbkdf2Ctx p;
+    p.password = "123456789";
+    RAND_bytes(p.salt, sizeof(p.salt));
+    for (size_t i = 0; i < sizeof(g_pbkdf2_iters) / sizeof(g_pbkdf2_iters[0]); i++) {
+        p.iterations = g_pbkdf2_iters[i];
+        CbMeasure m;
+        if (!cb_measure(cb_pbkdf2_once, &p, &m)) {
+            return 0;
+        }
+        double per_op = m.seconds / m.ops;
+        printf("%-10d %12.3f %14.0f %12.0f %12.1f\n", p.iterations, per_op * 1e3,
+               cb_cycles_per_op(m) / p.iterations, p.iterations / per_op, 1.0 / per_op);
+    }
+    return 1;
+}
+
+/*
+ * EVP 上下文开销：OpenSSL 3 里 EVP_aes_256_cbc() 等旧接口每次初始化都要按名称查找算法实现
+ */
+struct CbSetupCtx {
+    EVP_CIPHER *fetched;
+    EVP_CIPHER_CTX *ctx;
+    unsigned char key[CB_KEY_BYTES];
+    unsigned char iv[CB_IV_BYTES];
+};
+
+static int cb_setup_ctx_new_free(void *arg) {
+    (void)arg;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX_free(ctx);
+    return ctx != NULL;
+}
+
+static int cb_setup_new_init_free(void *arg) {
+    CbSetupCtx *s = (CbSetupCtx *)arg;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int ok = ctx && EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, s->key, s->iv, 1);
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+static int cb_setup_reinit_implicit(void *arg) {
+    CbSetupCtx *s = (CbSetupCtx *)arg;
+    return EVP_CipherInit_ex(s->ctx, EVP_aes_256_cbc(), NULL, s->key, s->iv, 1);
+}
+
+static int cb_setup_reinit_fetched(void *arg) {
+    CbSetupCtx *s = (CbSetupCtx *)arg;
+    return EVP_CipherInit_ex(s->ctx, s->fetched, NULL, s->key, s->iv, 1);
+}
+
+static int cb_setup_reinit_iv_only(void *arg) {
+    CbSetupCtx *s = (CbSetupCtx *)arg;
+    return EVP_CipherInit_ex(s->ctx, NULL, NULL, NULL, s->iv, 1);
+}
+
+static int cb_setup_cipher_fetch(void *arg) {
+    (void)arg;
+    EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+    EVP_CIPHER_free(cipher);
+    return cipher != NULL;
+}
+
+static int cb_setup_hmac_ctx(void *arg) {
+    (void)arg;
+    EVP_MAC_CTX *ctx = cb_new_hmac_sha512();
+    EVP_MAC_CTX_free(ctx);
+    return ctx != NULL;
+}
+
+int cb_bench_setup() {
+    printf("\n--- EVP 上下文与算法获取开销 ---\n");
+    printf("%-36s %12s %10s\n", "操作", "周期/次", "ns/次");
+
+    CbSetupCtx s;
+    s.fetched = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+    s.ctx = EVP_CIPHER_CTX_new();
+    RAND_bytes(s.key, sizeof(s.key));
+    RAND_bytes(s.iv, sizeof(s.iv));
+    if (!s.fetched || !s.ctx || !EVP_CipherInit_ex(s.ctx, s.fetched, NULL, s.key, s.iv, 1)) {
+        fprintf(stderr, "无法创建 AES-256-CBC 上下文\n");
+        EVP_CIPHER_free(s.fetched);
+        EVP_CIPHER_CTX_free(s.ctx);
+        return 0;
+    }
+
+    struct {
+        const char *name;
+        CbOp op;
+    } cases[] = {
+        {"EVP_CIPHER_CTX_new + free", cb_setup_ctx_new_free},
+        {"new + CipherInit(EVP_aes_256_cbc) + free", cb_setup_new_init_free},
+        {"CipherInit 复用上下文 (EVP_aes_256_cbc)", cb_setup_reinit_implicit},
+        {"CipherInit 复用上下文 (预先 fetch)", cb_setup_reinit_fetched},
+        {"CipherInit 只换 IV", cb_setup_reinit_iv_only},
+        {"EVP_CIPHER_fetch + free", cb_setup_cipher_fetch},
+        {"HMAC-SHA512 MAC_fetch + CTX_new + free", cb_setup_hmac_ctx},
+    };
+    int ok = 1;
+    for (size_t i = 0; ok && i < sizeof(cases) / sizeof(cases[0]); i++) {
+        CbMeasure m;
+        ok = cb_measure(cases[i].op, &s, &m);
+        if (ok) {
+            printf("%-36s %12.0f %10.1f\n", cases[i].name, cb_cycles_per_op(m), m.seconds * 1e9 / m.ops);
+        }
+    }
+    EVP_CIPHER_free(s.fetched);
+    EVP_CIPHER_CTX_free(s.ctx);
+    return ok;
+}
+
+/*
+ * 加密提供者策略对比：一页的完整工作量（AES-256-CBC + HMAC-SHA512）
+ * per-op：与 SQLCipher 4.10 自带的 OpenSSL 提供者相同，每页新建 EVP_CIPHER_CTX、
+ *         用 EVP_aes_256_cbc() 隐式查找算法、EVP_MAC_fetch + EVP_MAC_CTX_new，用完释放
+ * prefetch：每个 OSSL_LIB_CTX 只 fetch 一次 EVP_CIPHER/EVP_MAC/EVP_KDF，
+ *         每个编解码器持有一对 cipher/MAC 上下文，每页只换 IV 和输入
+ */
+struct CbProviderCtx {
+    // 进程级（每个 OSSL_LIB_CTX）预先获取的算法
+    EVP_CIPHER *cipher;
+    EVP_MAC *mac;
+    EVP_KDF *kdf;
+    // 编解码器级复用的上下文
+    EVP_CIPHER_CTX *cipher_ctx;
+    EVP_MAC_CTX *mac_ctx;
+    unsigned char key[CB_KEY_BYTES];
+    unsigned char hmac_key[CB_KEY_BYTES];
+    unsigned char iv[CB_IV_BYTES];
+    std::vector<unsigned char> in;
+    std::vector<unsigned char> out;
+    unsigned char mac_out[CB_HMAC_BYTES];
+    uint32_t pgno;
+};
+
+static int cb_provider_cipher(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher, CbProviderCtx *p) {
+    int len = 0, final_len = 0;
+    return EVP_CipherInit_ex(ctx, cipher, NULL, cipher ? p->key : NULL, p->iv, 1) &&
+           EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+           EVP_CipherUpdate(ctx, p->out.data(), &len, p->in.data(), (int)p->in.size()) &&
+           EVP_CipherFinal_ex(ctx, p->out.data() + len, &final_len);
+}
+
+static int cb_provider_hmac(EVP_MAC_CTX *ctx, const unsigned char *key, CbProviderCtx *p) {
+    size_t mac_len = 0;
+    unsigned char pgno_le[4];
+    memcpy(pgno_le, &p->pgno, sizeof(pgno_le));
+    return EVP_MAC_init(ctx, key, key ? sizeof(p->hmac_key) : 0, NULL) &&
+           EVP_MAC_update(ctx, p->out.data(), p->out.size()) &&
+           EVP_MAC_update(ctx, p->iv, sizeof(p->iv)) &&
+           EVP_MAC_update(ctx, pgno_le, sizeof(pgno_le)) &&
+           EVP_MAC_final(ctx, p->mac_out, &mac_len, sizeof(p->mac_out));
+}
+
+static int cb_provider_page_per_op(void *arg) {
+    CbProviderCtx *p = (CbProviderCtx *)arg;
+    p->pgno++;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int ok = ctx && cb_provider_cipher(ctx, EVP_aes_256_cbc(), p);
+    EVP_CIPHER_CTX_free(ctx);
+
+    EVP_MAC_CTX *mac_ctx = ok ? cb_new_hmac_sha512() : NULL;
+    ok = mac_ctx && cb_provider_hmac(mac_ctx, p->hmac_key, p);
+    EVP_MAC_CTX_free(mac_ctx);
+    if (!ok) {
+        fprintf(stderr, "per-op 页加密失败\n");
+    }
+    return ok;
+}
+
+static int cb_provider_page_prefetch(void *arg) {
+    CbProviderCtx *p = (CbProviderCtx *)arg;
+    p->pgno++;
+    // 密钥在编解码器生命周期内不变，已在首次初始化时设置，这里只换 IV；HMAC 传 NULL 沿用已设置的密钥
+    int ok = cb_provider_cipher(p->cipher_ctx, NULL, p) && cb_provider_hmac(p->mac_ctx, NULL, p);
+    if (!ok) {
+        fprintf(stderr, "prefetch 页加密失败\n");
+    }
+    return ok;
+}
+
+static int cb_provider_open(CbProviderCtx *p) {
+    p->cipher_ctx = NULL;
+    p->mac_ctx = NULL;
+    p->pgno = 0;
+    RAND_bytes(p->key, sizeof(p->key));
+    RAND_bytes(p->hmac_key, sizeof(p->hmac_key));
+    RAND_bytes(p->iv, sizeof(p->iv));
+    p->cipher = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+    p->mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    p->kdf = EVP_KDF_fetch(NULL, "PBKDF2", NULL);
+    if (!p->cipher || !p->mac || !p->kdf) {
+        return 0;
+    }
+
+    char digest[] = "SHA512";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end()
+    };
+    p->cipher_ctx = EVP_CIPHER_CTX_new();
+    p->mac_ctx = EVP_MAC_CTX_new(p->mac);
+    return p->cipher_ctx && p->mac_ctx &&
+           EVP_CipherInit_ex(p->cipher_ctx, p->cipher, NULL, p->key, p->iv, 1) &&
+           EVP_MAC_CTX_set_params(p->mac_ctx, params) &&
+           EVP_MAC_init(p->mac_ctx, p->hmac_key, sizeof(p->hmac_key), NULL);
+}
+
+static void cb_provider_close(CbProviderCtx *p) {
+    EVP_CIPHER_CTX_free(p->cipher_ctx);
+    EVP_MAC_CTX_free(p->mac_ctx);
+    EVP_CIPHER_free(p->cipher);
+    EVP_MAC_free(p->mac);
+    EVP_KDF_free(p->kdf);
+}
+
+/**
+ * 两种策略对同一页必须得到相同的密文和 HMAC，否则复用上下文时漏掉了状态重置
+ */
+static int cb_provider_check(CbProviderCtx *p) {
+    uint32_t pgno = p->pgno;
+    if (!cb_provider_page_per_op(p)) {
+        return 0;
+    }
+    std::vector<unsigned char> out = p->out;
+    unsigned char mac[CB_HMAC_BYTES];
+    memcpy(mac, p->mac_out, sizeof(mac));
+
+    p->pgno = pgno;
+    if (!cb_provider_page_prefetch(p)) {
+        return 0;
+    }
+    if (out != p->out || memcmp(mac, p->mac_out, sizeof(mac)) != 0) {
+        fprintf(stderr, "prefetch 结果与 per-op 不一致\n");
+        return 0;
+    }
+    return 1;
+}
+
+static int cb_provider_kdf(void *arg) {
+    CbProviderCtx *p = (CbProviderCtx *)arg;
+    EVP_KDF_CTX *ctx = EVP_KDF_CTX_new(p->kdf);
+    unsigned int iterations = 1;
+    char digest[] = "SHA512";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD, p->key, sizeof(p->key)),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, p->iv, sizeof(p->iv)),
+        OSSL_PARAM_construct_uint(OSSL_KDF_PARAM_ITER, &iterations),
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end()
+    };
+    int ok = ctx && EVP_KDF_derive(ctx, p->hmac_key, sizeof(p->hmac_key), params);
+    EVP_KDF_CTX_free(ctx);
+    return ok;
+}
+
+static int cb_provider_kdf_per_op(void *arg) {
+    CbProviderCtx *p = (CbProviderCtx *)arg;
+    return PKCS5_PBKDF2_HMAC((const char *)p->key, sizeof(p->key), p->iv, sizeof(p->iv), 1, EVP_sha512(),
+                             sizeof(p->hmac_key), p->hmac_key);
+}
+
+int cb_bench_provider() {
+    printf("\n--- 加密提供者策略：每页 AES-256-CBC + HMAC-SHA512 ---\n");
+    printf("%-8s %12s %12s %10s %14s\n", "页大小", "per-op ns", "prefetch ns", "节省", "每万页节省 ms");
+
+    CbProviderCtx p;
+    int ok = cb_provider_open(&p);
+    if (!ok) {
+        fprintf(stderr, "无法预先获取 AES-256-CBC/HMAC/PBKDF2\n");
+    }
+    for (size_t i = 0; ok && i < sizeof(g_page_sizes) / sizeof(g_page_sizes[0]); i++) {
+        int bytes = g_page_sizes[i] - CB_RESERVE_BYTES;
+        p.in.assign(bytes, 0);
+        p.out.assign(bytes, 0);
+        RAND_bytes(p.in.data(), bytes);
+
+        CbMeasure per_op, prefetch;
+        ok = cb_provider_check(&p) && cb_measure(cb_provider_page_per_op, &p, &per_op) &&
+             cb_measure(cb_provider_page_prefetch, &p, &prefetch);
+        if (ok) {
+            double a = per_op.seconds * 1e9 / per_op.ops;
+            double b = prefetch.seconds * 1e9 / prefetch.ops;
+            printf("%-8d %12.0f %12.0f %9.1f%% %14.2f\n", g_page_sizes[i], a, b, (a - b) * 100.0 / a,
+                   (a - b) * 10000 / 1e6);
+        }
+    }
+
+    // 打开数据库时的 KDF：PKCS5_PBKDF2_HMAC 每次按名称查找 vs 预先获取的 EVP_KDF（1 次迭代，只看固定开销）
+    CbMeasure kdf_per_op, kdf_prefetch;
+    if (ok && cb_measure(cb_provider_kdf_per_op, &p, &kdf_per_op) && cb_measure(cb_provider_kdf, &p, &kdf_prefetch)) {
+        printf("KDF 固定开销: PKCS5_PBKDF2_HMAC %.0f ns, 预先获取 EVP_KDF %.0f ns\n",
+               kdf_per_op.seconds * 1e9 / kdf_per_op.ops, kdf_prefetch.seconds * 1e9 / kdf_prefetch.ops);
+    }
+    cb_provider_close(&p);
+    return ok;
+}
+
+int cb_bench_all() {
+    return cb_print_environment() && cb_bench_cipher() && cb_bench_hmac() && cb_bench_pbkdf2() && cb_bench_setup() &&
+           cb_bench_provider() && cb_bench_batch();
+}
+
+/*
+ * 批量页加密
+ * CBC 加密每页内部是串行链，AES-NI 单流只用到 aesenc 流水线的一小部分（解密本身可并行，EVP 已经很快）；
+ * 不同页的 CBC 链互不相关，把 CB_BATCH_LANES 页的同一块交错送入 aesenc 即可填满流水线。
+ * HMAC-SHA512 没有公开的多缓冲接口，只复用已算好的 ipad/opad 状态，大批量时再按线程拆分
+ */
+#ifdef CB_HAVE_AESNI
+#define CB_AESNI_TARGET __attribute__((target("aes,sse2")))
+
+CB_AESNI_TARGET static inline __m128i cb_aes256_expand_a(__m128i t1, __m128i t2) {
+    t2 = _mm_shuffle_epi32(t2, 0xff);
+    __m128i t4 = _mm_slli_si128(t1, 4);
+    t1 = _mm_xor_si128(t1, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t1 = _mm_xor_si128(t1, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t1 = _mm_xor_si128(t1, t4);
+    return _mm_xor_si128(t1, t2);
+}
+
+CB_AESNI_TARGET static inline __m128i cb_aes256_expand_b(__m128i t1, __m128i t3) {
+    __m128i t2 = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(t1, 0x00), 0xaa);
+    __m128i t4 = _mm_slli_si128(t3, 4);
+    t3 = _mm_xor_si128(t3, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t3 = _mm_xor_si128(t3, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t3 = _mm_xor_si128(t3, t4);
+    return _mm_xor_si128(t3, t2);
+}
+
+// aeskeygenassist 的轮常量必须是立即数，只能展开
+#define CB_AES256_ROUND(i, rcon)                                                    \
+    t1 = cb_aes256_expand_a(t1, _mm_aeskeygenassist_si128(t3, rcon));               \
+    rk[i] = t1;                                                                     \
+    if (i + 1 < 15) {                                                               \
+        t3 = cb_aes256_expand_b(t1, t3);                                            \
+        rk[i + 1] = t3;                                                             \
+    }
+
+CB_AESNI_TARGET static void cb_aes256_key_expand(const unsigned char *key, unsigned char *round_keys) {
+    __m128i *rk = (__m128i *)round_keys;
+    __m128i t1 = _mm_loadu_si128((const __m128i *)key);
+    __m128i t3 = _mm_loadu_si128((const __m128i *)(key + 16));
+    rk[0] = t1;
+    rk[1] = t3;
+    CB_AES256_ROUND(2, 0x01);
+    CB_AES256_ROUND(4, 0x02);
+    CB_AES256_ROUND(6, 0x04);
+    CB_AES256_ROUND(8, 0x08);
+    CB_AES256_ROUND(10, 0x10);
+    CB_AES256_ROUND(12, 0x20);
+    CB_AES256_ROUND(14, 0x40);
+}
+
+/**
+ * N 页同时做 CBC 加密：每一轮对 N 个独立的块各发一条 aesenc，相邻指令之间没有依赖
+ */
+template <int N>
+CB_AESNI_TARGET static void cb_aesni_cbc_encrypt_lanes(const unsigned char *round_keys, const CbPageBatch *batch,
+                                                       int first) {
+    const __m128i *rk = (const __m128i *)round_keys;
+    int data_bytes = batch->page_size - CB_RESERVE_BYTES;
+    const unsigned char *in[N];
+    unsigned char *out[N];
+    __m128i state[N];
+    for (int l = 0; l < N; l++) {
+        size_t offset = (size_t)(first + l) * batch->page_size;
+        in[l] = batch->plain + offset;
+        out[l] = batch->pages + offset;
+        state[l] = _mm_loadu_si128((const __m128i *)(out[l] + data_bytes));
+    }
+
+    for (int off = 0; off < data_bytes; off += 16) {
+        for (int l = 0; l < N; l++) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(in[l] + off));
+            state[l] = _mm_xor_si128(_mm_xor_si128(block, state[l]), rk[0]);
+        }
+        for (int r = 1; r < 14; r++) {
+            for (int l = 0; l < N; l++) {
+                state[l] = _mm_aesenc_si128(state[l], rk[r]);
+            }
+        }
+        for (int l = 0; l < N; l++) {
+            state[l] = _mm_aesenclast_si128(state[l], rk[14]);
+            _mm_storeu_si128((__m128i *)(out[l] + off), state[l]);
+        }
+    }
+}
+#endif
+
+int cb_batch_codec_open(CbBatchCodec *codec, const unsigned char *key, const unsigned char *hmac_key) {
+    memcpy(codec->key, key, sizeof(codec->key));
+    memcpy(codec->hmac_key, hmac_key, sizeof(codec->hmac_key));
+    codec->cipher = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+    codec->mac_template = cb_new_hmac_sha512();
+    codec->aesni = 0;
+#ifdef CB_HAVE_AESNI
+    if (__builtin_cpu_supports("aes")) {
+        cb_aes256_key_expand(codec->key, codec->round_keys);
+        codec->aesni = 1;
+    }
+#endif
+    return codec->cipher && codec->mac_template &&
+           EVP_MAC_init(codec->mac_template, codec->hmac_key, sizeof(codec->hmac_key), NULL);
+}
+
+void cb_batch_codec_close(CbBatchCodec *codec) {
+    EVP_CIPHER_free(codec->cipher);
+    EVP_MAC_CTX_free(codec->mac_template);
+    OPENSSL_cleanse(codec->round_keys, sizeof(codec->round_keys));
+}
+
+static int cb_batch_hmac_page(EVP_MAC_CTX *ctx, const CbPageBatch *batch, int i) {
+    int data_bytes = batch->page_size - CB_RESERVE_BYTES;
+    unsigned char *page = batch->pages + (size_t)i * batch->page_size;
+    unsigned char pgno_le[4];
+    size_t mac_len = 0;
+    memcpy(pgno_le, &batch->pgnos[i], sizeof(pgno_le));
+    return EVP_MAC_init(ctx, NULL, 0, NULL) &&
+           EVP_MAC_update(ctx, page, data_bytes + CB_IV_BYTES) &&
+           EVP_MAC_update(ctx, pgno_le, sizeof(pgno_le)) &&
+           EVP_MAC_final(ctx, page + data_bytes + CB_IV_BYTES, &mac_len, CB_HMAC_BYTES);
+}
+
+/**
+ * 加密并校验 [begin, end) 这段页，IV 已由调用方写入每页的保留区；每个线程各用一份上下文
+ */
+static int cb_batch_chunk(CbBatchCodec *codec, const CbPageBatch *batch, int begin, int end) {
+    int data_bytes = batch->page_size - CB_RESERVE_BYTES;
+    int i = begin;
+#ifdef CB_HAVE_AESNI
+    if (codec->aesni) {
+        for (; i + CB_BATCH_LANES <= end; i += CB_BATCH_LANES) {
+            cb_aesni_cbc_encrypt_lanes<CB_BATCH_LANES>(codec->round_keys, batch, i);
+        }
+        for (; i < end; i++) {
+            cb_aesni_cbc_encrypt_lanes<1>(codec->round_keys, batch, i);
+        }
+    }
+#endif
+    EVP_CIPHER_CTX *cipher_ctx = NULL;
+    if (i < end) {
+        // 没有 AES-NI 时退回 EVP，每段只初始化一次密钥
+        cipher_ctx = EVP_CIPHER_CTX_new();
+        if (!cipher_ctx || !EVP_CipherInit_ex(cipher_ctx, codec->cipher, NULL, codec->key, NULL, 1) ||
+            !EVP_CIPHER_CTX_set_padding(cipher_ctx, 0)) {
+            EVP_CIPHER_CTX_free(cipher_ctx);
+            return 0;
+        }
+    }
+    for (; i < end; i++) {
+        size_t offset = (size_t)i * batch->page_size;
+        int len = 0;
+        if (!EVP_CipherInit_ex(cipher_ctx, NULL, NULL, NULL, batch->pages + offset + data_bytes, 1) ||
+            !EVP_CipherUpdate(cipher_ctx, batch->pages + offset, &len, batch->plain + offset, data_bytes)) {
+            EVP_CIPHER_CTX_free(cipher_ctx);
+            return 0;
+        }
+    }
+    EVP_CIPHER_CTX_free(cipher_ctx);
+
+    EVP_MAC_CTX *mac_ctx = EVP_MAC_CTX_dup(codec->mac_template);
+    int ok = mac_ctx != NULL;
+    for (i = begin; ok && i < end; i++) {
+        ok = cb_batch_hmac_page(mac_ctx, batch, i);
+    }
+    EVP_MAC_CTX_free(mac_ctx);
+    return ok;
+}
+
+/**
+ * 批量写出一组页：一次取出全部随机 IV，页数达到 CB_BATCH_PARALLEL_MIN_PAGES 且 threads > 1 时
+ * 按连续段分给多个线程，调用线程处理第一段
+ */
+int cb_batch_encrypt(CbBatchCodec *codec, const CbPageBatch *batch, int threads) {
+    int data_bytes = batch->page_size - CB_RESERVE_BYTES;
+    std::vector<unsigned char> ivs((size_t)batch->count * CB_IV_BYTES);
+    if (RAND_bytes(ivs.data(), (int)ivs.size()) != 1) {
+        return 0;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        memcpy(batch->pages + (size_t)i * batch->page_size + data_bytes, &ivs[(size_t)i * CB_IV_BYTES], CB_IV_BYTES);
+    }
+
+    if (threads > batch->count / (CB_BATCH_PARALLEL_MIN_PAGES / 2)) {
+        threads = batch->count / (CB_BATCH_PARALLEL_MIN_PAGES / 2);
+    }
+    if (threads <= 1 || batch->count < CB_BATCH_PARALLEL_MIN_PAGES) {
+        return cb_batch_chunk(codec, batch, 0, batch->count);
+    }
+
+    // 段边界按 CB_BATCH_LANES 对齐，让每段都能走满交错
+    int per_thread = (batch->count + threads - 1) / threads;
+    per_thread = (per_thread + CB_BATCH_LANES - 1) / CB_BATCH_LANES * CB_BATCH_LANES;
+    std::vector<std::thread> workers;
+    std::vector<int> results(threads, 1);
+    for (int t = 1; t < threads && t * per_thread < batch->count; t++) {
+        int begin = t * per_thread;
+        int end = std::min(batch->count, begin + per_thread);
+        workers.emplace_back([codec, batch, begin, end, &results, t]() {
+            results[t] = cb_batch_chunk(codec, batch, begin, end);
+        });
+    }
+    results[0] = cb_batch_chunk(codec, batch, 0, std::min(batch->count, per_thread));
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    for (int result : results) {
+        if (!result) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * 用 EVP 逐页解密并重算 HMAC，确认批量路径写出的页与 SQLCipher 格式一致
+ */
+int cb_batch_verify(CbBatchCodec *codec, const CbPageBatch *batch) {
+    int data_bytes = batch->page_size - CB_RESERVE_BYTES;
+    std::vector<unsigned char> plain(data_bytes);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    EVP_MAC_CTX *mac_ctx = EVP_MAC_CTX_dup(codec->mac_template);
+    int ok = ctx && mac_ctx;
+    for (int i = 0; ok && i < batch->count; i++) {
+        const unsigned char *page = batch->pages + (size_t)i * batch->page_size;
+        unsigned char mac[CB_HMAC_BYTES];
+        unsigned char pgno_le[4];
+        size_t mac_len = 0;
+        int len = 0;
+        memcpy(pgno_le, &batch->pgnos[i], sizeof(pgno_le));
+        ok = EVP_CipherInit_ex(ctx, codec->cipher, NULL, codec->key, page + data_bytes, 0) &&
+             EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+             EVP_CipherUpdate(ctx, plain.data(), &len, page, data_bytes) &&
+             memcmp(plain.data(), batch->plain + (size_t)i * batch->page_size, data_bytes) == 0 &&
+             EVP_MAC_init(mac_ctx, NULL, 0, NULL) &&
+             EVP_MAC_update(mac_ctx, page, data_bytes + CB_IV_BYTES) &&
+             EVP_MAC_update(mac_ctx, pgno_le, sizeof(pgno_le)) &&
+             EVP_MAC_final(mac_ctx, mac, &mac_len, sizeof(mac)) &&
+             memcmp(mac, page + data_bytes + CB_IV_BYTES, sizeof(mac)) == 0;
+        if (!ok) {
+            fprintf(stderr, "第 %d 页校验失败\n", i);
+        }
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    EVP_MAC_CTX_free(mac_ctx);
+    return ok;
+}
+
+// 逐页基线：与 SQLCipher 现在的写路径相同，每页取一次 IV、加密一页、算一次 HMAC（上下文已复用）
+struct CbBatchBench {
+    CbBatchCodec *codec;
+    CbPageBatch *batch;
+    EVP_CIPHER_CTX *cipher_ctx;
+    EVP_MAC_CTX *mac_ctx;
+    int threads;
+    int cbc_only;
+};
+
+static int cb_batch_bench_per_page(void *arg) {
+    CbBatchBench *b = (CbBatchBench *)arg;
+    const CbPageBatch *batch = b->batch;
+    int data_bytes = batch->page_size - CB_RESERVE_BYTES;
+    for (int i = 0; i < batch->count; i++) {
+        size_t offset = (size_t)i * batch->page_size;
+        unsigned char *iv = batch->pages + offset + data_bytes;
+        int len = 0;
+        if ((!b->cbc_only && RAND_bytes(iv, CB_IV_BYTES) != 1) ||
+            !EVP_CipherInit_ex(b->cipher_ctx, NULL, NULL, NULL, iv, 1) ||
+            !EVP_CipherUpdate(b->cipher_ctx, batch->pages + offset, &len, batch->plain + offset, data_bytes) ||
+            (!b->cbc_only && !cb_batch_hmac_page(b->mac_ctx, batch, i))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int cb_batch_bench_batched(void *arg) {
+    CbBatchBench *b = (CbBatchBench *)arg;
+#ifdef CB_HAVE_AESNI
+    if (b->cbc_only && b->codec->aesni) {
+        int i = 0;
+        for (; i + CB_BATCH_LANES <= b->batch->count; i += CB_BATCH_LANES) {
+            cb_aesni_cbc_encrypt_lanes<CB_BATCH_LANES>(b->codec->round_keys, b->batch, i);
+        }
+        for (; i < b->batch->count; i++) {
+            cb_aesni_cbc_encrypt_lanes<1>(b->codec->round_keys, b->batch, i);
+        }
+        return 1;
+    }
+#endif
+    return cb_batch_encrypt(b->codec, b->batch, b->threads);
+}
+
+int cb_bench_batch() {
+    int count = (int)cb_option_double("batch-pages", CB_BATCH_PAGES);
+    int threads = (int)cb_option_double("threads", std::thread::hardware_concurrency());
+    if (count < 1) {
+        count = 1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    printf("\n--- 批量写出 %d 页：AES-256-CBC + HMAC-SHA512 ---\n", count);
+
+    unsigned char key[CB_KEY_BYTES], hmac_key[CB_KEY_BYTES];
+    RAND_bytes(key, sizeof(key));
+    RAND_bytes(hmac_key, sizeof(hmac_key));
+    CbBatchCodec codec;
+    if (!cb_batch_codec_open(&codec, key, hmac_key)) {
+        fprintf(stderr, "无法创建批量加密上下文\n");
+        cb_batch_codec_close(&codec);
+        return 0;
+    }
+    printf("CBC 交错: %s, %d 路; 线程: %d（不少于 %d 页时启用）\n", codec.aesni ? "AES-NI" : "不可用，退回 EVP",
+           CB_BATCH_LANES, threads, CB_BATCH_PARALLEL_MIN_PAGES);
+    printf("%-22s %8s %12s %10s %8s\n", "操作", "页大小", "us/批", "MB/s", "加速比");
+
+    CbBatchBench b;
+    b.codec = &codec;
+    b.cipher_ctx = EVP_CIPHER_CTX_new();
+    b.mac_ctx = EVP_MAC_CTX_dup(codec.mac_template);
+    int ok = b.cipher_ctx && b.mac_ctx && EVP_CipherInit_ex(b.cipher_ctx, codec.cipher, NULL, key, NULL, 1) &&
+             EVP_CIPHER_CTX_set_padding(b.cipher_ctx, 0);
+
+    const int page_sizes[] = {1024, 4096, 16384, 65536};
+    for (size_t p = 0; ok && p < sizeof(page_sizes) / sizeof(page_sizes[0]); p++) {
+        std::vector<unsigned char> plain((size_t)count * page_sizes[p]);
+        std::vector<unsigned char> pages(plain.size());
+        std::vector<uint32_t> pgnos(count);
+        RAND_bytes(plain.data(), (int)plain.size());
+        for (int i = 0; i < count; i++) {
+            pgnos[i] = (uint32_t)(i + 2);
+        }
+        CbPageBatch batch = {page_sizes[p], count, plain.data(), pages.data(), pgnos.data()};
+        b.batch = &batch;
+
+        // 先确认两条路径写出的页都能按 SQLCipher 格式解开
+        b.threads = threads;
+        b.cbc_only = 0;
+        ok = cb_batch_bench_per_page(&b) && cb_batch_verify(&codec, &batch) && cb_batch_encrypt(&codec, &batch, threads) &&
+             cb_batch_verify(&codec, &batch);
+
+        struct {
+            const char *name;
+            CbOp op;
+            int cbc_only;
+            int threads;
+        } cases[] = {
+            {"CBC 逐页 EVP", cb_batch_bench_per_page, 1, 1},
+            {"CBC 交错", cb_batch_bench_batched, 1, 1},
+            {"整页 逐页", cb_batch_bench_per_page, 0, 1},
+            {"整页 批量 1 线程", cb_batch_bench_batched, 0, 1},
+            {"整页 批量多线程", cb_batch_bench_batched, 0, threads},
+        };
+        double baseline = 0.0;
+        for (size_t c = 0; ok && c < sizeof(cases) / sizeof(cases[0]); c++) {
+            if (c == 4 && threads <= 1) {
+                continue;
+            }
+            CbMeasure m;
+            b.cbc_only = cases[c].cbc_only;
+            b.threads = cases[c].threads;
+            ok = cb_measure(cases[c].op, &b, &m);
+            if (!ok) {
+                break;
+            }
+            double us = m.seconds * 1e6 / m.ops;
+            if (c == 0 || c == 2) {
+                baseline = us;
+            }
+            printf("%-22s %8d %12.1f %10.0f %7.2fx\n", cases[c].name, page_sizes[p], us,
+                   (double)(page_sizes[p] - CB_RESERVE_BYTES) * count / (us / 1e6) / 1048576.0, baseline / us);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "批量写出测量失败\n");
+    }
+    EVP_CIPHER_CTX_free(b.cipher_ctx);
+    EVP_MAC_CTX_free(b.mac_ctx);
+    cb_batch_codec_close(&codec);
+    return ok;
+}